@@ -0,0 +1,260 @@
+#include "account_cache.h"
+#include "config.h"
+#include "log.h"
+#include "thread.h"
+
+#include <ctype.h>
+
+struct cache_entry{
+	// hash chains
+	struct cache_entry *name_next;
+	struct cache_entry *id_next;
+	// lru list (head = most recently used)
+	struct cache_entry *prev;
+	struct cache_entry *next;
+	uint32 name_hash;
+	int64 expires;
+	char accname[32];
+	struct cached_account acc;
+};
+
+static struct{
+	bool enabled;
+	mutex_t mtx;
+	int64 ttl;
+	uint32 generation;
+	uint32 table_mask;
+	struct cache_entry **by_name;
+	struct cache_entry **by_id;
+	struct cache_entry *entries;
+	struct cache_entry *free;
+	struct cache_entry *lru_head;
+	struct cache_entry *lru_tail;
+} cache;
+
+static void key_lower(char *dst, const char *src){
+	size_t i;
+	for(i = 0; i < 31 && src[i] != 0; i += 1)
+		dst[i] = (char)tolower((unsigned char)src[i]);
+	dst[i] = 0;
+}
+
+static INLINE uint32 name_hash(const char *key){
+	return murmur2_32((const uint8*)key, strlen(key), 0x7A3C19E5);
+}
+
+static INLINE uint32 id_slot(int32 account_id){
+	return ((uint32)account_id * 2654435761U) & cache.table_mask;
+}
+
+static void lru_unlink(struct cache_entry *e){
+	if(e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		cache.lru_head = e->next;
+	if(e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		cache.lru_tail = e->prev;
+}
+
+static void lru_push_front(struct cache_entry *e){
+	e->prev = NULL;
+	e->next = cache.lru_head;
+	if(cache.lru_head != NULL)
+		cache.lru_head->prev = e;
+	else
+		cache.lru_tail = e;
+	cache.lru_head = e;
+}
+
+static void chain_unlink(struct cache_entry *e){
+	struct cache_entry **it;
+	it = &cache.by_name[e->name_hash & cache.table_mask];
+	while(*it != e)
+		it = &(*it)->name_next;
+	*it = e->name_next;
+	it = &cache.by_id[id_slot(e->acc.account_id)];
+	while(*it != e)
+		it = &(*it)->id_next;
+	*it = e->id_next;
+}
+
+static void entry_remove(struct cache_entry *e){
+	chain_unlink(e);
+	lru_unlink(e);
+	e->next = cache.free;
+	cache.free = e;
+}
+
+static struct cache_entry *entry_find(const char *key, uint32 hash){
+	struct cache_entry *e = cache.by_name[hash & cache.table_mask];
+	while(e != NULL){
+		if(e->name_hash == hash && strcmp(e->accname, key) == 0)
+			return e;
+		e = e->name_next;
+	}
+	return NULL;
+}
+
+bool account_cache_init_params(uint32 max_entries, int64 ttl_msec){
+	uint32 table_size = 1;
+	memset(&cache, 0, sizeof(cache));
+	mutex_init(&cache.mtx);
+	if(max_entries == 0)
+		return true;
+
+	// keep the load factor of both tables under 1
+	while(table_size < max_entries)
+		table_size <<= 1;
+	cache.table_mask = table_size - 1;
+	cache.by_name = kpl_malloc(table_size * sizeof(struct cache_entry*));
+	cache.by_id = kpl_malloc(table_size * sizeof(struct cache_entry*));
+	cache.entries = kpl_malloc(max_entries * sizeof(struct cache_entry));
+	memset(cache.by_name, 0, table_size * sizeof(struct cache_entry*));
+	memset(cache.by_id, 0, table_size * sizeof(struct cache_entry*));
+	for(uint32 i = 0; i < max_entries; i += 1){
+		cache.entries[i].next = cache.free;
+		cache.free = &cache.entries[i];
+	}
+	cache.ttl = ttl_msec;
+	cache.enabled = true;
+	return true;
+}
+
+bool account_cache_init(void){
+	int size = config_geti("account_cache_size");
+	int ttl = config_geti("account_cache_ttl");
+	if(size < 0 || ttl <= 0){
+		LOG_ERROR("account_cache_init: invalid size (%d) or ttl (%d)",
+			size, ttl);
+		return false;
+	}
+	return account_cache_init_params((uint32)size, (int64)ttl * 1000);
+}
+
+void account_cache_shutdown(void){
+	if(cache.enabled){
+		kpl_free(cache.by_name);
+		kpl_free(cache.by_id);
+		kpl_free(cache.entries);
+	}
+	mutex_destroy(&cache.mtx);
+	memset(&cache, 0, sizeof(cache));
+}
+
+bool account_cache_lookup(const char *accname, struct cached_account *out){
+	struct cache_entry *e;
+	char key[32];
+	uint32 hash;
+	if(!cache.enabled)
+		return false;
+
+	key_lower(key, accname);
+	hash = name_hash(key);
+	mutex_lock(&cache.mtx);
+	e = entry_find(key, hash);
+	if(e != NULL && kpl_clock_monotonic_msec() >= e->expires){
+		entry_remove(e);
+		e = NULL;
+	}
+	if(e != NULL){
+		lru_unlink(e);
+		lru_push_front(e);
+		memcpy(out, &e->acc, sizeof(struct cached_account));
+	}
+	mutex_unlock(&cache.mtx);
+	return e != NULL;
+}
+
+uint32 account_cache_load_begin(void){
+	uint32 ticket;
+	mutex_lock(&cache.mtx);
+	ticket = cache.generation;
+	mutex_unlock(&cache.mtx);
+	return ticket;
+}
+
+void account_cache_insert(uint32 ticket, const char *accname,
+		const struct cached_account *acc){
+	struct cache_entry *e;
+	char key[32];
+	uint32 hash, slot;
+	if(!cache.enabled)
+		return;
+
+	key_lower(key, accname);
+	hash = name_hash(key);
+	mutex_lock(&cache.mtx);
+	if(ticket != cache.generation){
+		mutex_unlock(&cache.mtx);
+		return;
+	}
+	// replace the current entry if there is one
+	e = entry_find(key, hash);
+	if(e != NULL)
+		entry_remove(e);
+	// evict the least recently used if full
+	if(cache.free == NULL)
+		entry_remove(cache.lru_tail);
+	e = cache.free;
+	cache.free = e->next;
+
+	memcpy(e->accname, key, sizeof(key));
+	memcpy(&e->acc, acc, sizeof(struct cached_account));
+	e->name_hash = hash;
+	e->expires = kpl_clock_monotonic_msec() + cache.ttl;
+	slot = hash & cache.table_mask;
+	e->name_next = cache.by_name[slot];
+	cache.by_name[slot] = e;
+	slot = id_slot(acc->account_id);
+	e->id_next = cache.by_id[slot];
+	cache.by_id[slot] = e;
+	lru_push_front(e);
+	mutex_unlock(&cache.mtx);
+}
+
+void account_cache_invalidate(const char *accname){
+	struct cache_entry *e;
+	char key[32];
+	uint32 hash;
+	if(!cache.enabled)
+		return;
+
+	key_lower(key, accname);
+	hash = name_hash(key);
+	mutex_lock(&cache.mtx);
+	cache.generation += 1;
+	e = entry_find(key, hash);
+	if(e != NULL)
+		entry_remove(e);
+	mutex_unlock(&cache.mtx);
+}
+
+void account_cache_invalidate_id(int32 account_id){
+	struct cache_entry *e, *next;
+	if(!cache.enabled)
+		return;
+
+	mutex_lock(&cache.mtx);
+	cache.generation += 1;
+	e = cache.by_id[id_slot(account_id)];
+	while(e != NULL){
+		next = e->id_next;
+		if(e->acc.account_id == account_id)
+			entry_remove(e);
+		e = next;
+	}
+	mutex_unlock(&cache.mtx);
+}
+
+void account_cache_clear(void){
+	if(!cache.enabled)
+		return;
+
+	mutex_lock(&cache.mtx);
+	cache.generation += 1;
+	while(cache.lru_head != NULL)
+		entry_remove(cache.lru_head);
+	mutex_unlock(&cache.mtx);
+}
@@ -0,0 +1,48 @@
+#ifndef KAPLAR_ACCOUNT_CACHE_H_
+#define KAPLAR_ACCOUNT_CACHE_H_ 1
+
+#include "common.h"
+
+// account cache
+//	NOTES:
+//	- Holds what the login needs from the database (account id,
+//	password hash, premend and charlist) keyed by the lowercased
+//	account name, so repeated logins don't touch the database.
+//	- Memory is bounded: there are `account_cache_size` entries
+//	allocated up front and the least recently used is evicted when
+//	it's full. Entries also expire `account_cache_ttl` seconds after
+//	they were loaded.
+//	- Any code that changes an account or its players in the
+//	database MUST call one of the invalidation functions.
+//	- Loads race with invalidations: take a ticket with
+//	`account_cache_load_begin` BEFORE querying the database and hand
+//	it to `account_cache_insert`. If anything was invalidated in the
+//	meantime the insert is dropped, so stale data never gets in.
+//	- Thread safe. A size of zero disables the cache.
+
+#define ACCOUNT_CACHE_MAX_CHARS 32
+struct cached_account{
+	int32 account_id;
+	int64 premend;
+	char password[64];
+	int num_chars;
+	char chars[ACCOUNT_CACHE_MAX_CHARS][32];
+};
+
+bool account_cache_init(void);
+void account_cache_shutdown(void);
+// used by `account_cache_init` (and tests) to skip the config
+bool account_cache_init_params(uint32 max_entries, int64 ttl_msec);
+
+// returns false on a miss
+bool account_cache_lookup(const char *accname, struct cached_account *out);
+uint32 account_cache_load_begin(void);
+void account_cache_insert(uint32 ticket, const char *accname,
+		const struct cached_account *acc);
+
+// invalidation hooks
+void account_cache_invalidate(const char *accname);
+void account_cache_invalidate_id(int32 account_id);
+void account_cache_clear(void);
+
+#endif //KAPLAR_ACCOUNT_CACHE_H_
@@ -3,9 +3,10 @@
 //
 
 #include "common.h"
+#include "adler32_simd.h"
 
-#define BASE 65521U
-#define NMAX 5552
+#define BASE ADLER32_BASE
+#define NMAX ADLER32_NMAX
 
 #define DO1(buf, i)	{a += buf[i]; b += a;}
 #define DO2(buf, i)	DO1(buf,i); DO1(buf,i+1);
@@ -13,9 +14,10 @@
 #define DO8(buf, i)	DO4(buf,i); DO4(buf,i+4);
 #define DO16(buf)	DO8(buf,0); DO8(buf,8);
 
-uint32 adler32(const uint8 *buf, size_t len){
-	uint32 a = 1;
-	uint32 b = 0;
+/* SCALAR */
+static uint32 adler32_scalar(uint32 adler, const uint8 *buf, size_t len){
+	uint32 a = adler & 0xFFFF;
+	uint32 b = adler >> 16;
 	int k;
 	while(len > 0){
 		k = (int)(len > NMAX ? NMAX : len);
@@ -34,3 +36,104 @@ uint32 adler32(const uint8 *buf, size_t len){
 	}
 	return a | (b << 16);
 }
+
+#ifdef ARCH_X86
+/* SSSE3 */
+//	- Steps of 32 bytes (see adler32_simd.h) with whatever is left
+//	going through the scalar version.
+TARGET_SSSE3
+static uint32 adler32_ssse3(uint32 adler, const uint8 *buf, size_t len){
+	const size_t max_steps = NMAX / ADLER32_SSSE3_STEP_LEN;
+	uint32 a = adler & 0xFFFF;
+	uint32 b = adler >> 16;
+	__m128i s1, s2, ps, x0, x1;
+	size_t steps, n;
+
+	steps = len / ADLER32_SSSE3_STEP_LEN;
+	len -= steps * ADLER32_SSSE3_STEP_LEN;
+	while(steps > 0){
+		n = steps > max_steps ? max_steps : steps;
+		steps -= n;
+		s1 = s2 = ps = _mm_setzero_si128();
+		for(size_t i = 0; i < n; i += 1){
+			x0 = _mm_loadu_si128((__m128i*)buf);
+			x1 = _mm_loadu_si128((__m128i*)(buf + 16));
+			ADLER32_SSSE3_STEP(x0, x1, s1, s2, ps);
+			buf += ADLER32_SSSE3_STEP_LEN;
+		}
+		ADLER32_SSSE3_REDUCE(a, b, s1, s2, ps, n);
+	}
+	return adler32_scalar(a | (b << 16), buf, len);
+}
+
+/* AVX2 */
+TARGET_AVX2
+static uint32 adler32_avx2(uint32 adler, const uint8 *buf, size_t len){
+	const size_t max_steps = NMAX / ADLER32_AVX2_STEP_LEN;
+	uint32 a = adler & 0xFFFF;
+	uint32 b = adler >> 16;
+	__m256i s1, s2, ps, x0, x1;
+	size_t steps, n;
+
+	steps = len / ADLER32_AVX2_STEP_LEN;
+	len -= steps * ADLER32_AVX2_STEP_LEN;
+	while(steps > 0){
+		n = steps > max_steps ? max_steps : steps;
+		steps -= n;
+		s1 = s2 = ps = _mm256_setzero_si256();
+		for(size_t i = 0; i < n; i += 1){
+			x0 = _mm256_loadu_si256((__m256i*)buf);
+			x1 = _mm256_loadu_si256((__m256i*)(buf + 32));
+			ADLER32_AVX2_STEP(x0, x1, s1, s2, ps);
+			buf += ADLER32_AVX2_STEP_LEN;
+		}
+		ADLER32_AVX2_REDUCE(a, b, s1, s2, ps, n);
+	}
+	return adler32_ssse3(a | (b << 16), buf, len);
+}
+#endif //ARCH_X86
+
+/* DISPATCH */
+typedef uint32 (*adler32_fn_t)(uint32, const uint8*, size_t);
+static const struct{
+	const char *name;
+	uint32 features;
+	adler32_fn_t fn;
+} impls[ADLER32_NUM_IMPLS] = {
+	[ADLER32_IMPL_SCALAR] = {"scalar", 0, adler32_scalar},
+#ifdef ARCH_X86
+	[ADLER32_IMPL_SSSE3] = {"ssse3", CPU_SSE2 | CPU_SSSE3, adler32_ssse3},
+	[ADLER32_IMPL_AVX2] = {"avx2", CPU_SSE2 | CPU_SSSE3 | CPU_AVX2, adler32_avx2},
+#else
+	[ADLER32_IMPL_SSSE3] = {"ssse3", 0, NULL},
+	[ADLER32_IMPL_AVX2] = {"avx2", 0, NULL},
+#endif
+};
+
+const char *adler32_impl_name(int impl){
+	DEBUG_ASSERT(impl >= 0 && impl < ADLER32_NUM_IMPLS);
+	return impls[impl].name;
+}
+
+bool adler32_impl_supported(int impl){
+	DEBUG_ASSERT(impl >= 0 && impl < ADLER32_NUM_IMPLS);
+	return impls[impl].fn != NULL
+		&& (kpl_cpu_features() & impls[impl].features) == impls[impl].features;
+}
+
+uint32 adler32_impl(int impl, uint32 adler, const uint8 *buf, size_t len){
+	DEBUG_ASSERT(adler32_impl_supported(impl));
+	return impls[impl].fn(adler, buf, len);
+}
+
+uint32 adler32_update(uint32 adler, const uint8 *buf, size_t len){
+	for(int i = ADLER32_NUM_IMPLS - 1; i > ADLER32_IMPL_SCALAR; i -= 1){
+		if(adler32_impl_supported(i))
+			return impls[i].fn(adler, buf, len);
+	}
+	return adler32_scalar(adler, buf, len);
+}
+
+uint32 adler32(const uint8 *buf, size_t len){
+	return adler32_update(1, buf, len);
+}
@@ -0,0 +1,102 @@
+#ifndef KAPLAR_ADLER32_SIMD_H_
+#define KAPLAR_ADLER32_SIMD_H_ 1
+
+#include "common.h"
+
+// adler32 SIMD steps
+//	NOTES:
+//	- Each step adds `ADLER32_SSSE3_STEP_LEN` or `ADLER32_AVX2_STEP_LEN`
+//	bytes to three accumulators that start at zero: `s1` (sum of
+//	bytes), `s2` (sum of bytes weighted by their distance to the end
+//	of the step) and `ps` (sum of `s1` before each step). At most
+//	`ADLER32_NMAX / STEP_LEN` steps may run before a reduce.
+//	- These are macros so they can be used inside functions compiled
+//	for a different target (see TARGET_SSSE3 and TARGET_AVX2).
+
+#define ADLER32_BASE 65521U
+#define ADLER32_NMAX 5552
+
+#ifdef ARCH_X86
+#include <immintrin.h>
+
+#define ADLER32_SSSE3_STEP_LEN 32
+#define ADLER32_AVX2_STEP_LEN 64
+
+#define ADLER32_SSE_HSUM(v, out)					\
+	do{	__m128i _v = (v);					\
+		_v = _mm_add_epi32(_v,					\
+			_mm_shuffle_epi32(_v, _MM_SHUFFLE(1, 0, 3, 2)));	\
+		_v = _mm_add_epi32(_v,					\
+			_mm_shuffle_epi32(_v, _MM_SHUFFLE(2, 3, 0, 1)));	\
+		out = (uint32)_mm_cvtsi128_si32(_v);			\
+	}while(0)
+
+#define ADLER32_AVX2_HSUM(v, out)					\
+	ADLER32_SSE_HSUM(_mm_add_epi32(_mm256_castsi256_si128(v),	\
+		_mm256_extracti128_si256(v, 1)), out)
+
+// adds `steps` steps of `step_len` bytes to `a` and `b`
+#define ADLER32_REDUCE(a, b, hs1, hs2, hps, steps, step_len)		\
+	do{	b += a * (uint32)((steps) * (step_len))			\
+			+ (hps) * (uint32)(step_len) + (hs2);		\
+		a += (hs1);						\
+		a %= ADLER32_BASE;					\
+		b %= ADLER32_BASE;					\
+	}while(0)
+
+// `x0` and `x1` are 16 bytes each
+#define ADLER32_SSSE3_STEP(x0, x1, s1, s2, ps)				\
+	do{	const __m128i _zero = _mm_setzero_si128();		\
+		const __m128i _ones = _mm_set1_epi16(1);		\
+		ps = _mm_add_epi32(ps, s1);				\
+		s1 = _mm_add_epi32(s1, _mm_sad_epu8(x0, _zero));	\
+		s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_maddubs_epi16(x0,\
+			_mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,	\
+				24, 23, 22, 21, 20, 19, 18, 17)), _ones));\
+		s1 = _mm_add_epi32(s1, _mm_sad_epu8(x1, _zero));	\
+		s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_maddubs_epi16(x1,\
+			_mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,	\
+				8, 7, 6, 5, 4, 3, 2, 1)), _ones));	\
+	}while(0)
+
+#define ADLER32_SSSE3_REDUCE(a, b, s1, s2, ps, steps)			\
+	do{	uint32 _hs1, _hs2, _hps;				\
+		ADLER32_SSE_HSUM(s1, _hs1);				\
+		ADLER32_SSE_HSUM(s2, _hs2);				\
+		ADLER32_SSE_HSUM(ps, _hps);				\
+		ADLER32_REDUCE(a, b, _hs1, _hs2, _hps, steps,		\
+			ADLER32_SSSE3_STEP_LEN);			\
+	}while(0)
+
+// `x0` and `x1` are 32 bytes each
+#define ADLER32_AVX2_STEP(x0, x1, s1, s2, ps)				\
+	do{	const __m256i _zero = _mm256_setzero_si256();		\
+		const __m256i _ones = _mm256_set1_epi16(1);		\
+		ps = _mm256_add_epi32(ps, s1);				\
+		s1 = _mm256_add_epi32(s1, _mm256_sad_epu8(x0, _zero));	\
+		s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(		\
+			_mm256_maddubs_epi16(x0, _mm256_setr_epi8(	\
+				64, 63, 62, 61, 60, 59, 58, 57,		\
+				56, 55, 54, 53, 52, 51, 50, 49,		\
+				48, 47, 46, 45, 44, 43, 42, 41,		\
+				40, 39, 38, 37, 36, 35, 34, 33)), _ones));\
+		s1 = _mm256_add_epi32(s1, _mm256_sad_epu8(x1, _zero));	\
+		s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(		\
+			_mm256_maddubs_epi16(x1, _mm256_setr_epi8(	\
+				32, 31, 30, 29, 28, 27, 26, 25,		\
+				24, 23, 22, 21, 20, 19, 18, 17,		\
+				16, 15, 14, 13, 12, 11, 10, 9,		\
+				8, 7, 6, 5, 4, 3, 2, 1)), _ones));	\
+	}while(0)
+
+#define ADLER32_AVX2_REDUCE(a, b, s1, s2, ps, steps)			\
+	do{	uint32 _hs1, _hs2, _hps;				\
+		ADLER32_AVX2_HSUM(s1, _hs1);				\
+		ADLER32_AVX2_HSUM(s2, _hs2);				\
+		ADLER32_AVX2_HSUM(ps, _hps);				\
+		ADLER32_REDUCE(a, b, _hs1, _hs2, _hps, steps,		\
+			ADLER32_AVX2_STEP_LEN);				\
+	}while(0)
+
+#endif //ARCH_X86
+#endif //KAPLAR_ADLER32_SIMD_H_
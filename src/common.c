@@ -4,7 +4,9 @@
 #ifdef PLATFORM_WINDOWS
 #	define WIN32_LEAN_AND_MEAN 1
 #	include <windows.h>
+#	include <immintrin.h>
 #else
+#	include <errno.h>
 #	include <time.h>
 #	include <unistd.h>
 #endif
@@ -20,6 +22,26 @@ int64 kpl_clock_monotonic_msec(void){
 #endif
 }
 
+int64 kpl_clock_monotonic_nsec(void){
+#ifdef PLATFORM_WINDOWS
+	static LARGE_INTEGER freq = {0};
+	LARGE_INTEGER counter;
+	int64 sec, rem;
+	if(freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&counter);
+	// split the conversion to avoid overflowing
+	sec = counter.QuadPart / freq.QuadPart;
+	rem = counter.QuadPart % freq.QuadPart;
+	return sec * 1000000000 + (rem * 1000000000) / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64)ts.tv_sec * 1000000000 +
+		(int64)ts.tv_nsec;
+#endif
+}
+
 void kpl_sleep_msec(int64 ms){
 #ifdef PLATFORM_WINDOWS
 	DEBUG_ASSERT(ms < MAXDWORD && "windows limitation");
@@ -32,6 +54,50 @@ void kpl_sleep_msec(int64 ms){
 #endif
 }
 
+#ifdef PLATFORM_WINDOWS
+#	ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#		define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002
+#	endif
+// each thread creates its timer on the first sleep and keeps it
+// for later ones (they're only used by threads that live as long
+// as the process so it's never closed)
+static THREAD_LOCAL HANDLE sleep_timer = NULL;
+static THREAD_LOCAL bool sleep_timer_failed = false;
+#endif
+
+// sleep until the monotonic clock reaches `deadline` (in
+// nanoseconds, see `kpl_clock_monotonic_nsec`)
+void kpl_sleep_until_nsec(int64 deadline){
+#ifdef PLATFORM_WINDOWS
+	LARGE_INTEGER due;
+	int64 remaining = deadline - kpl_clock_monotonic_nsec();
+	if(remaining <= 0)
+		return;
+	// high resolution timers are only available on windows 10
+	// (1803) and later so fallback to `Sleep` if it fails
+	if(sleep_timer == NULL && !sleep_timer_failed){
+		sleep_timer = CreateWaitableTimerExW(NULL, NULL,
+			CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+		sleep_timer_failed = (sleep_timer == NULL);
+	}
+	if(sleep_timer == NULL){
+		kpl_sleep_msec(remaining / 1000000);
+		return;
+	}
+	// negative values are relative times in 100ns units
+	due.QuadPart = -(remaining / 100);
+	if(SetWaitableTimer(sleep_timer, &due, 0, NULL, NULL, FALSE))
+		WaitForSingleObject(sleep_timer, INFINITE);
+#else
+	struct timespec ts;
+	ts.tv_sec = deadline / 1000000000;
+	ts.tv_nsec = deadline % 1000000000;
+	while(clock_nanosleep(CLOCK_MONOTONIC,
+			TIMER_ABSTIME, &ts, NULL) == EINTR)
+		continue;
+#endif
+}
+
 int kpl_cpu_count(void){
 #ifdef PLATFORM_WINDOWS
 	SYSTEM_INFO info;
@@ -44,6 +110,47 @@ int kpl_cpu_count(void){
 #endif
 }
 
+static uint32 detect_cpu_features(void){
+	uint32 features = 0;
+#if defined(ARCH_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 1)
+		return 0;
+	__cpuid(info, 1);
+	if(info[3] & (1 << 26))
+		features |= CPU_SSE2;
+	if(info[2] & (1 << 9))
+		features |= CPU_SSSE3;
+	// AVX2 also needs the os to save the ymm registers
+	if(((info[2] >> 27) & 3) == 3 && (_xgetbv(0) & 6) == 6){
+		__cpuid(info, 0);
+		if(info[0] >= 7){
+			__cpuidex(info, 7, 0);
+			if(info[1] & (1 << 5))
+				features |= CPU_AVX2;
+		}
+	}
+#elif defined(ARCH_X86)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2"))
+		features |= CPU_SSE2;
+	if(__builtin_cpu_supports("ssse3"))
+		features |= CPU_SSSE3;
+	if(__builtin_cpu_supports("avx2"))
+		features |= CPU_AVX2;
+#endif
+	return features;
+}
+
+uint32 kpl_cpu_features(void){
+	// racing threads will just store the same value
+	static volatile int32 features = -1;
+	if(features == -1)
+		features = (int32)detect_cpu_features();
+	return (uint32)features;
+}
+
 void kpl_abort(const char *fmt, ...){
 	va_list ap;
 	va_start(ap, fmt);
@@ -61,10 +61,16 @@ typedef ptrdiff_t	ptrdiff;
 #if defined(_MSC_VER)
 #	include <intrin.h>
 #	define INLINE __forceinline
+#	define THREAD_LOCAL __declspec(thread)
 #	define _CLZ32(x) ((int)__lzcnt(x))
 #	define _CLZ64(x) ((int)__lzcnt64(x))
 #	define _POPCNT32(x) ((int)__popcnt(x))
 #	define _POPCNT64(x) ((int)__popcnt64(x))
+#	define TARGET_SSSE3
+#	define TARGET_AVX2
+#	if defined(_M_X64) || defined(_M_IX86)
+#		define ARCH_X86 1
+#	endif
 #	ifdef _WIN64
 #		define COMPILER_ENV64 1
 #	else
@@ -72,10 +78,16 @@ typedef ptrdiff_t	ptrdiff;
 #	endif
 #elif defined(__GNUC__)
 #	define INLINE __attribute__((always_inline))
+#	define THREAD_LOCAL __thread
 #	define _CLZ32(x) ((int)__builtin_clzl(x))
 #	define _CLZ64(x) ((int)__builtin_clzll(x))
 #	define _POPCNT32(x) ((int)__builtin_popcountl(x))
 #	define _POPCNT64(x) ((int)__builtin_popcountll(x))
+#	define TARGET_SSSE3 __attribute__((target("ssse3")))
+#	define TARGET_AVX2 __attribute__((target("avx2")))
+#	if defined(__x86_64__) || defined(__i386__)
+#		define ARCH_X86 1
+#	endif
 #	ifdef __x86_64__
 #		define COMPILER_ENV64 1
 #	else
@@ -117,7 +129,22 @@ typedef ptrdiff_t	ptrdiff;
 
 // adler32.c
 // -----------------------------------------------
+//	- `adler32_update` continues a checksum from a previous
+//	call (starting with 1) so it can be computed in pieces.
+//	- The SIMD implementations are picked at runtime. The others
+//	are exposed for tests and benchmarks.
+enum{
+	ADLER32_IMPL_SCALAR = 0,
+	ADLER32_IMPL_SSSE3,
+	ADLER32_IMPL_AVX2,
+
+	ADLER32_NUM_IMPLS,
+};
 uint32 adler32(const uint8 *buf, size_t len);
+uint32 adler32_update(uint32 adler, const uint8 *buf, size_t len);
+const char *adler32_impl_name(int impl);
+bool adler32_impl_supported(int impl);
+uint32 adler32_impl(int impl, uint32 adler, const uint8 *buf, size_t len);
 
 // murmur2.c
 // -----------------------------------------------
@@ -139,8 +166,18 @@ void mem_arena_reset(struct mem_arena *arena);
 // -----------------------------------------------
 // system wrappers
 int64 kpl_clock_monotonic_msec(void);
+int64 kpl_clock_monotonic_nsec(void);
 void kpl_sleep_msec(int64 ms);
+void kpl_sleep_until_nsec(int64 deadline);
 int kpl_cpu_count(void);
+// x86 instruction set extensions the cpu (and os) support
+// (always zero on other archs)
+enum{
+	CPU_SSE2	= 0x01,
+	CPU_SSSE3	= 0x02,
+	CPU_AVX2	= 0x04,
+};
+uint32 kpl_cpu_features(void);
 void kpl_abort(const char *fmt, ...);
 // stdlib wrappers and replacements
 void *kpl_malloc(size_t size);
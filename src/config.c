@@ -28,7 +28,40 @@ config_defaults[] = {
 	{"sv_game_port", "7172"},
 
 	// game
-	{"tick_interval", "50"},
+	{"tick_interval", "33.333"},
+	{"frame_overrun_policy", "catchup"},
+	{"frame_max_catchup", "3"},
+	{"frame_report_interval", "60"},
+	{"frame_profiler_history", "32"},
+	{"game_frame_budget", "25"},
+	{"game_max_task_deferral", "10"},
+	{"game_shards", "1"},
+
+	// workers
+	{"worker_threads", "0"},
+	{"rsa_max_inflight", "16"},
+	{"rsa_max_queued", "1024"},
+	{"rsa_constant_time", "false"},
+	{"password_cost", "10"},
+	{"password_threads", "2"},
+	{"password_max_queued", "256"},
+
+	// trace
+	{"trace_enabled", "false"},
+	{"trace_output", "trace.json"},
+	{"trace_buffer_size", "65536"},
+	{"trace_flush_interval", "1000"},
+
+	// database
+	{"db_workers", "2"},
+	{"db_async_connections", "1"},
+	{"db_async_max_pending", "4096"},
+	{"db_slow_query_threshold", "100"},
+	{"db_stats_output", ""},
+	{"account_cache_size", "4096"},
+	{"account_cache_ttl", "300"},
+	{"player_save_interval", "5000"},
+	{"player_save_batch_size", "1000"},
 
 	// pgsql
 	{"pgsql_host", "localhost"},
@@ -40,12 +73,17 @@ config_defaults[] = {
 	{"pgsql_client_encoding", "UTF8"},
 	{"pgsql_application_name", "kaplarc"},
 
+	// local database (DB_BACKEND_LOCAL)
+	{"local_db_path", "localdb"},
+	{"local_db_snapshot_interval", "300"},
+	{"local_db_seed", "false"},
+
 	// misc
 	{"motd", "1\nKaplar!"},
 };
 
 // config hash table
-#define MAX_COLLISIONS 2
+#define MAX_COLLISIONS 4
 #define MAX_CONFIG_VARS 256
 static struct config_var config_table[MAX_CONFIG_VARS];
 
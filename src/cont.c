@@ -0,0 +1,149 @@
+#include "cont.h"
+#include "game.h"
+#include "password.h"
+#include "thread.h"
+#include "db/database.h"
+
+#define MAX_IDLE_CONTS 1024
+
+/* frame pool */
+static mutex_t cont_mtx;
+static int32 cont_list_size = 0;
+static struct cont *cont_head = NULL;
+
+/* thread state */
+static THREAD_LOCAL cont_domain_t thread_domain = CONT_DOMAIN_NONE;
+static THREAD_LOCAL bool thread_suspended = false;
+
+bool cont_init(void){
+	mutex_init(&cont_mtx);
+	return true;
+}
+
+void cont_shutdown(void){
+	struct cont *k, *next;
+	mutex_lock(&cont_mtx);
+	k = cont_head;
+	cont_head = NULL;
+	cont_list_size = 0;
+	mutex_unlock(&cont_mtx);
+	while(k != NULL){
+		next = k->next;
+		kpl_free(k);
+		k = next;
+	}
+	mutex_destroy(&cont_mtx);
+}
+
+void cont_set_thread_domain(cont_domain_t domain){
+	thread_domain = domain;
+}
+
+cont_domain_t cont_thread_domain(void){
+	return thread_domain;
+}
+
+struct cont *cont_create(void (*fn)(struct cont*), size_t datasize){
+	struct cont *k = NULL;
+	DEBUG_ASSERT(datasize <= CONT_MAX_DATA);
+	mutex_lock(&cont_mtx);
+	if(cont_head != NULL){
+		DEBUG_ASSERT(cont_list_size > 0);
+		cont_list_size -= 1;
+		k = cont_head;
+		cont_head = k->next;
+	}
+	mutex_unlock(&cont_mtx);
+	if(k == NULL)
+		k = kpl_malloc(sizeof(struct cont));
+	k->next = NULL;
+	k->fn = fn;
+	k->resume = 0;
+	k->failed = false;
+	memset(k->u.data, 0, datasize);
+	return k;
+}
+
+void cont_release(struct cont *k){
+	mutex_lock(&cont_mtx);
+	if(cont_list_size < MAX_IDLE_CONTS){
+		cont_list_size += 1;
+		k->next = cont_head;
+		cont_head = k;
+		k = NULL;
+	}
+	mutex_unlock(&cont_mtx);
+	if(k != NULL)
+		kpl_free(k);
+}
+
+static void cont_resume(void *arg){
+	struct cont *k = arg;
+	k->fn(k);
+}
+
+bool cont_start(struct cont *k){
+	bool prev = thread_suspended;
+	bool ret;
+	thread_suspended = false;
+	k->fn(k);
+	ret = thread_suspended;
+	thread_suspended = prev;
+	return ret;
+}
+
+void cont_complete(struct cont *k, bool failed){
+	k->failed = failed;
+	cont_start(k);
+}
+
+// `k` must not be touched if it was started
+bool cont_suspend_call(struct cont *k, bool started){
+	if(!started){
+		k->failed = true;
+		return false;
+	}
+	thread_suspended = true;
+	return true;
+}
+
+bool cont_suspend(struct cont *k, cont_domain_t domain){
+	bool posted = false;
+	k->failed = false;
+	if(domain == thread_domain)
+		return false;
+
+	// only the game shards may block on the game queues
+	switch(domain){
+	case CONT_DOMAIN_NET:
+		if(thread_domain == CONT_DOMAIN_GAME)
+			posted = game_add_server_task(cont_resume, k);
+		else
+			posted = game_try_add_server_task(cont_resume, k);
+		break;
+	case CONT_DOMAIN_GAME:
+		posted = game_try_add_task(cont_resume, k);
+		break;
+	case CONT_DOMAIN_DB:
+		// the network thread can't block on the database queue
+		if(thread_domain == CONT_DOMAIN_NET)
+			posted = db_try_add_task(cont_resume, k);
+		else
+			posted = db_add_task(cont_resume, k);
+		break;
+	case CONT_DOMAIN_PASSWORD:
+		posted = password_add_task(cont_resume, k);
+		break;
+	default:
+		DEBUG_LOG("cont_suspend: invalid domain %d", domain);
+		break;
+	}
+
+	if(!posted){
+		// resume on this thread so it can handle the failure
+		k->failed = true;
+		return false;
+	}
+	thread_suspended = true;
+	return true;
+}
@@ -0,0 +1,112 @@
+#ifndef KAPLAR_CONT_H_
+#define KAPLAR_CONT_H_ 1
+
+#include "common.h"
+
+// continuations
+//	NOTES:
+//	- A continuation is a function `void fn(struct cont *k)` that
+//	can suspend itself with `CONT_AWAIT` and be resumed later on
+//	another thread, right after the await (stackless coroutines
+//	built on a switch statement, like protothreads).
+//	- Locals DON'T survive an await. Any state that must be kept
+//	across awaits should live in the frame data (`CONT_DATA`).
+//	- There can't be two awaits on the same line and awaits can't
+//	be used inside another switch statement.
+//	- Frames are fixed size and come from a pool so creating one
+//	is as cheap as acquiring an outbuf.
+//	- Each thread is tagged with the domain it belongs to. Awaiting
+//	the domain the continuation is already running on is a no-op,
+//	so hops that aren't needed are skipped automatically.
+//	- GAME continuations run on the main shard.
+//	- NET continuations are posted with `game_add_server_task` and
+//	run on the server thread. This is also true when coming from the
+//	database, which avoids an extra hop through the game thread.
+//	- Hops to NET and GAME from threads other than the game shards
+//	don't block (see `game_try_add_task`) and fail when the queue
+//	is full.
+//	- PASSWORD continuations run on the password threads (see
+//	password.h). Their queue is bounded and never blocks so the hop
+//	fails when it's full.
+//	- If a continuation can't be posted to its target domain (queue
+//	full or inactive) it resumes on the current thread with
+//	`CONT_FAILED` set, so it can bail out cleanly.
+//	- `CONT_AWAIT_CALL(k, call)` waits on a completion instead of a
+//	domain. `call` starts something (eg: an async query, see
+//	database.h) that calls `cont_complete` on `k` once it's done. If
+//	`call` returns false nothing was started and `k` continues right
+//	away with `CONT_FAILED` set. Otherwise `k` may already be running
+//	on another thread when `call` returns.
+
+typedef enum cont_domain{
+	CONT_DOMAIN_NONE = 0,
+	CONT_DOMAIN_NET,
+	CONT_DOMAIN_GAME,
+	CONT_DOMAIN_DB,
+	CONT_DOMAIN_PASSWORD,
+} cont_domain_t;
+
+#define CONT_MAX_DATA 256
+struct cont{
+	struct cont *next;
+	void (*fn)(struct cont*);
+	int resume;
+	bool failed;
+	union{
+		void *ptr;
+		int64 i64;
+		double f64;
+		uint8 data[CONT_MAX_DATA];
+	} u;
+};
+
+#define CONT_DATA(k, type)	((type*)(k)->u.data)
+#define CONT_FAILED(k)		((k)->failed)
+
+#define CONT_BEGIN(k)							\
+	switch((k)->resume){ case 0:
+
+#define CONT_AWAIT(k, domain)						\
+	do{	(k)->resume = __LINE__;					\
+		if(cont_suspend((k), (domain))) return;			\
+		case __LINE__:;						\
+	}while(0)
+
+#define CONT_AWAIT_CALL(k, call)					\
+	do{	(k)->resume = __LINE__;					\
+		(k)->failed = false;					\
+		if(cont_suspend_call((k), (call))) return;		\
+		case __LINE__:;						\
+	}while(0)
+
+// releases the frame and returns
+#define CONT_EXIT(k)							\
+	do{ cont_release(k); return; }while(0)
+
+#define CONT_END(k)							\
+	} cont_release(k); return
+
+bool cont_init(void);
+void cont_shutdown(void);
+void cont_set_thread_domain(cont_domain_t domain);
+cont_domain_t cont_thread_domain(void);
+
+// `datasize` must be at most `CONT_MAX_DATA`. Frame data is
+// zero initialized.
+struct cont *cont_create(void (*fn)(struct cont*), size_t datasize);
+void cont_release(struct cont *k);
+
+// runs the continuation on the current thread until it either
+// finishes (returns false) or is suspended (returns true) in which
+// case `k` must not be touched anymore
+bool cont_start(struct cont *k);
+
+// resumes a continuation waiting on `CONT_AWAIT_CALL` on the
+// current thread (with `CONT_FAILED` set to `failed`)
+void cont_complete(struct cont *k, bool failed);
+
+// used by `CONT_AWAIT` and `CONT_AWAIT_CALL`
+bool cont_suspend(struct cont *k, cont_domain_t domain);
+bool cont_suspend_call(struct cont *k, bool started);
+
+#endif //KAPLAR_CONT_H_
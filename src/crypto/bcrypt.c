@@ -2,6 +2,7 @@
 #include "blowfish.h"
 #include "base64.h"
 #include "random.h"
+#include "../buffer_util.h"
 
 #include <ctype.h>
 #include <stdio.h>
@@ -9,15 +10,151 @@
 
 // x -> log_rounds		(2 bytes)
 // y -> salt encoded in base 64	(22 bytes)
-// z -> hash encoded in base 64	(32 bytes)
-// hash total length = 62 bytes (including null terminator)
+// z -> hash encoded in base 64	(31 bytes)
+// hash total length = 61 bytes (including null terminator)
 // salt total length = 30 bytes (including null terminator)
 // "$2b$x$y[z]"
 
+// only 23 of the 24 bytes of cipher text are encoded (same
+// as the original implementation)
 #define BCRYPT_SALT_LEN		16
 #define BCRYPT_HASH_LEN		24
+#define BCRYPT_HASH_ENCLEN	23
 #define BCRYPT_SALT_STRLEN	30
-#define BCRYPT_HASH_STRLEN	62
+
+// returns -1 if `salt` doesn't have a valid "$2?$x$" prefix
+static int parse_logr(const char *salt){
+	int logr;
+	if(salt[0] != '$' || salt[1] != '2' || salt[2] == 0 || salt[3] != '$'
+	|| isdigit(salt[4]) == 0 || isdigit(salt[5]) == 0 || salt[6] != '$')
+		return -1;
+	logr = (salt[4] - '0') * 10 + (salt[5] - '0');
+	if(logr < 4 || logr > 31)
+		return -1;
+	return logr;
+}
+
+/* EKSBLOWFISH */
+//	- Almost all of the time goes to the key schedule (2^cost pairs
+//	of expansions with 521 block encryptions each) so bcrypt has its
+//	own Blowfish core instead of going through blowfish.c:
+//	- The key and salt are turned into words once instead of being
+//	read one byte at a time for every expansion.
+//	- The 16 rounds are unrolled and the block stays in two locals
+//	(there's no encoding or decoding between encryptions).
+//	- P is copied to a local array while S is rewritten so the
+//	compiler knows the stores to S don't change it.
+//	- The state is the same `struct blowfish_ctx` (P and S together
+//	take 4KB which fits in L1 so there's nothing to gain from moving
+//	things around).
+
+#define EKS_F(S, x)							\
+	((((S)[(x) >> 24] + (S)[256 + (((x) >> 16) & 0xFF)])		\
+		^ (S)[512 + (((x) >> 8) & 0xFF)]) + (S)[768 + ((x) & 0xFF)])
+
+// `b ^ p` doesn't depend on the previous round so
+// it's kept out of the dependency chain
+#define EKS_ROUND(S, a, b, p) b = (b ^ (p)) ^ EKS_F(S, a)
+
+// encrypts the block (`l`, `r`) in place
+#define EKS_ENCIPHER(S, P, l, r)					\
+	do{	uint32 _t;						\
+		l ^= (P)[0];						\
+		EKS_ROUND(S, l, r, (P)[1]);	EKS_ROUND(S, r, l, (P)[2]);	\
+		EKS_ROUND(S, l, r, (P)[3]);	EKS_ROUND(S, r, l, (P)[4]);	\
+		EKS_ROUND(S, l, r, (P)[5]);	EKS_ROUND(S, r, l, (P)[6]);	\
+		EKS_ROUND(S, l, r, (P)[7]);	EKS_ROUND(S, r, l, (P)[8]);	\
+		EKS_ROUND(S, l, r, (P)[9]);	EKS_ROUND(S, r, l, (P)[10]);	\
+		EKS_ROUND(S, l, r, (P)[11]);	EKS_ROUND(S, r, l, (P)[12]);	\
+		EKS_ROUND(S, l, r, (P)[13]);	EKS_ROUND(S, r, l, (P)[14]);	\
+		EKS_ROUND(S, l, r, (P)[15]);	EKS_ROUND(S, r, l, (P)[16]);	\
+		r ^= (P)[17];						\
+		_t = l; l = r; r = _t;					\
+	}while(0)
+
+// the first 18 words of a cyclic byte stream (big endian)
+static void eks_stream_words(const uint8 *data, size_t len, uint32 *words){
+	size_t j = 0;
+	for(int i = 0; i < 18; i += 1){
+		words[i] = 0;
+		for(int k = 0; k < 4; k += 1){
+			words[i] = (words[i] << 8) | data[j];
+			if(++j >= len)
+				j = 0;
+		}
+	}
+}
+
+// `salt` is the salt as words, which repeat every 4 words
+static void eks_expandstate(struct blowfish_ctx *b,
+		const uint32 *key, const uint32 *salt){
+	uint32 *S = b->S;
+	uint32 P[18];
+	uint32 l, r;
+	int i;
+
+	for(i = 0; i < 18; i += 1)
+		P[i] = b->P[i] ^ key[i];
+	l = r = 0;
+	for(i = 0; i < 18; i += 2){
+		l ^= salt[i & 3];
+		r ^= salt[(i + 1) & 3];
+		EKS_ENCIPHER(S, P, l, r);
+		P[i] = l;
+		P[i + 1] = r;
+	}
+	// 18 words into the salt so it continues from the third one
+	for(i = 0; i < 1024; i += 2){
+		l ^= salt[(i + 2) & 3];
+		r ^= salt[(i + 3) & 3];
+		EKS_ENCIPHER(S, P, l, r);
+		S[i] = l;
+		S[i + 1] = r;
+	}
+	memcpy(b->P, P, sizeof(P));
+}
+
+// same as above without the salt (the key is either
+// the password or the salt)
+static void eks_expand0state(struct blowfish_ctx *b, const uint32 *key){
+	uint32 *S = b->S;
+	uint32 P[18];
+	uint32 l, r;
+	int i;
+
+	for(i = 0; i < 18; i += 1)
+		P[i] = b->P[i] ^ key[i];
+	l = r = 0;
+	for(i = 0; i < 18; i += 2){
+		EKS_ENCIPHER(S, P, l, r);
+		P[i] = l;
+		P[i + 1] = r;
+	}
+	for(i = 0; i < 1024; i += 2){
+		EKS_ENCIPHER(S, P, l, r);
+		S[i] = l;
+		S[i + 1] = r;
+	}
+	memcpy(b->P, P, sizeof(P));
+}
+
+// encrypts "OrpheanBeholderScryDoubt" 64 times with the
+// expanded state
+static void eks_encrypt_ctext(struct blowfish_ctx *b, uint8 *ctext){
+	static const uint8 ptext[BCRYPT_HASH_LEN] = "OrpheanBeholderScryDoubt";
+	uint32 *S = b->S;
+	uint32 P[18];
+	uint32 l, r;
+	memcpy(P, b->P, sizeof(P));
+	for(int i = 0; i < BCRYPT_HASH_LEN; i += 8){
+		l = decode_u32_be((uint8*)ptext + i);
+		r = decode_u32_be((uint8*)ptext + i + 4);
+		for(int j = 0; j < 64; j += 1)
+			EKS_ENCIPHER(S, P, l, r);
+		encode_u32_be(ctext + i, l);
+		encode_u32_be(ctext + i + 4, r);
+	}
+}
 
 static bool generate_salt(int logr, char *salt, size_t saltlen){
 	uint8 csalt[BCRYPT_SALT_LEN];
@@ -35,13 +172,13 @@ static bool generate_salt(int logr, char *salt, size_t saltlen){
 
 static bool generate_hash(const char *key, const char *salt,
 			char *hash, size_t hashlen){
-	static const char ptext[] =
-		"OrpheanBeholderScryDoubt";
 	struct blowfish_ctx b;
+	uint32 key_words[18], salt_words[18];
 	uint8 csalt[BCRYPT_SALT_LEN];
 	uint8 ctext[BCRYPT_HASH_LEN];
-	uint8 minor, logr;
+	uint8 minor;
 	uint32 rounds, i;
+	int logr;
 	size_t keylen;
 
 	if((strlen(salt)+1) < BCRYPT_SALT_STRLEN)
@@ -52,21 +189,19 @@ static bool generate_hash(const char *key, const char *salt,
 	if(salt[0] != '$' || salt[1] != '2')
 		return false;
 
-	// include null terminator on key length
+	// include null terminator on key length ($2y$ is the same
+	// as $2b$ and is used by php's crypt)
 	keylen = strlen(key) + 1;
 	switch((minor = salt[2])){
-	case 'b':	if(keylen > 72)
+	case 'b':
+	case 'y':	if(keylen > 72)
 				keylen = 72;
 	case 'a':	break;
 	default:	return false;
 	}
 
 	// check rounds
-	if(salt[3] != '$' || salt[6] != '$' ||
-	   isdigit(salt[4]) == 0 || isdigit(salt[5]) == 0)
-		return false;
-	logr = (salt[4] - '0') * 10 + (salt[5] - '0');
-	if(logr < 4 || logr > 31)
+	if((logr = parse_logr(salt)) < 0)
 		return false;
 	rounds = 1UL << logr;
 
@@ -75,22 +210,24 @@ static bool generate_hash(const char *key, const char *salt,
 		return false;
 
 	// setup key
+	eks_stream_words((const uint8*)key, keylen, key_words);
+	eks_stream_words(csalt, BCRYPT_SALT_LEN, salt_words);
 	blowfish_init(&b);
-	blowfish_expandkey1(&b, (uint8*)key, keylen,
-		csalt, BCRYPT_SALT_LEN);
+	eks_expandstate(&b, key_words, salt_words);
 	for(i = 0; i < rounds; i++){
-		blowfish_expandkey(&b, (uint8*)key, keylen);
-		blowfish_expandkey(&b, csalt, BCRYPT_SALT_LEN);
+		eks_expand0state(&b, key_words);
+		eks_expand0state(&b, salt_words);
 	}
 
 	// encrypt
-	memcpy(ctext, ptext, BCRYPT_HASH_LEN);
-	blowfish_ecb_encode_n(&b, 64, ctext, BCRYPT_HASH_LEN);
+	eks_encrypt_ctext(&b, ctext);
+	memset(key_words, 0, sizeof(key_words));
+	memset(&b, 0, sizeof(b));
 
 	// assemble the hash string
 	sprintf(hash, "$2%c$%2.2u$", minor, logr);
 	base64_encode(hash + 7, csalt, BCRYPT_SALT_LEN);
-	base64_encode(hash + 7 + 22, ctext, BCRYPT_HASH_LEN);
+	base64_encode(hash + 7 + 22, ctext, BCRYPT_HASH_ENCLEN);
 	// base64_encode already adds the null terminator
 	return true;
 }
@@ -121,3 +258,14 @@ bool bcrypt_checkpass(const char *pass, const char *hash){
 	return hashlen == strlen(test_hash) &&
 		hash_cmp(hash, test_hash, hashlen);
 }
+
+int bcrypt_hash_cost(const char *hash){
+	if(strlen(hash) != BCRYPT_HASH_STRLEN - 1)
+		return -1;
+	switch(hash[2]){
+	case 'a':
+	case 'b':
+	case 'y':	return parse_logr(hash);
+	default:	return -1;
+	}
+}
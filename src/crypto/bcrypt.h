@@ -3,7 +3,13 @@
 
 #include "../common.h"
 
+// hash length including the null terminator
+#define BCRYPT_HASH_STRLEN 61
+
 bool bcrypt_newhash(const char *pass, int logr, char *hash, size_t hashlen);
 bool bcrypt_checkpass(const char *pass, const char *hash);
+// returns the cost (log2 of the rounds) or -1 if `hash` isn't
+// a bcrypt hash
+int bcrypt_hash_cost(const char *hash);
 
 #endif //KAPLAR_CRYPTO_BCRYPT_H_
@@ -384,7 +384,7 @@ void blowfish_ecb_encode(struct blowfish_ctx *b, uint8 *data, size_t len){
 		d[1] = decode_u32_be(data + 4);
 		encode_one(b, d);
 		encode_u32_be(data, d[0]);
-		encode_u32_be(data, d[1]);
+		encode_u32_be(data + 4, d[1]);
 		len -= 8; data += 8;
 	}
 }
@@ -397,7 +397,7 @@ void blowfish_ecb_decode(struct blowfish_ctx *b, uint8 *data, size_t len){
 		d[1] = decode_u32_be(data + 4);
 		decode_one(b, d);
 		encode_u32_be(data, d[0]);
-		encode_u32_be(data, d[1]);
+		encode_u32_be(data + 4, d[1]);
 		len -= 8; data += 8;
 	}
 }
@@ -412,7 +412,7 @@ void blowfish_cbc_encode(struct blowfish_ctx *b, uint8 *iv, uint8 *data, size_t
 		d[1] = decode_u32_be(data + 4);
 		encode_one(b, d);
 		encode_u32_be(data, d[0]);
-		encode_u32_be(data, d[1]);
+		encode_u32_be(data + 4, d[1]);
 		len -= 8;
 		iv = data; data += 8;
 	}
@@ -430,7 +430,7 @@ void blowfish_cbc_decode(struct blowfish_ctx *b, uint8 *iv, uint8 *data, size_t
 		d[1] = decode_u32_be(data + 4);
 		decode_one(b, d);
 		encode_u32_be(data, d[0]);
-		encode_u32_be(data, d[1]);
+		encode_u32_be(data + 4, d[1]);
 		if(len > 8){
 			for(i = 0; i < 8; ++i)
 				data[i] ^= prev[i];
@@ -452,7 +452,7 @@ void blowfish_ecb_encode_n(struct blowfish_ctx *b, int n, uint8 *data, size_t le
 		for(i = 0; i < n; i++)
 			encode_one(b, d);
 		encode_u32_be(data, d[0]);
-		encode_u32_be(data, d[1]);
+		encode_u32_be(data + 4, d[1]);
 		len -= 8; data += 8;
 	}
 }
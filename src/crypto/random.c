@@ -2,10 +2,23 @@
 #include "random.h"
 
 #if defined(PLATFORM_WINDOWS)
-// @TODO
+
+#define WIN32_LEAN_AND_MEAN 1
+#include <windows.h>
+#include <bcrypt.h>
+
 bool crypto_random(void *data, size_t len){
-	ASSERT(0 && "crypto_random: not implemented");
-	return len == 0;
+	ULONG n;
+	while(len > 0){
+		// the length is a ULONG
+		n = (ULONG)(len > 0x40000000 ? 0x40000000 : len);
+		if(!BCRYPT_SUCCESS(BCryptGenRandom(NULL, data, n,
+				BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+			return false;
+		len -= n;
+		data = (uint8*)data + n;
+	}
+	return true;
 }
 
 #elif defined(PLATFORM_LINUX) || defined(PLATFORM_FREEBSD)
@@ -23,7 +36,7 @@ static bool getrandom_wrapper(void *data, size_t len){
 		if(ret == -1)
 			return false;
 		len -= ret;
-		data = advance_pointer(data, ret);
+		data = (uint8*)data + ret;
 	}
 	return true;
 }
@@ -48,7 +61,7 @@ static bool urandom_wrapper(void *data, size_t len){
 			return false;
 		}
 		len -= ret;
-		data = advance_pointer(data, ret);
+		data = (uint8*)data + ret;
 	}
 	pthread_mutex_unlock(&mtx);
 	return true;
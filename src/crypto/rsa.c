@@ -84,3 +84,126 @@ void rsa_decode(struct rsa_ctx *r, uint8 *data, size_t len, size_t *outlen){
 	mpz_addmul(r->x2, r->x3, r->q);			// x2 = x2 + x3 * q
 	mpz_export(data, outlen, 1, 1, 0, 0, r->x2);	// data = export(x2)
 }
+
+#ifdef RSA_HAS_FIXED
+/* FIXED WIDTH */
+#define LIMBS RSA_FIXED_LIMBS
+#define PRIME_LIMBS RSA_FIXED_PRIME_LIMBS
+// size of the temporaries (products of two primes)
+#define WIDE_LIMBS (PRIME_LIMBS * 2)
+
+// big endian bytes to `n` limbs
+static void import_limbs(mp_limb_t *r, mp_size_t n, const uint8 *data, size_t len){
+	size_t bit;
+	mpn_zero(r, n);
+	for(size_t i = 0; i < len; i += 1){
+		bit = (len - 1 - i) * 8;
+		r[bit / GMP_NUMB_BITS] |= (mp_limb_t)data[i] << (bit % GMP_NUMB_BITS);
+	}
+}
+
+// `len` bytes worth of limbs to big endian bytes
+static void export_limbs(uint8 *out, size_t len, const mp_limb_t *r){
+	size_t bit;
+	for(size_t i = 0; i < len; i += 1){
+		bit = (len - 1 - i) * 8;
+		out[i] = (uint8)(r[bit / GMP_NUMB_BITS] >> (bit % GMP_NUMB_BITS));
+	}
+}
+
+// copies `x` into `n` limbs (zero padded)
+static bool set_limbs(mp_limb_t *r, mp_size_t n, mpz_t x){
+	if(mpz_sgn(x) < 0 || (mp_size_t)mpz_size(x) > n)
+		return false;
+	for(mp_size_t i = 0; i < n; i += 1)
+		r[i] = mpz_getlimbn(x, i);
+	return true;
+}
+
+static mp_size_t max_itch(mp_size_t a, mp_size_t b){
+	return a > b ? a : b;
+}
+
+bool rsa_fixed_init(struct rsa_fixed *f, struct rsa_ctx *r){
+	mp_size_t itch;
+	// the `mpn_sec_*` functions need the most significant limb of
+	// the moduli to be set so each prime uses its exact size
+	f->pn = (mp_size_t)mpz_size(r->p);
+	f->qn = (mp_size_t)mpz_size(r->q);
+	if(mpz_size(r->n) > LIMBS || f->pn == 0 || f->qn == 0)
+		return false;
+	if(!set_limbs(f->p, PRIME_LIMBS, r->p)
+			|| !set_limbs(f->q, PRIME_LIMBS, r->q)
+			|| !set_limbs(f->dp, PRIME_LIMBS, r->dp)
+			|| !set_limbs(f->dq, PRIME_LIMBS, r->dq)
+			|| !set_limbs(f->qi, PRIME_LIMBS, r->qi))
+		return false;
+	// the exponent sizes aren't secret (they follow from p and q)
+	// and every bit less is one less step in `mpn_sec_powm`
+	f->dp_bits = mpz_sizeinbase(r->dp, 2);
+	f->dq_bits = mpz_sizeinbase(r->dq, 2);
+
+	// temporaries (see `rsa_fixed_decode`) + the largest
+	// scratch needed by the mpn functions
+	itch = mpn_sec_powm_itch(f->pn, f->dp_bits, f->pn);
+	itch = max_itch(itch, mpn_sec_powm_itch(f->qn, f->dq_bits, f->qn));
+	itch = max_itch(itch, mpn_sec_div_r_itch(WIDE_LIMBS, f->pn));
+	itch = max_itch(itch, mpn_sec_div_r_itch(WIDE_LIMBS, f->qn));
+	f->scratch_limbs = WIDE_LIMBS * 2 + PRIME_LIMBS * 2 + itch;
+	return true;
+}
+
+// (c ^ d) mod m with `c` being WIDE_LIMBS long (it's destroyed)
+static void fixed_powm(mp_limb_t *rp, mp_limb_t *c, const mp_limb_t *d,
+		mp_bitcnt_t dbits, const mp_limb_t *m, mp_size_t mn, mp_limb_t *tp){
+	mpn_sec_div_r(c, WIDE_LIMBS, m, mn, tp);
+	// `mpn_sec_powm` requires a non zero base
+	if(mpn_zero_p(c, mn))
+		mpn_zero(rp, mn);
+	else
+		mpn_sec_powm(rp, c, mn, d, dbits, m, mn, tp);
+}
+
+void rsa_fixed_decode(const struct rsa_fixed *f, uint8 *data,
+		size_t len, size_t *outlen, mp_limb_t *scratch){
+	mp_limb_t *c = scratch;			// WIDE_LIMBS
+	mp_limb_t *x = c + WIDE_LIMBS;		// WIDE_LIMBS
+	mp_limb_t *m1 = x + WIDE_LIMBS;		// PRIME_LIMBS
+	mp_limb_t *m2 = m1 + PRIME_LIMBS;	// PRIME_LIMBS
+	mp_limb_t *tp = m2 + PRIME_LIMBS;
+	mp_size_t pn = f->pn, qn = f->qn;
+	uint8 out[RSA_FIXED_BYTES];
+	size_t skip;
+
+	DEBUG_ASSERT(len <= RSA_FIXED_BYTES);
+	import_limbs(c, WIDE_LIMBS, data, len);
+
+	// same steps as `rsa_decode` (Chinese remainder theorem)
+	mpn_copyi(x, c, WIDE_LIMBS);
+	fixed_powm(m1, x, f->dp, f->dp_bits, f->p, pn, tp);	// m1 = (c ^ dp) mod p
+	mpn_copyi(x, c, WIDE_LIMBS);
+	fixed_powm(m2, x, f->dq, f->dq_bits, f->q, qn, tp);	// m2 = (c ^ dq) mod q
+	mpn_zero(x, WIDE_LIMBS);
+	mpn_copyi(x, m2, qn);
+	mpn_sec_div_r(x, WIDE_LIMBS, f->p, pn, tp);	// x = m2 mod p
+	if(mpn_sub_n(x, m1, x, pn) != 0)		// x = m1 - x
+		mpn_add_n(x, x, f->p, pn);		// if x < 0: x = x + p
+	mpn_zero(c, WIDE_LIMBS);
+	mpn_mul_n(c, x, f->qi, pn);			//
+	mpn_sec_div_r(c, WIDE_LIMBS, f->p, pn, tp);	// c = (x * qi) mod p
+	mpn_zero(x, WIDE_LIMBS);
+	if(pn >= qn)					//
+		mpn_mul(x, c, pn, f->q, qn);		//
+	else						//
+		mpn_mul(x, f->q, qn, c, pn);		//
+	mpn_add(x, x, pn + qn, m2, qn);			// x = m2 + c * q
+
+	// the result is smaller than the modulus so it fits in
+	// RSA_FIXED_BYTES, drop leading zeros like `mpz_export`
+	export_limbs(out, RSA_FIXED_BYTES, x);
+	for(skip = 0; skip < RSA_FIXED_BYTES && out[skip] == 0; skip += 1)
+		continue;
+	*outlen = RSA_FIXED_BYTES - skip;
+	memcpy(data, out + skip, *outlen);
+}
+#endif //RSA_HAS_FIXED
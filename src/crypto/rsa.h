@@ -17,4 +17,37 @@ bool rsa_setkey(struct rsa_ctx *r, const char *p, const char *q, const char *e);
 void rsa_encode(struct rsa_ctx *r, uint8 *data, size_t len, size_t *outlen);
 void rsa_decode(struct rsa_ctx *r, uint8 *data, size_t len, size_t *outlen);
 
+// fixed width decoding
+//	NOTES:
+//	- Decodes with the low level `mpn_sec_*` functions (GMP >= 6)
+//	on fixed size operands (up to a 1024 bits modulus) so it does no
+//	allocations and the key is only read. The same `rsa_fixed` can be
+//	used from any number of threads as long as each one has its own
+//	scratch space (`scratch_limbs` limbs).
+//	- Primes may be a limb larger than half the modulus (the Tibia
+//	key has a 513 bits `p`). `rsa_fixed_init` fails if the key doesn't
+//	fit, in which case `rsa_decode` should be used instead.
+//	- The output is the same as `rsa_decode` (leading zeros are
+//	dropped) and `data` must have room for `RSA_FIXED_BYTES`.
+#if __GNU_MP_VERSION >= 6
+#define RSA_HAS_FIXED 1
+#define RSA_FIXED_BYTES 128
+#define RSA_FIXED_LIMBS ((RSA_FIXED_BYTES * 8) / GMP_NUMB_BITS)
+#define RSA_FIXED_PRIME_LIMBS (RSA_FIXED_LIMBS / 2 + 1)
+struct rsa_fixed{
+	mp_limb_t p[RSA_FIXED_PRIME_LIMBS];
+	mp_limb_t q[RSA_FIXED_PRIME_LIMBS];
+	mp_limb_t dp[RSA_FIXED_PRIME_LIMBS];
+	mp_limb_t dq[RSA_FIXED_PRIME_LIMBS];
+	mp_limb_t qi[RSA_FIXED_PRIME_LIMBS];
+	mp_size_t pn, qn;
+	mp_bitcnt_t dp_bits, dq_bits;
+	mp_size_t scratch_limbs;
+};
+
+bool rsa_fixed_init(struct rsa_fixed *f, struct rsa_ctx *r);
+void rsa_fixed_decode(const struct rsa_fixed *f, uint8 *data,
+	size_t len, size_t *outlen, mp_limb_t *scratch);
+#endif
+
 #endif //KAPLAR_CRYPTO_RSA_H_
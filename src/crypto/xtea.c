@@ -1,40 +1,547 @@
 #include "xtea.h"
 #include "../buffer_util.h"
 
+#ifdef ARCH_X86
+#	include <immintrin.h>
+#endif
+
 #define IS_MULT_OF_8(x) (((x) & 7) == 0)
+#define XTEA_ROUNDS 32
+#define XTEA_DELTA 0x9E3779B9UL
 
-void xtea_encode(uint32 *k, uint8 *data, size_t len){
-	DEBUG_ASSERT(IS_MULT_OF_8(len));
-	uint32 v0, v1, delta, sum, i;
-	while(len > 0){
+// round keys
+//	- The key words added on each round only depend on `sum` so
+//	they're computed once per call instead of once per block. Decoding
+//	uses the same keys in reverse order.
+struct round_keys{
+	uint32 k0[XTEA_ROUNDS];
+	uint32 k1[XTEA_ROUNDS];
+};
+
+static void round_keys_init(struct round_keys *rk, const uint32 *k){
+	uint32 sum = 0UL;
+	for(int i = 0; i < XTEA_ROUNDS; i += 1){
+		rk->k0[i] = sum + k[sum & 3];
+		sum += XTEA_DELTA;
+		rk->k1[i] = sum + k[sum>>11 & 3];
+	}
+}
+
+/* SCALAR */
+static void encode_scalar(const struct round_keys *rk, uint8 *data, size_t blocks){
+	uint32 v0, v1;
+	while(blocks > 0){
 		v0 = decode_u32_le(data);
 		v1 = decode_u32_le(data + 4);
-		delta = 0x9E3779B9UL; sum = 0UL;
-		for(i = 0; i < 32; ++i){
-			v0 += ((v1<<4 ^ v1>>5) + v1) ^ (sum + k[sum & 3]);
-			sum += delta;
-			v1 += ((v0<<4 ^ v0>>5) + v0) ^ (sum + k[sum>>11 & 3]);
+		for(int i = 0; i < XTEA_ROUNDS; i += 1){
+			v0 += ((v1<<4 ^ v1>>5) + v1) ^ rk->k0[i];
+			v1 += ((v0<<4 ^ v0>>5) + v0) ^ rk->k1[i];
 		}
 		encode_u32_le(data, v0);
 		encode_u32_le(data + 4, v1);
-		len -= 8; data += 8;
+		blocks -= 1; data += 8;
 	}
 }
 
-void xtea_decode(uint32 *k, uint8 *data, size_t len){
-	DEBUG_ASSERT(IS_MULT_OF_8(len));
-	uint32 v0, v1, delta, sum, i;
-	while(len > 0){
+static void decode_scalar(const struct round_keys *rk, uint8 *data, size_t blocks){
+	uint32 v0, v1;
+	while(blocks > 0){
 		v0 = decode_u32_le(data);
 		v1 = decode_u32_le(data + 4);
-		delta = 0x9E3779B9UL; sum = 0xC6EF3720UL;
-		for(i = 0; i < 32; ++i){
-			v1 -= ((v0<<4 ^ v0>>5) + v0) ^ (sum + k[sum>>11 & 3]);
-			sum -= delta;
-			v0 -= ((v1<<4 ^ v1>>5) + v1) ^ (sum + k[sum & 3]);
+		for(int i = XTEA_ROUNDS - 1; i >= 0; i -= 1){
+			v1 -= ((v0<<4 ^ v0>>5) + v0) ^ rk->k1[i];
+			v0 -= ((v1<<4 ^ v1>>5) + v1) ^ rk->k0[i];
 		}
 		encode_u32_le(data, v0);
 		encode_u32_le(data + 4, v1);
-		len -= 8; data += 8;
+		blocks -= 1; data += 8;
+	}
+}
+
+#ifdef ARCH_X86
+/* LANES */
+//	- Used by the multi buffer kernels. Every lane walks its own
+//	segment of blocks with its own key. Buffers are split into segments
+//	of about `total / lanes` blocks so a single large buffer is still
+//	spread over all lanes, and lanes that run out of work are pointed
+//	at a scratch block until the others are done.
+//	- `lanes_refill` hands out new segments to the drained lanes and
+//	returns how many blocks can run before the next refill (zero when
+//	everything is done).
+#define XTEA_MAX_LANES 16
+struct lanes{
+	struct xtea_buffer *bufs;
+	int count;
+	int cur;
+	size_t cur_off;
+	size_t seg;
+	int num_lanes;
+	uint8 *ptr[XTEA_MAX_LANES];
+	size_t left[XTEA_MAX_LANES];
+	size_t inc[XTEA_MAX_LANES];
+	uint32 key[4][XTEA_MAX_LANES];
+	uint8 scratch[8];
+};
+
+static void lanes_init(struct lanes *ln, struct xtea_buffer *bufs,
+		int count, int num_lanes){
+	size_t total = 0;
+	DEBUG_ASSERT(num_lanes <= XTEA_MAX_LANES);
+	for(int i = 0; i < count; i += 1){
+		DEBUG_ASSERT(IS_MULT_OF_8(bufs[i].len));
+		total += bufs[i].len / 8;
+	}
+	ln->bufs = bufs;
+	ln->count = count;
+	ln->cur = 0;
+	ln->cur_off = 0;
+	ln->seg = (total + num_lanes - 1) / num_lanes;
+	if(ln->seg == 0)
+		ln->seg = 1;
+	ln->num_lanes = num_lanes;
+	for(int i = 0; i < num_lanes; i += 1){
+		ln->ptr[i] = ln->scratch;
+		ln->left[i] = 0;
+		ln->inc[i] = 0;
+	}
+}
+
+static size_t lanes_refill(struct lanes *ln){
+	struct xtea_buffer *buf;
+	size_t blocks, steps = SIZE_MAX;
+	for(int i = 0; i < ln->num_lanes; i += 1){
+		if(ln->left[i] == 0){
+			// skip finished (or empty) buffers
+			while(ln->cur < ln->count
+					&& ln->cur_off >= ln->bufs[ln->cur].len / 8){
+				ln->cur += 1;
+				ln->cur_off = 0;
+			}
+			if(ln->cur >= ln->count){
+				ln->ptr[i] = ln->scratch;
+				ln->inc[i] = 0;
+				continue;
+			}
+			buf = &ln->bufs[ln->cur];
+			blocks = buf->len / 8 - ln->cur_off;
+			if(blocks > ln->seg)
+				blocks = ln->seg;
+			ln->ptr[i] = buf->data + ln->cur_off * 8;
+			ln->left[i] = blocks;
+			ln->inc[i] = 8;
+			for(int j = 0; j < 4; j += 1)
+				ln->key[j][i] = buf->key[j];
+			ln->cur_off += blocks;
+		}
+		if(ln->left[i] < steps)
+			steps = ln->left[i];
+	}
+	if(steps == SIZE_MAX)
+		return 0;
+	for(int i = 0; i < ln->num_lanes; i += 1){
+		if(ln->left[i] > 0)
+			ln->left[i] -= steps;
+	}
+	return steps;
+}
+
+static INLINE void lanes_advance(struct lanes *ln){
+	for(int i = 0; i < ln->num_lanes; i += 1)
+		ln->ptr[i] += ln->inc[i];
+}
+
+/* SSE2 */
+//	- Two registers of blocks (v0 and v1 words of 4 blocks each) are
+//	deinterleaved with a shuffle and an unpack and interleaved back
+//	with an unpack. Two groups are processed at once because each round
+//	depends on the previous one.
+#define SSE2_F(v)							\
+	_mm_add_epi32(_mm_xor_si128(_mm_slli_epi32(v, 4),		\
+		_mm_srli_epi32(v, 5)), v)
+
+#define SSE2_LOAD(ptr, v0, v1)						\
+	do{	__m128i _a = _mm_loadu_si128((__m128i*)(ptr));		\
+		__m128i _b = _mm_loadu_si128((__m128i*)((ptr) + 16));	\
+		_a = _mm_shuffle_epi32(_a, _MM_SHUFFLE(3, 1, 2, 0));	\
+		_b = _mm_shuffle_epi32(_b, _MM_SHUFFLE(3, 1, 2, 0));	\
+		v0 = _mm_unpacklo_epi64(_a, _b);			\
+		v1 = _mm_unpackhi_epi64(_a, _b);			\
+	}while(0)
+
+#define SSE2_STORE(ptr, v0, v1)						\
+	do{	_mm_storeu_si128((__m128i*)(ptr),			\
+			_mm_unpacklo_epi32(v0, v1));			\
+		_mm_storeu_si128((__m128i*)((ptr) + 16),		\
+			_mm_unpackhi_epi32(v0, v1));			\
+	}while(0)
+
+static void encode_sse2(const struct round_keys *rk, uint8 *data, size_t blocks){
+	__m128i a0, a1, b0, b1, k;
+	for(; blocks >= 8; blocks -= 8, data += 64){
+		SSE2_LOAD(data, a0, a1);
+		SSE2_LOAD(data + 32, b0, b1);
+		for(int i = 0; i < XTEA_ROUNDS; i += 1){
+			k = _mm_set1_epi32(rk->k0[i]);
+			a0 = _mm_add_epi32(a0, _mm_xor_si128(SSE2_F(a1), k));
+			b0 = _mm_add_epi32(b0, _mm_xor_si128(SSE2_F(b1), k));
+			k = _mm_set1_epi32(rk->k1[i]);
+			a1 = _mm_add_epi32(a1, _mm_xor_si128(SSE2_F(a0), k));
+			b1 = _mm_add_epi32(b1, _mm_xor_si128(SSE2_F(b0), k));
+		}
+		SSE2_STORE(data, a0, a1);
+		SSE2_STORE(data + 32, b0, b1);
+	}
+	if(blocks >= 4){
+		SSE2_LOAD(data, a0, a1);
+		for(int i = 0; i < XTEA_ROUNDS; i += 1){
+			a0 = _mm_add_epi32(a0, _mm_xor_si128(SSE2_F(a1),
+				_mm_set1_epi32(rk->k0[i])));
+			a1 = _mm_add_epi32(a1, _mm_xor_si128(SSE2_F(a0),
+				_mm_set1_epi32(rk->k1[i])));
+		}
+		SSE2_STORE(data, a0, a1);
+		blocks -= 4; data += 32;
+	}
+	encode_scalar(rk, data, blocks);
+}
+
+static void decode_sse2(const struct round_keys *rk, uint8 *data, size_t blocks){
+	__m128i a0, a1, b0, b1, k;
+	for(; blocks >= 8; blocks -= 8, data += 64){
+		SSE2_LOAD(data, a0, a1);
+		SSE2_LOAD(data + 32, b0, b1);
+		for(int i = XTEA_ROUNDS - 1; i >= 0; i -= 1){
+			k = _mm_set1_epi32(rk->k1[i]);
+			a1 = _mm_sub_epi32(a1, _mm_xor_si128(SSE2_F(a0), k));
+			b1 = _mm_sub_epi32(b1, _mm_xor_si128(SSE2_F(b0), k));
+			k = _mm_set1_epi32(rk->k0[i]);
+			a0 = _mm_sub_epi32(a0, _mm_xor_si128(SSE2_F(a1), k));
+			b0 = _mm_sub_epi32(b0, _mm_xor_si128(SSE2_F(b1), k));
+		}
+		SSE2_STORE(data, a0, a1);
+		SSE2_STORE(data + 32, b0, b1);
+	}
+	if(blocks >= 4){
+		SSE2_LOAD(data, a0, a1);
+		for(int i = XTEA_ROUNDS - 1; i >= 0; i -= 1){
+			a1 = _mm_sub_epi32(a1, _mm_xor_si128(SSE2_F(a0),
+				_mm_set1_epi32(rk->k1[i])));
+			a0 = _mm_sub_epi32(a0, _mm_xor_si128(SSE2_F(a1),
+				_mm_set1_epi32(rk->k0[i])));
+		}
+		SSE2_STORE(data, a0, a1);
+		blocks -= 4; data += 32;
 	}
+	decode_scalar(rk, data, blocks);
+}
+
+// multi buffer
+//	- Each half round key is `sum + key[idx]` where `sum` and `idx`
+//	are the same for every lane so only the key words are per lane.
+#define SSE2_GATHER(p, v0, v1)						\
+	do{	__m128i _a = _mm_unpacklo_epi64(			\
+			_mm_loadl_epi64((__m128i*)(p)[0]),		\
+			_mm_loadl_epi64((__m128i*)(p)[1]));		\
+		__m128i _b = _mm_unpacklo_epi64(			\
+			_mm_loadl_epi64((__m128i*)(p)[2]),		\
+			_mm_loadl_epi64((__m128i*)(p)[3]));		\
+		_a = _mm_shuffle_epi32(_a, _MM_SHUFFLE(3, 1, 2, 0));	\
+		_b = _mm_shuffle_epi32(_b, _MM_SHUFFLE(3, 1, 2, 0));	\
+		v0 = _mm_unpacklo_epi64(_a, _b);			\
+		v1 = _mm_unpackhi_epi64(_a, _b);			\
+	}while(0)
+
+#define SSE2_SCATTER(p, v0, v1)						\
+	do{	__m128i _a = _mm_unpacklo_epi32(v0, v1);		\
+		__m128i _b = _mm_unpackhi_epi32(v0, v1);		\
+		_mm_storel_epi64((__m128i*)(p)[0], _a);			\
+		_mm_storel_epi64((__m128i*)(p)[1],			\
+			_mm_unpackhi_epi64(_a, _a));			\
+		_mm_storel_epi64((__m128i*)(p)[2], _b);			\
+		_mm_storel_epi64((__m128i*)(p)[3],			\
+			_mm_unpackhi_epi64(_b, _b));			\
+	}while(0)
+
+static void encode_many_sse2(struct xtea_buffer *bufs, int count){
+	struct lanes ln;
+	__m128i a0, a1, b0, b1, s, ka[4], kb[4];
+	size_t steps;
+	uint32 sum;
+	lanes_init(&ln, bufs, count, 8);
+	while((steps = lanes_refill(&ln)) > 0){
+		for(int j = 0; j < 4; j += 1){
+			ka[j] = _mm_loadu_si128((__m128i*)&ln.key[j][0]);
+			kb[j] = _mm_loadu_si128((__m128i*)&ln.key[j][4]);
+		}
+		for(; steps > 0; steps -= 1){
+			SSE2_GATHER(&ln.ptr[0], a0, a1);
+			SSE2_GATHER(&ln.ptr[4], b0, b1);
+			sum = 0UL;
+			for(int i = 0; i < XTEA_ROUNDS; i += 1){
+				s = _mm_set1_epi32(sum);
+				a0 = _mm_add_epi32(a0, _mm_xor_si128(SSE2_F(a1),
+					_mm_add_epi32(s, ka[sum & 3])));
+				b0 = _mm_add_epi32(b0, _mm_xor_si128(SSE2_F(b1),
+					_mm_add_epi32(s, kb[sum & 3])));
+				sum += XTEA_DELTA;
+				s = _mm_set1_epi32(sum);
+				a1 = _mm_add_epi32(a1, _mm_xor_si128(SSE2_F(a0),
+					_mm_add_epi32(s, ka[sum>>11 & 3])));
+				b1 = _mm_add_epi32(b1, _mm_xor_si128(SSE2_F(b0),
+					_mm_add_epi32(s, kb[sum>>11 & 3])));
+			}
+			SSE2_SCATTER(&ln.ptr[0], a0, a1);
+			SSE2_SCATTER(&ln.ptr[4], b0, b1);
+			lanes_advance(&ln);
+		}
+	}
+}
+
+/* AVX2 */
+//	- Same as SSE2 with 8 blocks per register. The shuffles and
+//	unpacks work within each 128 bit lane so the blocks end up in a
+//	different order inside the registers but they're put back in place
+//	by the store.
+#define AVX2_F(v)							\
+	_mm256_add_epi32(_mm256_xor_si256(_mm256_slli_epi32(v, 4),	\
+		_mm256_srli_epi32(v, 5)), v)
+
+#define AVX2_LOAD(ptr, v0, v1)						\
+	do{	__m256i _a = _mm256_loadu_si256((__m256i*)(ptr));	\
+		__m256i _b = _mm256_loadu_si256((__m256i*)((ptr) + 32));\
+		_a = _mm256_shuffle_epi32(_a, _MM_SHUFFLE(3, 1, 2, 0));	\
+		_b = _mm256_shuffle_epi32(_b, _MM_SHUFFLE(3, 1, 2, 0));	\
+		v0 = _mm256_unpacklo_epi64(_a, _b);			\
+		v1 = _mm256_unpackhi_epi64(_a, _b);			\
+	}while(0)
+
+#define AVX2_STORE(ptr, v0, v1)						\
+	do{	_mm256_storeu_si256((__m256i*)(ptr),			\
+			_mm256_unpacklo_epi32(v0, v1));			\
+		_mm256_storeu_si256((__m256i*)((ptr) + 32),		\
+			_mm256_unpackhi_epi32(v0, v1));			\
+	}while(0)
+
+TARGET_AVX2
+static void encode_avx2(const struct round_keys *rk, uint8 *data, size_t blocks){
+	__m256i a0, a1, b0, b1, k;
+	for(; blocks >= 16; blocks -= 16, data += 128){
+		AVX2_LOAD(data, a0, a1);
+		AVX2_LOAD(data + 64, b0, b1);
+		for(int i = 0; i < XTEA_ROUNDS; i += 1){
+			k = _mm256_set1_epi32(rk->k0[i]);
+			a0 = _mm256_add_epi32(a0, _mm256_xor_si256(AVX2_F(a1), k));
+			b0 = _mm256_add_epi32(b0, _mm256_xor_si256(AVX2_F(b1), k));
+			k = _mm256_set1_epi32(rk->k1[i]);
+			a1 = _mm256_add_epi32(a1, _mm256_xor_si256(AVX2_F(a0), k));
+			b1 = _mm256_add_epi32(b1, _mm256_xor_si256(AVX2_F(b0), k));
+		}
+		AVX2_STORE(data, a0, a1);
+		AVX2_STORE(data + 64, b0, b1);
+	}
+	if(blocks >= 8){
+		AVX2_LOAD(data, a0, a1);
+		for(int i = 0; i < XTEA_ROUNDS; i += 1){
+			a0 = _mm256_add_epi32(a0, _mm256_xor_si256(AVX2_F(a1),
+				_mm256_set1_epi32(rk->k0[i])));
+			a1 = _mm256_add_epi32(a1, _mm256_xor_si256(AVX2_F(a0),
+				_mm256_set1_epi32(rk->k1[i])));
+		}
+		AVX2_STORE(data, a0, a1);
+		blocks -= 8; data += 64;
+	}
+	encode_sse2(rk, data, blocks);
+}
+
+TARGET_AVX2
+static void decode_avx2(const struct round_keys *rk, uint8 *data, size_t blocks){
+	__m256i a0, a1, b0, b1, k;
+	for(; blocks >= 16; blocks -= 16, data += 128){
+		AVX2_LOAD(data, a0, a1);
+		AVX2_LOAD(data + 64, b0, b1);
+		for(int i = XTEA_ROUNDS - 1; i >= 0; i -= 1){
+			k = _mm256_set1_epi32(rk->k1[i]);
+			a1 = _mm256_sub_epi32(a1, _mm256_xor_si256(AVX2_F(a0), k));
+			b1 = _mm256_sub_epi32(b1, _mm256_xor_si256(AVX2_F(b0), k));
+			k = _mm256_set1_epi32(rk->k0[i]);
+			a0 = _mm256_sub_epi32(a0, _mm256_xor_si256(AVX2_F(a1), k));
+			b0 = _mm256_sub_epi32(b0, _mm256_xor_si256(AVX2_F(b1), k));
+		}
+		AVX2_STORE(data, a0, a1);
+		AVX2_STORE(data + 64, b0, b1);
+	}
+	if(blocks >= 8){
+		AVX2_LOAD(data, a0, a1);
+		for(int i = XTEA_ROUNDS - 1; i >= 0; i -= 1){
+			a1 = _mm256_sub_epi32(a1, _mm256_xor_si256(AVX2_F(a0),
+				_mm256_set1_epi32(rk->k1[i])));
+			a0 = _mm256_sub_epi32(a0, _mm256_xor_si256(AVX2_F(a1),
+				_mm256_set1_epi32(rk->k0[i])));
+		}
+		AVX2_STORE(data, a0, a1);
+		blocks -= 8; data += 64;
+	}
+	decode_sse2(rk, data, blocks);
+}
+
+// multi buffer
+//	- The gather puts lanes 0-3 in the low halves and 4-7 in the high
+//	halves of the 128 bit lanes so, after the deinterleave, the blocks
+//	are in the order 0, 1, 4, 5, 2, 3, 6, 7 and the keys are loaded in
+//	the same order.
+#define AVX2_LOAD2(p0, p1)						\
+	_mm_unpacklo_epi64(_mm_loadl_epi64((__m128i*)(p0)),		\
+		_mm_loadl_epi64((__m128i*)(p1)))
+
+#define AVX2_GATHER(p, v0, v1)						\
+	do{	__m256i _a = _mm256_inserti128_si256(			\
+			_mm256_castsi128_si256(AVX2_LOAD2((p)[0], (p)[1])),\
+			AVX2_LOAD2((p)[2], (p)[3]), 1);			\
+		__m256i _b = _mm256_inserti128_si256(			\
+			_mm256_castsi128_si256(AVX2_LOAD2((p)[4], (p)[5])),\
+			AVX2_LOAD2((p)[6], (p)[7]), 1);			\
+		_a = _mm256_shuffle_epi32(_a, _MM_SHUFFLE(3, 1, 2, 0));	\
+		_b = _mm256_shuffle_epi32(_b, _MM_SHUFFLE(3, 1, 2, 0));	\
+		v0 = _mm256_unpacklo_epi64(_a, _b);			\
+		v1 = _mm256_unpackhi_epi64(_a, _b);			\
+	}while(0)
+
+#define AVX2_STORE2(p0, p1, v)						\
+	do{	_mm_storel_epi64((__m128i*)(p0), v);			\
+		_mm_storel_epi64((__m128i*)(p1),			\
+			_mm_unpackhi_epi64(v, v));			\
+	}while(0)
+
+#define AVX2_SCATTER(p, v0, v1)						\
+	do{	__m256i _a = _mm256_unpacklo_epi32(v0, v1);		\
+		__m256i _b = _mm256_unpackhi_epi32(v0, v1);		\
+		AVX2_STORE2((p)[0], (p)[1], _mm256_castsi256_si128(_a));\
+		AVX2_STORE2((p)[2], (p)[3], _mm256_extracti128_si256(_a, 1));\
+		AVX2_STORE2((p)[4], (p)[5], _mm256_castsi256_si128(_b));\
+		AVX2_STORE2((p)[6], (p)[7], _mm256_extracti128_si256(_b, 1));\
+	}while(0)
+
+#define AVX2_LANE_KEYS(k)						\
+	_mm256_setr_epi32((k)[0], (k)[1], (k)[4], (k)[5],		\
+		(k)[2], (k)[3], (k)[6], (k)[7])
+
+TARGET_AVX2
+static void encode_many_avx2(struct xtea_buffer *bufs, int count){
+	struct lanes ln;
+	__m256i a0, a1, b0, b1, s, ka[4], kb[4];
+	size_t steps;
+	uint32 sum;
+	lanes_init(&ln, bufs, count, 16);
+	while((steps = lanes_refill(&ln)) > 0){
+		for(int j = 0; j < 4; j += 1){
+			ka[j] = AVX2_LANE_KEYS(&ln.key[j][0]);
+			kb[j] = AVX2_LANE_KEYS(&ln.key[j][8]);
+		}
+		for(; steps > 0; steps -= 1){
+			AVX2_GATHER(&ln.ptr[0], a0, a1);
+			AVX2_GATHER(&ln.ptr[8], b0, b1);
+			sum = 0UL;
+			for(int i = 0; i < XTEA_ROUNDS; i += 1){
+				s = _mm256_set1_epi32(sum);
+				a0 = _mm256_add_epi32(a0, _mm256_xor_si256(AVX2_F(a1),
+					_mm256_add_epi32(s, ka[sum & 3])));
+				b0 = _mm256_add_epi32(b0, _mm256_xor_si256(AVX2_F(b1),
+					_mm256_add_epi32(s, kb[sum & 3])));
+				sum += XTEA_DELTA;
+				s = _mm256_set1_epi32(sum);
+				a1 = _mm256_add_epi32(a1, _mm256_xor_si256(AVX2_F(a0),
+					_mm256_add_epi32(s, ka[sum>>11 & 3])));
+				b1 = _mm256_add_epi32(b1, _mm256_xor_si256(AVX2_F(b0),
+					_mm256_add_epi32(s, kb[sum>>11 & 3])));
+			}
+			AVX2_SCATTER(&ln.ptr[0], a0, a1);
+			AVX2_SCATTER(&ln.ptr[8], b0, b1);
+			lanes_advance(&ln);
+		}
+	}
+}
+#endif //ARCH_X86
+
+static void encode_many_scalar(struct xtea_buffer *bufs, int count){
+	struct round_keys rk;
+	for(int i = 0; i < count; i += 1){
+		DEBUG_ASSERT(IS_MULT_OF_8(bufs[i].len));
+		round_keys_init(&rk, bufs[i].key);
+		encode_scalar(&rk, bufs[i].data, bufs[i].len / 8);
+	}
+}
+
+/* DISPATCH */
+typedef void (*xtea_fn_t)(const struct round_keys*, uint8*, size_t);
+typedef void (*xtea_many_fn_t)(struct xtea_buffer*, int);
+static const struct{
+	const char *name;
+	uint32 features;
+	xtea_fn_t encode;
+	xtea_fn_t decode;
+	xtea_many_fn_t encode_many;
+} impls[XTEA_NUM_IMPLS] = {
+	[XTEA_IMPL_SCALAR] = {"scalar", 0,
+		encode_scalar, decode_scalar, encode_many_scalar},
+#ifdef ARCH_X86
+	[XTEA_IMPL_SSE2] = {"sse2", CPU_SSE2,
+		encode_sse2, decode_sse2, encode_many_sse2},
+	[XTEA_IMPL_AVX2] = {"avx2", CPU_AVX2,
+		encode_avx2, decode_avx2, encode_many_avx2},
+#else
+	[XTEA_IMPL_SSE2] = {"sse2", 0, NULL, NULL, NULL},
+	[XTEA_IMPL_AVX2] = {"avx2", 0, NULL, NULL, NULL},
+#endif
+};
+
+static int best_impl(void){
+	for(int i = XTEA_NUM_IMPLS - 1; i > XTEA_IMPL_SCALAR; i -= 1){
+		if(xtea_impl_supported(i))
+			return i;
+	}
+	return XTEA_IMPL_SCALAR;
+}
+
+const char *xtea_impl_name(int impl){
+	DEBUG_ASSERT(impl >= 0 && impl < XTEA_NUM_IMPLS);
+	return impls[impl].name;
+}
+
+bool xtea_impl_supported(int impl){
+	DEBUG_ASSERT(impl >= 0 && impl < XTEA_NUM_IMPLS);
+	return impls[impl].encode != NULL
+		&& (kpl_cpu_features() & impls[impl].features) == impls[impl].features;
+}
+
+void xtea_encode_impl(int impl, uint32 *k, uint8 *data, size_t len){
+	struct round_keys rk;
+	DEBUG_ASSERT(IS_MULT_OF_8(len));
+	DEBUG_ASSERT(xtea_impl_supported(impl));
+	round_keys_init(&rk, k);
+	impls[impl].encode(&rk, data, len / 8);
+}
+
+void xtea_decode_impl(int impl, uint32 *k, uint8 *data, size_t len){
+	struct round_keys rk;
+	DEBUG_ASSERT(IS_MULT_OF_8(len));
+	DEBUG_ASSERT(xtea_impl_supported(impl));
+	round_keys_init(&rk, k);
+	impls[impl].decode(&rk, data, len / 8);
+}
+
+void xtea_encode_many_impl(int impl, struct xtea_buffer *bufs, int count){
+	DEBUG_ASSERT(xtea_impl_supported(impl));
+	impls[impl].encode_many(bufs, count);
+}
+
+void xtea_encode(uint32 *k, uint8 *data, size_t len){
+	xtea_encode_impl(best_impl(), k, data, len);
+}
+
+void xtea_decode(uint32 *k, uint8 *data, size_t len){
+	xtea_decode_impl(best_impl(), k, data, len);
+}
+
+void xtea_encode_many(struct xtea_buffer *bufs, int count){
+	xtea_encode_many_impl(best_impl(), bufs, count);
 }
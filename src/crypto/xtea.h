@@ -5,4 +5,39 @@
 void xtea_encode(uint32 *k, uint8 *data, size_t len);
 void xtea_decode(uint32 *k, uint8 *data, size_t len);
 
+// implementations
+//	NOTES:
+//	- Blocks are independent (there is no chaining) so the SIMD
+//	implementations run 4 (SSE2) or 8 (AVX2) blocks per register
+//	with every round key broadcast across the lanes. Whatever doesn't
+//	fill a register goes through the scalar one.
+//	- `xtea_encode`/`xtea_decode` use the fastest one the cpu
+//	supports. The others are exposed for tests and benchmarks.
+enum{
+	XTEA_IMPL_SCALAR = 0,
+	XTEA_IMPL_SSE2,
+	XTEA_IMPL_AVX2,
+
+	XTEA_NUM_IMPLS,
+};
+const char *xtea_impl_name(int impl);
+bool xtea_impl_supported(int impl);
+void xtea_encode_impl(int impl, uint32 *k, uint8 *data, size_t len);
+void xtea_decode_impl(int impl, uint32 *k, uint8 *data, size_t len);
+
+// multi buffer
+//	NOTES:
+//	- Encodes a set of buffers, each with its own key, in a single
+//	call. The SIMD implementations give each lane its own buffer (or
+//	piece of a buffer) so small messages from different connections
+//	still fill the registers.
+//	- Every `len` must be a multiple of 8.
+struct xtea_buffer{
+	const uint32 *key;
+	uint8 *data;
+	size_t len;
+};
+void xtea_encode_many(struct xtea_buffer *bufs, int count);
+void xtea_encode_many_impl(int impl, struct xtea_buffer *bufs, int count);
+
 #endif //KAPLAR_CRYPTO_XTEA_H_
@@ -1,46 +1,341 @@
 #define DB_INTERNAL 1
 #include "database.h"
+#include "../config.h"
+#include "../cont.h"
+#include "../log.h"
 #include "../task_rbuffer.h"
 #include "../thread.h"
+#include "../trace.h"
 
-static thread_t thr;
+#include <stdio.h>
 
 #define MAX_DB_TASKS 1024
+#define MAX_DB_TASKS_OVERFLOW 4096
 static struct task_rbuffer *dbtasks;
 
-static void *db_thread(void *unused){
+// worker pool
+//	- Each worker has its own connection (the connection handle
+//	in pgsql.c is thread local) and they all share `dbtasks`.
+struct db_worker{
+	uint32 id;
+	thread_t thr;
+	bool started;
+	bool connected;
+};
+static uint32 num_workers;
+static struct db_worker workers[DB_MAX_WORKERS];
+static mutex_t startup_mtx;
+static condvar_t startup_cv;
+
+// ordered tasks
+//	- Keys are hashed into a fixed number of slots so different
+//	keys may end up being serialized together but tasks with the
+//	same key will never run concurrently or out of order.
+#define ORDERED_SLOTS 1024
+struct ordered_task{
+	struct ordered_task *next;
+	uint32 slot;
+	void (*fp)(void*);
+	void *arg;
+	int64 enqueued;
+};
+struct ordered_slot{
+	bool busy;
+	struct ordered_task *head;
+	struct ordered_task *tail;
+};
+static mutex_t ordered_mtx;
+static struct ordered_slot ordered[ORDERED_SLOTS];
+
+// task stats
+//	- Tasks are wrapped so the time they spent in the queue and the
+//	time they took to run are recorded (see `db_stats_report`).
+struct timed_task{
+	void (*fp)(void*);
+	void *arg;
+	int64 enqueued;
+};
+static int task_stat = -1;
+
+static void *db_thread(void *arg){
+	struct db_worker *worker = arg;
+	char name[32];
+	snprintf(name, sizeof(name), "database %u", worker->id);
+	trace_thread_name(name);
+	cont_set_thread_domain(CONT_DOMAIN_DB);
+
+	// connect and report back to `db_init`
+	worker->connected = db_internal_connect();
+	mutex_lock(&startup_mtx);
+	worker->started = true;
+	condvar_signal(&startup_cv);
+	mutex_unlock(&startup_mtx);
+	if(!worker->connected)
+		return NULL;
+
+	// check the connection after each task so a broken
+	// connection is reset before the next one runs
 	while(task_rbuffer_run_one(dbtasks))
-		continue;
+		db_internal_connection_check();
+	db_internal_connection_close();
 	return NULL;
 }
 
+static void db_stop_workers(uint32 count){
+	// this will make `task_rbuffer_run_one()` return false
+	// effectively ending the database threads
+	task_rbuffer_set_inactive(dbtasks);
+	for(uint32 i = 0; i < count; i += 1)
+		thread_join(&workers[i].thr, NULL);
+}
+
+static void db_cleanup(void){
+	task_rbuffer_destroy(dbtasks);
+	condvar_destroy(&startup_cv);
+	mutex_destroy(&startup_mtx);
+	mutex_destroy(&ordered_mtx);
+}
+
 bool db_init(void){
-	// connect to database
-	if(!db_internal_connect()){
-		LOG_ERROR("db_init: failed to initialize database connection");
+	bool ok = true;
+	int count = config_geti("db_workers");
+	if(count < 1 || count > DB_MAX_WORKERS){
+		LOG_ERROR("db_init: invalid number of workers (%d)"
+			" (should be within [1, %d])", count, DB_MAX_WORKERS);
 		return false;
 	}
+
+	if(!db_internal_init())
+		return false;
+	task_stat = db_stats_register("task");
+
 	// init task ringbuffer
-	dbtasks = task_rbuffer_create(MAX_DB_TASKS);
-	// create db thread
-	if(thread_init(&thr, db_thread, NULL) != 0){
-		task_rbuffer_destroy(dbtasks);
-		db_internal_connection_close();
+	dbtasks = task_rbuffer_create("database",
+		MAX_DB_TASKS, MAX_DB_TASKS_OVERFLOW);
+	mutex_init(&startup_mtx);
+	condvar_init(&startup_cv);
+	mutex_init(&ordered_mtx);
+	memset(ordered, 0, sizeof(ordered));
+
+	// start workers
+	for(num_workers = 0; num_workers < (uint32)count; num_workers += 1){
+		struct db_worker *worker = &workers[num_workers];
+		worker->id = num_workers;
+		worker->started = false;
+		worker->connected = false;
+		if(thread_init(&worker->thr, db_thread, worker) != 0){
+			LOG_ERROR("db_init: failed to start worker %u", num_workers);
+			ok = false;
+			break;
+		}
+	}
+
+	// wait for all workers to connect
+	mutex_lock(&startup_mtx);
+	for(uint32 i = 0; i < num_workers; i += 1){
+		while(!workers[i].started)
+			condvar_wait(&startup_cv, &startup_mtx);
+		if(!workers[i].connected)
+			ok = false;
+	}
+	mutex_unlock(&startup_mtx);
+	if(ok && !db_internal_async_init())
+		ok = false;
+	if(!ok){
+		LOG_ERROR("db_init: failed to initialize database connections");
+		db_stop_workers(num_workers);
+		db_cleanup();
+		db_internal_shutdown();
+		num_workers = 0;
 		return false;
 	}
 	return true;
 }
 
 void db_shutdown(void){
-	// this will make `task_rbuffer_run_one()` return false
-	// effectively ending the database thread
-	task_rbuffer_set_inactive(dbtasks);
+	db_internal_async_shutdown();
+	db_stop_workers(num_workers);
+	db_cleanup();
+	db_internal_shutdown();
+	num_workers = 0;
+}
 
-	thread_join(&thr, NULL);
+// enqueue time of the task running on this worker
+static THREAD_LOCAL int64 task_enqueued = 0;
 
-	db_internal_connection_close();
+int64 db_task_enqueued(void){
+	return task_enqueued;
+}
+
+static void run_timed_task(void *arg){
+	struct timed_task *task = arg;
+	int64 start = kpl_clock_monotonic_nsec();
+	task_enqueued = task->enqueued;
+	task->fp(task->arg);
+	task_enqueued = 0;
+	db_stats_record(task_stat, start - task->enqueued,
+		kpl_clock_monotonic_nsec() - start, false);
+	kpl_free(task);
+}
+
+static bool add_timed_task(void (*fp)(void*), void *arg, bool try_add){
+	struct timed_task *task = kpl_malloc(sizeof(struct timed_task));
+	bool ret;
+	task->fp = fp;
+	task->arg = arg;
+	task->enqueued = kpl_clock_monotonic_nsec();
+	if(try_add)
+		ret = task_rbuffer_try_push(dbtasks, run_timed_task, task);
+	else
+		ret = task_rbuffer_push(dbtasks, run_timed_task, task);
+	if(!ret)
+		kpl_free(task);
+	return ret;
 }
 
 bool db_add_task(void (*fp)(void*), void *arg){
-	return task_rbuffer_push(dbtasks, fp, arg);
+	return add_timed_task(fp, arg, false);
+}
+
+bool db_try_add_task(void (*fp)(void*), void *arg){
+	return add_timed_task(fp, arg, true);
+}
+
+/* ORDERED TASKS */
+static void run_ordered_task(void *arg){
+	struct ordered_task *task = arg;
+	struct ordered_slot *slot = &ordered[task->slot];
+	int64 start, run_start;
+	// keep running the slot's pending tasks on this worker
+	// until it's empty instead of pushing them back into the
+	// ring (which could block every worker if it's full)
+	while(task != NULL){
+		start = trace_begin();
+		run_start = kpl_clock_monotonic_nsec();
+		task_enqueued = task->enqueued;
+		task->fp(task->arg);
+		task_enqueued = 0;
+		trace_end(TRACE_CAT_TASK, (void*)task->fp, start);
+		db_stats_record(task_stat, run_start - task->enqueued,
+			kpl_clock_monotonic_nsec() - run_start, false);
+		kpl_free(task);
+
+		mutex_lock(&ordered_mtx);
+		task = slot->head;
+		if(task != NULL){
+			slot->head = task->next;
+			if(slot->head == NULL)
+				slot->tail = NULL;
+		}else{
+			slot->busy = false;
+		}
+		mutex_unlock(&ordered_mtx);
+	}
+}
+
+static bool add_ordered_task(uint32 key, void (*fp)(void*), void *arg, bool try_add){
+	struct ordered_task *task;
+	struct ordered_slot *slot;
+	bool ret;
+
+	task = kpl_malloc(sizeof(struct ordered_task));
+	task->next = NULL;
+	task->slot = (key * 2654435761U) >> 22; // top 10 bits
+	task->fp = fp;
+	task->arg = arg;
+	task->enqueued = kpl_clock_monotonic_nsec();
+	slot = &ordered[task->slot];
+
+	mutex_lock(&ordered_mtx);
+	if(slot->busy){
+		// a worker is already running this slot so
+		// it'll pick this task up when it's done
+		if(slot->tail != NULL)
+			slot->tail->next = task;
+		else
+			slot->head = task;
+		slot->tail = task;
+		mutex_unlock(&ordered_mtx);
+		return true;
+	}
+
+	if(try_add){
+		// the push doesn't block so it's done while holding the
+		// lock and the slot is only marked busy if it succeeded
+		// (nothing can be chained behind a task that failed)
+		ret = task_rbuffer_try_push(dbtasks, run_ordered_task, task);
+		slot->busy = ret;
+		mutex_unlock(&ordered_mtx);
+		if(!ret)
+			kpl_free(task);
+		return ret;
+	}
+
+	// the blocking push is done outside the lock so tasks added
+	// to the slot in the meantime are chained behind this one
+	slot->busy = true;
+	mutex_unlock(&ordered_mtx);
+	ret = task_rbuffer_push(dbtasks, run_ordered_task, task);
+	if(!ret){
+		// the queue is inactive (shutting down) so nothing in this
+		// slot will run and the tasks chained behind it are dropped
+		struct ordered_task *next;
+		mutex_lock(&ordered_mtx);
+		next = slot->head;
+		slot->head = NULL;
+		slot->tail = NULL;
+		slot->busy = false;
+		mutex_unlock(&ordered_mtx);
+		while(next != NULL){
+			struct ordered_task *tmp = next->next;
+			DEBUG_LOG("add_ordered_task: dropped task from slot %u",
+				task->slot);
+			kpl_free(next);
+			next = tmp;
+		}
+		kpl_free(task);
+	}
+	return ret;
+}
+
+bool db_add_task_ordered(uint32 key, void (*fp)(void*), void *arg){
+	return add_ordered_task(key, fp, arg, false);
+}
+
+bool db_try_add_task_ordered(uint32 key, void (*fp)(void*), void *arg){
+	return add_ordered_task(key, fp, arg, true);
+}
+
+// copies the fields of `groups` from `src` into `dst`, marking
+// them dirty and keeping the newest version
+void db_player_state_merge(struct db_player_state *dst,
+		const struct db_player_state *src, uint32 groups){
+	if(groups & DB_PLAYER_STATS){
+		dst->level = src->level;
+		dst->experience = src->experience;
+	}
+	if(groups & DB_PLAYER_VITALS){
+		dst->health = src->health;
+		dst->max_health = src->max_health;
+		dst->mana = src->mana;
+		dst->max_mana = src->max_mana;
+	}
+	if(groups & DB_PLAYER_POSITION){
+		dst->pos_x = src->pos_x;
+		dst->pos_y = src->pos_y;
+		dst->pos_z = src->pos_z;
+	}
+	if(groups & DB_PLAYER_DATA){
+		dst->data_len = src->data_len;
+		dst->data = src->data;
+	}
+	dst->dirty |= groups;
+	if(dst->version < src->version)
+		dst->version = src->version;
+}
+
+// results are single allocations for every backend
+void db_result_free(void *res){
+	if(res != NULL)
+		kpl_free(res);
 }
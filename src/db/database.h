@@ -2,51 +2,241 @@
 // NOTE1: any db_load_* functions should be run in a task
 // running on the database thread
 
-// NOTE2: DB_RESULT_* values are intimately connected to
-// the query functions associated and should only be changed
-// accordingly.
-
 #ifndef KAPLAR_DB_DATABASE_H_
 #define KAPLAR_DB_DATABASE_H_ 1
 
 #include "../common.h"
-
-typedef void db_result_t;
+#include "../cont.h"
 
 // internal database routines
+//	- These are implemented by the backend (see docs/CONFIG.txt).
+//	- `db_internal_init` and `db_internal_shutdown` run before the
+//	workers are started and after they're stopped.
+//	- Connection routines operate on the calling thread's connection
+//	and `db_internal_connection_check` runs after each task.
 #ifdef DB_INTERNAL
+bool db_internal_init(void);
+void db_internal_shutdown(void);
 bool db_internal_connect(void);
 bool db_internal_connection_reset(void);
+bool db_internal_connection_check(void);
 void db_internal_connection_close(void);
+bool db_internal_async_init(void);
+void db_internal_async_shutdown(void);
+
+// stats recording
+//	- `db_stats_register` returns an id for a statement name (or -1
+//	if there's no room, which is ignored by `db_stats_record`).
+//	- Times are in nanoseconds: `wait` is the time spent waiting to
+//	run and `exec` the time it took to get the result.
+//	- `db_stats_record` returns true if the query went over the slow
+//	query threshold so the backend can log it along with its params
+//	(which must be redacted).
+int db_stats_register(const char *name);
+bool db_stats_record(int id, int64 wait, int64 exec, bool failed);
+void db_stats_reconnect(bool ok);
+
+// `db_task_enqueued` returns when the task running on the calling
+// worker was queued (or zero outside of a task) so statements can
+// record how long they waited before being sent
+int64 db_task_enqueued(void);
 #endif
 
 // init/shutdown
+//	- There are `db_workers` threads, each with its own connection,
+//	running tasks from a shared queue so tasks may run concurrently
+//	and out of order. Tasks that need to be serialized (eg: anything
+//	that writes to the same account) should be added with an ordering
+//	key through `db_add_task_ordered`.
+#define DB_MAX_WORKERS 16
 bool db_init(void);
 void db_shutdown(void);
+
+// db stats
+//	- Queue wait and execution times are recorded per statement
+//	(plus the task queue itself) along with error, slow query and
+//	reconnect counts.
+//	- `db_stats_report` logs a summary of the last report window and,
+//	if `db_stats_output` is set, exports everything to that file in
+//	Prometheus text format. It's called by the main shard and only
+//	holds the stats mutex to take a summary: the file is written by a
+//	database worker.
+//	- Queries over `db_slow_query_threshold` milliseconds are logged
+//	as they complete (zero disables it).
+bool db_stats_init(void);
+void db_stats_shutdown(void);
+void db_stats_report(void);
+// `db_add_task` will block if the task queue is full and should
+// not be used from threads that can't stall (use `db_try_add_task`)
 bool db_add_task(void (*fp)(void*), void *arg);
+bool db_try_add_task(void (*fp)(void*), void *arg);
+bool db_add_task_ordered(uint32 key, void (*fp)(void*), void *arg);
+bool db_try_add_task_ordered(uint32 key, void (*fp)(void*), void *arg);
 
-// db result interface
-int db_result_nrows(db_result_t *res);
-int32 db_result_get_int32(db_result_t *res, int row, int field);
-int64 db_result_get_int64(db_result_t *res, int row, int field);
-float db_result_get_float(db_result_t *res, int row, int field);
-double db_result_get_double(db_result_t *res, int row, int field);
-const char *db_result_get_value(db_result_t *res, int row, int field);
-void db_result_clear(db_result_t *res);
+// db results
+//	- Results are decoded on the database thread into the structs
+//	below and the backend's own result is released right away. Each
+//	one is a single allocation (strings are stored inline) so it's
+//	cheap to hand over to other threads.
+//	- A missing account or player is a valid result with `found`
+//	set to false. Failed queries have no result (NULL).
+//	- Release with `db_result_free`.
+#define DB_MAX_NAME_LEN		32
+#define DB_MAX_PASSWORD_LEN	64
+struct db_account_info{
+	bool found;
+	int32 account_id;
+	int64 premend;
+	char password[DB_MAX_PASSWORD_LEN + 1];
+};
+
+// `names` point into the same allocation
+struct db_charlist{
+	int count;
+	const char *names[];
+};
+
+// `data` is the player blob (see player_blob.h) and is empty
+// if the player was never saved with one
+struct db_player_info{
+	bool found;
+	int32 player_id;
+	int32 account_id;
+	int64 version;
+	uint16 pos_x;
+	uint16 pos_y;
+	uint8 pos_z;
+	int data_len;
+	uint8 data[];
+};
+
+void db_result_free(void *res);
 
 // database loading functions
+struct db_account_info *db_load_account_info(const char *accname);
+struct db_charlist *db_load_account_charlist(int32 account_id);
+struct db_player_info *db_load_player(const char *charname);
+
+// database saving functions
+
+// password updates
+//	- The password is only replaced if it's still `old_password` so
+//	a change made somewhere else (eg: a website) after the old one
+//	was loaded isn't undone. It returns false if the query failed or
+//	the password didn't match.
+//	- Callers must invalidate the account cache afterwards.
+bool db_update_account_password(int32 account_id,
+		const char *old_password, const char *new_password);
 
-#define DBRES_ACC_INFO_ID		0
-#define DBRES_ACC_INFO_PREMEND		1
-#define DBRES_ACC_INFO_PASSWORD		2
-db_result_t *db_load_account_info(const char *name);
+// player saves
+//	- Only the groups of fields set in `dirty` are written, the
+//	others are left as they are in the database.
+//	- Rows are versioned for optimistic concurrency: a state is only
+//	written if its `version` is greater than the one stored, which
+//	then becomes its version. Versions start at the one the player
+//	was loaded with (see `db_player_info`) and must increase with each
+//	snapshot, so a stale snapshot (or another server that loaded the
+//	same player) can't overwrite newer data.
+//	- `data` is the encoded player blob (DB_PLAYER_DATA). The state
+//	doesn't own it: whoever fills the state keeps it alive until the
+//	save completes (see player_save.c).
+//	- All states are written in a single transaction. Players that
+//	don't exist anymore or have a stale version are skipped (and
+//	logged) without failing the others.
+enum{
+	DB_PLAYER_STATS		= 0x01,	// level, experience
+	DB_PLAYER_VITALS	= 0x02,	// health, mana and their max
+	DB_PLAYER_POSITION	= 0x04,	// pos_x, pos_y, pos_z
+	DB_PLAYER_DATA		= 0x08,	// data, data_len
 
-#define DBRES_ACC_CHARLIST_NAME		0
-db_result_t *db_load_account_charlist(int32 account_id);
+	DB_PLAYER_ALL		= 0x0F,
+};
+struct db_player_state{
+	int32 player_id;
+	uint32 dirty;
+	int64 version;
+	// DB_PLAYER_STATS
+	int32 level;
+	int64 experience;
+	// DB_PLAYER_VITALS
+	int32 health;
+	int32 max_health;
+	int32 mana;
+	int32 max_mana;
+	// DB_PLAYER_POSITION
+	uint16 pos_x;
+	uint16 pos_y;
+	uint8 pos_z;
+	// DB_PLAYER_DATA
+	int data_len;
+	const uint8 *data;
+};
+void db_player_state_merge(struct db_player_state *dst,
+		const struct db_player_state *src, uint32 groups);
+bool db_save_players(const struct db_player_state *states, int count);
 
-#define DBRES_PLAYER_ID			0
-#define DBRES_PLAYER_ACCOUNT_ID		1
-db_result_t *db_load_player(const char *charname);
+// database batches
+//	- Queries added to a batch are sent back to back when calling
+//	`db_batch_exec` and their results are read in the same order so
+//	the whole batch costs a single round trip. With libpq 14 onwards
+//	this uses pipeline mode. Older versions send the batch as a single
+//	multi statement query (in that case, if a query fails, the ones
+//	after it in the same batch fail too).
+//	- Each `db_batch_load_*` returns the index of its result which
+//	has the same type as its `db_load_*` counterpart.
+//	- Results are owned by the batch and are valid until the batch
+//	is reset or destroyed (don't call `db_result_free` on them).
+//	- `db_batch_result` returns NULL if that query failed.
+//	- Queries can't depend on the results of other queries in the
+//	same batch so use statements that resolve dependencies in the
+//	database instead (eg: `load_account_charlist_by_name`).
+#define DB_BATCH_MAX_QUERIES 16
+struct db_batch;
+struct db_batch *db_batch_create(void);
+void db_batch_destroy(struct db_batch *batch);
+void db_batch_reset(struct db_batch *batch);
+int db_batch_load_account_info(struct db_batch *batch, const char *accname);
+int db_batch_load_account_charlist(struct db_batch *batch, int32 account_id);
+int db_batch_load_account_charlist_by_name(struct db_batch *batch, const char *accname);
+int db_batch_load_player(struct db_batch *batch, const char *charname);
+bool db_batch_exec(struct db_batch *batch);
+void *db_batch_result(struct db_batch *batch, int idx);
 
+// asynchronous queries
+//	- These don't need to run on a database worker. The query is
+//	handed to a single thread multiplexing `db_async_connections`
+//	non blocking connections and `fn` is called with the result on
+//	the domain given (NET: server thread, GAME: main shard, NONE: the
+//	database thread itself, which must not block).
+//	- Submitting never blocks. It fails if there are already
+//	`db_async_max_pending` queries waiting for a connection or if
+//	async queries are disabled (`db_async_connections` is zero or the
+//	connections couldn't be made at startup). Callers should fall back
+//	to a database worker in that case.
+//	- `res` has the same type as the `db_load_*` counterpart. It's
+//	NULL if the query failed (or if the completion couldn't be posted
+//	to its domain, in which case `fn` runs on the database thread and
+//	should only release `arg`). Otherwise it's owned by `fn` and must
+//	be released with `db_result_free`.
+//	- Queries aren't ordered with respect to each other or to tasks
+//	running on the database workers.
+//	- `db_async_batch_exec` runs a whole batch (see above) the same
+//	way. `res` is the batch itself once its results are in (each one
+//	may be NULL as with `db_batch_exec`). The batch is still owned by
+//	the caller and must not be touched until `fn` runs. If the submit
+//	fails, the batch is left as it was so it can still be executed on
+//	a database worker.
+#define DB_ASYNC_MAX_CONNECTIONS 16
+typedef void (*db_async_fn_t)(void *res, void *arg);
+bool db_async_load_account_info(const char *accname,
+		cont_domain_t domain, db_async_fn_t fn, void *arg);
+bool db_async_load_account_charlist(int32 account_id,
+		cont_domain_t domain, db_async_fn_t fn, void *arg);
+bool db_async_load_account_charlist_by_name(const char *accname,
+		cont_domain_t domain, db_async_fn_t fn, void *arg);
+bool db_async_load_player(const char *charname,
+		cont_domain_t domain, db_async_fn_t fn, void *arg);
+bool db_async_batch_exec(struct db_batch *batch,
+		cont_domain_t domain, db_async_fn_t fn, void *arg);
 
 #endif //KAPLAR_DB_DATABASE_H_
@@ -0,0 +1,1347 @@
+
+// embedded storage backend
+//	- Everything is kept in memory and persisted to two files:
+//	`<local_db_path>.snap`, a snapshot of the whole store written and
+//	read through a memory mapping, and `<local_db_path>.log`, an
+//	append-only log of the changes made since the snapshot.
+//	- Log records are grouped by commit markers and a group is only
+//	replayed if its marker made it to disk, so each write (like a
+//	batch of player saves) is atomic, same as a transaction.
+//	- Every `local_db_snapshot_interval` seconds the log is rotated
+//	(to `.log.old`) and a new snapshot is written. The old log is
+//	only removed after the new snapshot is in place and records are
+//	idempotent so a crash at any point can be recovered from.
+//	- Ids are dense (nothing is ever removed) so entities are
+//	indexed directly by `id - 1`.
+//	- If there is no data and `local_db_seed` is set, the store is
+//	seeded with the same test accounts as `schema.pgsql`. It is off
+//	by default so a fresh deployment never ships known credentials.
+//	- The log is flushed on every commit but not synced to disk.
+
+#ifdef DB_BACKEND_LOCAL
+
+#define DB_INTERNAL 1
+
+#include "database.h"
+#include "../buffer_util.h"
+#include "../config.h"
+#include "../game.h"
+#include "../log.h"
+#include "../thread.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef PLATFORM_WINDOWS
+#define WIN32_LEAN_AND_MEAN 1
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define LOCAL_MAX_PATH 256
+#define LOCAL_NAME_LEN 32
+#define LOCAL_PASSWORD_LEN 64
+
+struct local_account{
+	int32 account_id;
+	int64 premend;
+	char name[LOCAL_NAME_LEN];
+	char password[LOCAL_PASSWORD_LEN];
+	// not persisted
+	char lname[LOCAL_NAME_LEN];
+	int32 first_player;
+};
+
+// `state.data` is owned by the store
+struct local_player{
+	int32 player_id;
+	int32 account_id;
+	char name[LOCAL_NAME_LEN];
+	struct db_player_state state;
+	// not persisted
+	char lname[LOCAL_NAME_LEN];
+	int32 next_player;
+};
+
+// name index
+//	- Open addressing table of `idx + 1` (zero is an empty slot)
+//	keyed by the lowercased name.
+struct name_index{
+	int32 *slots;
+	uint32 mask;
+};
+
+static struct{
+	mutex_t mtx;
+	char path[LOCAL_MAX_PATH];
+	struct local_account *accounts;
+	int num_accounts;
+	int max_accounts;
+	struct local_player *players;
+	int num_players;
+	int max_players;
+	struct name_index account_names;
+	struct name_index player_names;
+
+	// log (protected by `mtx`)
+	FILE *log;
+	uint8 *logbuf;
+	int loglen;
+	int logcap;
+
+	// snapshots
+	int64 snapshot_interval;
+	int64 next_snapshot;
+	bool snapshot_running;
+	bool loaded;
+} store;
+
+// queries
+enum{
+	QUERY_ACCOUNT_INFO = 0,
+	QUERY_ACCOUNT_CHARLIST,
+	QUERY_ACCOUNT_CHARLIST_BY_NAME,
+	QUERY_PLAYER,
+
+	NUM_QUERIES,
+};
+
+struct local_query{
+	int type;
+	int32 id;
+	char name[LOCAL_NAME_LEN];
+};
+
+// query stat ids (see `db_stats_register`), `wait` is the time
+// spent waiting for the store's lock
+static int query_stats[NUM_QUERIES];
+static int save_stat;
+static int password_stat;
+
+/* MEMORY MAPPED FILES */
+struct mapped_file{
+	uint8 *data;
+	size_t size;
+#ifdef PLATFORM_WINDOWS
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+};
+
+#ifdef PLATFORM_WINDOWS
+static bool map_file(struct mapped_file *mf, const char *path, size_t create_size){
+	LARGE_INTEGER size;
+	bool create = (create_size > 0);
+	memset(mf, 0, sizeof(struct mapped_file));
+	mf->file = CreateFileA(path, create ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+		0, NULL, create ? CREATE_ALWAYS : OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	if(mf->file == INVALID_HANDLE_VALUE)
+		return false;
+	if(create){
+		size.QuadPart = (LONGLONG)create_size;
+	}else if(!GetFileSizeEx(mf->file, &size) || size.QuadPart == 0){
+		CloseHandle(mf->file);
+		return false;
+	}
+	// creating the mapping extends the file if needed
+	mf->mapping = CreateFileMappingA(mf->file, NULL,
+		create ? PAGE_READWRITE : PAGE_READONLY,
+		size.HighPart, size.LowPart, NULL);
+	if(mf->mapping == NULL){
+		CloseHandle(mf->file);
+		return false;
+	}
+	mf->data = MapViewOfFile(mf->mapping,
+		create ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0);
+	if(mf->data == NULL){
+		CloseHandle(mf->mapping);
+		CloseHandle(mf->file);
+		return false;
+	}
+	mf->size = (size_t)size.QuadPart;
+	return true;
+}
+
+static bool unmap_file(struct mapped_file *mf){
+	bool ret = true;
+	if(mf->data == NULL)
+		return true;
+	ret = (FlushViewOfFile(mf->data, 0) != 0);
+	UnmapViewOfFile(mf->data);
+	CloseHandle(mf->mapping);
+	CloseHandle(mf->file);
+	mf->data = NULL;
+	return ret;
+}
+
+static bool replace_file(const char *from, const char *to){
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) != 0;
+}
+
+static bool truncate_file(const char *path, size_t size){
+	LARGE_INTEGER pos;
+	bool ret;
+	HANDLE file = CreateFileA(path, GENERIC_WRITE, 0, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+	pos.QuadPart = (LONGLONG)size;
+	ret = SetFilePointerEx(file, pos, NULL, FILE_BEGIN)
+		&& SetEndOfFile(file);
+	CloseHandle(file);
+	return ret;
+}
+#else
+static bool map_file(struct mapped_file *mf, const char *path, size_t create_size){
+	struct stat st;
+	bool create = (create_size > 0);
+	memset(mf, 0, sizeof(struct mapped_file));
+	mf->fd = create ? open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)
+		: open(path, O_RDONLY);
+	if(mf->fd == -1)
+		return false;
+	if(create){
+		if(ftruncate(mf->fd, (off_t)create_size) != 0){
+			close(mf->fd);
+			return false;
+		}
+		mf->size = create_size;
+	}else{
+		if(fstat(mf->fd, &st) != 0 || st.st_size == 0){
+			close(mf->fd);
+			return false;
+		}
+		mf->size = (size_t)st.st_size;
+	}
+	mf->data = mmap(NULL, mf->size, create ? (PROT_READ | PROT_WRITE) : PROT_READ,
+		MAP_SHARED, mf->fd, 0);
+	if(mf->data == MAP_FAILED){
+		mf->data = NULL;
+		close(mf->fd);
+		return false;
+	}
+	return true;
+}
+
+static bool unmap_file(struct mapped_file *mf){
+	bool ret = true;
+	if(mf->data == NULL)
+		return true;
+	ret = (msync(mf->data, mf->size, MS_SYNC) == 0);
+	munmap(mf->data, mf->size);
+	close(mf->fd);
+	mf->data = NULL;
+	return ret;
+}
+
+static bool replace_file(const char *from, const char *to){
+	return rename(from, to) == 0;
+}
+
+static bool truncate_file(const char *path, size_t size){
+	return truncate(path, (off_t)size) == 0;
+}
+#endif
+
+static void store_file_path(char *buf, size_t bufsize, const char *suffix){
+	snprintf(buf, bufsize, "%s%s", store.path, suffix);
+}
+
+static bool file_exists(const char *path){
+	FILE *f = fopen(path, "rb");
+	if(f == NULL)
+		return false;
+	fclose(f);
+	return true;
+}
+
+/* NAME INDEX */
+static void name_lower(char *dst, const char *src){
+	int i;
+	for(i = 0; i < LOCAL_NAME_LEN - 1 && src[i] != 0; i += 1)
+		dst[i] = (char)tolower((unsigned char)src[i]);
+	dst[i] = 0;
+}
+
+static INLINE uint32 name_hash(const char *lname){
+	return murmur2_32((const uint8*)lname, strlen(lname), 0x1B873593);
+}
+
+static const char *account_lname(int32 idx){
+	return store.accounts[idx].lname;
+}
+
+static const char *player_lname(int32 idx){
+	return store.players[idx].lname;
+}
+
+static int32 *index_find_slot(struct name_index *ni, const char *lname,
+		const char *(*lname_at)(int32)){
+	uint32 i = name_hash(lname) & ni->mask;
+	int32 *slot;
+	while(1){
+		slot = &ni->slots[i];
+		if(*slot == 0 || strcmp(lname_at(*slot - 1), lname) == 0)
+			return slot;
+		i = (i + 1) & ni->mask;
+	}
+}
+
+// rebuilds the index so it's at most half full for `count` entries
+static void index_rebuild(struct name_index *ni, int count,
+		const char *(*lname_at)(int32)){
+	uint32 size = 64;
+	while(size < (uint32)count * 2)
+		size <<= 1;
+	kpl_free(ni->slots);
+	ni->slots = kpl_malloc(size * sizeof(int32));
+	memset(ni->slots, 0, size * sizeof(int32));
+	ni->mask = size - 1;
+	for(int32 i = 0; i < count; i += 1)
+		*index_find_slot(ni, lname_at(i), lname_at) = i + 1;
+}
+
+static int32 index_lookup(struct name_index *ni, const char *name,
+		const char *(*lname_at)(int32)){
+	char lname[LOCAL_NAME_LEN];
+	name_lower(lname, name);
+	return *index_find_slot(ni, lname, lname_at) - 1;
+}
+
+/* STORE */
+static struct local_account *store_account(int32 account_id){
+	if(account_id < 1 || account_id > store.num_accounts)
+		return NULL;
+	return &store.accounts[account_id - 1];
+}
+
+static struct local_player *store_player(int32 player_id){
+	if(player_id < 1 || player_id > store.num_players)
+		return NULL;
+	return &store.players[player_id - 1];
+}
+
+// puts are idempotent so records can be replayed more than once
+static bool store_put_account(const struct local_account *acc){
+	struct local_account *dst;
+	int32 idx = acc->account_id - 1;
+	if(idx < 0 || idx > store.num_accounts)
+		return false;
+	if(idx == store.num_accounts){
+		if(store.num_accounts == store.max_accounts){
+			store.max_accounts = store.max_accounts * 2 + 64;
+			store.accounts = kpl_realloc(store.accounts,
+				store.max_accounts * sizeof(struct local_account));
+		}
+		store.num_accounts += 1;
+		store.accounts[idx].first_player = 0;
+	}else if(strcmp(store.accounts[idx].name, acc->name) != 0){
+		// accounts can't be renamed here
+		return false;
+	}
+	dst = &store.accounts[idx];
+	dst->account_id = acc->account_id;
+	dst->premend = acc->premend;
+	kpl_strncpy(dst->name, sizeof(dst->name), acc->name);
+	kpl_strncpy(dst->password, sizeof(dst->password), acc->password);
+	name_lower(dst->lname, dst->name);
+	if(store.num_accounts * 2 > (int)store.account_names.mask)
+		index_rebuild(&store.account_names, store.num_accounts, account_lname);
+	else
+		*index_find_slot(&store.account_names, dst->lname, account_lname) = idx + 1;
+	return true;
+}
+
+static const uint8 *copy_data(const uint8 *data, int len){
+	uint8 *copy;
+	if(len <= 0)
+		return NULL;
+	copy = kpl_malloc(len);
+	memcpy(copy, data, len);
+	return copy;
+}
+
+static void free_data(struct db_player_state *st){
+	if(st->data != NULL)
+		kpl_free((void*)st->data);
+	st->data = NULL;
+	st->data_len = 0;
+}
+
+static bool store_put_player(const struct local_player *player){
+	struct local_player *dst;
+	struct local_account *acc;
+	int32 idx = player->player_id - 1;
+	if(idx < 0 || idx > store.num_players)
+		return false;
+	acc = store_account(player->account_id);
+	if(acc == NULL)
+		return false;
+	if(idx == store.num_players){
+		if(store.num_players == store.max_players){
+			store.max_players = store.max_players * 2 + 64;
+			store.players = kpl_realloc(store.players,
+				store.max_players * sizeof(struct local_player));
+		}
+		store.num_players += 1;
+		store.players[idx].state.data = NULL;
+		store.players[idx].next_player = acc->first_player;
+		acc->first_player = idx + 1;
+	}else if(store.players[idx].account_id != player->account_id
+	|| strcmp(store.players[idx].name, player->name) != 0){
+		// players can't be moved or renamed here
+		return false;
+	}
+	dst = &store.players[idx];
+	dst->player_id = player->player_id;
+	dst->account_id = player->account_id;
+	kpl_strncpy(dst->name, sizeof(dst->name), player->name);
+	free_data(&dst->state);
+	dst->state = player->state;
+	dst->state.player_id = player->player_id;
+	if(!(player->state.dirty & DB_PLAYER_DATA))
+		dst->state.data_len = 0;
+	dst->state.data = copy_data(player->state.data, dst->state.data_len);
+	name_lower(dst->lname, dst->name);
+	if(store.num_players * 2 > (int)store.player_names.mask)
+		index_rebuild(&store.player_names, store.num_players, player_lname);
+	else
+		*index_find_slot(&store.player_names, dst->lname, player_lname) = idx + 1;
+	return true;
+}
+
+// same as the merge in pgsql.c, missing players and stale
+// versions are skipped (which also makes replays idempotent)
+static bool store_put_player_state(const struct db_player_state *state){
+	struct local_player *player = store_player(state->player_id);
+	if(player == NULL || player->state.version >= state->version)
+		return false;
+	if(state->dirty & DB_PLAYER_DATA)
+		free_data(&player->state);
+	db_player_state_merge(&player->state, state, state->dirty);
+	if(state->dirty & DB_PLAYER_DATA)
+		player->state.data = copy_data(state->data, state->data_len);
+	return true;
+}
+
+/* RECORD ENCODING */
+//	- Everything is little endian with fixed size strings.
+//	- State records end with the player blob (u32 length followed
+//	by the data) so their size depends on it. The sizes below don't
+//	include the blob data.
+#define ACCOUNT_RECORD_SIZE (4 + 8 + LOCAL_NAME_LEN + LOCAL_PASSWORD_LEN)
+#define STATE_RECORD_SIZE (4 + 4 + 8 + 4 + 8 + 4 + 4 + 4 + 4 + 2 + 2 + 1 + 4)
+#define PLAYER_RECORD_SIZE (4 + 4 + LOCAL_NAME_LEN + STATE_RECORD_SIZE)
+
+static int state_data_len(const struct db_player_state *st){
+	return (st->dirty & DB_PLAYER_DATA) ? st->data_len : 0;
+}
+
+static void encode_str(uint8 *data, const char *str, int size){
+	memset(data, 0, size);
+	kpl_strncpy((char*)data, size, str);
+}
+
+static void decode_str(uint8 *data, char *str, int size){
+	memcpy(str, data, size);
+	str[size - 1] = 0;
+}
+
+static void encode_account(uint8 *data, const struct local_account *acc){
+	encode_u32_le(data + 0, acc->account_id);
+	encode_u64_le(data + 4, acc->premend);
+	encode_str(data + 12, acc->name, LOCAL_NAME_LEN);
+	encode_str(data + 12 + LOCAL_NAME_LEN, acc->password, LOCAL_PASSWORD_LEN);
+}
+
+static void decode_account(uint8 *data, struct local_account *acc){
+	acc->account_id = decode_u32_le(data + 0);
+	acc->premend = decode_u64_le(data + 4);
+	decode_str(data + 12, acc->name, LOCAL_NAME_LEN);
+	decode_str(data + 12 + LOCAL_NAME_LEN, acc->password, LOCAL_PASSWORD_LEN);
+}
+
+// fields of groups that aren't dirty are still written
+// but they're ignored when applied
+static int encode_state(uint8 *data, const struct db_player_state *st){
+	int data_len = state_data_len(st);
+	encode_u32_le(data + 0, st->player_id);
+	encode_u32_le(data + 4, st->dirty);
+	encode_u64_le(data + 8, st->version);
+	encode_u32_le(data + 16, st->level);
+	encode_u64_le(data + 20, st->experience);
+	encode_u32_le(data + 28, st->health);
+	encode_u32_le(data + 32, st->max_health);
+	encode_u32_le(data + 36, st->mana);
+	encode_u32_le(data + 40, st->max_mana);
+	encode_u16_le(data + 44, st->pos_x);
+	encode_u16_le(data + 46, st->pos_y);
+	encode_u8(data + 48, st->pos_z);
+	encode_u32_le(data + 49, data_len);
+	if(data_len > 0)
+		memcpy(data + STATE_RECORD_SIZE, st->data, data_len);
+	return STATE_RECORD_SIZE + data_len;
+}
+
+// `st->data` points into `data` and the size of the
+// record is returned (-1 if it doesn't fit in `len`)
+static int decode_state(uint8 *data, int len, struct db_player_state *st){
+	if(len < STATE_RECORD_SIZE)
+		return -1;
+	st->player_id = decode_u32_le(data + 0);
+	st->dirty = decode_u32_le(data + 4);
+	st->version = decode_u64_le(data + 8);
+	st->level = decode_u32_le(data + 16);
+	st->experience = decode_u64_le(data + 20);
+	st->health = decode_u32_le(data + 28);
+	st->max_health = decode_u32_le(data + 32);
+	st->mana = decode_u32_le(data + 36);
+	st->max_mana = decode_u32_le(data + 40);
+	st->pos_x = decode_u16_le(data + 44);
+	st->pos_y = decode_u16_le(data + 46);
+	st->pos_z = decode_u8(data + 48);
+	st->data_len = (int)decode_u32_le(data + 49);
+	st->data = data + STATE_RECORD_SIZE;
+	if(st->data_len < 0 || st->data_len > len - STATE_RECORD_SIZE)
+		return -1;
+	return STATE_RECORD_SIZE + st->data_len;
+}
+
+static int player_record_size(const struct local_player *player){
+	return PLAYER_RECORD_SIZE + state_data_len(&player->state);
+}
+
+static int encode_player(uint8 *data, const struct local_player *player){
+	encode_u32_le(data + 0, player->player_id);
+	encode_u32_le(data + 4, player->account_id);
+	encode_str(data + 8, player->name, LOCAL_NAME_LEN);
+	return 8 + LOCAL_NAME_LEN
+		+ encode_state(data + 8 + LOCAL_NAME_LEN, &player->state);
+}
+
+static int decode_player(uint8 *data, int len, struct local_player *player){
+	int state_len;
+	if(len < PLAYER_RECORD_SIZE)
+		return -1;
+	player->player_id = decode_u32_le(data + 0);
+	player->account_id = decode_u32_le(data + 4);
+	decode_str(data + 8, player->name, LOCAL_NAME_LEN);
+	state_len = decode_state(data + 8 + LOCAL_NAME_LEN,
+		len - 8 - LOCAL_NAME_LEN, &player->state);
+	if(state_len < 0)
+		return -1;
+	return 8 + LOCAL_NAME_LEN + state_len;
+}
+
+/* LOG */
+//	- Record: u32 length (type + payload), u8 type, payload,
+//	u32 adler32 (type + payload).
+enum{
+	LOG_ACCOUNT = 1,
+	LOG_PLAYER,
+	LOG_PLAYER_STATE,
+	LOG_COMMIT,
+};
+#define LOG_RECORD_OVERHEAD 9
+
+static void log_reserve(int len){
+	if(store.loglen + len > store.logcap){
+		while(store.loglen + len > store.logcap)
+			store.logcap = store.logcap * 2 + 4096;
+		store.logbuf = kpl_realloc(store.logbuf, store.logcap);
+	}
+}
+
+static uint8 *log_record_begin(uint8 type, int payload_len){
+	uint8 *rec;
+	log_reserve(payload_len + LOG_RECORD_OVERHEAD);
+	rec = store.logbuf + store.loglen;
+	encode_u32_le(rec, payload_len + 1);
+	encode_u8(rec + 4, type);
+	store.loglen += payload_len + LOG_RECORD_OVERHEAD;
+	return rec + 5;
+}
+
+static void log_record_end(uint8 *payload, int payload_len){
+	uint8 *type = payload - 1;
+	encode_u32_le(payload + payload_len, adler32(type, payload_len + 1));
+}
+
+static void log_account(const struct local_account *acc){
+	uint8 *payload = log_record_begin(LOG_ACCOUNT, ACCOUNT_RECORD_SIZE);
+	encode_account(payload, acc);
+	log_record_end(payload, ACCOUNT_RECORD_SIZE);
+}
+
+static void log_player(const struct local_player *player){
+	int len = player_record_size(player);
+	uint8 *payload = log_record_begin(LOG_PLAYER, len);
+	encode_player(payload, player);
+	log_record_end(payload, len);
+}
+
+static void log_player_state(const struct db_player_state *st){
+	int len = STATE_RECORD_SIZE + state_data_len(st);
+	uint8 *payload = log_record_begin(LOG_PLAYER_STATE, len);
+	encode_state(payload, st);
+	log_record_end(payload, len);
+}
+
+static bool log_open(void){
+	char path[LOCAL_MAX_PATH];
+	store_file_path(path, sizeof(path), ".log");
+	store.log = fopen(path, "ab");
+	if(store.log == NULL){
+		LOG_ERROR("local_db: failed to open `%s`", path);
+		return false;
+	}
+	return true;
+}
+
+// writes everything logged since the last commit
+static bool log_commit(void){
+	uint8 *payload = log_record_begin(LOG_COMMIT, 0);
+	bool ret;
+	log_record_end(payload, 0);
+	// the log may have failed to reopen after a rotation
+	if(store.log == NULL && !log_open()){
+		store.loglen = 0;
+		return false;
+	}
+	ret = (fwrite(store.logbuf, 1, store.loglen, store.log) == (size_t)store.loglen)
+		&& (fflush(store.log) == 0);
+	if(!ret)
+		LOG_ERROR("local_db: failed to write to log");
+	store.loglen = 0;
+	return ret;
+}
+
+static bool log_apply(uint8 type, uint8 *payload, int len){
+	struct local_account acc;
+	struct local_player player;
+	struct db_player_state st;
+	switch(type){
+	case LOG_ACCOUNT:
+		if(len != ACCOUNT_RECORD_SIZE)
+			return false;
+		decode_account(payload, &acc);
+		return store_put_account(&acc);
+	case LOG_PLAYER:
+		if(decode_player(payload, len, &player) != len)
+			return false;
+		return store_put_player(&player);
+	case LOG_PLAYER_STATE:
+		if(decode_state(payload, len, &st) != len)
+			return false;
+		store_put_player_state(&st);
+		return true;
+	}
+	return false;
+}
+
+// replays every committed group of records. Anything after the
+// last commit is an incomplete write and is cut off so new records
+// aren't appended after it.
+static bool log_replay(const char *path){
+	struct mapped_file mf;
+	uint8 *data, *group;
+	size_t pos = 0, group_start = 0;
+	uint32 len, group_len;
+	int replayed = 0;
+	bool ret = true;
+
+	if(!map_file(&mf, path, 0))
+		return true; // missing or empty
+	data = mf.data;
+	while(pos + LOG_RECORD_OVERHEAD <= mf.size){
+		len = decode_u32_le(data + pos);
+		if(len == 0 || len > mf.size - pos - 8
+		|| adler32(data + pos + 4, len) != decode_u32_le(data + pos + 4 + len))
+			break;
+		if(data[pos + 4] == LOG_COMMIT){
+			// apply the group
+			group = data + group_start;
+			while(group < data + pos){
+				group_len = decode_u32_le(group);
+				if(!log_apply(group[4], group + 5, group_len - 1)){
+					LOG_ERROR("local_db: invalid record in `%s`", path);
+					ret = false;
+				}
+				replayed += 1;
+				group += group_len + 8;
+			}
+			group_start = pos + len + 8;
+		}
+		pos += len + 8;
+	}
+	unmap_file(&mf);
+	if(group_start < mf.size){
+		LOG_WARNING("local_db: dropping %d bytes of incomplete"
+			" writes at the end of `%s`", (int)(mf.size - group_start), path);
+		if(!truncate_file(path, group_start)){
+			LOG_ERROR("local_db: failed to truncate `%s`", path);
+			ret = false;
+		}
+	}
+	LOG("local_db: replayed %d records from `%s`", replayed, path);
+	return ret;
+}
+
+/* SNAPSHOTS */
+//	- Header: magic (8), u32 version, u32 num_accounts,
+//	u32 num_players, u32 adler32 (body), 8 bytes reserved.
+#define SNAPSHOT_MAGIC "KPLRDB\0\0"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_HEADER_SIZE 32
+
+static bool snapshot_load(const char *path){
+	struct mapped_file mf;
+	struct local_account acc;
+	struct local_player player;
+	uint32 num_accounts, num_players;
+	uint8 *data, *end;
+	size_t body_size;
+	int len;
+	bool ret = false;
+
+	if(!map_file(&mf, path, 0))
+		return true; // missing or empty
+	data = mf.data;
+	if(mf.size < SNAPSHOT_HEADER_SIZE
+	|| memcmp(data, SNAPSHOT_MAGIC, 8) != 0
+	|| decode_u32_le(data + 8) != SNAPSHOT_VERSION){
+		LOG_ERROR("local_db: `%s` is not a valid snapshot", path);
+		goto done;
+	}
+	num_accounts = decode_u32_le(data + 12);
+	num_players = decode_u32_le(data + 16);
+	body_size = mf.size - SNAPSHOT_HEADER_SIZE;
+	if(body_size < (size_t)num_accounts * ACCOUNT_RECORD_SIZE
+			+ (size_t)num_players * PLAYER_RECORD_SIZE
+	|| adler32(data + SNAPSHOT_HEADER_SIZE, body_size) != decode_u32_le(data + 20)){
+		LOG_ERROR("local_db: snapshot `%s` is corrupted", path);
+		goto done;
+	}
+	data += SNAPSHOT_HEADER_SIZE;
+	end = data + body_size;
+	for(uint32 i = 0; i < num_accounts; i += 1){
+		decode_account(data, &acc);
+		if(acc.account_id != (int32)i + 1 || !store_put_account(&acc)){
+			LOG_ERROR("local_db: invalid account in `%s`", path);
+			goto done;
+		}
+		data += ACCOUNT_RECORD_SIZE;
+	}
+	for(uint32 i = 0; i < num_players; i += 1){
+		len = decode_player(data, (int)(end - data), &player);
+		if(len < 0 || player.player_id != (int32)i + 1
+		|| !store_put_player(&player)){
+			LOG_ERROR("local_db: invalid player in `%s`", path);
+			goto done;
+		}
+		data += len;
+	}
+	if(data != end){
+		LOG_ERROR("local_db: snapshot `%s` is corrupted", path);
+		goto done;
+	}
+	LOG("local_db: loaded %u accounts and %u players from `%s`",
+		num_accounts, num_players, path);
+	ret = true;
+done:
+	unmap_file(&mf);
+	return ret;
+}
+
+static bool snapshot_write(const char *path, struct local_account *accounts,
+		int num_accounts, struct local_player *players, int num_players){
+	struct mapped_file mf;
+	size_t body_size = (size_t)num_accounts * ACCOUNT_RECORD_SIZE;
+	uint8 *data;
+
+	for(int i = 0; i < num_players; i += 1)
+		body_size += player_record_size(&players[i]);
+	if(!map_file(&mf, path, SNAPSHOT_HEADER_SIZE + body_size))
+		return false;
+	data = mf.data;
+	memset(data, 0, SNAPSHOT_HEADER_SIZE);
+	memcpy(data, SNAPSHOT_MAGIC, 8);
+	encode_u32_le(data + 8, SNAPSHOT_VERSION);
+	encode_u32_le(data + 12, num_accounts);
+	encode_u32_le(data + 16, num_players);
+	data += SNAPSHOT_HEADER_SIZE;
+	for(int i = 0; i < num_accounts; i += 1){
+		encode_account(data, &accounts[i]);
+		data += ACCOUNT_RECORD_SIZE;
+	}
+	for(int i = 0; i < num_players; i += 1)
+		data += encode_player(data, &players[i]);
+	encode_u32_le(mf.data + 20, adler32(mf.data + SNAPSHOT_HEADER_SIZE, body_size));
+	return unmap_file(&mf);
+}
+
+// writes a snapshot of the current state and drops the log
+static bool store_snapshot(void){
+	char snap_path[LOCAL_MAX_PATH], tmp_path[LOCAL_MAX_PATH];
+	char log_path[LOCAL_MAX_PATH], old_path[LOCAL_MAX_PATH];
+	struct local_account *accounts;
+	struct local_player *players;
+	int num_accounts, num_players;
+	bool ret;
+
+	store_file_path(snap_path, sizeof(snap_path), ".snap");
+	store_file_path(tmp_path, sizeof(tmp_path), ".snap.tmp");
+	store_file_path(log_path, sizeof(log_path), ".log");
+	store_file_path(old_path, sizeof(old_path), ".log.old");
+
+	// copy the state and rotate the log so writes can continue
+	// while the snapshot is written (if there's an old log left
+	// from a failed snapshot it must be kept, so there's no
+	// rotation until that one is written)
+	mutex_lock(&store.mtx);
+	num_accounts = store.num_accounts;
+	num_players = store.num_players;
+	accounts = kpl_malloc(num_accounts * sizeof(struct local_account) + 1);
+	players = kpl_malloc(num_players * sizeof(struct local_player) + 1);
+	memcpy(accounts, store.accounts, num_accounts * sizeof(struct local_account));
+	memcpy(players, store.players, num_players * sizeof(struct local_player));
+	for(int i = 0; i < num_players; i += 1){
+		players[i].state.data = copy_data(players[i].state.data,
+			state_data_len(&players[i].state));
+	}
+	ret = true;
+	if(!file_exists(old_path)){
+		if(store.log != NULL){
+			fclose(store.log);
+			store.log = NULL;
+		}
+		ret = replace_file(log_path, old_path);
+		if(!log_open())
+			ret = false;
+	}
+	mutex_unlock(&store.mtx);
+
+	ret = ret && snapshot_write(tmp_path, accounts,
+			num_accounts, players, num_players)
+		&& replace_file(tmp_path, snap_path)
+		&& remove(old_path) == 0;
+	if(!ret)
+		LOG_ERROR("local_db: failed to write snapshot `%s`", snap_path);
+	kpl_free(accounts);
+	for(int i = 0; i < num_players; i += 1)
+		free_data(&players[i].state);
+	kpl_free(players);
+	return ret;
+}
+
+static void seed_store(void){
+	static const struct{
+		const char *name;
+		const char *password;
+		int64 premend;
+	} accounts[] = {
+		{"admin", "admin", 32503593600LL}, // 2999-12-31
+		{"acctest", "pwdtest", 0},
+	};
+	static const struct{
+		int32 account_id;
+		const char *name;
+	} players[] = {
+		{1, "GameMaster"},
+		{2, "Player1"},
+		{2, "Player2"},
+	};
+	struct local_account acc;
+	struct local_player player;
+
+	LOG("local_db: seeding empty store with test accounts");
+	for(int i = 0; i < (int)ARRAY_SIZE(accounts); i += 1){
+		memset(&acc, 0, sizeof(acc));
+		acc.account_id = i + 1;
+		acc.premend = accounts[i].premend;
+		kpl_strncpy(acc.name, sizeof(acc.name), accounts[i].name);
+		kpl_strncpy(acc.password, sizeof(acc.password), accounts[i].password);
+		store_put_account(&acc);
+		log_account(&acc);
+	}
+	for(int i = 0; i < (int)ARRAY_SIZE(players); i += 1){
+		// same defaults as `schema.pgsql`
+		memset(&player, 0, sizeof(player));
+		player.player_id = i + 1;
+		player.account_id = players[i].account_id;
+		kpl_strncpy(player.name, sizeof(player.name), players[i].name);
+		player.state.dirty = DB_PLAYER_ALL;
+		player.state.level = 1;
+		player.state.health = 150;
+		player.state.max_health = 150;
+		player.state.pos_z = 7;
+		store_put_player(&player);
+		log_player(&player);
+	}
+	log_commit();
+}
+
+/* DB INTERNAL ROUTINES */
+bool db_internal_init(void){
+	char path[LOCAL_MAX_PATH];
+	int interval = config_geti("local_db_snapshot_interval");
+	if(interval <= 0){
+		LOG_ERROR("local_db: invalid snapshot interval (%d)", interval);
+		return false;
+	}
+	memset(&store, 0, sizeof(store));
+	mutex_init(&store.mtx);
+	kpl_strncpy(store.path, sizeof(store.path), config_get("local_db_path"));
+	store.snapshot_interval = (int64)interval * 1000;
+	store.next_snapshot = kpl_clock_monotonic_msec() + store.snapshot_interval;
+	index_rebuild(&store.account_names, 0, account_lname);
+	index_rebuild(&store.player_names, 0, player_lname);
+
+	store_file_path(path, sizeof(path), ".snap");
+	if(!snapshot_load(path))
+		goto fail;
+	store_file_path(path, sizeof(path), ".log.old");
+	if(!log_replay(path))
+		goto fail;
+	store_file_path(path, sizeof(path), ".log");
+	if(!log_replay(path))
+		goto fail;
+	if(!log_open())
+		goto fail;
+	if(store.num_accounts == 0 && config_getb("local_db_seed"))
+		seed_store();
+	store.loaded = true;
+
+	query_stats[QUERY_ACCOUNT_INFO] = db_stats_register("load_account_info");
+	query_stats[QUERY_ACCOUNT_CHARLIST] = db_stats_register("load_account_charlist");
+	query_stats[QUERY_ACCOUNT_CHARLIST_BY_NAME] =
+		db_stats_register("load_account_charlist_by_name");
+	query_stats[QUERY_PLAYER] = db_stats_register("load_player");
+	save_stat = db_stats_register("save_players");
+	password_stat = db_stats_register("update_account_password");
+	return true;
+
+fail:
+	LOG_ERROR("local_db: failed to load store `%s`", store.path);
+	db_internal_shutdown();
+	return false;
+}
+
+void db_internal_shutdown(void){
+	// compact the log before leaving
+	if(store.loaded)
+		store_snapshot();
+	if(store.log != NULL)
+		fclose(store.log);
+	kpl_free(store.accounts);
+	for(int i = 0; i < store.num_players; i += 1)
+		free_data(&store.players[i].state);
+	kpl_free(store.players);
+	kpl_free(store.account_names.slots);
+	kpl_free(store.player_names.slots);
+	kpl_free(store.logbuf);
+	mutex_destroy(&store.mtx);
+	memset(&store, 0, sizeof(store));
+}
+
+// there are no connections but the worker hooks are used to
+// write snapshots periodically
+bool db_internal_connect(void){
+	return true;
+}
+
+bool db_internal_connection_reset(void){
+	return true;
+}
+
+bool db_internal_connection_check(void){
+	int64 now = kpl_clock_monotonic_msec();
+	bool run = false;
+	mutex_lock(&store.mtx);
+	if(!store.snapshot_running && now >= store.next_snapshot){
+		store.snapshot_running = true;
+		run = true;
+	}
+	mutex_unlock(&store.mtx);
+	if(run){
+		store_snapshot();
+		mutex_lock(&store.mtx);
+		store.snapshot_running = false;
+		store.next_snapshot = kpl_clock_monotonic_msec() + store.snapshot_interval;
+		mutex_unlock(&store.mtx);
+	}
+	return true;
+}
+
+void db_internal_connection_close(void){
+	// nothing to do
+}
+
+/* QUERIES */
+//	- These must be called with the store locked. Results are
+//	copies so they stay valid after the lock is released.
+static struct db_account_info *query_account_info(const char *accname){
+	struct db_account_info *info = kpl_malloc(sizeof(struct db_account_info));
+	struct local_account *acc;
+	int32 idx = index_lookup(&store.account_names, accname, account_lname);
+	memset(info, 0, sizeof(struct db_account_info));
+	if(idx >= 0){
+		acc = &store.accounts[idx];
+		info->found = true;
+		info->account_id = acc->account_id;
+		info->premend = acc->premend;
+		kpl_strncpy(info->password, sizeof(info->password), acc->password);
+	}
+	return info;
+}
+
+static int compare_names(const void *a, const void *b){
+	return strcmp(*(const char**)a, *(const char**)b);
+}
+
+static struct db_charlist *query_account_charlist(int32 account_id){
+	struct db_charlist *list;
+	struct local_account *acc = store_account(account_id);
+	struct local_player *player;
+	size_t size = sizeof(struct db_charlist);
+	char *names;
+	int32 it;
+	int count = 0;
+
+	if(acc != NULL){
+		for(it = acc->first_player; it != 0; it = player->next_player){
+			player = &store.players[it - 1];
+			size += sizeof(const char*) + strlen(player->name) + 1;
+			count += 1;
+		}
+	}
+	list = kpl_malloc(size);
+	list->count = count;
+	names = (char*)&list->names[count];
+	count = 0;
+	if(acc != NULL){
+		for(it = acc->first_player; it != 0; it = player->next_player){
+			player = &store.players[it - 1];
+			strcpy(names, player->name);
+			list->names[count++] = names;
+			names += strlen(names) + 1;
+		}
+	}
+	// ORDER BY name ASC
+	qsort((void*)list->names, count, sizeof(const char*), compare_names);
+	return list;
+}
+
+static struct db_charlist *query_account_charlist_by_name(const char *accname){
+	int32 idx = index_lookup(&store.account_names, accname, account_lname);
+	return query_account_charlist(idx >= 0 ? store.accounts[idx].account_id : 0);
+}
+
+static struct db_player_info *query_player(const char *charname){
+	struct db_player_info *info;
+	struct local_player *player = NULL;
+	int32 idx = index_lookup(&store.player_names, charname, player_lname);
+	int data_len = 0;
+	if(idx >= 0){
+		player = &store.players[idx];
+		data_len = state_data_len(&player->state);
+	}
+	info = kpl_malloc(sizeof(struct db_player_info) + data_len);
+	memset(info, 0, sizeof(struct db_player_info));
+	if(player != NULL){
+		info->found = true;
+		info->player_id = player->player_id;
+		info->account_id = player->account_id;
+		info->version = player->state.version;
+		info->pos_x = player->state.pos_x;
+		info->pos_y = player->state.pos_y;
+		info->pos_z = player->state.pos_z;
+		info->data_len = data_len;
+		if(data_len > 0)
+			memcpy(info->data, player->state.data, data_len);
+	}
+	return info;
+}
+
+static void *query_run(struct local_query *q){
+	switch(q->type){
+	case QUERY_ACCOUNT_INFO:
+		return query_account_info(q->name);
+	case QUERY_ACCOUNT_CHARLIST:
+		return query_account_charlist(q->id);
+	case QUERY_ACCOUNT_CHARLIST_BY_NAME:
+		return query_account_charlist_by_name(q->name);
+	case QUERY_PLAYER:
+		return query_player(q->name);
+	}
+	return NULL;
+}
+
+static void record(int stat, int64 start, int64 locked, int64 end){
+	if(db_stats_record(stat, locked - start, end - locked, false)){
+		LOG_WARNING("local_db: slow query took %lldms (wait = %lldms)",
+			(long long)((end - locked) / 1000000),
+			(long long)((locked - start) / 1000000));
+	}
+}
+
+static void *query_locked(struct local_query *q){
+	int64 start, locked;
+	void *res;
+	start = kpl_clock_monotonic_nsec();
+	mutex_lock(&store.mtx);
+	locked = kpl_clock_monotonic_nsec();
+	res = query_run(q);
+	mutex_unlock(&store.mtx);
+	record(query_stats[q->type], start, locked, kpl_clock_monotonic_nsec());
+	return res;
+}
+
+struct db_account_info *db_load_account_info(const char *accname){
+	struct local_query q = {QUERY_ACCOUNT_INFO, 0};
+	kpl_strncpy(q.name, sizeof(q.name), accname);
+	return query_locked(&q);
+}
+
+struct db_charlist *db_load_account_charlist(int32 account_id){
+	struct local_query q = {QUERY_ACCOUNT_CHARLIST, account_id};
+	q.name[0] = 0;
+	return query_locked(&q);
+}
+
+struct db_player_info *db_load_player(const char *charname){
+	struct local_query q = {QUERY_PLAYER, 0};
+	kpl_strncpy(q.name, sizeof(q.name), charname);
+	return query_locked(&q);
+}
+
+bool db_save_players(const struct db_player_state *states, int count){
+	int64 start, locked;
+	int skipped = 0;
+	bool ret;
+	if(count <= 0)
+		return true;
+	start = kpl_clock_monotonic_nsec();
+	mutex_lock(&store.mtx);
+	locked = kpl_clock_monotonic_nsec();
+	for(int i = 0; i < count; i += 1){
+		if(store_put_player_state(&states[i]))
+			log_player_state(&states[i]);
+		else
+			skipped += 1;
+	}
+	ret = log_commit();
+	mutex_unlock(&store.mtx);
+	record(save_stat, start, locked, kpl_clock_monotonic_nsec());
+	if(skipped > 0){
+		LOG_WARNING("db_save_players: %d of %d players were skipped"
+			" (stale version or missing player)", skipped, count);
+	}
+	return ret;
+}
+
+bool db_update_account_password(int32 account_id,
+		const char *old_password, const char *new_password){
+	struct local_account *acc;
+	int64 start, locked;
+	bool ret = false;
+	start = kpl_clock_monotonic_nsec();
+	mutex_lock(&store.mtx);
+	locked = kpl_clock_monotonic_nsec();
+	acc = store_account(account_id);
+	if(acc != NULL && strcmp(acc->password, old_password) == 0){
+		kpl_strncpy(acc->password, sizeof(acc->password), new_password);
+		log_account(acc);
+		ret = log_commit();
+	}
+	mutex_unlock(&store.mtx);
+	record(password_stat, start, locked, kpl_clock_monotonic_nsec());
+	return ret;
+}
+
+/* BATCHES */
+struct db_batch{
+	int count;
+	struct local_query queries[DB_BATCH_MAX_QUERIES];
+	void *results[DB_BATCH_MAX_QUERIES];
+};
+
+struct db_batch *db_batch_create(void){
+	struct db_batch *batch = kpl_malloc(sizeof(struct db_batch));
+	batch->count = 0;
+	return batch;
+}
+
+void db_batch_destroy(struct db_batch *batch){
+	db_batch_reset(batch);
+	kpl_free(batch);
+}
+
+void db_batch_reset(struct db_batch *batch){
+	for(int i = 0; i < batch->count; i += 1){
+		if(batch->results[i] != NULL)
+			kpl_free(batch->results[i]);
+	}
+	batch->count = 0;
+}
+
+static int batch_add(struct db_batch *batch, int type, int32 id, const char *name){
+	struct local_query *q;
+	DEBUG_ASSERT(batch->count < DB_BATCH_MAX_QUERIES);
+	q = &batch->queries[batch->count];
+	q->type = type;
+	q->id = id;
+	kpl_strncpy(q->name, sizeof(q->name), name != NULL ? name : "");
+	batch->results[batch->count] = NULL;
+	batch->count += 1;
+	return batch->count - 1;
+}
+
+int db_batch_load_account_info(struct db_batch *batch, const char *accname){
+	return batch_add(batch, QUERY_ACCOUNT_INFO, 0, accname);
+}
+
+int db_batch_load_account_charlist(struct db_batch *batch, int32 account_id){
+	return batch_add(batch, QUERY_ACCOUNT_CHARLIST, account_id, NULL);
+}
+
+int db_batch_load_account_charlist_by_name(struct db_batch *batch, const char *accname){
+	return batch_add(batch, QUERY_ACCOUNT_CHARLIST_BY_NAME, 0, accname);
+}
+
+int db_batch_load_player(struct db_batch *batch, const char *charname){
+	return batch_add(batch, QUERY_PLAYER, 0, charname);
+}
+
+// the whole batch sees the same state
+bool db_batch_exec(struct db_batch *batch){
+	int64 start, locked, end;
+	start = kpl_clock_monotonic_nsec();
+	mutex_lock(&store.mtx);
+	locked = end = kpl_clock_monotonic_nsec();
+	for(int i = 0; i < batch->count; i += 1){
+		batch->results[i] = query_run(&batch->queries[i]);
+		end = kpl_clock_monotonic_nsec();
+		record(query_stats[batch->queries[i].type], start, locked, end);
+	}
+	mutex_unlock(&store.mtx);
+	return true;
+}
+
+void *db_batch_result(struct db_batch *batch, int idx){
+	DEBUG_ASSERT(idx >= 0 && idx < batch->count);
+	return batch->results[idx];
+}
+
+/* ASYNC QUERIES */
+//	- Queries run right away on the calling thread (they don't
+//	block on anything but the store's lock) and only the completion
+//	is posted to its domain, so `fn` never runs before the submit
+//	returns, same as with pgsql.
+struct async_completion{
+	db_async_fn_t fn;
+	void *arg;
+	void *res;
+};
+
+bool db_internal_async_init(void){
+	return true;
+}
+
+void db_internal_async_shutdown(void){
+	// nothing to do
+}
+
+static void async_run_callback(void *arg){
+	struct async_completion *c = arg;
+	c->fn(c->res, c->arg);
+	kpl_free(c);
+}
+
+// returns false if it couldn't be posted (`c` is left as it was)
+static bool async_post(struct async_completion *c, cont_domain_t domain){
+	// the caller may be on any thread so this can't block
+	switch(domain){
+	case CONT_DOMAIN_NET:
+		return game_try_add_server_task(async_run_callback, c);
+	case CONT_DOMAIN_GAME:
+		return game_try_add_task(async_run_callback, c);
+	default:
+		// there is no database thread so it runs here
+		async_run_callback(c);
+		return true;
+	}
+}
+
+static bool async_submit(struct local_query *q, cont_domain_t domain,
+		db_async_fn_t fn, void *arg){
+	struct async_completion *c = kpl_malloc(sizeof(struct async_completion));
+	c->fn = fn;
+	c->arg = arg;
+	c->res = query_locked(q);
+	if(!async_post(c, domain)){
+		kpl_free(c->res);
+		kpl_free(c);
+		return false;
+	}
+	return true;
+}
+
+bool db_async_load_account_info(const char *accname,
+		cont_domain_t domain, db_async_fn_t fn, void *arg){
+	struct local_query q = {QUERY_ACCOUNT_INFO, 0};
+	kpl_strncpy(q.name, sizeof(q.name), accname);
+	return async_submit(&q, domain, fn, arg);
+}
+
+bool db_async_load_account_charlist(int32 account_id,
+		cont_domain_t domain, db_async_fn_t fn, void *arg){
+	struct local_query q = {QUERY_ACCOUNT_CHARLIST, account_id};
+	q.name[0] = 0;
+	return async_submit(&q, domain, fn, arg);
+}
+
+bool db_async_load_account_charlist_by_name(const char *accname,
+		cont_domain_t domain, db_async_fn_t fn, void *arg){
+	struct local_query q = {QUERY_ACCOUNT_CHARLIST_BY_NAME, 0};
+	kpl_strncpy(q.name, sizeof(q.name), accname);
+	return async_submit(&q, domain, fn, arg);
+}
+
+bool db_async_load_player(const char *charname,
+		cont_domain_t domain, db_async_fn_t fn, void *arg){
+	struct local_query q = {QUERY_PLAYER, 0};
+	kpl_strncpy(q.name, sizeof(q.name), charname);
+	return async_submit(&q, domain, fn, arg);
+}
+
+bool db_async_batch_exec(struct db_batch *batch,
+		cont_domain_t domain, db_async_fn_t fn, void *arg){
+	struct async_completion *c = kpl_malloc(sizeof(struct async_completion));
+	c->fn = fn;
+	c->arg = arg;
+	c->res = batch;
+	db_batch_exec(batch);
+	if(!async_post(c, domain)){
+		// leave the batch as it was
+		for(int i = 0; i < batch->count; i += 1){
+			if(batch->results[i] != NULL){
+				kpl_free(batch->results[i]);
+				batch->results[i] = NULL;
+			}
+		}
+		kpl_free(c);
+		return false;
+	}
+	return true;
+}
+
+#endif //DB_BACKEND_LOCAL
@@ -3,15 +3,31 @@
 //	either `0` for string format or `1` for binary format
 // NOTE2: binary int/float is sent in big endian
 
+#ifndef DB_BACKEND_LOCAL
+
 #define DB_INTERNAL 1
 
 #include "database.h"
 #include "../buffer_util.h"
 #include "../config.h"
+#include "../game.h"
 #include "../log.h"
 #include "../thread.h"
+#include "../trace.h"
+
+#ifdef PLATFORM_WINDOWS
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 #include <libpq-fe.h>
+#include <stdlib.h>
 
 static const struct{
 	const char *config_key;
@@ -37,10 +53,95 @@ static const struct{
 };
 #define NUM_PARAMS ARRAY_SIZE(pgsql_params)
 
+// PREPARED STATEMENTS
+//	- Every statement is prepared once per connection when it's
+//	established (or reset) and executed by name with binary params.
+#define PGSQL_OID_INT4	23
+#define PGSQL_OID_TEXT	25
+#define PGSQL_MAX_PARAMS 4
+enum{
+	STMT_LOAD_ACCOUNT_INFO = 0,
+	STMT_LOAD_ACCOUNT_CHARLIST,
+	STMT_LOAD_ACCOUNT_CHARLIST_BY_NAME,
+	STMT_LOAD_PLAYER,
+	STMT_UPDATE_ACCOUNT_PASSWORD,
+
+	NUM_STMTS,
+};
+static const struct{
+	const char *name;
+	const char *query;
+	int nparams;
+	Oid types[PGSQL_MAX_PARAMS];
+} pgsql_stmts[NUM_STMTS] = {
+	[STMT_LOAD_ACCOUNT_INFO] = {
+		"load_account_info",
+		"SELECT account_id, date_part('epoch', premend)::bigint, password"
+		" FROM accounts"
+		" WHERE lower(name) = $1",
+		1, {PGSQL_OID_TEXT},
+	},
+	[STMT_LOAD_ACCOUNT_CHARLIST] = {
+		"load_account_charlist",
+		"SELECT name"
+		" FROM players"
+		" WHERE account_id = $1"
+		" ORDER BY name ASC",
+		1, {PGSQL_OID_INT4},
+	},
+	[STMT_LOAD_ACCOUNT_CHARLIST_BY_NAME] = {
+		"load_account_charlist_by_name",
+		"SELECT name"
+		" FROM players"
+		" WHERE account_id = (SELECT account_id"
+			" FROM accounts WHERE lower(name) = $1)"
+		" ORDER BY name ASC",
+		1, {PGSQL_OID_TEXT},
+	},
+	[STMT_LOAD_PLAYER] = {
+		"load_player",
+		"SELECT player_id, account_id, version, pos_x, pos_y, pos_z, data"
+		" FROM players"
+		" WHERE lower(name) = $1",
+		1, {PGSQL_OID_TEXT},
+	},
+	[STMT_UPDATE_ACCOUNT_PASSWORD] = {
+		"update_account_password",
+		"UPDATE accounts"
+		" SET password = $2"
+		" WHERE account_id = $1 AND password = $3",
+		3, {PGSQL_OID_INT4, PGSQL_OID_TEXT, PGSQL_OID_TEXT},
+	},
+};
+
 // DB INTERNAL ROUTINES
-static PGconn *conn = NULL;
-bool db_internal_connect(void){
-	DEBUG_ASSERT(conn == NULL);
+// (each database worker has its own connection)
+static THREAD_LOCAL PGconn *conn = NULL;
+static THREAD_LOCAL int64 next_reset = 0;
+static THREAD_LOCAL bool save_stage_ready = false;
+
+// minimum interval between reset attempts (ms)
+#define PGSQL_RESET_INTERVAL 1000
+static bool pgsql_prepare_statements(PGconn *conn){
+	PGresult *res;
+	for(int i = 0; i < NUM_STMTS; i += 1){
+		res = PQprepare(conn, pgsql_stmts[i].name,
+			pgsql_stmts[i].query, pgsql_stmts[i].nparams,
+			pgsql_stmts[i].types);
+		if(res == NULL || PQresultStatus(res) != PGRES_COMMAND_OK){
+			LOG_ERROR("pgsql_prepare_statements: failed to prepare"
+				" `%s`: %s", pgsql_stmts[i].name, PQerrorMessage(conn));
+			if(res != NULL)
+				PQclear(res);
+			return false;
+		}
+		PQclear(res);
+	}
+	return true;
+}
+
+static PGconn *pgsql_connect(void){
+	PGconn *conn;
 
 	// k & v are null terminated arrays
 	const char *k[NUM_PARAMS + 1];
@@ -62,99 +163,304 @@ bool db_internal_connect(void){
 	conn = PQconnectdbParams(k, v, 0);
 	if(conn == NULL){
 		LOG_ERROR("pgsql_connect: failed to create connection handle");
-		return false;
+		return NULL;
 	}
 	if(PQstatus(conn) != CONNECTION_OK){
 		LOG_ERROR("pgsql_connect: %s", PQerrorMessage(conn));
-		conn = NULL;
-		return false;
+		PQfinish(conn);
+		return NULL;
 	}
-	return true;
+	if(!pgsql_prepare_statements(conn)){
+		PQfinish(conn);
+		return NULL;
+	}
+	return conn;
 }
 
-bool db_internal_connection_reset(void){
-	DEBUG_ASSERT(conn != NULL);
+// resets a connection and prepares its statements again
+static bool pgsql_reset(PGconn *conn){
 	PQreset(conn);
 	if(PQstatus(conn) != CONNECTION_OK){
 		LOG_ERROR("pgsql_connection_reset: %s", PQerrorMessage(conn));
+		db_stats_reconnect(false);
+		return false;
+	}
+	// prepared statements don't survive the reset
+	if(!pgsql_prepare_statements(conn)){
+		db_stats_reconnect(false);
 		return false;
 	}
+	LOG("pgsql_connection_reset: connection restored");
+	db_stats_reconnect(true);
 	return true;
 }
 
+// stat ids (see `db_stats_register`)
+static int stmt_stats[NUM_STMTS];
+static int save_stat;
+
+bool db_internal_init(void){
+	// connections are made by each worker
+	for(int i = 0; i < NUM_STMTS; i += 1)
+		stmt_stats[i] = db_stats_register(pgsql_stmts[i].name);
+	save_stat = db_stats_register("save_players");
+	return true;
+}
+
+void db_internal_shutdown(void){
+	// nothing to do
+}
+
+bool db_internal_connect(void){
+	DEBUG_ASSERT(conn == NULL);
+	save_stage_ready = false;
+	conn = pgsql_connect();
+	return conn != NULL;
+}
+
+bool db_internal_connection_reset(void){
+	DEBUG_ASSERT(conn != NULL);
+	// temporary tables don't survive the reset
+	save_stage_ready = false;
+	return pgsql_reset(conn);
+}
+
+// resets the connection if it's broken (attempts are
+// rate limited so a database outage won't spin a worker)
+bool db_internal_connection_check(void){
+	int64 now;
+	DEBUG_ASSERT(conn != NULL);
+	if(PQstatus(conn) == CONNECTION_OK)
+		return true;
+	now = kpl_clock_monotonic_msec();
+	if(now < next_reset)
+		return false;
+	next_reset = now + PGSQL_RESET_INTERVAL;
+	return db_internal_connection_reset();
+}
+
 void db_internal_connection_close(void){
 	DEBUG_ASSERT(conn != NULL);
 	PQfinish(conn);
 	conn = NULL;
 }
 
-// db result interface
-int db_result_nrows(db_result_t *res){
-	return PQntuples(res);
+// RESULT DECODING
+//	- Results are decoded into the structs from database.h and the
+//	PGresult is cleared right away.
+//	- Fields are in binary format except for batches sent without
+//	pipeline mode which come back in text format (see `db_batch_exec`).
+static bool check_fields(PGresult *res, int stmt, int nfields){
+	if(PQnfields(res) != nfields){
+		LOG_ERROR("pgsql: `%s` returned %d fields (expected %d)",
+			pgsql_stmts[stmt].name, PQnfields(res), nfields);
+		return false;
+	}
+	return true;
 }
-int32 db_result_get_int32(db_result_t *res, int row, int field){
-	return decode_u32_be(PQgetvalue(res, row, field));
+
+static int32 field_int32(PGresult *res, int row, int col){
+	if(PQfformat(res, col) == 1)
+		return (int32)decode_u32_be(PQgetvalue(res, row, col));
+	return (int32)strtol(PQgetvalue(res, row, col), NULL, 10);
 }
-int64 db_result_get_int64(db_result_t *res, int row, int field){
-	return decode_u64_be(PQgetvalue(res, row, field));
+
+static int64 field_int64(PGresult *res, int row, int col){
+	if(PQfformat(res, col) == 1)
+		return (int64)decode_u64_be(PQgetvalue(res, row, col));
+	return (int64)strtoll(PQgetvalue(res, row, col), NULL, 10);
 }
-float db_result_get_float(db_result_t *res, int row, int field){
-	return decode_f32_be(PQgetvalue(res, row, field));
+
+static void *decode_account_info(PGresult *res, int stmt){
+	struct db_account_info *info;
+	int len;
+	if(!check_fields(res, stmt, 3))
+		return NULL;
+	info = kpl_malloc(sizeof(struct db_account_info));
+	memset(info, 0, sizeof(struct db_account_info));
+	if(PQntuples(res) > 0){
+		DEBUG_ASSERT(PQntuples(res) == 1); // PARANOID
+		info->found = true;
+		info->account_id = field_int32(res, 0, 0);
+		info->premend = field_int64(res, 0, 1);
+		len = PQgetlength(res, 0, 2);
+		if(len > DB_MAX_PASSWORD_LEN)
+			len = DB_MAX_PASSWORD_LEN;
+		memcpy(info->password, PQgetvalue(res, 0, 2), len);
+	}
+	return info;
 }
-double db_result_get_double(db_result_t *res, int row, int field){
-	return decode_f64_be(PQgetvalue(res, row, field));
+
+static void *decode_charlist(PGresult *res, int stmt){
+	struct db_charlist *list;
+	char *names;
+	size_t size;
+	int count, len;
+	if(!check_fields(res, stmt, 1))
+		return NULL;
+	count = PQntuples(res);
+	size = sizeof(struct db_charlist) + count * sizeof(const char*);
+	for(int i = 0; i < count; i += 1)
+		size += PQgetlength(res, i, 0) + 1;
+	list = kpl_malloc(size);
+	list->count = count;
+	names = (char*)&list->names[count];
+	for(int i = 0; i < count; i += 1){
+		len = PQgetlength(res, i, 0);
+		memcpy(names, PQgetvalue(res, i, 0), len);
+		names[len] = 0;
+		list->names[i] = names;
+		names += len + 1;
+	}
+	return list;
 }
-const char *db_result_get_value(db_result_t *res, int row, int field){
-	return PQgetvalue(res, row, field);
+
+// the blob is copied inline (a NULL blob has zero length)
+static void *decode_player(PGresult *res, int stmt){
+	struct db_player_info *info;
+	const uint8 *data = NULL;
+	uint8 *unescaped = NULL;
+	size_t unescaped_len;
+	int data_len = 0;
+	if(!check_fields(res, stmt, 7))
+		return NULL;
+	if(PQntuples(res) > 0 && !PQgetisnull(res, 0, 6)){
+		if(PQfformat(res, 6) == 1){
+			data = (const uint8*)PQgetvalue(res, 0, 6);
+			data_len = PQgetlength(res, 0, 6);
+		}else{
+			unescaped = PQunescapeBytea(
+				(const uint8*)PQgetvalue(res, 0, 6), &unescaped_len);
+			if(unescaped == NULL){
+				LOG_ERROR("pgsql: `%s` returned an invalid bytea",
+					pgsql_stmts[stmt].name);
+				return NULL;
+			}
+			data = unescaped;
+			data_len = (int)unescaped_len;
+		}
+	}
+	info = kpl_malloc(sizeof(struct db_player_info) + data_len);
+	memset(info, 0, sizeof(struct db_player_info));
+	if(PQntuples(res) > 0){
+		DEBUG_ASSERT(PQntuples(res) == 1); // PARANOID
+		info->found = true;
+		info->player_id = field_int32(res, 0, 0);
+		info->account_id = field_int32(res, 0, 1);
+		info->version = field_int64(res, 0, 2);
+		info->pos_x = (uint16)field_int32(res, 0, 3);
+		info->pos_y = (uint16)field_int32(res, 0, 4);
+		info->pos_z = (uint8)field_int32(res, 0, 5);
+		info->data_len = data_len;
+		if(data_len > 0)
+			memcpy(info->data, data, data_len);
+	}
+	if(unescaped != NULL)
+		PQfreemem(unescaped);
+	return info;
 }
-void db_result_clear(db_result_t *res){
+
+// always clears `res` (which may be NULL if the query couldn't
+// be sent) and returns NULL if the query failed
+static void *pgsql_decode(PGresult *res, int stmt, PGconn *c){
+	void *ret = NULL;
+	if(res == NULL || PQresultStatus(res) != PGRES_TUPLES_OK){
+		LOG_ERROR("pgsql: `%s` failed: %s", pgsql_stmts[stmt].name,
+			res != NULL ? PQresultErrorMessage(res)
+				: (c != NULL ? PQerrorMessage(c) : "no result"));
+		if(res != NULL)
+			PQclear(res);
+		return NULL;
+	}
+	switch(stmt){
+	case STMT_LOAD_ACCOUNT_INFO:
+		ret = decode_account_info(res, stmt);
+		break;
+	case STMT_LOAD_ACCOUNT_CHARLIST:
+	case STMT_LOAD_ACCOUNT_CHARLIST_BY_NAME:
+		ret = decode_charlist(res, stmt);
+		break;
+	case STMT_LOAD_PLAYER:
+		ret = decode_player(res, stmt);
+		break;
+	default:
+		DEBUG_LOG("pgsql_decode: statement `%s` has no decoder",
+			pgsql_stmts[stmt].name);
+		break;
+	}
 	PQclear(res);
+	return ret;
+}
+
+// time from when the running task was queued until `start`
+static int64 pgsql_wait(int64 start){
+	int64 enqueued = db_task_enqueued();
+	return enqueued != 0 ? start - enqueued : 0;
 }
 
-#define PGSQL_VALIDATE_RESULT_OR_RETURN_NULL(res)			\
-	if((res) == NULL || PQresultStatus(res) != PGRES_TUPLES_OK){	\
-		LOG_ERROR(__FUNCTION__ ": %s", PQerrorMessage(conn));	\
-		if((res) != NULL)					\
-			PQclear(res);					\
-		return NULL;						\
+// records the query and logs it if it was slow (params are
+// redacted, only their type and length are logged)
+static void pgsql_record(int stmt, const int *lengths,
+		int64 wait, int64 exec, bool failed){
+	char params[256];
+	int len = 0;
+	if(!db_stats_record(stmt_stats[stmt], wait, exec, failed))
+		return;
+	params[0] = 0;
+	for(int i = 0; i < pgsql_stmts[stmt].nparams; i += 1){
+		len += snprintf(params + len, sizeof(params) - len,
+			"%s$%d = <%s, %d bytes>", (i > 0 ? ", " : ""), i + 1,
+			(pgsql_stmts[stmt].types[i] == PGSQL_OID_INT4 ? "int4" : "text"),
+			lengths[i]);
 	}
+	LOG_WARNING("pgsql: slow query `%s` took %lldms (wait = %lldms, %s)",
+		pgsql_stmts[stmt].name, (long long)(exec / 1000000),
+		(long long)(wait / 1000000), params);
+}
 
-db_result_t *db_load_account_info(const char *accname){
-	PGresult *res;
-	res = PQexecParams(conn,
-		"SELECT account_id, date_part('epoch', premend)::bigint, password"
-		" FROM accounts"
-		" WHERE lower(name) = $1",
-		/*nParams = */		1,
-		/*paramTypes = */	NULL,
-		/*paramValues = */	&accname,
-		/*paramLengths = */	NULL,
-		/*paramFormats = */	NULL,
-		/*resultFormat = */	1);
-	PGSQL_VALIDATE_RESULT_OR_RETURN_NULL(res);
-	return res;
+#ifdef BUILD_TEST
+// lets the benchmark in test/pgsql_test.c compare prepared
+// statements against sending the query text on every call
+static bool exec_text = false;
+void pgsql_test_exec_text(bool enabled){
+	exec_text = enabled;
 }
+#endif
 
-db_result_t *db_load_account_charlist(int32 account_id){
-	PGresult *res;
+// all params and results are in binary format
+static PGresult *pgsql_exec(int stmt, const char **values, const int *lengths){
+	static const int formats[PGSQL_MAX_PARAMS] = {1, 1, 1, 1};
+	DEBUG_ASSERT(stmt >= 0 && stmt < NUM_STMTS);
+#ifdef BUILD_TEST
+	if(exec_text){
+		return PQexecParams(conn, pgsql_stmts[stmt].query,
+			pgsql_stmts[stmt].nparams, pgsql_stmts[stmt].types,
+			values, lengths, formats, 1);
+	}
+#endif
+	return PQexecPrepared(conn, pgsql_stmts[stmt].name,
+		pgsql_stmts[stmt].nparams, values, lengths, formats, 1);
+}
+
+static void *pgsql_query(int stmt, const char **values, const int *lengths){
+	int64 start = kpl_clock_monotonic_nsec();
+	void *ret = pgsql_decode(pgsql_exec(stmt, values, lengths), stmt, conn);
+	pgsql_record(stmt, lengths, pgsql_wait(start),
+		kpl_clock_monotonic_nsec() - start, ret == NULL);
+	return ret;
+}
+
+struct db_account_info *db_load_account_info(const char *accname){
+	int length = (int)strlen(accname);
+	return pgsql_query(STMT_LOAD_ACCOUNT_INFO, &accname, &length);
+}
+
+struct db_charlist *db_load_account_charlist(int32 account_id){
 	char param_buf[sizeof(int32)];
-	char *param_value = param_buf;
+	const char *param_value = param_buf;
 	int param_length = sizeof(int32);
-	int param_format = 1;
 	encode_u32_be(param_buf, account_id);
-	res = PQexecParams(conn,
-		"SELECT name"
-		" FROM players"
-		" WHERE account_id = $1"
-		" ORDER BY name ASC",
-		/*nParams = */		1,
-		/*paramTypes = */	NULL,
-		/*paramValues = */	&param_value,
-		/*paramLengths = */	&param_length,
-		/*paramFormats = */	&param_format,
-		/*resultFormat = */	1);
-	PGSQL_VALIDATE_RESULT_OR_RETURN_NULL(res);
-	return res;
+	return pgsql_query(STMT_LOAD_ACCOUNT_CHARLIST, &param_value, &param_length);
 }
 
 /*
@@ -176,18 +482,1137 @@ bool pgsql_load_player(const char *name, struct db_result_player *player){
 }
 */
 
-db_result_t *db_load_player(const char *charname){
+struct db_player_info *db_load_player(const char *charname){
+	int length = (int)strlen(charname);
+	return pgsql_query(STMT_LOAD_PLAYER, &charname, &length);
+}
+
+// updates don't have a result to decode, only the row count
+bool db_update_account_password(int32 account_id,
+		const char *old_password, const char *new_password){
+	char param_buf[sizeof(int32)];
+	const char *values[3] = {param_buf, new_password, old_password};
+	int lengths[3] = {sizeof(int32),
+		(int)strlen(new_password), (int)strlen(old_password)};
+	int64 start = kpl_clock_monotonic_nsec();
 	PGresult *res;
-	res = PQexecParams(conn,
-		"SELECT player_id, account_id"
-		" FROM players"
-		" WHERE lower(name) = $1",
-		/*nParams = */		1,
-		/*paramTypes = */	NULL,
-		/*paramValues = */	&charname,
-		/*paramLengths = */	NULL,
-		/*paramFormats = */	NULL,
-		/*resultFormat = */	1);
-	PGSQL_VALIDATE_RESULT_OR_RETURN_NULL(res);
-	return res;
+	bool failed, ret;
+
+	encode_u32_be(param_buf, account_id);
+	res = pgsql_exec(STMT_UPDATE_ACCOUNT_PASSWORD, values, lengths);
+	failed = (res == NULL || PQresultStatus(res) != PGRES_COMMAND_OK);
+	if(failed){
+		LOG_ERROR("pgsql: `%s` failed: %s",
+			pgsql_stmts[STMT_UPDATE_ACCOUNT_PASSWORD].name,
+			res != NULL ? PQresultErrorMessage(res) : PQerrorMessage(conn));
+	}
+	ret = !failed && strcmp(PQcmdTuples(res), "1") == 0;
+	if(res != NULL)
+		PQclear(res);
+	pgsql_record(STMT_UPDATE_ACCOUNT_PASSWORD, lengths, pgsql_wait(start),
+		kpl_clock_monotonic_nsec() - start, failed);
+	return ret;
+}
+
+// PLAYER SAVES
+//	- Rows are streamed with COPY into a temporary staging table and
+//	merged into `players` with a single UPDATE so a batch costs one
+//	transaction no matter how many players it has.
+//	- The staging table lives as long as the connection (it's empty
+//	outside of a transaction because of ON COMMIT DELETE ROWS).
+//	- Groups that aren't dirty are sent as NULL and the merge keeps
+//	the current values for them. Rows whose version isn't newer than
+//	the stored one aren't touched.
+//	- The player blob is sent as a hex bytea and may span several
+//	chunks (the other fields of a row always fit in one).
+
+#define SAVE_COPY_CHUNK 8192
+static const char save_stage_query[] =
+	"CREATE TEMP TABLE player_save_stage ("
+		" player_id int, version bigint, level int, experience bigint,"
+		" health int, max_health int, mana int, max_mana int,"
+		" pos_x int, pos_y int, pos_z int, data bytea"
+	") ON COMMIT DELETE ROWS";
+static const char save_copy_query[] =
+	"COPY player_save_stage FROM STDIN";
+static const char save_merge_query[] =
+	"UPDATE players AS p SET"
+		" level = COALESCE(s.level, p.level),"
+		" experience = COALESCE(s.experience, p.experience),"
+		" health = COALESCE(s.health, p.health),"
+		" max_health = COALESCE(s.max_health, p.max_health),"
+		" mana = COALESCE(s.mana, p.mana),"
+		" max_mana = COALESCE(s.max_mana, p.max_mana),"
+		" pos_x = COALESCE(s.pos_x, p.pos_x),"
+		" pos_y = COALESCE(s.pos_y, p.pos_y),"
+		" pos_z = COALESCE(s.pos_z, p.pos_z),"
+		" data = COALESCE(s.data, p.data),"
+		" version = s.version"
+	" FROM player_save_stage AS s"
+	" WHERE p.player_id = s.player_id AND p.version < s.version";
+
+static bool save_command(const char *query, ExecStatusType expected){
+	PGresult *res = PQexec(conn, query);
+	bool ret = (res != NULL && PQresultStatus(res) == expected);
+	if(!ret)
+		LOG_ERROR("db_save_players: %s", PQerrorMessage(conn));
+	if(res != NULL)
+		PQclear(res);
+	return ret;
+}
+
+// the merge reports how many rows it updated
+static bool save_merge(int count){
+	PGresult *res = PQexec(conn, save_merge_query);
+	int updated;
+	if(res == NULL || PQresultStatus(res) != PGRES_COMMAND_OK){
+		LOG_ERROR("db_save_players: %s", PQerrorMessage(conn));
+		if(res != NULL)
+			PQclear(res);
+		return false;
+	}
+	updated = atoi(PQcmdTuples(res));
+	PQclear(res);
+	if(updated < count){
+		LOG_WARNING("db_save_players: %d of %d players were skipped"
+			" (stale version or missing player)", count - updated, count);
+	}
+	return true;
+}
+
+// writes a row (without the blob) with NULLs for
+// the groups that aren't dirty
+static int save_format_row(char *buf, int bufsize,
+		const struct db_player_state *st){
+	int len = snprintf(buf, bufsize, "%d\t%lld",
+		st->player_id, (long long)st->version);
+	if(st->dirty & DB_PLAYER_STATS){
+		len += snprintf(buf + len, bufsize - len, "\t%d\t%lld",
+			st->level, (long long)st->experience);
+	}else{
+		len += snprintf(buf + len, bufsize - len, "\t\\N\t\\N");
+	}
+	if(st->dirty & DB_PLAYER_VITALS){
+		len += snprintf(buf + len, bufsize - len, "\t%d\t%d\t%d\t%d",
+			st->health, st->max_health, st->mana, st->max_mana);
+	}else{
+		len += snprintf(buf + len, bufsize - len, "\t\\N\t\\N\t\\N\t\\N");
+	}
+	if(st->dirty & DB_PLAYER_POSITION){
+		len += snprintf(buf + len, bufsize - len, "\t%d\t%d\t%d",
+			st->pos_x, st->pos_y, st->pos_z);
+	}else{
+		len += snprintf(buf + len, bufsize - len, "\t\\N\t\\N\t\\N");
+	}
+	return len;
+}
+
+static bool save_copy_flush(char *buf, int *len){
+	if(PQputCopyData(conn, buf, *len) != 1)
+		return false;
+	*len = 0;
+	return true;
+}
+
+// the bytea hex format (`\x` followed by two digits per byte)
+// with the backslash escaped for COPY
+static bool save_copy_data(char *buf, int bufsize, int *len,
+		const struct db_player_state *st){
+	static const char digits[] = "0123456789abcdef";
+	memcpy(buf + *len, "\t\\\\x", 4);
+	*len += 4;
+	for(int i = 0; i < st->data_len; i += 1){
+		// keep room for the row terminator
+		if(*len > bufsize - 3 && !save_copy_flush(buf, len))
+			return false;
+		buf[*len] = digits[st->data[i] >> 4];
+		buf[*len + 1] = digits[st->data[i] & 0x0F];
+		*len += 2;
+	}
+	return true;
+}
+
+static bool save_copy_rows(const struct db_player_state *states, int count){
+	char buf[SAVE_COPY_CHUNK];
+	PGresult *res;
+	int len = 0;
+	bool ret, failed = false;
+
+	if(!save_command(save_copy_query, PGRES_COPY_IN))
+		return false;
+	for(int i = 0; i < count; i += 1){
+		// a row without its blob is well under 256 bytes
+		if(len > (int)sizeof(buf) - 256 && !save_copy_flush(buf, &len)){
+			failed = true;
+			break;
+		}
+		len += save_format_row(buf + len, sizeof(buf) - len, &states[i]);
+		if(!(states[i].dirty & DB_PLAYER_DATA)){
+			memcpy(buf + len, "\t\\N", 3);
+			len += 3;
+		}else if(!save_copy_data(buf, sizeof(buf), &len, &states[i])){
+			failed = true;
+			break;
+		}
+		buf[len] = '\n';
+		len += 1;
+	}
+	if(failed || (len > 0 && !save_copy_flush(buf, &len))){
+		PQputCopyEnd(conn, "failed to send data");
+	}else if(PQputCopyEnd(conn, NULL) != 1){
+		LOG_ERROR("db_save_players: %s", PQerrorMessage(conn));
+	}
+
+	// the COPY result tells whether it actually succeeded
+	ret = false;
+	while((res = PQgetResult(conn)) != NULL){
+		if(PQresultStatus(res) == PGRES_COMMAND_OK)
+			ret = true;
+		else
+			LOG_ERROR("db_save_players: %s", PQresultErrorMessage(res));
+		PQclear(res);
+	}
+	return ret;
+}
+
+static bool save_players(const struct db_player_state *states, int count){
+	if(!save_command("BEGIN", PGRES_COMMAND_OK))
+		return false;
+	if((save_stage_ready || save_command(save_stage_query, PGRES_COMMAND_OK))
+	&& save_copy_rows(states, count)
+	&& save_merge(count)
+	&& save_command("COMMIT", PGRES_COMMAND_OK)){
+		// the staging table only exists after the
+		// transaction that created it is committed
+		save_stage_ready = true;
+		DEBUG_LOG("db_save_players: saved %d players", count);
+		return true;
+	}
+	// this may fail if the connection is broken but then
+	// it'll be reset by the worker which also aborts it
+	save_command("ROLLBACK", PGRES_COMMAND_OK);
+	return false;
+}
+
+bool db_save_players(const struct db_player_state *states, int count){
+	int64 start, exec;
+	bool ret;
+	if(count <= 0)
+		return true;
+	start = kpl_clock_monotonic_nsec();
+	ret = save_players(states, count);
+	exec = kpl_clock_monotonic_nsec() - start;
+	if(db_stats_record(save_stat, pgsql_wait(start), exec, !ret)){
+		LOG_WARNING("pgsql: slow query `save_players` took %lldms"
+			" (%d players)", (long long)(exec / 1000000), count);
+	}
+	return ret;
+}
+
+// BATCHES
+#define PGSQL_MAX_PARAM_LEN 64
+struct db_batch_query{
+	int stmt;
+	const char *values[PGSQL_MAX_PARAMS];
+	int lengths[PGSQL_MAX_PARAMS];
+	char data[PGSQL_MAX_PARAMS][PGSQL_MAX_PARAM_LEN];
+};
+
+struct db_batch{
+	int count;
+	struct db_batch_query queries[DB_BATCH_MAX_QUERIES];
+	void *results[DB_BATCH_MAX_QUERIES];
+};
+
+struct db_batch *db_batch_create(void){
+	struct db_batch *batch = kpl_malloc(sizeof(struct db_batch));
+	batch->count = 0;
+	return batch;
+}
+
+void db_batch_destroy(struct db_batch *batch){
+	db_batch_reset(batch);
+	kpl_free(batch);
+}
+
+void db_batch_reset(struct db_batch *batch){
+	for(int i = 0; i < batch->count; i += 1){
+		if(batch->results[i] != NULL)
+			kpl_free(batch->results[i]);
+	}
+	batch->count = 0;
+}
+
+static struct db_batch_query *batch_add(struct db_batch *batch, int stmt){
+	struct db_batch_query *q;
+	DEBUG_ASSERT(batch->count < DB_BATCH_MAX_QUERIES);
+	q = &batch->queries[batch->count];
+	q->stmt = stmt;
+	batch->results[batch->count] = NULL;
+	batch->count += 1;
+	return q;
+}
+
+static void batch_param_str(struct db_batch_query *q, int idx, const char *str){
+	int len = (int)strlen(str);
+	if(len > PGSQL_MAX_PARAM_LEN)
+		len = PGSQL_MAX_PARAM_LEN;
+	memcpy(q->data[idx], str, len);
+	q->values[idx] = q->data[idx];
+	q->lengths[idx] = len;
+}
+
+static void batch_param_int32(struct db_batch_query *q, int idx, int32 val){
+	encode_u32_be(q->data[idx], val);
+	q->values[idx] = q->data[idx];
+	q->lengths[idx] = sizeof(int32);
+}
+
+int db_batch_load_account_info(struct db_batch *batch, const char *accname){
+	struct db_batch_query *q = batch_add(batch, STMT_LOAD_ACCOUNT_INFO);
+	batch_param_str(q, 0, accname);
+	return batch->count - 1;
+}
+
+int db_batch_load_account_charlist(struct db_batch *batch, int32 account_id){
+	struct db_batch_query *q = batch_add(batch, STMT_LOAD_ACCOUNT_CHARLIST);
+	batch_param_int32(q, 0, account_id);
+	return batch->count - 1;
+}
+
+int db_batch_load_account_charlist_by_name(struct db_batch *batch, const char *accname){
+	struct db_batch_query *q = batch_add(batch, STMT_LOAD_ACCOUNT_CHARLIST_BY_NAME);
+	batch_param_str(q, 0, accname);
+	return batch->count - 1;
+}
+
+int db_batch_load_player(struct db_batch *batch, const char *charname){
+	struct db_batch_query *q = batch_add(batch, STMT_LOAD_PLAYER);
+	batch_param_str(q, 0, charname);
+	return batch->count - 1;
+}
+
+#ifdef LIBPQ_HAS_PIPELINING
+// leave pipeline mode after a failure so the connection can still
+// be used (if the connection is broken, it'll be reset by the worker)
+static void batch_abort_pipeline(int count, bool synced){
+	PGresult *res;
+	if(PQstatus(conn) != CONNECTION_OK)
+		return;
+	if(!synced && !PQpipelineSync(conn))
+		return;
+	// each query yields at most a result and a NULL
+	for(int i = 0; i < 2 * count + 1; i += 1){
+		res = PQgetResult(conn);
+		if(res != NULL){
+			if(PQresultStatus(res) == PGRES_PIPELINE_SYNC){
+				PQclear(res);
+				break;
+			}
+			PQclear(res);
+		}
+	}
+	PQexitPipelineMode(conn);
+}
+
+// send all queries back to back and read their results in order
+static bool batch_exec_pipeline(struct db_batch *batch){
+	static const int formats[PGSQL_MAX_PARAMS] = {1, 1, 1, 1};
+	struct db_batch_query *q;
+	PGresult *res;
+	int64 start = kpl_clock_monotonic_nsec();
+	int64 wait = pgsql_wait(start);
+
+	if(!PQenterPipelineMode(conn)){
+		LOG_ERROR("db_batch_exec: %s", PQerrorMessage(conn));
+		return false;
+	}
+	for(int i = 0; i < batch->count; i += 1){
+		q = &batch->queries[i];
+		if(!PQsendQueryPrepared(conn, pgsql_stmts[q->stmt].name,
+				pgsql_stmts[q->stmt].nparams, q->values,
+				q->lengths, formats, 1)){
+			LOG_ERROR("db_batch_exec: %s", PQerrorMessage(conn));
+			batch_abort_pipeline(i, false);
+			return false;
+		}
+	}
+	if(!PQpipelineSync(conn)){
+		LOG_ERROR("db_batch_exec: %s", PQerrorMessage(conn));
+		batch_abort_pipeline(batch->count, false);
+		return false;
+	}
+
+	// each query yields its result followed by a NULL (the
+	// time recorded for each query is what the batch waited
+	// for its result)
+	for(int i = 0; i < batch->count; i += 1){
+		q = &batch->queries[i];
+		batch->results[i] = pgsql_decode(PQgetResult(conn), q->stmt, conn);
+		pgsql_record(q->stmt, q->lengths, wait,
+			kpl_clock_monotonic_nsec() - start,
+			batch->results[i] == NULL);
+		while((res = PQgetResult(conn)) != NULL)
+			PQclear(res);
+	}
+	// consume the sync result
+	res = PQgetResult(conn);
+	if(res == NULL || PQresultStatus(res) != PGRES_PIPELINE_SYNC){
+		LOG_ERROR("db_batch_exec: pipeline out of sync");
+		if(res != NULL)
+			PQclear(res);
+		batch_abort_pipeline(batch->count, true);
+		return false;
+	}
+	PQclear(res);
+	if(!PQexitPipelineMode(conn)){
+		LOG_ERROR("db_batch_exec: %s", PQerrorMessage(conn));
+		return false;
+	}
+	return true;
+}
+#else
+// libpq < 14 doesn't have pipeline mode so the whole batch is sent
+// as a single simple query with an EXECUTE of the prepared statement
+// for each query and params inlined as literals. Its results come
+// back in text format, one for each query in order. The statements
+// run in an implicit transaction so if one fails, the ones after it
+// don't run and their results are NULL.
+#define BATCH_MAX_QUERY_LEN (DB_BATCH_MAX_QUERIES				\
+	* (64 + PGSQL_MAX_PARAMS * (2 * PGSQL_MAX_PARAM_LEN + 8)))
+
+static bool batch_append(char *buf, int *len, const char *str){
+	int slen = (int)strlen(str);
+	if((*len + slen) >= BATCH_MAX_QUERY_LEN)
+		return false;
+	memcpy(buf + *len, str, slen + 1);
+	*len += slen;
+	return true;
+}
+
+static bool batch_append_param(PGconn *c, char *buf, int *len,
+		struct db_batch_query *q, int idx){
+	char tmp[PGSQL_MAX_PARAM_LEN + 1];
+	char *literal;
+	bool ret;
+	if(pgsql_stmts[q->stmt].types[idx] == PGSQL_OID_INT4){
+		snprintf(tmp, sizeof(tmp), "%d",
+			(int32)decode_u32_be(q->data[idx]));
+		return batch_append(buf, len, tmp);
+	}
+	literal = PQescapeLiteral(c, q->values[idx], q->lengths[idx]);
+	if(literal == NULL){
+		LOG_ERROR("db_batch_exec: %s", PQerrorMessage(c));
+		return false;
+	}
+	ret = batch_append(buf, len, literal);
+	PQfreemem(literal);
+	return ret;
+}
+
+// `c` is only used to escape string params
+static bool batch_build_query(PGconn *c, struct db_batch *batch, char *buf){
+	struct db_batch_query *q;
+	int len = 0;
+	buf[0] = 0;
+	for(int i = 0; i < batch->count; i += 1){
+		q = &batch->queries[i];
+		if(!batch_append(buf, &len, "EXECUTE ")
+				|| !batch_append(buf, &len, pgsql_stmts[q->stmt].name)
+				|| !batch_append(buf, &len, "("))
+			return false;
+		for(int j = 0; j < pgsql_stmts[q->stmt].nparams; j += 1){
+			if((j > 0 && !batch_append(buf, &len, ", "))
+					|| !batch_append_param(c, buf, &len, q, j))
+				return false;
+		}
+		if(!batch_append(buf, &len, ");"))
+			return false;
+	}
+	return true;
+}
+
+static bool batch_exec_simple(struct db_batch *batch){
+	struct db_batch_query *q;
+	PGresult *res;
+	char *query;
+	bool done = false;
+	int64 start = kpl_clock_monotonic_nsec();
+	int64 wait = pgsql_wait(start);
+
+	query = kpl_malloc(BATCH_MAX_QUERY_LEN);
+	if(!batch_build_query(conn, batch, query)){
+		LOG_ERROR("db_batch_exec: failed to build query");
+		kpl_free(query);
+		return false;
+	}
+	if(!PQsendQuery(conn, query)){
+		LOG_ERROR("db_batch_exec: %s", PQerrorMessage(conn));
+		kpl_free(query);
+		return false;
+	}
+	kpl_free(query);
+
+	// the time recorded for each query is what the
+	// batch waited for its result
+	for(int i = 0; i < batch->count; i += 1){
+		q = &batch->queries[i];
+		res = NULL;
+		if(!done){
+			res = PQgetResult(conn);
+			done = (res == NULL
+				|| PQresultStatus(res) != PGRES_TUPLES_OK);
+		}
+		batch->results[i] = pgsql_decode(res, q->stmt, conn);
+		pgsql_record(q->stmt, q->lengths, wait,
+			kpl_clock_monotonic_nsec() - start,
+			batch->results[i] == NULL);
+	}
+	while((res = PQgetResult(conn)) != NULL)
+		PQclear(res);
+	return true;
+}
+#endif
+
+bool db_batch_exec(struct db_batch *batch){
+#ifdef LIBPQ_HAS_PIPELINING
+	return batch_exec_pipeline(batch);
+#else
+	return batch_exec_simple(batch);
+#endif
+}
+
+// errors were already logged when decoding
+void *db_batch_result(struct db_batch *batch, int idx){
+	DEBUG_ASSERT(idx >= 0 && idx < batch->count);
+	return batch->results[idx];
+}
+
+// ASYNC QUERIES
+//	- A single thread owns `db_async_connections` non blocking
+//	connections and waits on all their sockets (plus a wakeup socket
+//	for new submissions) with poll. Results are read as they arrive
+//	and each completion is posted to the domain that asked for it.
+//	- Without pipeline mode each connection can only have one query
+//	in flight so there are at most `db_async_connections` in flight
+//	at once. With it, up to ASYNC_MAX_PIPELINE queries are sent back
+//	to back on each connection, each followed by a sync so errors
+//	stay isolated.
+//	- Batches (`db_async_batch_exec`) count as a single query. With
+//	pipeline mode their queries are sent back to back with a single
+//	sync at the end. Without it, they're sent as a single simple query
+//	like in `batch_exec_simple`.
+//	- Logins load their accounts through here (see protocol_login.c).
+//	If the connections can't be made at startup, async queries are
+//	disabled and logins fall back to the database workers.
+//	- Resets are still blocking but they're rate limited and only
+//	happen when a connection is broken.
+#define ASYNC_MAX_PIPELINE 32
+#define ASYNC_POLL_TIMEOUT PGSQL_RESET_INTERVAL
+
+#ifdef PLATFORM_WINDOWS
+typedef SOCKET async_socket_t;
+#define ASYNC_INVALID_SOCKET INVALID_SOCKET
+#define async_poll WSAPoll
+#define async_close_socket closesocket
+#else
+typedef int async_socket_t;
+#define ASYNC_INVALID_SOCKET -1
+#define async_poll poll
+#define async_close_socket close
+#endif
+
+struct async_query{
+	struct async_query *next;
+	// single queries use `q` and batches use the caller's
+	// batch (results are decoded straight into it)
+	struct db_batch *batch;
+	struct db_batch_query q;
+	int count;
+	int cur;
+	PGresult *pgres[DB_BATCH_MAX_QUERIES];
+	cont_domain_t domain;
+	db_async_fn_t fn;
+	void *arg;
+	void *res;
+	int64 submitted;
+	int64 sent;
+};
+
+static struct db_batch_query *async_query_at(struct async_query *aq, int idx){
+	DEBUG_ASSERT(idx >= 0 && idx < aq->count);
+	return aq->batch != NULL ? &aq->batch->queries[idx] : &aq->q;
+}
+
+static void async_clear_results(struct async_query *aq){
+	for(int i = 0; i < aq->count; i += 1){
+		if(aq->pgres[i] != NULL){
+			PQclear(aq->pgres[i]);
+			aq->pgres[i] = NULL;
+		}
+	}
+}
+
+struct async_conn{
+	PGconn *conn;
+	int64 next_reset;
+	int inflight;
+	bool want_write;
+	struct async_query *head;
+	struct async_query *tail;
+};
+
+static struct{
+	thread_t thr;
+	bool started;
+	volatile uint32 running;
+	int num_conns;
+	struct async_conn conns[DB_ASYNC_MAX_CONNECTIONS];
+	async_socket_t wakeup;
+
+	// submissions (protected by `mtx`)
+	mutex_t mtx;
+	int max_pending;
+	int num_pending;
+	struct async_query *head;
+	struct async_query *tail;
+} async;
+
+// wakeup socket
+//	- UDP socket connected to itself so submitting threads can
+//	interrupt the poll on every platform (WSAPoll only takes sockets).
+static bool async_wakeup_init(void){
+	struct sockaddr_in addr;
+	socklen_t addrlen = sizeof(addr);
+	async_socket_t s = socket(AF_INET, SOCK_DGRAM, 0);
+	if(s == ASYNC_INVALID_SOCKET)
+		return false;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+	if(bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0
+	|| getsockname(s, (struct sockaddr*)&addr, &addrlen) != 0
+	|| connect(s, (struct sockaddr*)&addr, addrlen) != 0){
+		async_close_socket(s);
+		return false;
+	}
+#ifdef PLATFORM_WINDOWS
+	{	u_long nonblocking = 1;
+		ioctlsocket(s, FIONBIO, &nonblocking); }
+#else
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+#endif
+	async.wakeup = s;
+	return true;
+}
+
+static void async_wakeup(void){
+	// if the socket buffer is full the thread is already awake
+	char c = 0;
+	send(async.wakeup, &c, 1, 0);
+}
+
+static void async_wakeup_drain(void){
+	char buf[64];
+	while(recv(async.wakeup, buf, sizeof(buf), 0) > 0)
+		continue;
+}
+
+// completions
+static void async_run_callback(void *arg){
+	struct async_query *aq = arg;
+	aq->fn(aq->res, aq->arg);
+	kpl_free(aq);
 }
+
+static void async_complete(struct async_query *aq){
+	struct db_batch_query *q;
+	int64 now = kpl_clock_monotonic_nsec();
+	int64 wait, exec;
+	void *res;
+	bool posted = false;
+
+	if(aq->sent != 0){
+		wait = aq->sent - aq->submitted;
+		exec = now - aq->sent;
+	}else{
+		wait = now - aq->submitted;
+		exec = 0;
+	}
+	// decode here so only the compact result leaves this thread
+	// (queries that failed to be sent or read have no PGresult)
+	for(int i = 0; i < aq->count; i += 1){
+		q = async_query_at(aq, i);
+		res = NULL;
+		if(aq->pgres[i] != NULL){
+			res = pgsql_decode(aq->pgres[i], q->stmt, NULL);
+			aq->pgres[i] = NULL;
+		}
+		pgsql_record(q->stmt, q->lengths, wait, exec, res == NULL);
+		if(aq->batch != NULL)
+			aq->batch->results[i] = res;
+		else
+			aq->res = res;
+	}
+	if(aq->batch != NULL)
+		aq->res = aq->batch;
+
+	// the async thread can't block on the game queues
+	switch(aq->domain){
+	case CONT_DOMAIN_NET:
+		posted = game_try_add_server_task(async_run_callback, aq);
+		break;
+	case CONT_DOMAIN_GAME:
+		posted = game_try_add_task(async_run_callback, aq);
+		break;
+	default:
+		// CONT_DOMAIN_NONE runs on the async thread
+		async_run_callback(aq);
+		return;
+	}
+
+	if(!posted){
+		// same as continuations: run on this thread with
+		// no result so `fn` can at least release `arg`
+		DEBUG_LOG("db_async: failed to post completion");
+		// batch results are released with the batch
+		if(aq->batch == NULL && aq->res != NULL)
+			kpl_free(aq->res);
+		aq->res = NULL;
+		async_run_callback(aq);
+	}
+}
+
+// used at shutdown when completions can't be posted anymore
+static void async_abort(struct async_query *aq){
+	async_clear_results(aq);
+	aq->res = NULL;
+	async_run_callback(aq);
+}
+
+// pops the oldest query in flight
+static struct async_query *async_conn_pop(struct async_conn *c){
+	struct async_query *aq = c->head;
+	DEBUG_ASSERT(aq != NULL);
+	c->head = aq->next;
+	if(c->head == NULL)
+		c->tail = NULL;
+	c->inflight -= 1;
+	return aq;
+}
+
+static void async_conn_fail_all(struct async_conn *c){
+	struct async_query *aq;
+	while(c->head != NULL){
+		aq = async_conn_pop(c);
+		async_clear_results(aq);
+		async_complete(aq);
+	}
+	c->want_write = false;
+}
+
+// returns false if the query couldn't be sent, otherwise it's
+// queued on the connection (if the connection breaks afterwards
+// it'll be failed by `async_conn_check`)
+#ifndef LIBPQ_HAS_PIPELINING
+static bool async_conn_send_simple(struct async_conn *c, struct async_query *aq){
+	char *query = kpl_malloc(BATCH_MAX_QUERY_LEN);
+	bool ret = batch_build_query(c->conn, aq->batch, query);
+	if(!ret)
+		LOG_ERROR("db_async: failed to build batch query");
+	else
+		ret = PQsendQuery(c->conn, query) != 0;
+	kpl_free(query);
+	return ret;
+}
+#endif
+
+static bool async_conn_send(struct async_conn *c, struct async_query *aq){
+	static const int formats[PGSQL_MAX_PARAMS] = {1, 1, 1, 1};
+	struct db_batch_query *q;
+	int ret;
+#ifdef LIBPQ_HAS_PIPELINING
+	for(int i = 0; i < aq->count; i += 1){
+		q = async_query_at(aq, i);
+		if(!PQsendQueryPrepared(c->conn, pgsql_stmts[q->stmt].name,
+				pgsql_stmts[q->stmt].nparams, q->values,
+				q->lengths, formats, 1)){
+			if(i == 0)
+				return false;
+			// the ones already sent still need their sync
+			// (the rest will have no result)
+			LOG_ERROR("db_async: %s", PQerrorMessage(c->conn));
+			break;
+		}
+	}
+	if(!PQpipelineSync(c->conn))
+		LOG_ERROR("db_async: %s", PQerrorMessage(c->conn));
+#else
+	if(aq->count == 1){
+		q = async_query_at(aq, 0);
+		if(!PQsendQueryPrepared(c->conn, pgsql_stmts[q->stmt].name,
+				pgsql_stmts[q->stmt].nparams, q->values,
+				q->lengths, formats, 1))
+			return false;
+	}else if(!async_conn_send_simple(c, aq)){
+		return false;
+	}
+#endif
+	aq->next = NULL;
+	aq->cur = 0;
+	aq->sent = kpl_clock_monotonic_nsec();
+	if(c->tail != NULL)
+		c->tail->next = aq;
+	else
+		c->head = aq;
+	c->tail = aq;
+	c->inflight += 1;
+
+	// whatever didn't fit the socket buffer is sent
+	// when the socket becomes writable
+	ret = PQflush(c->conn);
+	c->want_write = (ret == 1);
+	if(ret == -1)
+		LOG_ERROR("db_async: %s", PQerrorMessage(c->conn));
+	return true;
+}
+
+static void async_conn_read(struct async_conn *c){
+	struct async_query *aq;
+	PGresult *res;
+	if(!PQconsumeInput(c->conn)){
+		LOG_ERROR("db_async: %s", PQerrorMessage(c->conn));
+		return;
+	}
+	while(c->head != NULL && !PQisBusy(c->conn)){
+		res = PQgetResult(c->conn);
+		aq = c->head;
+#ifdef LIBPQ_HAS_PIPELINING
+		// the results of each query in the batch end with a NULL
+		// and the batch ends with the result of its sync
+		if(res == NULL){
+			aq->cur += 1;
+			continue;
+		}
+		if(PQresultStatus(res) == PGRES_PIPELINE_SYNC){
+			PQclear(res);
+			async_complete(async_conn_pop(c));
+			continue;
+		}
+		// keep the first result of each query
+		if(aq->cur < aq->count && aq->pgres[aq->cur] == NULL)
+			aq->pgres[aq->cur] = res;
+		else
+			PQclear(res);
+#else
+		// there is a result for each statement and
+		// a NULL once they're all done
+		if(res == NULL){
+			async_complete(async_conn_pop(c));
+			continue;
+		}
+		if(aq->cur < aq->count)
+			aq->pgres[aq->cur] = res;
+		else
+			PQclear(res);
+		aq->cur += 1;
+#endif
+	}
+}
+
+static void async_conn_check(struct async_conn *c){
+	int64 now;
+	if(PQstatus(c->conn) == CONNECTION_OK)
+		return;
+	// anything in flight is lost with the connection
+	async_conn_fail_all(c);
+	now = kpl_clock_monotonic_msec();
+	if(now < c->next_reset)
+		return;
+	c->next_reset = now + PGSQL_RESET_INTERVAL;
+	if(!pgsql_reset(c->conn))
+		return;
+	PQsetnonblocking(c->conn, 1);
+#ifdef LIBPQ_HAS_PIPELINING
+	if(!PQenterPipelineMode(c->conn))
+		LOG_ERROR("db_async: %s", PQerrorMessage(c->conn));
+#endif
+}
+
+// hands pending submissions to connections with room for them
+static void async_dispatch(void){
+	struct async_conn *c;
+	struct async_query *aq;
+	int capacity;
+#ifdef LIBPQ_HAS_PIPELINING
+	capacity = ASYNC_MAX_PIPELINE;
+#else
+	capacity = 1;
+#endif
+	for(int i = 0; i < async.num_conns; i += 1){
+		c = &async.conns[i];
+		if(PQstatus(c->conn) != CONNECTION_OK)
+			continue;
+		while(c->inflight < capacity){
+			mutex_lock(&async.mtx);
+			aq = async.head;
+			if(aq != NULL){
+				async.head = aq->next;
+				if(async.head == NULL)
+					async.tail = NULL;
+				async.num_pending -= 1;
+			}
+			mutex_unlock(&async.mtx);
+			if(aq == NULL)
+				return;
+			if(!async_conn_send(c, aq)){
+				LOG_ERROR("db_async: %s", PQerrorMessage(c->conn));
+				async_complete(aq);
+				break;
+			}
+		}
+	}
+}
+
+static void *async_thread(void *arg){
+	struct pollfd fds[DB_ASYNC_MAX_CONNECTIONS + 1];
+	struct async_conn *polled[DB_ASYNC_MAX_CONNECTIONS + 1];
+	struct async_conn *c;
+	int nfds, sock;
+
+	trace_thread_name("database async");
+	cont_set_thread_domain(CONT_DOMAIN_DB);
+	while(atomic_load_acquire_u32(&async.running)){
+		fds[0].fd = async.wakeup;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		nfds = 1;
+		for(int i = 0; i < async.num_conns; i += 1){
+			// broken connections have no socket
+			c = &async.conns[i];
+			sock = PQsocket(c->conn);
+			if(sock < 0)
+				continue;
+			fds[nfds].fd = (async_socket_t)sock;
+			fds[nfds].events = POLLIN;
+			if(c->want_write)
+				fds[nfds].events |= POLLOUT;
+			fds[nfds].revents = 0;
+			polled[nfds] = c;
+			nfds += 1;
+		}
+
+		if(async_poll(fds, nfds, ASYNC_POLL_TIMEOUT) < 0){
+			LOG_ERROR("db_async: poll failed");
+			break;
+		}
+		if(fds[0].revents & POLLIN)
+			async_wakeup_drain();
+		for(int i = 1; i < nfds; i += 1){
+			c = polled[i];
+			if(fds[i].revents & POLLOUT)
+				c->want_write = (PQflush(c->conn) == 1);
+			if(fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+				async_conn_read(c);
+		}
+		for(int i = 0; i < async.num_conns; i += 1)
+			async_conn_check(&async.conns[i]);
+		async_dispatch();
+	}
+	return NULL;
+}
+
+// closes whatever was opened by `async_start` and fails queries
+// that didn't complete so they still release their args (the game
+// has already been shutdown at this point)
+static void async_cleanup(void){
+	struct async_query *aq, *next;
+	for(int i = 0; i < async.num_conns; i += 1){
+		struct async_conn *c = &async.conns[i];
+		while(c->head != NULL)
+			async_abort(async_conn_pop(c));
+		PQfinish(c->conn);
+		c->conn = NULL;
+	}
+	// connection that failed during init
+	if(async.num_conns < DB_ASYNC_MAX_CONNECTIONS
+	&& async.conns[async.num_conns].conn != NULL){
+		PQfinish(async.conns[async.num_conns].conn);
+		async.conns[async.num_conns].conn = NULL;
+	}
+	mutex_lock(&async.mtx);
+	next = async.head;
+	async.head = NULL;
+	async.tail = NULL;
+	async.num_pending = 0;
+	mutex_unlock(&async.mtx);
+	while((aq = next) != NULL){
+		next = aq->next;
+		async_abort(aq);
+	}
+	async.num_conns = 0;
+
+	if(async.wakeup != ASYNC_INVALID_SOCKET){
+		async_close_socket(async.wakeup);
+		async.wakeup = ASYNC_INVALID_SOCKET;
+#ifdef PLATFORM_WINDOWS
+		WSACleanup();
+#endif
+	}
+}
+
+static bool async_start(int count){
+	struct async_conn *c;
+#ifdef PLATFORM_WINDOWS
+	{	WSADATA wsd;
+		if(WSAStartup(MAKEWORD(2, 2), &wsd) != 0){
+			LOG_ERROR("db_async_init: WSAStartup failed");
+			return false;
+		}
+	}
+#endif
+	if(!async_wakeup_init()){
+		LOG_ERROR("db_async_init: failed to create wakeup socket");
+#ifdef PLATFORM_WINDOWS
+		WSACleanup();
+#endif
+		return false;
+	}
+	for(async.num_conns = 0; async.num_conns < count; async.num_conns += 1){
+		c = &async.conns[async.num_conns];
+		c->conn = pgsql_connect();
+		if(c->conn == NULL || PQsetnonblocking(c->conn, 1) != 0){
+			LOG_ERROR("db_async_init: failed to initialize connection %d",
+				async.num_conns);
+			return false;
+		}
+#ifdef LIBPQ_HAS_PIPELINING
+		if(!PQenterPipelineMode(c->conn)){
+			LOG_ERROR("db_async_init: %s", PQerrorMessage(c->conn));
+			return false;
+		}
+#endif
+	}
+	async.running = 1;
+	if(thread_init(&async.thr, async_thread, NULL) != 0){
+		LOG_ERROR("db_async_init: failed to start async thread");
+		async.running = 0;
+		return false;
+	}
+	mutex_lock(&async.mtx);
+	async.started = true;
+	mutex_unlock(&async.mtx);
+	return true;
+}
+
+// only an invalid config fails here, if the connections can't be
+// made async queries are disabled (submissions fail right away and
+// callers fall back to the database workers)
+bool db_internal_async_init(void){
+	int count = config_geti("db_async_connections");
+	if(count < 0 || count > DB_ASYNC_MAX_CONNECTIONS){
+		LOG_ERROR("db_async_init: invalid number of connections (%d)"
+			" (should be within [0, %d])", count, DB_ASYNC_MAX_CONNECTIONS);
+		return false;
+	}
+	memset(&async, 0, sizeof(async));
+	async.wakeup = ASYNC_INVALID_SOCKET;
+	async.max_pending = config_geti("db_async_max_pending");
+	mutex_init(&async.mtx);
+	if(count > 0 && !async_start(count)){
+		LOG_WARNING("db_async_init: async queries are disabled");
+		async_cleanup();
+	}
+	return true;
+}
+
+void db_internal_async_shutdown(void){
+	if(async.started){
+		mutex_lock(&async.mtx);
+		async.started = false;
+		mutex_unlock(&async.mtx);
+		atomic_store_release_u32(&async.running, 0);
+		async_wakeup();
+		thread_join(&async.thr, NULL);
+	}
+	async_cleanup();
+	mutex_destroy(&async.mtx);
+}
+
+static bool async_submit(struct async_query *aq, cont_domain_t domain,
+		db_async_fn_t fn, void *arg){
+	aq->next = NULL;
+	aq->cur = 0;
+	memset(aq->pgres, 0, sizeof(aq->pgres));
+	aq->domain = domain;
+	aq->fn = fn;
+	aq->arg = arg;
+	aq->res = NULL;
+	aq->submitted = kpl_clock_monotonic_nsec();
+	aq->sent = 0;
+
+	mutex_lock(&async.mtx);
+	if(!async.started || async.num_pending >= async.max_pending){
+		mutex_unlock(&async.mtx);
+		kpl_free(aq);
+		return false;
+	}
+	if(async.tail != NULL)
+		async.tail->next = aq;
+	else
+		async.head = aq;
+	async.tail = aq;
+	async.num_pending += 1;
+	mutex_unlock(&async.mtx);
+	async_wakeup();
+	return true;
+}
+
+static struct async_query *async_query_create(int stmt){
+	struct async_query *aq = kpl_malloc(sizeof(struct async_query));
+	aq->batch = NULL;
+	aq->count = 1;
+	aq->q.stmt = stmt;
+	return aq;
+}
+
+bool db_async_load_account_info(const char *accname,
+		cont_domain_t domain, db_async_fn_t fn, void *arg){
+	struct async_query *aq = async_query_create(STMT_LOAD_ACCOUNT_INFO);
+	batch_param_str(&aq->q, 0, accname);
+	return async_submit(aq, domain, fn, arg);
+}
+
+bool db_async_load_account_charlist(int32 account_id,
+		cont_domain_t domain, db_async_fn_t fn, void *arg){
+	struct async_query *aq = async_query_create(STMT_LOAD_ACCOUNT_CHARLIST);
+	batch_param_int32(&aq->q, 0, account_id);
+	return async_submit(aq, domain, fn, arg);
+}
+
+bool db_async_load_account_charlist_by_name(const char *accname,
+		cont_domain_t domain, db_async_fn_t fn, void *arg){
+	struct async_query *aq = async_query_create(STMT_LOAD_ACCOUNT_CHARLIST_BY_NAME);
+	batch_param_str(&aq->q, 0, accname);
+	return async_submit(aq, domain, fn, arg);
+}
+
+bool db_async_load_player(const char *charname,
+		cont_domain_t domain, db_async_fn_t fn, void *arg){
+	struct async_query *aq = async_query_create(STMT_LOAD_PLAYER);
+	batch_param_str(&aq->q, 0, charname);
+	return async_submit(aq, domain, fn, arg);
+}
+
+bool db_async_batch_exec(struct db_batch *batch,
+		cont_domain_t domain, db_async_fn_t fn, void *arg){
+	struct async_query *aq;
+	DEBUG_ASSERT(batch->count > 0);
+	aq = kpl_malloc(sizeof(struct async_query));
+	aq->batch = batch;
+	aq->count = batch->count;
+	return async_submit(aq, domain, fn, arg);
+}
+
+#endif //DB_BACKEND_LOCAL
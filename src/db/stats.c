@@ -0,0 +1,314 @@
+#define DB_INTERNAL 1
+#include "database.h"
+#include "../config.h"
+#include "../histogram.h"
+#include "../log.h"
+#include "../thread.h"
+
+#include <stdio.h>
+
+// db stats
+//	- Histograms cover a report window (they're reset on each
+//	`db_stats_report`) while counters and sums are cumulative so they
+//	can be exported as monotonic counters.
+//	- Recording takes a mutex but it's nothing compared to the cost
+//	of a query.
+#define DB_STATS_MAX 16
+#define DB_STATS_MAX_NAME 32
+
+struct db_stat{
+	char name[DB_STATS_MAX_NAME];
+	uint64 total_count;
+	uint64 total_errors;
+	uint64 total_slow;
+	int64 total_wait;
+	int64 total_exec;
+	struct histogram wait;
+	struct histogram exec;
+};
+
+static struct{
+	bool initialized;
+	mutex_t mtx;
+	int64 slow_threshold;
+	char output[256];
+	int num_stats;
+	struct db_stat stats[DB_STATS_MAX];
+	uint64 total_reconnects;
+	uint64 total_reconnect_failures;
+	bool exporting;
+} dbstats;
+
+bool db_stats_init(void){
+	int threshold = config_geti("db_slow_query_threshold");
+	if(threshold < 0){
+		LOG_ERROR("db_stats_init: invalid slow query threshold (%d)",
+			threshold);
+		return false;
+	}
+	memset(&dbstats, 0, sizeof(dbstats));
+	mutex_init(&dbstats.mtx);
+	// zero disables the slow query log
+	dbstats.slow_threshold = threshold > 0
+		? (int64)threshold * 1000000 : INT64_MAX;
+	kpl_strncpy(dbstats.output, sizeof(dbstats.output),
+		config_get("db_stats_output"));
+	dbstats.initialized = true;
+	return true;
+}
+
+void db_stats_shutdown(void){
+	if(!dbstats.initialized)
+		return;
+	dbstats.initialized = false;
+	mutex_destroy(&dbstats.mtx);
+}
+
+int db_stats_register(const char *name){
+	struct db_stat *stat;
+	int id = -1;
+	if(!dbstats.initialized)
+		return -1;
+	mutex_lock(&dbstats.mtx);
+	// backends register again when they restart
+	for(int i = 0; i < dbstats.num_stats; i += 1){
+		if(strcmp(dbstats.stats[i].name, name) == 0){
+			id = i;
+			break;
+		}
+	}
+	if(id == -1 && dbstats.num_stats < DB_STATS_MAX){
+		id = dbstats.num_stats;
+		stat = &dbstats.stats[id];
+		memset(stat, 0, sizeof(struct db_stat));
+		kpl_strncpy(stat->name, sizeof(stat->name), name);
+		histogram_reset(&stat->wait);
+		histogram_reset(&stat->exec);
+		dbstats.num_stats += 1;
+	}else if(id == -1){
+		LOG_WARNING("db_stats_register: too many stats"
+			" (`%s` won't be recorded)", name);
+	}
+	mutex_unlock(&dbstats.mtx);
+	return id;
+}
+
+bool db_stats_record(int id, int64 wait, int64 exec, bool failed){
+	struct db_stat *stat;
+	bool slow;
+	if(!dbstats.initialized || id < 0)
+		return false;
+	if(wait < 0)
+		wait = 0;
+	if(exec < 0)
+		exec = 0;
+	slow = (exec >= dbstats.slow_threshold);
+	stat = &dbstats.stats[id];
+	mutex_lock(&dbstats.mtx);
+	stat->total_count += 1;
+	stat->total_wait += wait;
+	stat->total_exec += exec;
+	if(failed)
+		stat->total_errors += 1;
+	if(slow)
+		stat->total_slow += 1;
+	histogram_add(&stat->wait, (uint64)wait);
+	histogram_add(&stat->exec, (uint64)exec);
+	mutex_unlock(&dbstats.mtx);
+	return slow;
+}
+
+void db_stats_reconnect(bool ok){
+	if(!dbstats.initialized)
+		return;
+	mutex_lock(&dbstats.mtx);
+	dbstats.total_reconnects += 1;
+	if(!ok)
+		dbstats.total_reconnect_failures += 1;
+	mutex_unlock(&dbstats.mtx);
+}
+
+// report
+//	- The report works on a summary taken under the mutex so nothing
+//	else happens while holding it. Logging is done right away but the
+//	export is file io and is handed to a database worker.
+//	- The export is Prometheus text format so it can be picked up by
+//	the node exporter's textfile collector (or anything that reads
+//	it). The file is written to a temporary and renamed into place.
+//	- If the previous export is still running (or can't be queued),
+//	this one is skipped. The counters are cumulative so nothing is
+//	lost and the quantiles only cover the window anyway.
+#define DB_STATS_NUM_QUANTILES 4
+static const double quantiles[DB_STATS_NUM_QUANTILES] = {50.0, 90.0, 99.0, 99.9};
+
+struct db_stat_summary{
+	uint64 max;
+	uint64 quantiles[DB_STATS_NUM_QUANTILES];
+};
+
+struct db_stats_snapshot{
+	char output[sizeof(dbstats.output)];
+	int num_stats;
+	uint64 total_reconnects;
+	uint64 total_reconnect_failures;
+	struct{
+		char name[DB_STATS_MAX_NAME];
+		uint64 count;
+		uint64 total_count;
+		uint64 total_errors;
+		uint64 total_slow;
+		int64 total_wait;
+		int64 total_exec;
+		struct db_stat_summary wait;
+		struct db_stat_summary exec;
+	} stats[DB_STATS_MAX];
+};
+
+static void summarize(struct db_stat_summary *sum, struct histogram *h){
+	sum->max = h->max;
+	for(int i = 0; i < DB_STATS_NUM_QUANTILES; i += 1){
+		sum->quantiles[i] = h->count > 0
+			? histogram_percentile(h, quantiles[i]) : 0;
+	}
+}
+
+static void export_summary(FILE *f, const char *metric, const char *name,
+		struct db_stat_summary *sum, int64 total, uint64 count){
+	for(int i = 0; i < DB_STATS_NUM_QUANTILES; i += 1){
+		fprintf(f, "%s{statement=\"%s\",quantile=\"%g\"} %.9f\n",
+			metric, name, quantiles[i] / 100.0,
+			sum->quantiles[i] / 1e9);
+	}
+	fprintf(f, "%s_sum{statement=\"%s\"} %.9f\n",
+		metric, name, total / 1e9);
+	fprintf(f, "%s_count{statement=\"%s\"} %llu\n",
+		metric, name, (unsigned long long)count);
+}
+
+static void export_stats(void *arg){
+	struct db_stats_snapshot *report = arg;
+	char tmp[sizeof(report->output) + 4];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", report->output);
+	f = fopen(tmp, "w");
+	if(f == NULL){
+		LOG_ERROR("db_stats_report: failed to open `%s`", tmp);
+		goto done;
+	}
+	fprintf(f, "# TYPE kaplar_db_exec_seconds summary\n");
+	for(int i = 0; i < report->num_stats; i += 1){
+		export_summary(f, "kaplar_db_exec_seconds", report->stats[i].name,
+			&report->stats[i].exec, report->stats[i].total_exec,
+			report->stats[i].total_count);
+	}
+	fprintf(f, "# TYPE kaplar_db_wait_seconds summary\n");
+	for(int i = 0; i < report->num_stats; i += 1){
+		export_summary(f, "kaplar_db_wait_seconds", report->stats[i].name,
+			&report->stats[i].wait, report->stats[i].total_wait,
+			report->stats[i].total_count);
+	}
+	fprintf(f, "# TYPE kaplar_db_errors_total counter\n");
+	for(int i = 0; i < report->num_stats; i += 1){
+		fprintf(f, "kaplar_db_errors_total{statement=\"%s\"} %llu\n",
+			report->stats[i].name,
+			(unsigned long long)report->stats[i].total_errors);
+	}
+	fprintf(f, "# TYPE kaplar_db_slow_queries_total counter\n");
+	for(int i = 0; i < report->num_stats; i += 1){
+		fprintf(f, "kaplar_db_slow_queries_total{statement=\"%s\"} %llu\n",
+			report->stats[i].name,
+			(unsigned long long)report->stats[i].total_slow);
+	}
+	fprintf(f, "# TYPE kaplar_db_reconnects_total counter\n");
+	fprintf(f, "kaplar_db_reconnects_total %llu\n",
+		(unsigned long long)report->total_reconnects);
+	fprintf(f, "# TYPE kaplar_db_reconnect_failures_total counter\n");
+	fprintf(f, "kaplar_db_reconnect_failures_total %llu\n",
+		(unsigned long long)report->total_reconnect_failures);
+	fclose(f);
+
+	// rename won't replace an existing file on windows
+	remove(report->output);
+	if(rename(tmp, report->output) != 0)
+		LOG_ERROR("db_stats_report: failed to write `%s`", report->output);
+
+done:
+	mutex_lock(&dbstats.mtx);
+	dbstats.exporting = false;
+	mutex_unlock(&dbstats.mtx);
+	kpl_free(report);
+}
+
+static void log_summary(const char *label, struct db_stat_summary *sum){
+	LOG("    %-6s p50 = %lluus, p90 = %lluus, p99 = %lluus,"
+		" max = %lluus", label,
+		(unsigned long long)sum->quantiles[0] / 1000,
+		(unsigned long long)sum->quantiles[1] / 1000,
+		(unsigned long long)sum->quantiles[2] / 1000,
+		(unsigned long long)sum->max / 1000);
+}
+
+void db_stats_report(void){
+	struct db_stats_snapshot *report;
+	struct db_stat *stat;
+	bool export;
+	if(!dbstats.initialized)
+		return;
+
+	report = kpl_malloc(sizeof(struct db_stats_snapshot));
+	mutex_lock(&dbstats.mtx);
+	kpl_strncpy(report->output, sizeof(report->output), dbstats.output);
+	report->num_stats = dbstats.num_stats;
+	report->total_reconnects = dbstats.total_reconnects;
+	report->total_reconnect_failures = dbstats.total_reconnect_failures;
+	for(int i = 0; i < dbstats.num_stats; i += 1){
+		stat = &dbstats.stats[i];
+		memcpy(report->stats[i].name, stat->name, sizeof(stat->name));
+		report->stats[i].count = stat->exec.count;
+		report->stats[i].total_count = stat->total_count;
+		report->stats[i].total_errors = stat->total_errors;
+		report->stats[i].total_slow = stat->total_slow;
+		report->stats[i].total_wait = stat->total_wait;
+		report->stats[i].total_exec = stat->total_exec;
+		summarize(&report->stats[i].wait, &stat->wait);
+		summarize(&report->stats[i].exec, &stat->exec);
+
+		// start a new report window
+		histogram_reset(&stat->wait);
+		histogram_reset(&stat->exec);
+	}
+	export = (dbstats.output[0] != 0 && !dbstats.exporting);
+	if(export)
+		dbstats.exporting = true;
+	mutex_unlock(&dbstats.mtx);
+
+	for(int i = 0; i < report->num_stats; i += 1){
+		if(report->stats[i].count == 0)
+			continue;
+		LOG("db `%s`: %llu queries (%llu errors, %llu slow in total)",
+			report->stats[i].name,
+			(unsigned long long)report->stats[i].count,
+			(unsigned long long)report->stats[i].total_errors,
+			(unsigned long long)report->stats[i].total_slow);
+		log_summary("exec", &report->stats[i].exec);
+		log_summary("wait", &report->stats[i].wait);
+	}
+	if(report->total_reconnects > 0){
+		LOG("db: %llu reconnects (%llu failed)",
+			(unsigned long long)report->total_reconnects,
+			(unsigned long long)report->total_reconnect_failures);
+	}
+
+	// NOTE: this is called from the main shard so it can't block
+	// on the database queue
+	if(export && !db_try_add_task(export_stats, report)){
+		LOG_WARNING("db_stats_report: failed to queue export");
+		mutex_lock(&dbstats.mtx);
+		dbstats.exporting = false;
+		mutex_unlock(&dbstats.mtx);
+		export = false;
+	}
+	if(!export)
+		kpl_free(report);
+}
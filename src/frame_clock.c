@@ -0,0 +1,79 @@
+#include "frame_clock.h"
+
+bool frame_overrun_policy_from_string(const char *str,
+		frame_overrun_policy_t *out_policy){
+	if(strcmp(str, "skip") == 0)
+		*out_policy = FRAME_OVERRUN_SKIP;
+	else if(strcmp(str, "catchup") == 0)
+		*out_policy = FRAME_OVERRUN_CATCHUP;
+	else if(strcmp(str, "stretch") == 0)
+		*out_policy = FRAME_OVERRUN_STRETCH;
+	else
+		return false;
+	return true;
+}
+
+void frame_clock_init(struct frame_clock *clk, int64 interval,
+		frame_overrun_policy_t policy, int max_catchup){
+	DEBUG_ASSERT(interval > 0);
+	clk->interval = interval;
+	clk->next_frame = kpl_clock_monotonic_nsec();
+	clk->policy = policy;
+	clk->max_catchup = max_catchup >= 0 ? max_catchup : 0;
+	frame_clock_reset_stats(clk);
+}
+
+void frame_clock_reset_stats(struct frame_clock *clk){
+	memset(&clk->stats, 0, sizeof(struct frame_clock_stats));
+}
+
+// wait for the next frame and return its scheduled start
+int64 frame_clock_wait(struct frame_clock *clk){
+	struct frame_clock_stats *stats = &clk->stats;
+	int64 frame_start, now, jitter, behind;
+
+	now = kpl_clock_monotonic_nsec();
+	if(now < clk->next_frame){
+		kpl_sleep_until_nsec(clk->next_frame);
+		now = kpl_clock_monotonic_nsec();
+	}
+
+	// lateness is recorded whether the frame had to wait or
+	// it was already due (after a long frame)
+	jitter = now - clk->next_frame;
+	if(stats->num_frames == 0 || jitter < stats->jitter_min)
+		stats->jitter_min = jitter;
+	if(stats->num_frames == 0 || jitter > stats->jitter_max)
+		stats->jitter_max = jitter;
+	stats->jitter_sum += jitter;
+	if(jitter > 0)
+		stats->num_late += 1;
+	stats->num_frames += 1;
+
+	// number of whole frames we're behind schedule
+	frame_start = clk->next_frame;
+	behind = (now - frame_start) / clk->interval;
+	clk->next_frame += clk->interval;
+	if(behind > 0){
+		stats->num_overruns += 1;
+		switch(clk->policy){
+		case FRAME_OVERRUN_SKIP:
+			clk->next_frame += behind * clk->interval;
+			stats->num_skipped += (uint32)behind;
+			break;
+		case FRAME_OVERRUN_CATCHUP:
+			if(behind > clk->max_catchup){
+				behind -= clk->max_catchup;
+				clk->next_frame += behind * clk->interval;
+				stats->num_skipped += (uint32)behind;
+			}
+			break;
+		case FRAME_OVERRUN_STRETCH:
+		default:
+			frame_start = now;
+			clk->next_frame = now + clk->interval;
+			break;
+		}
+	}
+	return frame_start;
+}
@@ -0,0 +1,55 @@
+#ifndef KAPLAR_FRAME_CLOCK_H_
+#define KAPLAR_FRAME_CLOCK_H_ 1
+
+#include "common.h"
+
+// frame clock
+//	NOTES:
+//	- Frames are scheduled on an absolute grid (start + n * interval)
+//	so a late wake up or a long frame won't shift every later frame.
+//	- All times are in nanoseconds from `kpl_clock_monotonic_nsec`.
+//	- When a frame takes longer than the interval (overrun), the
+//	overrun policy decides what happens to the frames that were missed:
+//		SKIP:		drop them and realign with the grid
+//		CATCHUP:	run them back to back (up to `max_catchup`
+//				frames, the rest are dropped)
+//		STRETCH:	restart the grid from the end of the
+//				late frame (old behaviour)
+//	- Every frame records how late it started (jitter) and any
+//	frame that starts after its scheduled time counts as a late
+//	start. Only frames that are behind by a whole interval or more
+//	count as overruns and go through the policy.
+
+typedef enum frame_overrun_policy{
+	FRAME_OVERRUN_SKIP = 0,
+	FRAME_OVERRUN_CATCHUP,
+	FRAME_OVERRUN_STRETCH,
+} frame_overrun_policy_t;
+
+struct frame_clock_stats{
+	uint32 num_frames;
+	uint32 num_late;
+	uint32 num_overruns;
+	uint32 num_skipped;
+	// start lateness of every frame
+	int64 jitter_min;
+	int64 jitter_max;
+	int64 jitter_sum;
+};
+
+struct frame_clock{
+	int64 interval;
+	int64 next_frame;
+	frame_overrun_policy_t policy;
+	int max_catchup;
+	struct frame_clock_stats stats;
+};
+
+bool frame_overrun_policy_from_string(const char *str,
+		frame_overrun_policy_t *out_policy);
+void frame_clock_init(struct frame_clock *clk, int64 interval,
+		frame_overrun_policy_t policy, int max_catchup);
+int64 frame_clock_wait(struct frame_clock *clk);
+void frame_clock_reset_stats(struct frame_clock *clk);
+
+#endif //KAPLAR_FRAME_CLOCK_H_
@@ -0,0 +1,129 @@
+#include "frame_profiler.h"
+#include "log.h"
+
+// minimum interval between overrun dumps (1s)
+#define FRAME_PROFILER_DUMP_INTERVAL 1000000000
+
+void frame_profiler_init(struct frame_profiler *prof,
+		uint32 shard, int64 budget, int history_len){
+	memset(prof, 0, sizeof(struct frame_profiler));
+	if(history_len < 0)
+		history_len = 0;
+	else if(history_len > FRAME_PROFILER_MAX_HISTORY)
+		history_len = FRAME_PROFILER_MAX_HISTORY;
+	prof->shard = shard;
+	prof->budget = budget;
+	prof->history_len = (uint32)history_len;
+	histogram_reset(&prof->user_time);
+	histogram_reset(&prof->idle_time);
+	histogram_reset(&prof->game_tasks);
+	histogram_reset(&prof->server_tasks);
+	histogram_reset(&prof->deferred_tasks);
+}
+
+void frame_profiler_add(struct frame_profiler *prof, struct frame_record *rec){
+	rec->frame = prof->num_frames;
+	histogram_add(&prof->user_time, rec->user_time > 0 ? rec->user_time : 0);
+	histogram_add(&prof->idle_time, rec->idle_time > 0 ? rec->idle_time : 0);
+	histogram_add(&prof->game_tasks, rec->game_tasks);
+	histogram_add(&prof->server_tasks, rec->server_tasks);
+	histogram_add(&prof->deferred_tasks, rec->deferred_tasks);
+	prof->num_promoted += rec->promoted_tasks;
+
+	if(prof->history_len > 0){
+		prof->history[prof->history_pos] = *rec;
+		prof->history_pos += 1;
+		if(prof->history_pos >= prof->history_len)
+			prof->history_pos = 0;
+	}
+	prof->num_frames += 1;
+
+	if(rec->user_time > prof->budget){
+		prof->num_overruns += 1;
+		if(rec->start >= prof->next_dump){
+			LOG_WARNING("shard %u: frame %llu overran its budget"
+				" (user = %lldus, budget = %lldus)", prof->shard,
+				rec->frame, rec->user_time / 1000,
+				prof->budget / 1000);
+			frame_profiler_dump(prof);
+			prof->next_dump = rec->start + FRAME_PROFILER_DUMP_INTERVAL;
+		}
+	}
+}
+
+void frame_profiler_dump(struct frame_profiler *prof){
+	struct frame_record *rec, *last;
+	uint32 count, pos;
+	count = (uint32)MIN(prof->num_frames, (uint64)prof->history_len);
+	if(count == 0)
+		return;
+	// oldest record first
+	pos = (prof->history_pos + prof->history_len - count) % prof->history_len;
+	last = &prof->history[(prof->history_pos + prof->history_len - 1) % prof->history_len];
+	LOG("shard %u: last %u frames", prof->shard, count);
+	while(count > 0){
+		rec = &prof->history[pos];
+		LOG("    frame %llu: start = %lldus, user = %lldus,"
+			" idle = %lldus, game_tasks = %u, server_tasks = %u,"
+			" deferred = %u, promoted = %u",
+			rec->frame, (rec->start - last->start) / 1000,
+			rec->user_time / 1000, rec->idle_time / 1000,
+			rec->game_tasks, rec->server_tasks,
+			rec->deferred_tasks, rec->promoted_tasks);
+		pos += 1;
+		if(pos >= prof->history_len)
+			pos = 0;
+		count -= 1;
+	}
+}
+
+static void report_time(const char *name, struct histogram *h){
+	LOG("    %-12s p50 = %lluus, p90 = %lluus, p99 = %lluus,"
+		" p99.9 = %lluus, max = %lluus", name,
+		histogram_percentile(h, 50.0) / 1000,
+		histogram_percentile(h, 90.0) / 1000,
+		histogram_percentile(h, 99.0) / 1000,
+		histogram_percentile(h, 99.9) / 1000,
+		h->max / 1000);
+}
+
+static void report_count(const char *name, struct histogram *h){
+	LOG("    %-12s p50 = %llu, p90 = %llu, p99 = %llu,"
+		" p99.9 = %llu, max = %llu", name,
+		histogram_percentile(h, 50.0),
+		histogram_percentile(h, 90.0),
+		histogram_percentile(h, 99.0),
+		histogram_percentile(h, 99.9),
+		h->max);
+}
+
+void frame_profiler_report(struct frame_profiler *prof,
+		struct frame_clock_stats *clock_stats){
+	int64 jitter_avg = 0;
+	if(prof->user_time.count == 0)
+		return;
+	if(clock_stats->num_frames > 0)
+		jitter_avg = clock_stats->jitter_sum / clock_stats->num_frames;
+	LOG("shard %u: %llu frames, %u overruns, %u late starts"
+		" (%u by a frame or more), %u skipped, %u promoted tasks",
+		prof->shard, prof->user_time.count, prof->num_overruns,
+		clock_stats->num_late, clock_stats->num_overruns,
+		clock_stats->num_skipped, prof->num_promoted);
+	report_time("user time", &prof->user_time);
+	report_time("idle time", &prof->idle_time);
+	report_count("game tasks", &prof->game_tasks);
+	report_count("server tasks", &prof->server_tasks);
+	report_count("deferred", &prof->deferred_tasks);
+	LOG("    %-12s avg = %lldus, min = %lldus, max = %lldus",
+		"jitter", jitter_avg / 1000, clock_stats->jitter_min / 1000,
+		clock_stats->jitter_max / 1000);
+
+	// start a new report window
+	prof->num_overruns = 0;
+	prof->num_promoted = 0;
+	histogram_reset(&prof->user_time);
+	histogram_reset(&prof->idle_time);
+	histogram_reset(&prof->game_tasks);
+	histogram_reset(&prof->server_tasks);
+	histogram_reset(&prof->deferred_tasks);
+}
@@ -0,0 +1,61 @@
+#ifndef KAPLAR_FRAME_PROFILER_H_
+#define KAPLAR_FRAME_PROFILER_H_ 1
+
+#include "common.h"
+#include "frame_clock.h"
+#include "histogram.h"
+
+// frame profiler
+//	NOTES:
+//	- It's always on (release builds included) and only does O(1)
+//	work per frame so it should be used by every game shard.
+//	- Per frame values are added to histograms and logged as a
+//	percentile summary on `frame_profiler_report`.
+//	- The last `history_len` frames are kept in a ring buffer and
+//	are dumped to the log when a frame overruns its budget (dumps are
+//	rate limited so a slow period won't flood the log).
+//	- All times are in nanoseconds.
+
+#define FRAME_PROFILER_MAX_HISTORY 256
+
+struct frame_record{
+	uint64 frame;
+	int64 start;
+	int64 user_time;
+	int64 idle_time;
+	uint32 game_tasks;
+	// run on the server thread since the last frame
+	// (only recorded by the main shard)
+	uint32 server_tasks;
+	// low priority tasks carried over to the next
+	// frame and the ones that were promoted
+	uint32 deferred_tasks;
+	uint32 promoted_tasks;
+};
+
+struct frame_profiler{
+	uint32 shard;
+	int64 budget;
+	int64 next_dump;
+	uint64 num_frames;
+	uint32 num_overruns;
+	uint32 num_promoted;
+	uint32 history_len;
+	uint32 history_pos;
+	struct frame_record history[FRAME_PROFILER_MAX_HISTORY];
+	struct histogram user_time;
+	struct histogram idle_time;
+	struct histogram game_tasks;
+	struct histogram server_tasks;
+	struct histogram deferred_tasks;
+};
+
+void frame_profiler_init(struct frame_profiler *prof,
+		uint32 shard, int64 budget, int history_len);
+// `rec->frame` is set by the profiler
+void frame_profiler_add(struct frame_profiler *prof, struct frame_record *rec);
+void frame_profiler_dump(struct frame_profiler *prof);
+void frame_profiler_report(struct frame_profiler *prof,
+		struct frame_clock_stats *clock_stats);
+
+#endif //KAPLAR_FRAME_PROFILER_H_
@@ -1,8 +1,20 @@
 #include "game.h"
 #include "buffer_util.h"
+#include "config.h"
+#include "cont.h"
+#include "frame_clock.h"
+#include "frame_profiler.h"
+#include "log.h"
+#include "outbuf.h"
+#include "password.h"
+#include "player_save.h"
+#include "db/database.h"
 #include "server/server.h"
 #include "task_dbuffer.h"
 #include "thread.h"
+#include "trace.h"
+
+#include <stdio.h>
 
 // @TODO: If needed use the frame allocator to send additional data
 // with `game_add_task`. This data will be valid when the task is run
@@ -11,98 +23,681 @@
 //static struct mem_arena *frame_allocator[2]; = NULL;
 
 #define MAX_GAME_TASKS 1024
-static struct task_dbuffer *game_tasks = NULL;
-
+#define MAX_GAME_TASKS_OVERFLOW 8192
 #define MAX_SERVER_TASKS 1024
+#define MAX_SERVER_TASKS_OVERFLOW 8192
+
+// frame interval in milliseconds (`tick_interval`):
+//	16.667 is ~60fps
+//	33.333 is ~30fps
+//	66.667 is ~15fps
+#define GAME_MIN_FRAME_INTERVAL 1.0f
+#define GAME_MAX_FRAME_INTERVAL 1000.0f
+
+// low priority tasks carried over to later frames
+#define MIN_DEFERRED_TASKS 256
+struct deferred_task{
+	void (*fp)(void*);
+	void *arg;
+	uint64 frame;
+};
+
+struct game_shard{
+	uint32 id;
+	struct game_shard_rect rect;
+	struct task_dbuffer *tasks[GAME_TASK_NUM_PRIORITIES];
+	uint64 frame;
+	uint32 deferred_head;
+	uint32 deferred_count;
+	uint32 deferred_capacity;
+	struct deferred_task *deferred;
+	struct frame_clock clock;
+	struct frame_profiler profiler;
+	int64 next_report;
+	thread_t thr;
+};
+
+// frame clock settings
+static int64 frame_interval;
+static frame_overrun_policy_t frame_overrun_policy;
+static int frame_max_catchup;
+static int64 frame_report_interval;
+static int frame_profiler_history;
+
+// task budget settings
+static int64 frame_budget;
+static uint64 max_task_deferral;
+
+static uint32 num_shards = 0;
+static struct game_shard shards[GAME_MAX_SHARDS];
+static THREAD_LOCAL uint32 current_shard = GAME_NO_SHARD;
+
+// server tasks are shared by all shards but are only
+// flushed by the main shard
 static struct task_dbuffer *server_tasks = NULL;
 
+// server tasks run by maintenance routines that finished since
+// the main shard's last frame record (the routine runs on the
+// server thread after `server_exec` returns)
+static mutex_t server_stats_mtx;
+static uint32 server_tasks_ran = 0;
+
+// running flag for the shard threads
+static mutex_t running_mtx;
+static bool running = false;
+
+// connection routing table (the lower 16 bits of a
+// connection uid are its slot on the connection manager)
+//	- Connection tasks are numbered per priority when they're
+//	queued and the owner runs them in that order (see
+//	`run_connection_task`).
+#define MAX_ROUTED_CONNECTIONS 4096
+#define ROUTE_SLOT(uid) ((uid) & 0xFFFF)
+struct connection_route{
+	uint32 connection;
+	uint32 shard;
+	uint32 next_seq[GAME_TASK_NUM_PRIORITIES];
+	uint32 next_run[GAME_TASK_NUM_PRIORITIES];
+};
+static mutex_t route_mtx;
+static struct connection_route routes[MAX_ROUTED_CONNECTIONS];
+
+static bool game_running(void){
+	bool ret;
+	mutex_lock(&running_mtx);
+	ret = running;
+	mutex_unlock(&running_mtx);
+	return ret;
+}
+
+/* SHARDS */
+uint32 game_shard_count(void){
+	return num_shards;
+}
+
+uint32 game_current_shard(void){
+	return current_shard;
+}
+
+uint32 game_shard_at(uint16 x, uint16 y){
+	// shards are vertical strips so only `x` matters
+	for(uint32 i = 0; i < num_shards; i += 1){
+		if(x >= shards[i].rect.x0 && x < shards[i].rect.x1)
+			return i;
+	}
+	// the last shard extends to the end of the map
+	return num_shards - 1;
+}
+
+void game_shard_rect(uint32 shard, struct game_shard_rect *out_rect){
+	DEBUG_ASSERT(shard < num_shards);
+	*out_rect = shards[shard].rect;
+}
+
+bool game_shard_add_task(uint32 shard, void (*fp)(void*), void *arg){
+	return game_shard_add_task_prio(shard, GAME_TASK_NORMAL, fp, arg);
+}
+
+bool game_shard_add_task_prio(uint32 shard, game_task_priority_t prio,
+		void (*fp)(void*), void *arg){
+	DEBUG_ASSERT(shard < num_shards);
+	DEBUG_ASSERT(prio >= 0 && prio < GAME_TASK_NUM_PRIORITIES);
+	return task_dbuffer_add(shards[shard].tasks[prio], fp, arg);
+}
+
+bool game_shard_try_add_task_prio(uint32 shard, game_task_priority_t prio,
+		void (*fp)(void*), void *arg){
+	DEBUG_ASSERT(shard < num_shards);
+	DEBUG_ASSERT(prio >= 0 && prio < GAME_TASK_NUM_PRIORITIES);
+	return task_dbuffer_try_add(shards[shard].tasks[prio], fp, arg);
+}
+
+bool game_shard_broadcast(void (*fp)(void*), const void *arg, size_t argsize){
+	void *copy;
+	bool ret = true;
+	for(uint32 i = 0; i < num_shards; i += 1){
+		copy = kpl_malloc(argsize);
+		memcpy(copy, arg, argsize);
+		if(!game_shard_add_task(i, fp, copy)){
+			kpl_free(copy);
+			ret = false;
+		}
+	}
+	return ret;
+}
+
+/* CONNECTION ROUTING */
+void game_route_connection(uint32 connection, uint32 shard){
+	uint32 slot = ROUTE_SLOT(connection);
+	DEBUG_ASSERT(slot < MAX_ROUTED_CONNECTIONS);
+	DEBUG_ASSERT(shard < num_shards);
+	mutex_lock(&route_mtx);
+	// a handoff keeps the task order of the connection
+	if(routes[slot].connection != connection){
+		memset(&routes[slot], 0, sizeof(struct connection_route));
+		routes[slot].connection = connection;
+	}
+	routes[slot].shard = shard;
+	mutex_unlock(&route_mtx);
+}
+
+void game_unroute_connection(uint32 connection){
+	uint32 slot = ROUTE_SLOT(connection);
+	DEBUG_ASSERT(slot < MAX_ROUTED_CONNECTIONS);
+	mutex_lock(&route_mtx);
+	if(routes[slot].connection == connection){
+		routes[slot].connection = 0;
+		routes[slot].shard = 0;
+	}
+	mutex_unlock(&route_mtx);
+}
+
+uint32 game_connection_shard(uint32 connection){
+	uint32 slot = ROUTE_SLOT(connection);
+	uint32 shard = 0;
+	DEBUG_ASSERT(slot < MAX_ROUTED_CONNECTIONS);
+	mutex_lock(&route_mtx);
+	if(routes[slot].connection == connection)
+		shard = routes[slot].shard;
+	mutex_unlock(&route_mtx);
+	return shard;
+}
+
+struct connection_task{
+	uint32 connection;
+	uint32 shard;
+	game_task_priority_t prio;
+	// tasks queued while the connection was routed
+	// are numbered (see `connection_route`)
+	bool sequenced;
+	uint32 seq;
+	void (*fp)(void*);
+	void *arg;
+};
+
+// returns false if an earlier task of the same priority
+// hasn't run yet on the owner shard
+static bool connection_task_ready(struct connection_task *task, uint32 *owner){
+	struct connection_route *route = &routes[ROUTE_SLOT(task->connection)];
+	uint32 *next_run;
+	bool ready = true;
+	*owner = 0;
+	mutex_lock(&route_mtx);
+	if(route->connection == task->connection){
+		*owner = route->shard;
+		if(*owner == task->shard && task->sequenced){
+			// tasks before `next_run` that are still around
+			// were skipped (see below) and can run at any time
+			next_run = &route->next_run[task->prio];
+			if((int32)(task->seq - *next_run) > 0)
+				ready = false;
+			else if(task->seq == *next_run)
+				*next_run += 1;
+		}
+	}
+	mutex_unlock(&route_mtx);
+	return ready;
+}
+
+static void skip_connection_task(struct connection_task *task){
+	struct connection_route *route = &routes[ROUTE_SLOT(task->connection)];
+	mutex_lock(&route_mtx);
+	if(route->connection == task->connection)
+		route->next_run[task->prio] = task->seq + 1;
+	mutex_unlock(&route_mtx);
+}
+
+static void run_connection_task(void *arg){
+	struct connection_task *task = arg;
+	int64 start;
+	uint32 owner;
+	if(!connection_task_ready(task, &owner)){
+		// a task queued on the previous owner before a handoff
+		// is still being forwarded so this one waits on the
+		// next frame (on this same shard)
+		if(task_dbuffer_try_add(shards[task->shard].tasks[task->prio],
+				run_connection_task, task))
+			return;
+		DEBUG_LOG("run_connection_task: failed to requeue task"
+			" (running out of order)");
+		skip_connection_task(task);
+	}else if(owner != task->shard){
+		// the connection was handed off to another
+		// shard while this task was in flight
+		task->shard = owner;
+		if(game_shard_add_task_prio(owner, task->prio, run_connection_task, task))
+			return;
+		// if forwarding fails, run it here so the
+		// task has a chance to release its resources
+		DEBUG_LOG("run_connection_task: failed to forward"
+			" task to shard %u", owner);
+	}
+	start = trace_begin();
+	task->fp(task->arg);
+	trace_end(TRACE_CAT_TASK, (void*)task->fp, start);
+	kpl_free(task);
+}
+
+bool game_try_add_connection_task(uint32 connection, void (*fp)(void*), void *arg){
+	return game_try_add_connection_task_prio(connection, GAME_TASK_NORMAL, fp, arg);
+}
+
+bool game_try_add_connection_task_prio(uint32 connection, game_task_priority_t prio,
+		void (*fp)(void*), void *arg){
+	struct connection_route *route = &routes[ROUTE_SLOT(connection)];
+	struct connection_task *task;
+	bool ret;
+	DEBUG_ASSERT(ROUTE_SLOT(connection) < MAX_ROUTED_CONNECTIONS);
+	DEBUG_ASSERT(prio >= 0 && prio < GAME_TASK_NUM_PRIORITIES);
+	task = kpl_malloc(sizeof(struct connection_task));
+	task->connection = connection;
+	task->prio = prio;
+	task->fp = fp;
+	task->arg = arg;
+	// the task is queued while holding the route so a failed add
+	// doesn't leave a gap in the sequence (this is also why it
+	// can't block)
+	mutex_lock(&route_mtx);
+	if(route->connection == connection){
+		task->shard = route->shard;
+		task->sequenced = true;
+		task->seq = route->next_seq[prio];
+	}else{
+		task->shard = 0;
+		task->sequenced = false;
+		task->seq = 0;
+	}
+	ret = task_dbuffer_try_add(shards[task->shard].tasks[prio],
+		run_connection_task, task);
+	if(ret && task->sequenced)
+		route->next_seq[prio] += 1;
+	mutex_unlock(&route_mtx);
+	if(!ret)
+		kpl_free(task);
+	return ret;
+}
+
+/* SHARD HANDOFF */
+struct shard_handoff{
+	uint32 from;
+	uint32 to;
+	void (*on_arrive)(void*);
+	void *creature;
+};
+
+static void run_shard_handoff(void *arg){
+	struct shard_handoff *handoff = arg;
+	handoff->on_arrive(handoff->creature);
+	kpl_free(handoff);
+}
+
+bool game_shard_handoff(uint32 from, uint32 to, uint32 connection,
+		void (*on_arrive)(void*), void *creature){
+	struct shard_handoff *handoff;
+	DEBUG_ASSERT(from < num_shards && to < num_shards);
+	handoff = kpl_malloc(sizeof(struct shard_handoff));
+	handoff->from = from;
+	handoff->to = to;
+	handoff->on_arrive = on_arrive;
+	handoff->creature = creature;
+	// handoffs must not be delayed or the creature would be
+	// missing from both shards for a while
+	if(!game_shard_add_task_prio(to, GAME_TASK_HIGH, run_shard_handoff, handoff)){
+		kpl_free(handoff);
+		return false;
+	}
+	// route the connection only after the handoff task has been
+	// queued so any task resolving the new route will be queued
+	// after it (tasks still in the old shard will be forwarded)
+	if(connection != 0)
+		game_route_connection(connection, to);
+	return true;
+}
 
+/* MAIN SHARD */
 bool game_add_task(void (*fp)(void*), void *arg){
-	return task_dbuffer_add(game_tasks, fp, arg);
+	return game_shard_add_task(0, fp, arg);
+}
+
+bool game_add_task_prio(game_task_priority_t prio, void (*fp)(void*), void *arg){
+	return game_shard_add_task_prio(0, prio, fp, arg);
 }
 
 bool game_add_server_task(void (*fp)(void*), void *arg){
 	return task_dbuffer_add(server_tasks, fp, arg);
 }
 
-bool game_init(void){
-	game_tasks = task_dbuffer_create(MAX_GAME_TASKS);
-	server_tasks = task_dbuffer_create(MAX_SERVER_TASKS);
-	return true;
+bool game_try_add_task(void (*fp)(void*), void *arg){
+	return game_shard_try_add_task_prio(0, GAME_TASK_NORMAL, fp, arg);
 }
 
-void game_shutdown(void){
-	task_dbuffer_destroy(server_tasks);
-	task_dbuffer_destroy(game_tasks);
+bool game_try_add_server_task(void (*fp)(void*), void *arg){
+	return task_dbuffer_try_add(server_tasks, fp, arg);
 }
 
+/* FRAME LOOP */
 static void server_maintenance_routine(void *arg){
+	uint32 ran;
 	// DO ANY WORK ON THE SERVER THREAD
-	task_dbuffer_swap_and_run(server_tasks);
-}
-
-// frame interval in milliseconds:
-//	16 is ~60fps
-//	33 is ~30fps
-//	66 is ~15fps
-#define GAME_FRAME_INTERVAL 33
-
-#ifdef BUILD_DEBUG
-static void calc_stats(int64 *data, int datalen,
-		int64 *out_avg, int64 *out_min, int64 *out_max){
-	DEBUG_ASSERT(datalen > 0);
-	int64 avg, min, max;
-	avg = min = max = data[0];
-	for(int i = 1; i < datalen; i += 1){
-		if(data[i] < min)
-			min = data[i];
-		else if(data[i] > max)
-			max = data[i];
-		avg += data[i];
-	}
-	*out_avg = avg / datalen;
-	*out_min = min;
-	*out_max = max;
-}
-#endif
+	ran = task_dbuffer_swap_and_run(server_tasks);
+	mutex_lock(&server_stats_mtx);
+	server_tasks_ran += ran;
+	mutex_unlock(&server_stats_mtx);
+	// wrap and send everything that was queued until now
+	outbuf_wrap_flush();
+}
 
-void game_run(void){
+/* TASK BUDGET */
+static void shard_defer_task(struct game_shard *shard, struct task *task){
+	struct deferred_task *dt;
+	uint32 old_capacity, tail;
+	if(shard->deferred_count >= shard->deferred_capacity){
+		// double the capacity and move the wrapped
+		// part of the ring to the new space
+		old_capacity = shard->deferred_capacity;
+		shard->deferred_capacity = old_capacity * 2;
+		shard->deferred = kpl_realloc(shard->deferred,
+			sizeof(struct deferred_task) * shard->deferred_capacity);
+		if(shard->deferred_head > 0){
+			memcpy(&shard->deferred[old_capacity], &shard->deferred[0],
+				sizeof(struct deferred_task) * shard->deferred_head);
+		}
+	}
+	tail = (shard->deferred_head + shard->deferred_count)
+		& (shard->deferred_capacity - 1);
+	dt = &shard->deferred[tail];
+	dt->fp = task->fp;
+	dt->arg = task->arg;
+	dt->frame = shard->frame;
+	shard->deferred_count += 1;
+}
+
+static uint32 shard_run_tasks(struct game_shard *shard,
+		int64 deadline, struct frame_record *rec){
+	struct deferred_task *dt;
+	struct task *tasks;
+	void (*fp)(void*);
+	void *arg;
+	int64 start;
+	uint32 count, ran;
+
+	// high and normal priority tasks always run
+	ran = task_dbuffer_swap_and_run(shard->tasks[GAME_TASK_HIGH]);
+	ran += task_dbuffer_swap_and_run(shard->tasks[GAME_TASK_NORMAL]);
+
+	// queue new low priority tasks behind the ones that
+	// were carried over and run them in order while there
+	// is time left (or they're too old to be deferred)
+	count = task_dbuffer_swap(shard->tasks[GAME_TASK_LOW], &tasks);
+	for(uint32 i = 0; i < count; i += 1)
+		shard_defer_task(shard, &tasks[i]);
+	while(shard->deferred_count > 0){
+		dt = &shard->deferred[shard->deferred_head];
+		if((shard->frame - dt->frame) >= max_task_deferral)
+			rec->promoted_tasks += 1;
+		else if(kpl_clock_monotonic_nsec() >= deadline)
+			break;
+		fp = dt->fp;
+		arg = dt->arg;
+		shard->deferred_head = (shard->deferred_head + 1)
+			& (shard->deferred_capacity - 1);
+		shard->deferred_count -= 1;
+
+		start = trace_begin();
+		fp(arg);
+		trace_end(TRACE_CAT_TASK, (void*)fp, start);
+		ran += 1;
+	}
+	rec->deferred_tasks = shard->deferred_count;
+	shard->frame += 1;
+	return ran;
+}
+
+static void shard_report_frame_stats(struct game_shard *shard, int64 now){
+	if(frame_report_interval <= 0 || now < shard->next_report)
+		return;
+	frame_profiler_report(&shard->profiler, &shard->clock.stats);
+	frame_clock_reset_stats(&shard->clock);
+	// the main shard also reports all task queues,
+	// password checks and the database
+	if(shard->id == 0){
+		task_queue_report();
+		password_report();
+		db_stats_report();
+	}
+	shard->next_report = now + frame_report_interval;
+}
+
+static void shard_run(struct game_shard *shard){
 	int64 frame_start;
 	int64 frame_end;
-	int64 next_frame;
-	while(1){
-		// calculate frame times so each frame takes the
-		// same time to complete (in a perfect scenario)
-		frame_start = kpl_clock_monotonic_msec();
-		next_frame = frame_start + GAME_FRAME_INTERVAL;
+	struct frame_record rec;
+	char name[32];
+	snprintf(name, sizeof(name), "game shard %u", shard->id);
+	trace_thread_name(name);
+	current_shard = shard->id;
+	cont_set_thread_domain(CONT_DOMAIN_GAME);
+	frame_clock_init(&shard->clock, frame_interval,
+		frame_overrun_policy, frame_max_catchup);
+	frame_profiler_init(&shard->profiler, shard->id,
+		frame_interval, frame_profiler_history);
+	frame_end = kpl_clock_monotonic_nsec();
+	shard->next_report = frame_end + frame_report_interval;
+	while(game_running()){
+		// stall until the next frame is due
+		frame_clock_wait(&shard->clock);
+		frame_start = kpl_clock_monotonic_nsec();
 
 		// do work
-		server_exec(server_maintenance_routine, NULL);
-		task_dbuffer_swap_and_run(game_tasks);
-
-		// stall until the next frame if we finished too early
-		frame_end = kpl_clock_monotonic_msec();
-		if(frame_end < next_frame)
-			kpl_sleep_msec(next_frame - frame_end);
-
-#ifdef BUILD_DEBUG
-		// calc frame statistics
-		#define GAME_MAX_FPS (1000/GAME_FRAME_INTERVAL + 1)
-		static int64 frame_user_time[GAME_MAX_FPS];
-		static int64 frame_idle_time[GAME_MAX_FPS];
-		static int num_frames = 0;
-		if(num_frames >= GAME_MAX_FPS){
-			int64 avg, min, max;
-			DEBUG_LOG("frame stats over %d frames", num_frames);
-			calc_stats(frame_user_time, num_frames, &avg, &min, &max);
-			DEBUG_LOG("    user time: (avg = %lld, min = %lld, max = %lld)", avg, min, max);
-			calc_stats(frame_idle_time, num_frames, &avg, &min, &max);
-			DEBUG_LOG("    idle time: (avg = %lld, min = %lld, max = %lld)", avg, min, max);
-			num_frames = 0;
+		memset(&rec, 0, sizeof(struct frame_record));
+		if(shard->id == 0){
+			mutex_lock(&server_stats_mtx);
+			rec.server_tasks = server_tasks_ran;
+			server_tasks_ran = 0;
+			mutex_unlock(&server_stats_mtx);
+			server_exec(server_maintenance_routine, NULL);
 		}
-		frame_user_time[num_frames] = frame_end - frame_start;
-		frame_idle_time[num_frames] = next_frame - frame_end;
-		num_frames += 1;
-#endif
+		rec.game_tasks = shard_run_tasks(shard,
+			frame_start + frame_budget, &rec);
+		if(shard->id == 0)
+			player_save_update();
+
+		// idle time is the time spent waiting since the last frame
+		rec.start = frame_start;
+		rec.idle_time = frame_start - frame_end;
+		frame_end = kpl_clock_monotonic_nsec();
+		rec.user_time = frame_end - frame_start;
+		frame_profiler_add(&shard->profiler, &rec);
+		shard_report_frame_stats(shard, frame_end);
 	}
 }
+static void *shard_thread(void *arg){
+	shard_run(arg);
+	return NULL;
+}
+
+// runs whatever is left on the shard's queues (including the
+// deferred low priority tasks) so their arguments are released
+static uint32 shard_drain(struct game_shard *shard){
+	struct deferred_task *dt;
+	struct task *tasks;
+	uint32 count, ran;
+	ran = task_dbuffer_swap_and_run(shard->tasks[GAME_TASK_HIGH]);
+	ran += task_dbuffer_swap_and_run(shard->tasks[GAME_TASK_NORMAL]);
+	count = task_dbuffer_swap(shard->tasks[GAME_TASK_LOW], &tasks);
+	for(uint32 i = 0; i < count; i += 1)
+		shard_defer_task(shard, &tasks[i]);
+	while(shard->deferred_count > 0){
+		dt = &shard->deferred[shard->deferred_head];
+		shard->deferred_head = (shard->deferred_head + 1)
+			& (shard->deferred_capacity - 1);
+		shard->deferred_count -= 1;
+		dt->fp(dt->arg);
+		ran += 1;
+	}
+	return ran;
+}
+
+static void shard_cleanup(struct game_shard *shard){
+	for(int i = 0; i < GAME_TASK_NUM_PRIORITIES; i += 1){
+		task_dbuffer_destroy(shard->tasks[i]);
+		shard->tasks[i] = NULL;
+	}
+	kpl_free(shard->deferred);
+	shard->deferred = NULL;
+}
+
+static void shard_init(struct game_shard *shard, uint32 id, uint32 count){
+	static const char *prio_names[GAME_TASK_NUM_PRIORITIES] = {
+		"high", "normal", "low",
+	};
+	char name[TASK_QUEUE_MAX_NAME];
+	// split the map into `count` vertical strips
+	uint32 width = (UINT16_MAX + 1) / count;
+	memset(shard, 0, sizeof(struct game_shard));
+	shard->id = id;
+	shard->rect.x0 = (uint16)(id * width);
+	shard->rect.x1 = (id + 1 == count) ? UINT16_MAX
+		: (uint16)((id + 1) * width);
+	shard->rect.y0 = 0;
+	shard->rect.y1 = UINT16_MAX;
+	for(int i = 0; i < GAME_TASK_NUM_PRIORITIES; i += 1){
+		snprintf(name, sizeof(name), "shard %u %s", id, prio_names[i]);
+		shard->tasks[i] = task_dbuffer_create(name,
+			MAX_GAME_TASKS, MAX_GAME_TASKS_OVERFLOW);
+	}
+	shard->deferred_capacity = MIN_DEFERRED_TASKS;
+	shard->deferred = kpl_malloc(sizeof(struct deferred_task)
+		* shard->deferred_capacity);
+}
+
+static bool load_frame_config(void){
+	const char *policy = config_get("frame_overrun_policy");
+	float interval = config_getf("tick_interval");
+	float budget;
+	int max_deferral;
+	if(interval < GAME_MIN_FRAME_INTERVAL || interval > GAME_MAX_FRAME_INTERVAL){
+		LOG_ERROR("game_init: invalid tick interval (%f)"
+			" (should be within [%f, %f] ms)", interval,
+			GAME_MIN_FRAME_INTERVAL, GAME_MAX_FRAME_INTERVAL);
+		return false;
+	}
+	if(!frame_overrun_policy_from_string(policy, &frame_overrun_policy)){
+		LOG_ERROR("game_init: invalid frame overrun policy `%s`"
+			" (should be skip, catchup or stretch)", policy);
+		return false;
+	}
+	frame_interval = (int64)((double)interval * 1000000.0);
+	frame_max_catchup = config_geti("frame_max_catchup");
+	frame_report_interval = (int64)config_geti("frame_report_interval") * 1000000000;
+	frame_profiler_history = config_geti("frame_profiler_history");
+	if(frame_profiler_history < 0 || frame_profiler_history > FRAME_PROFILER_MAX_HISTORY){
+		LOG_ERROR("game_init: invalid frame profiler history (%d)"
+			" (should be within [0, %d])", frame_profiler_history,
+			FRAME_PROFILER_MAX_HISTORY);
+		return false;
+	}
+
+	budget = config_getf("game_frame_budget");
+	if(budget <= 0.0f){
+		LOG_ERROR("game_init: invalid frame budget (%f)", budget);
+		return false;
+	}else if(budget > interval){
+		LOG_WARNING("game_init: frame budget (%f) is larger than"
+			" the tick interval (%f)", budget, interval);
+		budget = interval;
+	}
+	frame_budget = (int64)((double)budget * 1000000.0);
+	max_deferral = config_geti("game_max_task_deferral");
+	if(max_deferral < 0){
+		LOG_ERROR("game_init: invalid max task deferral (%d)",
+			max_deferral);
+		return false;
+	}
+	max_task_deferral = (uint64)max_deferral;
+	return true;
+}
+
+bool game_init(void){
+	int count = config_geti("game_shards");
+	if(count < 1 || count > GAME_MAX_SHARDS){
+		LOG_ERROR("game_init: invalid number of shards (%d)"
+			" (should be within [1, %d])", count, GAME_MAX_SHARDS);
+		return false;
+	}
+	if(!load_frame_config())
+		return false;
+
+	mutex_init(&running_mtx);
+	mutex_init(&route_mtx);
+	mutex_init(&server_stats_mtx);
+	server_tasks_ran = 0;
+	memset(routes, 0, sizeof(routes));
+	server_tasks = task_dbuffer_create("server",
+		MAX_SERVER_TASKS, MAX_SERVER_TASKS_OVERFLOW);
+	num_shards = (uint32)count;
+	for(uint32 i = 0; i < num_shards; i += 1)
+		shard_init(&shards[i], i, num_shards);
+
+	// the main shard will run on the thread that calls `game_run`
+	// but the other shards need to be started here
+	running = true;
+	for(uint32 i = 1; i < num_shards; i += 1){
+		if(thread_init(&shards[i].thr, shard_thread, &shards[i]) != 0){
+			LOG_ERROR("game_init: failed to start shard %u", i);
+			mutex_lock(&running_mtx);
+			running = false;
+			mutex_unlock(&running_mtx);
+			for(uint32 j = 1; j < i; j += 1)
+				thread_join(&shards[j].thr, NULL);
+			for(uint32 j = 0; j < num_shards; j += 1)
+				shard_cleanup(&shards[j]);
+			task_dbuffer_destroy(server_tasks);
+			mutex_destroy(&server_stats_mtx);
+			mutex_destroy(&route_mtx);
+			mutex_destroy(&running_mtx);
+			num_shards = 0;
+			return false;
+		}
+	}
+	return true;
+}
+
+void game_shutdown(void){
+	uint32 prev_shard = current_shard;
+	uint32 ran;
+	mutex_lock(&running_mtx);
+	running = false;
+	mutex_unlock(&running_mtx);
+	for(uint32 i = 1; i < num_shards; i += 1)
+		thread_join(&shards[i].thr, NULL);
+
+	// tasks still queued are run here (as if they were on their
+	// shard) and any task they add from now on fails right away
+	// like it would on other queues that were shut down
+	for(uint32 i = 0; i < num_shards; i += 1){
+		for(int j = 0; j < GAME_TASK_NUM_PRIORITIES; j += 1)
+			task_dbuffer_set_inactive(shards[i].tasks[j]);
+	}
+	task_dbuffer_set_inactive(server_tasks);
+	ran = 0;
+	for(uint32 i = 0; i < num_shards; i += 1){
+		current_shard = i;
+		ran += shard_drain(&shards[i]);
+	}
+	current_shard = prev_shard;
+	if(ran > 0)
+		LOG("game_shutdown: ran %u tasks left on the shards", ran);
+
+	for(uint32 i = 0; i < num_shards; i += 1)
+		shard_cleanup(&shards[i]);
+	task_dbuffer_destroy(server_tasks);
+	mutex_destroy(&server_stats_mtx);
+	mutex_destroy(&route_mtx);
+	mutex_destroy(&running_mtx);
+	num_shards = 0;
+}
+
+void game_run(void){
+	shard_run(&shards[0]);
+}
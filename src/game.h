@@ -3,9 +3,102 @@
 
 #include "common.h"
 
+// game shards
+//	NOTES:
+//	- The world map is split into vertical strips along the x
+//	axis and each strip (shard) is owned by a single game thread
+//	with its own task queue and frame loop.
+//	- Shard 0 is the main shard. It runs on the thread that calls
+//	`game_run` and is the only one that flushes server tasks.
+//	- Any state owned by a shard should only be touched by tasks
+//	running on that shard. Talking to another shard is done by
+//	posting tasks to it.
+#define GAME_MAX_SHARDS 8
+
+struct game_shard_rect{
+	// [x0, x1) x [y0, y1) on every floor
+	uint16 x0, y0;
+	uint16 x1, y1;
+};
+
+// task priorities
+//	- High and normal priority tasks always run on the frame after
+//	they were queued. Anything that must stay on time (movement,
+//	combat, shard handoffs) should be high priority.
+//	- Low priority tasks (look requests, channel lists, ...) only run
+//	while the frame is within its budget (`game_frame_budget`) and
+//	the rest is carried over to the next frame. Tasks that have been
+//	carried over for `game_max_task_deferral` frames are promoted and
+//	will run regardless of the budget.
+typedef enum game_task_priority{
+	GAME_TASK_HIGH = 0,
+	GAME_TASK_NORMAL,
+	GAME_TASK_LOW,
+	GAME_TASK_NUM_PRIORITIES,
+} game_task_priority_t;
+
+// `game_current_shard` returns the shard running on the calling
+// thread (or GAME_NO_SHARD if it's not a game thread)
+#define GAME_NO_SHARD 0xFFFFFFFF
+uint32 game_shard_count(void);
+uint32 game_current_shard(void);
+uint32 game_shard_at(uint16 x, uint16 y);
+void game_shard_rect(uint32 shard, struct game_shard_rect *out_rect);
+bool game_shard_add_task(uint32 shard, void (*fp)(void*), void *arg);
+bool game_shard_add_task_prio(uint32 shard, game_task_priority_t prio,
+		void (*fp)(void*), void *arg);
+bool game_shard_try_add_task_prio(uint32 shard, game_task_priority_t prio,
+		void (*fp)(void*), void *arg);
+// `arg` is copied into a new allocation for each shard and each
+// copy is owned by the task that receives it (must be kpl_free'd)
+bool game_shard_broadcast(void (*fp)(void*), const void *arg, size_t argsize);
+
+// connection routing
+//	- Game connections are routed to the shard that owns the
+//	player's position once the player is loaded (see protocol_game.c)
+//	and unrouted when they close. Connections that aren't routed
+//	belong to the main shard.
+//	- Tasks added with `game_try_add_connection_task` will run on the
+//	shard that owns the connection at the time they're executed. If
+//	the connection changes owners while the task is in flight, the
+//	task will be forwarded to the new owner.
+//	- Tasks of the same priority and connection run in the order
+//	they were added, even across handoffs. Tasks added right after
+//	a handoff wait on the new owner until the ones that were still
+//	queued on the old owner are forwarded and run.
+//	- Adding a connection task never blocks (see below). It fails
+//	right away if the owner's queue is full.
+void game_route_connection(uint32 connection, uint32 shard);
+void game_unroute_connection(uint32 connection);
+uint32 game_connection_shard(uint32 connection);
+bool game_try_add_connection_task(uint32 connection, void (*fp)(void*), void *arg);
+bool game_try_add_connection_task_prio(uint32 connection, game_task_priority_t prio,
+		void (*fp)(void*), void *arg);
+
+// shard handoff
+//	- Should be called from the shard `from` after the creature has
+//	been removed from its map. `on_arrive` will run on the shard `to`
+//	and should insert the creature into the new map region. If the
+//	creature is controlled by a connection, it will be routed to the
+//	new shard before any of its later tasks get to run there.
+bool game_shard_handoff(uint32 from, uint32 to, uint32 connection,
+		void (*on_arrive)(void*), void *creature);
+
+// these will add tasks to the main shard
 bool game_add_task(void (*fp)(void*), void *arg);
+bool game_add_task_prio(game_task_priority_t prio, void (*fp)(void*), void *arg);
 bool game_add_server_task(void (*fp)(void*), void *arg);
 
+// non blocking adds
+//	- The `game_add_*` functions block while the queue is full until
+//	the shard (or the server thread) swaps it. Threads other than the
+//	shards (the server thread, database workers, the worker pool,
+//	password threads) must use the `game_try_add_*` versions instead,
+//	which fail right away, and drop whatever they were posting (or
+//	close its connection) when they do.
+bool game_try_add_task(void (*fp)(void*), void *arg);
+bool game_try_add_server_task(void (*fp)(void*), void *arg);
+
 bool game_init(void);
 void game_shutdown(void);
 void game_run(void);
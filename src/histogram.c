@@ -0,0 +1,78 @@
+#include "histogram.h"
+
+static INLINE uint32 bucket_index(uint64 value){
+	int shift;
+	if(value < HISTOGRAM_SUB_COUNT)
+		return (uint32)value;
+	// `value >> shift` will be in [SUB_COUNT, 2*SUB_COUNT)
+	shift = (63 - _CLZ64(value)) - HISTOGRAM_SUB_BITS;
+	return (uint32)((shift + 1) * HISTOGRAM_SUB_COUNT
+		+ ((value >> shift) - HISTOGRAM_SUB_COUNT));
+}
+
+// highest value that falls into bucket `idx`
+static INLINE uint64 bucket_upper_bound(uint32 idx){
+	uint32 group = idx / HISTOGRAM_SUB_COUNT;
+	uint64 sub = idx % HISTOGRAM_SUB_COUNT;
+	if(group == 0)
+		return sub;
+	return ((HISTOGRAM_SUB_COUNT + sub + 1) << (group - 1)) - 1;
+}
+
+void histogram_reset(struct histogram *h){
+	memset(h, 0, sizeof(struct histogram));
+}
+
+void histogram_add(struct histogram *h, uint64 value){
+	if(h->count == 0 || value < h->min)
+		h->min = value;
+	if(h->count == 0 || value > h->max)
+		h->max = value;
+	h->count += 1;
+	h->sum += value;
+	h->buckets[bucket_index(value)] += 1;
+}
+
+void histogram_merge(struct histogram *dst, struct histogram *src){
+	if(src->count == 0)
+		return;
+	if(dst->count == 0 || src->min < dst->min)
+		dst->min = src->min;
+	if(dst->count == 0 || src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for(int i = 0; i < HISTOGRAM_NUM_BUCKETS; i += 1)
+		dst->buckets[i] += src->buckets[i];
+}
+
+uint64 histogram_mean(struct histogram *h){
+	if(h->count == 0)
+		return 0;
+	return h->sum / h->count;
+}
+
+uint64 histogram_percentile(struct histogram *h, double p){
+	uint64 rank, seen;
+	if(h->count == 0)
+		return 0;
+	if(p <= 0.0)
+		return h->min;
+	if(p >= 100.0)
+		return h->max;
+	// rank of the value we're looking for (1-based)
+	rank = (uint64)((p / 100.0) * (double)h->count + 0.5);
+	if(rank == 0)
+		rank = 1;
+	seen = 0;
+	for(uint32 i = 0; i < HISTOGRAM_NUM_BUCKETS; i += 1){
+		seen += h->buckets[i];
+		if(seen >= rank){
+			// don't report anything outside the
+			// range of values actually added
+			uint64 value = bucket_upper_bound(i);
+			return MIN(value, h->max);
+		}
+	}
+	return h->max;
+}
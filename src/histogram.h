@@ -0,0 +1,34 @@
+#ifndef KAPLAR_HISTOGRAM_H_
+#define KAPLAR_HISTOGRAM_H_ 1
+
+#include "common.h"
+
+// histogram
+//	NOTES:
+//	- Log-linear buckets (HDR style): values under 32 get their own
+//	bucket and every power of two after that is split into 32 linear
+//	buckets which keeps the relative error under ~3% for any value.
+//	- Adding a value is O(1) and the histogram has a fixed size so
+//	it's cheap enough to be always on.
+//	- It's not thread safe.
+
+#define HISTOGRAM_SUB_BITS	5
+#define HISTOGRAM_SUB_COUNT	(1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_NUM_BUCKETS	((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram{
+	uint64 count;
+	uint64 sum;
+	uint64 min;
+	uint64 max;
+	uint32 buckets[HISTOGRAM_NUM_BUCKETS];
+};
+
+void histogram_reset(struct histogram *h);
+void histogram_add(struct histogram *h, uint64 value);
+void histogram_merge(struct histogram *dst, struct histogram *src);
+uint64 histogram_mean(struct histogram *h);
+// `p` is in the range [0, 100]
+uint64 histogram_percentile(struct histogram *h, double p);
+
+#endif //KAPLAR_HISTOGRAM_H_
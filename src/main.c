@@ -1,9 +1,16 @@
+#include "account_cache.h"
 #include "config.h"
 #include "common.h"
+#include "cont.h"
 #include "log.h"
 #include "game.h"
 #include "outbuf.h"
+#include "password.h"
+#include "player_save.h"
+#include "task.h"
 #include "tibia_rsa.h"
+#include "trace.h"
+#include "worker_pool.h"
 
 #include "server/server.h"
 #include "db/database.h"
@@ -34,11 +41,20 @@ int main(int argc, char **argv){
 		LOG_WARNING("running with default config");
 
 	// init support systems
+	init_system("trace", trace_init, trace_shutdown);
+	init_system("task", task_init, task_shutdown);
+	init_system("worker_pool", worker_pool_init, worker_pool_shutdown);
+	init_system("password", password_init, password_shutdown);
 	init_system("outbuf", outbuf_init, outbuf_shutdown);
+	init_system("cont", cont_init, cont_shutdown);
 	init_system("tibia_rsa", tibia_rsa_init, tibia_rsa_shutdown);
+	init_system("account_cache", account_cache_init, account_cache_shutdown);
 
 	// init database thread
+	init_system("db_stats", db_stats_init, db_stats_shutdown);
 	init_system("database", db_init, db_shutdown);
+	// must shutdown before the database to flush any pending saves
+	init_system("player_save", player_save_init, player_save_shutdown);
 
 	// init network thread
 	extern struct protocol protocol_echo;
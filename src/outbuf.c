@@ -1,18 +1,47 @@
 #include "outbuf.h"
 #include "buffer_util.h"
 #include "thread.h"
+#include "worker_pool.h"
+#include "crypto/xtea.h"
 
 /* outbuf list control */
 static mutex_t outbuf_mtx;
 static int32 outbuf_list_size = 0;
 static struct outbuf *outbuf_head = NULL;
 
+/* wrap stage control */
+struct wrap_item{
+	struct outbuf *buf;
+	uint32 xtea[4];
+	uint32 connection;
+	void (*on_wrapped)(uint32, struct outbuf*);
+};
+
+struct wrap_list{
+	int count;
+	int capacity;
+	struct wrap_item *items;
+};
+
+static mutex_t wrap_mtx;
+static struct wrap_list wrap_pending;
+static struct wrap_list wrap_flushing;
+
 bool outbuf_init(void){
 	mutex_init(&outbuf_mtx);
+	mutex_init(&wrap_mtx);
 	return true;
 }
 
 void outbuf_shutdown(void){
+	// whatever was queued after the last flush is dropped
+	for(int i = 0; i < wrap_pending.count; i += 1)
+		kpl_free(wrap_pending.items[i].buf);
+	kpl_free(wrap_pending.items);
+	kpl_free(wrap_flushing.items);
+	memset(&wrap_pending, 0, sizeof(struct wrap_list));
+	memset(&wrap_flushing, 0, sizeof(struct wrap_list));
+	mutex_destroy(&wrap_mtx);
 	mutex_destroy(&outbuf_mtx);
 }
 
@@ -78,3 +107,123 @@ void outbuf_write_lstr(struct outbuf *buf, const char *s, int len){
 	if(len > 0) memcpy(buf->ptr + 2, s, len);
 	buf->ptr += total;
 }
+
+/* wrap stage */
+//	- The queued buffers are split into about one chunk per thread
+//	with roughly the same number of bytes. Small flushes aren't worth
+//	waking up the workers for and run in a single chunk.
+#define WRAP_MIN_CHUNK_LEN 16384
+#define WRAP_MAX_CHUNKS (WORKER_POOL_MAX_THREADS + 1)
+
+struct wrap_job{
+	struct wrap_item *items;
+	struct xtea_buffer *xbufs;
+	int bounds[WRAP_MAX_CHUNKS + 1];
+};
+
+void outbuf_wrap_add(struct outbuf *buf, const uint32 *xtea,
+		uint32 connection, void (*on_wrapped)(uint32, struct outbuf*)){
+	struct wrap_item *item;
+	DEBUG_ASSERT(buf->ptr >= buf->base + 8);
+	mutex_lock(&wrap_mtx);
+	if(wrap_pending.count >= wrap_pending.capacity){
+		wrap_pending.capacity = MAX(wrap_pending.capacity * 2, 64);
+		wrap_pending.items = kpl_realloc(wrap_pending.items,
+			sizeof(struct wrap_item) * wrap_pending.capacity);
+	}
+	item = &wrap_pending.items[wrap_pending.count];
+	wrap_pending.count += 1;
+	item->buf = buf;
+	memcpy(item->xtea, xtea, sizeof(item->xtea));
+	item->connection = connection;
+	item->on_wrapped = on_wrapped;
+	mutex_unlock(&wrap_mtx);
+}
+
+static void wrap_chunk(void *arg, int chunk){
+	struct wrap_job *job = arg;
+	int first = job->bounds[chunk];
+	int last = job->bounds[chunk + 1];
+	struct outbuf *buf;
+	uint8 *data;
+	uint32 datalen;
+	int padding;
+
+	// pad and set the inner length
+	for(int i = first; i < last; i += 1){
+		buf = job->items[i].buf;
+		data = buf->base + 6;
+		datalen = (uint32)(buf->ptr - data);
+		padding = (8 - (datalen & 7)) & 7;
+		encode_u16_le(data, (uint16)(datalen - 2));
+		while(padding-- > 0)
+			outbuf_write_byte(buf, 0x33);
+		job->xbufs[i].key = job->items[i].xtea;
+		job->xbufs[i].data = data;
+		job->xbufs[i].len = (size_t)(buf->ptr - data);
+	}
+
+	xtea_encode_many(&job->xbufs[first], last - first);
+
+	// add message headers
+	for(int i = first; i < last; i += 1){
+		buf = job->items[i].buf;
+		datalen = (uint32)job->xbufs[i].len;
+		encode_u16_le(buf->base, (uint16)(datalen + 4));
+		encode_u32_le(buf->base + 2,
+			adler32(job->xbufs[i].data, datalen));
+	}
+}
+
+void outbuf_wrap_flush(void){
+	struct wrap_list tmp;
+	struct wrap_job job;
+	struct wrap_item *items;
+	size_t total, per_chunk, acc;
+	int count, chunks, c;
+
+	mutex_lock(&wrap_mtx);
+	tmp = wrap_pending;
+	wrap_pending = wrap_flushing;
+	wrap_pending.count = 0;
+	wrap_flushing = tmp;
+	mutex_unlock(&wrap_mtx);
+
+	count = wrap_flushing.count;
+	items = wrap_flushing.items;
+	if(count == 0)
+		return;
+
+	total = 0;
+	for(int i = 0; i < count; i += 1)
+		total += outbuf_len(items[i].buf);
+	chunks = (int)(total / WRAP_MIN_CHUNK_LEN);
+	chunks = MIN(chunks, worker_pool_size() + 1);
+	chunks = MIN(chunks, count);
+	if(chunks < 1)
+		chunks = 1;
+
+	// split at buffer boundaries every `per_chunk` bytes
+	job.items = items;
+	job.xbufs = kpl_malloc(sizeof(struct xtea_buffer) * count);
+	per_chunk = (total + chunks - 1) / chunks;
+	job.bounds[0] = 0;
+	acc = 0; c = 1;
+	for(int i = 0; i < count - 1 && c < chunks; i += 1){
+		acc += outbuf_len(items[i].buf);
+		if(acc >= per_chunk * c){
+			job.bounds[c] = i + 1;
+			c += 1;
+		}
+	}
+	// large buffers may leave less chunks than planned
+	chunks = c;
+	job.bounds[chunks] = count;
+
+	worker_pool_parallel(wrap_chunk, &job, chunks);
+	kpl_free(job.xbufs);
+
+	for(int i = 0; i < count; i += 1)
+		items[i].on_wrapped(items[i].connection, items[i].buf);
+	wrap_flushing.count = 0;
+}
@@ -41,4 +41,21 @@ void outbuf_write_u32(struct outbuf *buf, uint32 val);
 void outbuf_write_str(struct outbuf *buf, const char *s);
 void outbuf_write_lstr(struct outbuf *buf, const char *s, int len);
 
+// wrap stage
+//	NOTES:
+//	- Messages are written after an 8 bytes header (see
+//	`outbuf_prepare`). Wrapping pads, xtea encodes and checksums the
+//	message and fills in the header.
+//	- `outbuf_wrap_add` only queues the buffer (it's thread safe and
+//	copies the key). `outbuf_wrap_flush` runs on the server thread once
+//	per frame, wraps everything that was queued in a single pass over
+//	the worker pool (mixing connections so the xtea lanes are filled)
+//	and then calls each `on_wrapped` on the server thread.
+static INLINE void outbuf_prepare(struct outbuf *buf){
+	buf->ptr = buf->base + 8;
+}
+void outbuf_wrap_add(struct outbuf *buf, const uint32 *xtea,
+	uint32 connection, void (*on_wrapped)(uint32, struct outbuf*));
+void outbuf_wrap_flush(void);
+
 #endif //KAPLAR_OUTBUF_H_
@@ -0,0 +1,160 @@
+#include "password.h"
+#include "config.h"
+#include "cont.h"
+#include "histogram.h"
+#include "log.h"
+#include "task_rbuffer.h"
+#include "thread.h"
+#include "trace.h"
+
+#include <stdio.h>
+
+static struct task_rbuffer *tasks;
+static int num_threads;
+static thread_t threads[PASSWORD_MAX_THREADS];
+static int cost;
+
+// stats for the current report window (see `password_report`)
+static struct{
+	mutex_t mtx;
+	uint64 failed;
+	uint64 rehashed;
+	struct histogram time;
+} stats;
+
+static void *password_thread(void *arg){
+	char name[32];
+	snprintf(name, sizeof(name), "password %d", (int)(intptr_t)arg);
+	trace_thread_name(name);
+	cont_set_thread_domain(CONT_DOMAIN_PASSWORD);
+	while(task_rbuffer_run_one(tasks))
+		continue;
+	return NULL;
+}
+
+static void stop_threads(int count){
+	// this will make `task_rbuffer_run_one()` return false
+	task_rbuffer_set_inactive(tasks);
+	for(int i = 0; i < count; i += 1)
+		thread_join(&threads[i], NULL);
+}
+
+bool password_init(void){
+	int count = config_geti("password_threads");
+	int max_queued = config_geti("password_max_queued");
+	cost = config_geti("password_cost");
+	if(count < 1 || count > PASSWORD_MAX_THREADS){
+		LOG_ERROR("password_init: invalid number of threads (%d)"
+			" (should be within [1, %d])", count, PASSWORD_MAX_THREADS);
+		return false;
+	}
+	if(max_queued <= 0 || !IS_POWER_OF_TWO(max_queued)){
+		LOG_ERROR("password_init: `password_max_queued` must be"
+			" a power of two (%d)", max_queued);
+		return false;
+	}
+	if(cost < 4 || cost > 31){
+		LOG_ERROR("password_init: invalid cost (%d)"
+			" (should be within [4, 31])", cost);
+		return false;
+	}
+
+	mutex_init(&stats.mtx);
+	stats.failed = 0;
+	stats.rehashed = 0;
+	histogram_reset(&stats.time);
+
+	// no overflow: the queue size is the limit
+	tasks = task_rbuffer_create("password", max_queued, 0);
+	for(num_threads = 0; num_threads < count; num_threads += 1){
+		if(thread_init(&threads[num_threads], password_thread,
+				(void*)(intptr_t)num_threads) != 0){
+			LOG_ERROR("password_init: failed to start thread %d",
+				num_threads);
+			stop_threads(num_threads);
+			task_rbuffer_destroy(tasks);
+			mutex_destroy(&stats.mtx);
+			num_threads = 0;
+			return false;
+		}
+	}
+	return true;
+}
+
+void password_shutdown(void){
+	stop_threads(num_threads);
+	task_rbuffer_destroy(tasks);
+	mutex_destroy(&stats.mtx);
+	num_threads = 0;
+}
+
+bool password_add_task(void (*fp)(void*), void *arg){
+	return task_rbuffer_try_push(tasks, fp, arg);
+}
+
+void password_report(void){
+	mutex_lock(&stats.mtx);
+	if(stats.time.count > 0){
+		LOG("password: %llu checks (%llu failed, %llu rehashed)"
+			" at cost %d", stats.time.count, stats.failed,
+			stats.rehashed, cost);
+		LOG("    %-6s p50 = %lluus, p90 = %lluus, p99 = %lluus,"
+			" max = %lluus", "check",
+			histogram_percentile(&stats.time, 50.0) / 1000,
+			histogram_percentile(&stats.time, 90.0) / 1000,
+			histogram_percentile(&stats.time, 99.0) / 1000,
+			stats.time.max / 1000);
+	}
+	// start a new report window
+	stats.failed = 0;
+	stats.rehashed = 0;
+	histogram_reset(&stats.time);
+	mutex_unlock(&stats.mtx);
+}
+
+/* HASHING */
+bool password_hash(const char *password, char *hash, size_t hashlen){
+	if(!bcrypt_newhash(password, cost, hash, hashlen)){
+		LOG_ERROR("password_hash: failed to hash password");
+		return false;
+	}
+	return true;
+}
+
+// compares the whole string no matter where the
+// first difference is
+static bool plaintext_cmp(const char *password, const char *stored){
+	size_t len = strlen(password);
+	int res = 0;
+	if(len != strlen(stored))
+		return false;
+	for(size_t i = 0; i < len; i += 1)
+		res |= password[i] ^ stored[i];
+	return res == 0;
+}
+
+bool password_check(const char *password, const char *stored,
+		char *rehash, size_t rehashlen){
+	int64 start = kpl_clock_monotonic_nsec();
+	int stored_cost = bcrypt_hash_cost(stored);
+	bool ok;
+
+	rehash[0] = 0;
+	if(stored_cost < 0){
+		// plaintext (from before passwords were hashed)
+		ok = stored[0] != 0 && plaintext_cmp(password, stored);
+	}else{
+		ok = bcrypt_checkpass(password, stored);
+	}
+	if(ok && stored_cost < cost && !password_hash(password, rehash, rehashlen))
+		rehash[0] = 0;
+
+	mutex_lock(&stats.mtx);
+	if(!ok)
+		stats.failed += 1;
+	if(rehash[0] != 0)
+		stats.rehashed += 1;
+	histogram_add(&stats.time, kpl_clock_monotonic_nsec() - start);
+	mutex_unlock(&stats.mtx);
+	return ok;
+}
@@ -0,0 +1,43 @@
+#ifndef KAPLAR_PASSWORD_H_
+#define KAPLAR_PASSWORD_H_ 1
+
+#include "common.h"
+#include "crypto/bcrypt.h"
+
+// password hashing
+//	NOTES:
+//	- Passwords are stored as bcrypt hashes with a cost (log2 of
+//	the rounds) of `password_cost`. Each step up doubles the time a
+//	check takes.
+//	- bcrypt is slow on purpose so checks run on their own threads
+//	(`password_threads`). On the database workers they'd stall every
+//	query behind them and on the worker pool they'd delay the short
+//	crypto tasks (like the RSA decoding of other logins).
+//	- Continuations get there with `CONT_AWAIT(k, CONT_DOMAIN_PASSWORD)`.
+//	At most `password_max_queued` of them may be waiting (a power of
+//	two). Above that the await fails right away, so a login flood is
+//	turned away instead of piling up behind the hashes.
+//	- The queue depth is listed with the other task queues (see
+//	`task_queue_report`) and `password_report` logs how many checks
+//	ran and how long they took. Compare both against the login rate
+//	when tuning `password_cost`.
+//	- `password_check` also accepts plaintext passwords (rows from
+//	before hashing was enabled). If it returns true and `rehash`
+//	isn't empty, the stored password should be replaced with it.
+//	This happens when the stored password is in plaintext or it was
+//	hashed with a lower cost than `password_cost`.
+//	- `password_hash` and `password_check` can run on any thread but
+//	should only be called from the password threads.
+
+#define PASSWORD_MAX_THREADS 16
+
+bool password_init(void);
+void password_shutdown(void);
+bool password_add_task(void (*fp)(void*), void *arg);
+void password_report(void);
+
+bool password_hash(const char *password, char *hash, size_t hashlen);
+bool password_check(const char *password, const char *stored,
+		char *rehash, size_t rehashlen);
+
+#endif //KAPLAR_PASSWORD_H_
@@ -0,0 +1,225 @@
+#include "player_blob.h"
+#include "buffer_util.h"
+
+#define DEFAULT_SKILL_LEVEL 10
+
+void player_data_init(struct player_data *pd){
+	memset(pd, 0, sizeof(struct player_data));
+	player_data_reset(pd);
+}
+
+void player_data_free(struct player_data *pd){
+	if(pd->storage != NULL)
+		kpl_free(pd->storage);
+	if(pd->items != NULL)
+		kpl_free(pd->items);
+	memset(pd, 0, sizeof(struct player_data));
+}
+
+void player_data_reset(struct player_data *pd){
+	for(int i = 0; i < PLAYER_NUM_SKILLS; i += 1){
+		pd->skills[i].level = DEFAULT_SKILL_LEVEL;
+		pd->skills[i].tries = 0;
+	}
+	pd->num_storage = 0;
+	pd->num_items = 0;
+}
+
+static void reserve_storage(struct player_data *pd, int count){
+	if(count <= pd->max_storage)
+		return;
+	if(count < pd->max_storage * 2)
+		count = pd->max_storage * 2;
+	pd->storage = kpl_realloc(pd->storage,
+		sizeof(struct player_storage) * count);
+	pd->max_storage = count;
+}
+
+static void reserve_items(struct player_data *pd, int count){
+	if(count <= pd->max_items)
+		return;
+	if(count < pd->max_items * 2)
+		count = pd->max_items * 2;
+	pd->items = kpl_realloc(pd->items,
+		sizeof(struct player_item) * count);
+	pd->max_items = count;
+}
+
+bool player_data_add_storage(struct player_data *pd, uint32 key, int32 value){
+	if(pd->num_storage >= PLAYER_MAX_STORAGE)
+		return false;
+	reserve_storage(pd, pd->num_storage + 1);
+	pd->storage[pd->num_storage].key = key;
+	pd->storage[pd->num_storage].value = value;
+	pd->num_storage += 1;
+	return true;
+}
+
+bool player_data_add_item(struct player_data *pd, const struct player_item *item){
+	if(pd->num_items >= PLAYER_MAX_ITEMS)
+		return false;
+	reserve_items(pd, pd->num_items + 1);
+	pd->items[pd->num_items] = *item;
+	pd->num_items += 1;
+	return true;
+}
+
+/* ENCODE */
+#define HEADER_SIZE		1
+#define SKILL_SIZE		6
+#define STORAGE_SIZE		8
+#define ITEM_SIZE		6
+
+int player_blob_size(const struct player_data *pd){
+	return HEADER_SIZE
+		+ 1 + PLAYER_NUM_SKILLS * SKILL_SIZE
+		+ 2 + pd->num_storage * STORAGE_SIZE
+		+ 2 + pd->num_items * ITEM_SIZE;
+}
+
+int player_blob_encode(const struct player_data *pd, uint8 *buf, int bufsize){
+	uint8 *ptr = buf;
+	if(bufsize < player_blob_size(pd))
+		return -1;
+
+	encode_u8(ptr, PLAYER_BLOB_VERSION);
+	ptr += 1;
+
+	encode_u8(ptr, PLAYER_NUM_SKILLS);
+	ptr += 1;
+	for(int i = 0; i < PLAYER_NUM_SKILLS; i += 1){
+		encode_u16_le(ptr, pd->skills[i].level);
+		encode_u32_le(ptr + 2, pd->skills[i].tries);
+		ptr += SKILL_SIZE;
+	}
+
+	encode_u16_le(ptr, (uint16)pd->num_storage);
+	ptr += 2;
+	for(int i = 0; i < pd->num_storage; i += 1){
+		encode_u32_le(ptr, pd->storage[i].key);
+		encode_u32_le(ptr + 4, (uint32)pd->storage[i].value);
+		ptr += STORAGE_SIZE;
+	}
+
+	encode_u16_le(ptr, (uint16)pd->num_items);
+	ptr += 2;
+	for(int i = 0; i < pd->num_items; i += 1){
+		encode_u8(ptr, pd->items[i].slot);
+		encode_u16_le(ptr + 1, pd->items[i].id);
+		encode_u8(ptr + 3, pd->items[i].count);
+		encode_u16_le(ptr + 4, pd->items[i].num_children);
+		ptr += ITEM_SIZE;
+	}
+	return (int)(ptr - buf);
+}
+
+/* DECODE */
+// checks that `num_children` describe a valid forest: every item's
+// subtree fits in the array and only top level items have a slot
+static bool check_items(const struct player_data *pd){
+	// pending[depth] is the number of items still expected at `depth`
+	int pending[64];
+	int depth = 0;
+	for(int i = 0; i < pd->num_items; i += 1){
+		const struct player_item *item = &pd->items[i];
+		if(depth == 0){
+			if(item->slot == 0)
+				return false;
+		}else{
+			if(item->slot != 0)
+				return false;
+			pending[depth - 1] -= 1;
+		}
+		if(item->num_children > 0){
+			if(depth >= (int)ARRAY_SIZE(pending))
+				return false;
+			pending[depth] = item->num_children;
+			depth += 1;
+		}
+		while(depth > 0 && pending[depth - 1] == 0)
+			depth -= 1;
+	}
+	return depth == 0;
+}
+
+static bool decode_v1(struct player_data *pd, uint8 *ptr, uint8 *end){
+	int num_skills, count;
+
+	if((end - ptr) < 1)
+		return false;
+	num_skills = decode_u8(ptr);
+	ptr += 1;
+	if((end - ptr) < num_skills * SKILL_SIZE)
+		return false;
+	// skills added in later versions keep their default values
+	// and unknown ones are skipped
+	for(int i = 0; i < num_skills; i += 1){
+		if(i < PLAYER_NUM_SKILLS){
+			pd->skills[i].level = decode_u16_le(ptr);
+			pd->skills[i].tries = decode_u32_le(ptr + 2);
+		}
+		ptr += SKILL_SIZE;
+	}
+
+	if((end - ptr) < 2)
+		return false;
+	count = decode_u16_le(ptr);
+	ptr += 2;
+	if((end - ptr) < count * STORAGE_SIZE)
+		return false;
+	reserve_storage(pd, count);
+	for(int i = 0; i < count; i += 1){
+		pd->storage[i].key = decode_u32_le(ptr);
+		pd->storage[i].value = (int32)decode_u32_le(ptr + 4);
+		ptr += STORAGE_SIZE;
+	}
+	pd->num_storage = count;
+
+	if((end - ptr) < 2)
+		return false;
+	count = decode_u16_le(ptr);
+	ptr += 2;
+	if((end - ptr) < count * ITEM_SIZE)
+		return false;
+	reserve_items(pd, count);
+	for(int i = 0; i < count; i += 1){
+		pd->items[i].slot = decode_u8(ptr);
+		pd->items[i].id = decode_u16_le(ptr + 1);
+		pd->items[i].count = decode_u8(ptr + 3);
+		pd->items[i].num_children = decode_u16_le(ptr + 4);
+		ptr += ITEM_SIZE;
+	}
+	pd->num_items = count;
+	return ptr == end && check_items(pd);
+}
+
+bool player_blob_decode(struct player_data *pd,
+		const uint8 *data, int len, bool *upgraded){
+	uint8 *ptr = (uint8*)data;
+	uint8 *end = ptr + len;
+	int version;
+	bool ok;
+
+	player_data_reset(pd);
+	*upgraded = false;
+	if(data == NULL || len <= 0){
+		// version zero: the player was never saved with a blob
+		*upgraded = true;
+		return true;
+	}
+
+	version = decode_u8(ptr);
+	ptr += 1;
+	// each version is read into the current representation with
+	// the defaults filling anything it didn't have
+	switch(version){
+	case 1: ok = decode_v1(pd, ptr, end); break;
+	default: ok = false; break;
+	}
+	if(!ok){
+		player_data_reset(pd);
+		return false;
+	}
+	*upgraded = (version != PLAYER_BLOB_VERSION);
+	return true;
+}
@@ -0,0 +1,91 @@
+#ifndef KAPLAR_PLAYER_BLOB_H_
+#define KAPLAR_PLAYER_BLOB_H_ 1
+
+#include "common.h"
+
+// player blob
+//	NOTES:
+//	- Compact binary serialization of the player data that doesn't
+//	have columns of its own (skills, storage values and the inventory
+//	tree). It's stored in `players.data` so loading a player is one
+//	row fetch plus one linear decode.
+//	- The inventory is kept flat in pre-order: each item is followed
+//	by its `num_children` items (recursively) so containers don't need
+//	to be rebuilt as a tree to be saved or loaded. Top level items
+//	have the inventory slot they're in, the others have a zero slot.
+//	- The first byte is the format version. `player_blob_encode`
+//	always writes the latest version and `player_blob_decode` reads
+//	any of them, setting `upgraded` when the blob wasn't in the latest
+//	version so the caller can mark it dirty (DB_PLAYER_DATA) to have it
+//	rewritten. Players that were never saved with a blob (NULL or
+//	empty) decode as version zero with default values.
+//	- Everything is little endian (see buffer_util.h).
+//
+//	version 1:
+//		u8 version
+//		u8 num_skills, num_skills * (u16 level, u32 tries)
+//		u16 num_storage, num_storage * (u32 key, i32 value)
+//		u16 num_items, num_items * (u8 slot, u16 id, u8 count,
+//			u16 num_children)
+
+#define PLAYER_BLOB_VERSION		1
+#define PLAYER_MAX_STORAGE		0xFFFF
+#define PLAYER_MAX_ITEMS		0xFFFF
+
+enum{
+	PLAYER_SKILL_FIST = 0,
+	PLAYER_SKILL_CLUB,
+	PLAYER_SKILL_SWORD,
+	PLAYER_SKILL_AXE,
+	PLAYER_SKILL_DISTANCE,
+	PLAYER_SKILL_SHIELDING,
+	PLAYER_SKILL_FISHING,
+
+	PLAYER_NUM_SKILLS,
+};
+
+struct player_skill{
+	uint16 level;
+	uint32 tries;
+};
+
+struct player_storage{
+	uint32 key;
+	int32 value;
+};
+
+struct player_item{
+	uint8 slot;
+	uint16 id;
+	uint8 count;
+	uint16 num_children;
+};
+
+struct player_data{
+	struct player_skill skills[PLAYER_NUM_SKILLS];
+	int num_storage;
+	int max_storage;
+	struct player_storage *storage;
+	int num_items;
+	int max_items;
+	struct player_item *items;
+};
+
+void player_data_init(struct player_data *pd);
+void player_data_free(struct player_data *pd);
+// sets default values (what a player without a blob gets)
+void player_data_reset(struct player_data *pd);
+bool player_data_add_storage(struct player_data *pd, uint32 key, int32 value);
+bool player_data_add_item(struct player_data *pd, const struct player_item *item);
+
+// `player_blob_encode` returns the number of bytes written or -1 if
+// `buf` is too small (`player_blob_size` is the exact size needed)
+int player_blob_size(const struct player_data *pd);
+int player_blob_encode(const struct player_data *pd, uint8 *buf, int bufsize);
+// returns false if the blob is invalid or has an unknown version
+// (`pd` is left reset and it's up to the caller to log it along
+// with the player it belongs to)
+bool player_blob_decode(struct player_data *pd,
+		const uint8 *data, int len, bool *upgraded);
+
+#endif //KAPLAR_PLAYER_BLOB_H_
@@ -0,0 +1,284 @@
+#include "player_save.h"
+#include "config.h"
+#include "log.h"
+#include "thread.h"
+
+// all flushes share the same ordering key so they're
+// written by the database in the order they were made
+#define SAVE_ORDER_KEY 0x504C5952
+#define SAVE_MIN_CAPACITY 256
+#define SAVE_SHUTDOWN_TIMEOUT 30000
+
+// dirty set
+//	- Dense array of states plus an open addressing index of
+//	`player_id -> array index + 1` (zero is an empty slot).
+//	- States with DB_PLAYER_DATA own their blob. It moves with the
+//	state between sets and is released when it's replaced or when the
+//	state is dropped after being written.
+struct dirty_set{
+	struct db_player_state *states;
+	int count;
+	int capacity;
+	int32 *index;
+	uint32 index_mask;
+};
+
+struct save_job{
+	struct dirty_set set;
+};
+
+// `carry` holds states that failed to be written. They're merged
+// into the next job without replacing newer snapshots, which is
+// safe because jobs run in order.
+static mutex_t save_mtx;
+static condvar_t save_cv;
+static struct dirty_set dirty;
+static struct dirty_set carry;
+static int batch_size;
+static int64 flush_interval;
+static int64 next_flush;
+static bool flush_delayed;
+static bool shutdown_done;
+
+static INLINE uint32 index_slot(int32 player_id){
+	return (uint32)player_id * 2654435761U;
+}
+
+static void set_alloc(struct dirty_set *set, int capacity){
+	uint32 index_size = 1;
+	// keep the index at most half full
+	while(index_size < (uint32)capacity * 2)
+		index_size <<= 1;
+	set->states = kpl_malloc(capacity * sizeof(struct db_player_state));
+	set->index = kpl_malloc(index_size * sizeof(int32));
+	memset(set->index, 0, index_size * sizeof(int32));
+	set->index_mask = index_size - 1;
+	set->capacity = capacity;
+	set->count = 0;
+}
+
+static void set_free(struct dirty_set *set){
+	kpl_free(set->states);
+	kpl_free(set->index);
+	memset(set, 0, sizeof(struct dirty_set));
+}
+
+static void release_data(struct db_player_state *state){
+	if((state->dirty & DB_PLAYER_DATA) && state->data != NULL)
+		kpl_free((void*)state->data);
+	state->data = NULL;
+}
+
+static void set_release_data(struct dirty_set *set){
+	for(int i = 0; i < set->count; i += 1)
+		release_data(&set->states[i]);
+}
+
+static int32 *set_find_slot(struct dirty_set *set, int32 player_id){
+	uint32 i = index_slot(player_id) & set->index_mask;
+	int32 *slot;
+	while(1){
+		slot = &set->index[i];
+		if(*slot == 0 || set->states[*slot - 1].player_id == player_id)
+			return slot;
+		i = (i + 1) & set->index_mask;
+	}
+}
+
+static void set_grow(struct dirty_set *set){
+	struct dirty_set bigger;
+	set_alloc(&bigger, set->capacity * 2);
+	memcpy(bigger.states, set->states,
+		set->count * sizeof(struct db_player_state));
+	bigger.count = set->count;
+	for(int i = 0; i < set->count; i += 1)
+		*set_find_slot(&bigger, set->states[i].player_id) = i + 1;
+	set_free(set);
+	*set = bigger;
+}
+
+// `replace` is false when merging states that failed to be
+// written so they don't overwrite groups of newer snapshots
+// (the set takes over the state's blob either way)
+static void set_put(struct dirty_set *set,
+		const struct db_player_state *state, bool replace){
+	int32 *slot = set_find_slot(set, state->player_id);
+	struct db_player_state *cur;
+	uint32 groups;
+	if(*slot != 0){
+		cur = &set->states[*slot - 1];
+		groups = replace ? state->dirty : (state->dirty & ~cur->dirty);
+		if(groups & DB_PLAYER_DATA)
+			release_data(cur);
+		else if((state->dirty & DB_PLAYER_DATA) && state->data != NULL)
+			kpl_free((void*)state->data);
+		db_player_state_merge(cur, state, groups);
+		return;
+	}
+	if(set->count == set->capacity){
+		set_grow(set);
+		slot = set_find_slot(set, state->player_id);
+	}
+	set->states[set->count] = *state;
+	set->count += 1;
+	*slot = set->count;
+}
+
+/* DATABASE TASKS */
+static void run_save_job(void *arg){
+	struct save_job *job = arg;
+	struct db_player_state *states;
+	int n;
+
+	// take whatever failed on previous jobs
+	mutex_lock(&save_mtx);
+	for(int i = 0; i < carry.count; i += 1)
+		set_put(&job->set, &carry.states[i], false);
+	carry.count = 0;
+	memset(carry.index, 0, (carry.index_mask + 1) * sizeof(int32));
+	mutex_unlock(&save_mtx);
+
+	states = job->set.states;
+	for(int i = 0; i < job->set.count; i += n){
+		n = job->set.count - i;
+		if(n > batch_size)
+			n = batch_size;
+		if(!db_save_players(states + i, n)){
+			LOG_ERROR("player_save: failed to save %d players"
+				" (they'll be retried on the next flush)", n);
+			mutex_lock(&save_mtx);
+			for(int j = i; j < i + n; j += 1){
+				set_put(&carry, &states[j], true);
+				states[j].data = NULL;
+			}
+			mutex_unlock(&save_mtx);
+		}
+	}
+	set_release_data(&job->set);
+	set_free(&job->set);
+	kpl_free(job);
+}
+
+static void run_shutdown_barrier(void *arg){
+	mutex_lock(&save_mtx);
+	shutdown_done = true;
+	condvar_signal(&save_cv);
+	mutex_unlock(&save_mtx);
+}
+
+/* GAME INTERFACE */
+bool player_save_init(void){
+	int interval = config_geti("player_save_interval");
+	batch_size = config_geti("player_save_batch_size");
+	if(interval <= 0 || batch_size <= 0){
+		LOG_ERROR("player_save_init: invalid interval (%d)"
+			" or batch size (%d)", interval, batch_size);
+		return false;
+	}
+	flush_interval = interval;
+	next_flush = kpl_clock_monotonic_msec() + flush_interval;
+	mutex_init(&save_mtx);
+	condvar_init(&save_cv);
+	set_alloc(&dirty, SAVE_MIN_CAPACITY);
+	set_alloc(&carry, SAVE_MIN_CAPACITY);
+	return true;
+}
+
+void player_save_shutdown(void){
+	bool done;
+	player_save_flush();
+
+	// wait for all flushes to be written
+	shutdown_done = false;
+	if(db_add_task_ordered(SAVE_ORDER_KEY, run_shutdown_barrier, NULL)){
+		mutex_lock(&save_mtx);
+		while(!shutdown_done){
+			if(!condvar_timedwait(&save_cv, &save_mtx, SAVE_SHUTDOWN_TIMEOUT))
+				break;
+		}
+		done = shutdown_done;
+		mutex_unlock(&save_mtx);
+		if(!done)
+			LOG_ERROR("player_save_shutdown: timed out waiting for saves");
+	}
+
+	// if the barrier timed out, a database task may still
+	// be running and touch `dirty` (we leak it instead)
+	mutex_lock(&save_mtx);
+	if(dirty.count > 0 || carry.count > 0){
+		LOG_ERROR("player_save_shutdown: %d players couldn't be saved",
+			dirty.count + carry.count);
+	}
+	done = shutdown_done;
+	mutex_unlock(&save_mtx);
+	if(done){
+		set_release_data(&dirty);
+		set_release_data(&carry);
+		set_free(&dirty);
+		set_free(&carry);
+		condvar_destroy(&save_cv);
+		mutex_destroy(&save_mtx);
+	}
+}
+
+void player_save_mark_dirty(const struct db_player_state *state){
+	struct db_player_state copy = *state;
+	uint8 *data = NULL;
+	if((state->dirty & DB_PLAYER_DATA) && state->data_len > 0){
+		data = kpl_malloc(state->data_len);
+		memcpy(data, state->data, state->data_len);
+	}
+	copy.data = data;
+	mutex_lock(&save_mtx);
+	set_put(&dirty, &copy, true);
+	mutex_unlock(&save_mtx);
+}
+
+// returns false if the database queue was full
+static bool flush_dirty(void){
+	struct save_job *job;
+	mutex_lock(&save_mtx);
+	if(dirty.count == 0 && carry.count == 0){
+		mutex_unlock(&save_mtx);
+		return true;
+	}
+	// hand the set over to the job and start a new one
+	job = kpl_malloc(sizeof(struct save_job));
+	job->set = dirty;
+	set_alloc(&dirty, job->set.capacity);
+	mutex_unlock(&save_mtx);
+
+	// the game can't stall on a full database queue so if it's
+	// full the job is merged back (without replacing snapshots
+	// marked in the meantime) and we try again later
+	if(!db_try_add_task_ordered(SAVE_ORDER_KEY, run_save_job, job)){
+		LOG_WARNING("player_save_flush: database queue is full,"
+			" delaying %d player saves", job->set.count);
+		mutex_lock(&save_mtx);
+		for(int i = 0; i < job->set.count; i += 1)
+			set_put(&dirty, &job->set.states[i], false);
+		mutex_unlock(&save_mtx);
+		set_free(&job->set);
+		kpl_free(job);
+		return false;
+	}
+	return true;
+}
+
+void player_save_flush(void){
+	flush_dirty();
+}
+
+void player_save_update(void){
+	int64 now = kpl_clock_monotonic_msec();
+	int count;
+	mutex_lock(&save_mtx);
+	count = dirty.count;
+	mutex_unlock(&save_mtx);
+	// a full batch is flushed right away unless the last
+	// flush failed, then it waits for the next interval
+	if(now >= next_flush || (count >= batch_size && !flush_delayed)){
+		next_flush = now + flush_interval;
+		flush_delayed = !flush_dirty();
+	}
+}
@@ -0,0 +1,40 @@
+#ifndef KAPLAR_PLAYER_SAVE_H_
+#define KAPLAR_PLAYER_SAVE_H_ 1
+
+#include "common.h"
+#include "db/database.h"
+
+// write-behind player saves
+//	NOTES:
+//	- The game marks players dirty with a snapshot of the groups of
+//	fields that changed (`dirty`, see `db_player_state`). Marking a
+//	player again before it's written merges the groups (newer values
+//	win) so each player is written at most once per flush and only
+//	with the groups that changed. Players that didn't change aren't
+//	written at all.
+//	- Each snapshot must carry a newer `version` than the last one
+//	(eg: bump a per player counter on each mark).
+//	- The player blob (DB_PLAYER_DATA) is copied when marking so the
+//	caller's buffer can be reused right away.
+//	- Every `player_save_interval` milliseconds (or as soon as there
+//	are `player_save_batch_size` dirty players) the dirty set is handed
+//	over to the database as a whole and written in batches of
+//	`player_save_batch_size` players, each in a single transaction
+//	(see `db_save_players`). A global save only costs the game a few
+//	hash table inserts per player.
+//	- Flushes are written in order (ordered database task) so an
+//	older snapshot can never overwrite a newer one.
+//	- Batches that fail to be written are merged into the next flush
+//	without overwriting groups that were marked again in the meantime.
+//	- `player_save_mark_dirty` is thread safe. `player_save_update`
+//	is called by the main shard every frame.
+//	- `player_save_shutdown` flushes and waits for everything to be
+//	written (or to fail) so it must run before the database shutdown.
+
+bool player_save_init(void);
+void player_save_shutdown(void);
+void player_save_mark_dirty(const struct db_player_state *state);
+void player_save_flush(void);
+void player_save_update(void);
+
+#endif //KAPLAR_PLAYER_SAVE_H_
@@ -33,25 +33,319 @@ struct player_handle{
 
 #include "buffer_util.h"
 #include "common.h"
+#include "cont.h"
+#include "game.h"
+#include "log.h"
+#include "password.h"
 #include "tibia_rsa.h"
+#include "crypto/xtea.h"
+#include "db/database.h"
 #include "server/protocol.h"
 #include "server/server.h"
 
+/* LOGIN FLOW
+ *	`struct login_info` lives in the frame of the `login_flow`
+ *	continuation (like in protocol_login.c). Once the RSA block is
+ *	decoded it loads the account and the player in a single async
+ *	batch that completes back on the server thread (or on a database
+ *	worker if async queries are disabled or full, see database.h),
+ *	hops to the password threads to check the password (see
+ *	password.h) and back to the server thread where the connection
+ *	is routed to the shard that owns the player's position (see
+ *	game.h). From there on, everything about the
+ *	player runs on that shard, starting with `enter_world`.
+ *	The player must belong to the account and the password must
+ *	match or the connection is closed without being routed.
+ *	Passwords that need to be rehashed are left alone here. The
+ *	client always goes through the account login first (see
+ *	protocol_login.c) and that one stores the new hash.
+ */
 
 struct login_info{
-	struct outbuf *output_queue;
 	uint32 connection;
 	uint32 xtea[4];
 	bool gm_flag;
 	char accname[32];
 	char password[32];
 	char charname[32];
+	uint16 version;
+	bool authorized;
+	// the RSA block is only needed until it's decoded
+	// and the player only after that
+	union{
+		uint8 rsa[128];
+		struct{
+			bool found;
+			int32 player_id;
+			uint16 pos_x;
+			uint16 pos_y;
+			uint8 pos_z;
+			char stored[DB_MAX_PASSWORD_LEN + 1];
+			// loading (see `begin_load_player`)
+			struct db_batch *batch;
+			int8 i_account;
+			int8 i_player;
+			bool batch_submitted;
+			bool batch_ok;
+		} player;
+	} u;
+};
+
+// connection userdata (set once the player is routed)
+struct game_connection{
+	uint32 xtea[4];
+};
+
+struct enter_world{
+	uint32 connection;
+	int32 player_id;
+	uint16 pos_x;
+	uint16 pos_y;
+	uint8 pos_z;
+};
+
+static void close_connection(void *arg){
+	connection_close((uint32)(uintptr_t)arg);
+}
+
+static void resume_reading(void *arg){
+	connection_resume_reading((uint32)(uintptr_t)arg);
+}
+
+// runs on the shard that owns the player
+static void enter_world(void *arg){
+	struct enter_world *enter = arg;
+	DEBUG_ASSERT(game_current_shard() == game_shard_at(enter->pos_x, enter->pos_y));
+	LOG("player %d entering shard %u at (%u, %u, %u)",
+		enter->player_id, game_current_shard(),
+		enter->pos_x, enter->pos_y, enter->pos_z);
+	// @TODO: insert the player into the shard's map and send
+	// the map description (there is no map yet)
+
+	// client messages are only read from now on (see
+	// `on_recv_message`)
+	if(!game_add_server_task(resume_reading,
+			(void*)(uintptr_t)enter->connection)){
+		DEBUG_LOG("enter_world: failed to resume reading"
+			" (the connection will time out)");
+	}
+	kpl_free(enter);
+}
+
+// returns false if there is nothing to load
+static bool begin_load_player(struct login_info *login){
+	struct db_batch *batch;
+	if(login->accname[0] == 0 || login->charname[0] == 0)
+		return false;
+	batch = login->u.player.batch = db_batch_create();
+	login->u.player.i_account = (int8)db_batch_load_account_info(
+		batch, login->accname);
+	login->u.player.i_player = (int8)db_batch_load_player(
+		batch, login->charname);
+	login->u.player.batch_submitted = false;
+	login->u.player.batch_ok = false;
+	return true;
+}
+
+// called on the server thread once the async batch is done (or on
+// the database thread with no result if it couldn't be posted)
+static void on_login_batch(void *res, void *arg){
+	struct cont *k = arg;
+	struct login_info *login = CONT_DATA(k, struct login_info);
+	login->u.player.batch_submitted = true;
+	login->u.player.batch_ok = (res != NULL);
+	cont_complete(k, res == NULL);
+}
+
+// leaves the player not found unless both the account and the
+// player exist and the player belongs to the account
+static void load_player(struct login_info *login){
+	struct db_batch *batch = login->u.player.batch;
+	struct db_account_info *account;
+	struct db_player_info *player;
+
+	login->u.player.batch = NULL;
+	if(!login->u.player.batch_ok){
+		db_batch_destroy(batch);
+		return;
+	}
+	account = db_batch_result(batch, login->u.player.i_account);
+	player = db_batch_result(batch, login->u.player.i_player);
+	if(account != NULL && account->found && player != NULL && player->found
+			&& player->account_id == account->account_id){
+		login->u.player.found = true;
+		login->u.player.player_id = player->player_id;
+		login->u.player.pos_x = player->pos_x;
+		login->u.player.pos_y = player->pos_y;
+		login->u.player.pos_z = player->pos_z;
+		kpl_strncpy(login->u.player.stored,
+			sizeof(login->u.player.stored), account->password);
+	}
+	if(account != NULL)
+		memset(account->password, 0, sizeof(account->password));
+	db_batch_destroy(batch);
+}
+
+static void check_password(struct login_info *login){
+	// see the notes above about rehashing
+	char rehash[BCRYPT_HASH_STRLEN];
+	login->authorized = password_check(login->password,
+		login->u.player.stored, rehash, sizeof(rehash));
+	memset(rehash, 0, sizeof(rehash));
+}
+
+// called on the server thread once the player is loaded
+static void route_player(struct login_info *login){
+	struct game_connection *gc;
+	struct enter_world *enter;
+	uint32 shard;
+	void **udata;
+
+	// the connection may have closed while the
+	// player was being loaded
+	udata = connection_userdata(login->connection);
+	if(udata == NULL)
+		return;
+	if(!login->u.player.found || !login->authorized){
+		connection_close(login->connection); //"Account name or password is not correct."
+		return;
+	}
+
+	// tasks for this connection will run on `shard` until the
+	// player crosses into another one (see `game_shard_handoff`)
+	shard = game_shard_at(login->u.player.pos_x, login->u.player.pos_y);
+	game_route_connection(login->connection, shard);
+	gc = kpl_malloc(sizeof(struct game_connection));
+	memcpy(gc->xtea, login->xtea, sizeof(gc->xtea));
+	*udata = gc;
+	enter = kpl_malloc(sizeof(struct enter_world));
+	enter->connection = login->connection;
+	enter->player_id = login->u.player.player_id;
+	enter->pos_x = login->u.player.pos_x;
+	enter->pos_y = login->u.player.pos_y;
+	enter->pos_z = login->u.player.pos_z;
+	if(!game_try_add_connection_task(login->connection, enter_world, enter)){
+		kpl_free(enter);
+		connection_close(login->connection); //"Internal error. Try again later."
+	}
+}
+
+static void login_flow(struct cont *k){
+	struct login_info *login = CONT_DATA(k, struct login_info);
+	CONT_BEGIN(k);
+	// a failed hop leaves the player not found or not
+	// authorized and the connection is closed
+	if(begin_load_player(login)){
+		CONT_AWAIT_CALL(k, db_async_batch_exec(login->u.player.batch,
+			CONT_DOMAIN_NET, on_login_batch, k));
+		if(!login->u.player.batch_submitted){
+			// async queries are disabled or full
+			CONT_AWAIT(k, CONT_DOMAIN_DB);
+			login->u.player.batch_ok = !CONT_FAILED(k)
+				&& db_batch_exec(login->u.player.batch);
+		}
+		load_player(login);
+	}
+	if(login->u.player.found){
+		CONT_AWAIT(k, CONT_DOMAIN_PASSWORD);
+		if(!CONT_FAILED(k))
+			check_password(login);
+	}
+	CONT_AWAIT(k, CONT_DOMAIN_NET);
+	// if we failed to get back to the server thread there's no
+	// safe place to touch the connection (it will time out)
+	if(!CONT_FAILED(k))
+		route_player(login);
+	memset(login->password, 0, sizeof(login->password));
+	memset(login->xtea, 0, sizeof(login->xtea));
+	// the stored password may be in plaintext
+	memset(&login->u, 0, sizeof(login->u));
+	CONT_END(k);
+}
+
+/* CLIENT MESSAGES
+ *	Each message is handled on the shard that owns the connection,
+ *	with the priority of its type (see game.h). Anything that must
+ *	stay on time (movement, combat) is high priority. Requests that
+ *	only show information (look, channel lists) are low priority so
+ *	a burst of them is spread over the next frames instead of
+ *	delaying everything else.
+ *	PLACEHOLDERS: There is no map or creature yet, so apart from
+ *	logout the handlers below only decode and log their message.
+ *	They're here to give each opcode its priority in the dispatch
+ *	table and will be filled in along with the map.
+ */
+
+struct game_message{
+	uint32 connection;
+	uint8 opcode;
+	uint16 len;
+	uint8 data[];
 };
 
-static void database_resolve_login(void *udata){
+static void handle_logout(void *arg){
+	struct game_message *msg = arg;
+	// @TODO: remove the player from the map and save it
+	if(!game_add_server_task(close_connection,
+			(void*)(uintptr_t)msg->connection)){
+		DEBUG_LOG("handle_logout: failed to close connection"
+			" (it will time out)");
+	}
+	kpl_free(msg);
+}
 
+static void handle_move(void *arg){
+	struct game_message *msg = arg;
+	// 0x65 = north, 0x66 = east, 0x67 = south, 0x68 = west
+	// @TODO: move the player (there is no map yet)
+	DEBUG_LOG("handle_move: connection %08X, direction %d",
+		msg->connection, msg->opcode - 0x65);
+	kpl_free(msg);
+}
+
+static void handle_attack(void *arg){
+	struct game_message *msg = arg;
+	// @TODO: set the player's target
+	if(msg->len >= 4){
+		DEBUG_LOG("handle_attack: connection %08X, creature %08X",
+			msg->connection, decode_u32_le(msg->data));
+	}
+	kpl_free(msg);
 }
 
+static void handle_look(void *arg){
+	struct game_message *msg = arg;
+	// @TODO: send the description of what's at the position
+	if(msg->len >= 5){
+		DEBUG_LOG("handle_look: connection %08X, (%u, %u, %u)",
+			msg->connection, decode_u16_le(msg->data + 0),
+			decode_u16_le(msg->data + 2), decode_u8(msg->data + 4));
+	}
+	kpl_free(msg);
+}
+
+static void handle_channel_list(void *arg){
+	struct game_message *msg = arg;
+	// @TODO: send the list of channels the player can join
+	DEBUG_LOG("handle_channel_list: connection %08X", msg->connection);
+	kpl_free(msg);
+}
+
+static const struct{
+	uint8 opcode;
+	game_task_priority_t prio;
+	void (*fp)(void*);
+} message_handlers[] = {
+	{0x14, GAME_TASK_NORMAL,	handle_logout},
+	{0x65, GAME_TASK_HIGH,		handle_move},
+	{0x66, GAME_TASK_HIGH,		handle_move},
+	{0x67, GAME_TASK_HIGH,		handle_move},
+	{0x68, GAME_TASK_HIGH,		handle_move},
+	{0x8C, GAME_TASK_LOW,		handle_look},
+	{0x97, GAME_TASK_LOW,		handle_channel_list},
+	{0xA1, GAME_TASK_HIGH,		handle_attack},
+};
+
 /* PROTOCOL IMPL */
 static bool on_assign_protocol(uint32 c){
 	*connection_userdata(c) = NULL;
@@ -59,7 +353,14 @@ static bool on_assign_protocol(uint32 c){
 }
 
 static void on_close(uint32 c){
+	void **udata = connection_userdata(c);
 	DEBUG_LOG("game on close");
+	// later tasks for this connection will run on the main shard
+	game_unroute_connection(c);
+	if(*udata != NULL){
+		kpl_free(*udata);
+		*udata = NULL;
+	}
 }
 
 static protocol_status_t on_connect(uint32 c){
@@ -81,44 +382,72 @@ static protocol_status_t on_connect(uint32 c){
 static protocol_status_t on_write(uint32 c){
 	return PROTO_OK;
 }
+// COMMON BODY STRUCTURE (see protocol_login.c)
 static protocol_status_t on_recv_message(uint32 c, uint8 *data, uint32 datalen){
-	return PROTO_CLOSE;
-}
-static protocol_status_t on_recv_first_message(uint32 c, uint8 *data, uint32 datalen){
-	// @NOTE: See `protocol_login.on_recv_first_message`
-	// comments if something is unclear. They're almost
-	// the same function so I omitted common comments in here.
-	struct login_info *login;
-	uint8 *decoded;
-	size_t decoded_len;
-	uint16 version, A, B, C, S;
+	struct game_connection *gc = *connection_userdata(c);
+	struct game_message *msg;
+	uint16 len;
+	uint8 opcode;
+	int i;
 
-	if(datalen != 137){
-		DEBUG_LOG("protocol_game: invalid login message length"
-			" (expected = %d, got = %d)", 137, datalen);
-		return PROTO_CLOSE;
+	// messages are only read after the player is routed
+	DEBUG_ASSERT(gc != NULL);
+	if(datalen < 12 || ((datalen - 4) & 7) != 0
+			|| adler32(data + 4, datalen - 4) != decode_u32_le(data))
+		return PROTO_ABORT;
+	xtea_decode(gc->xtea, data + 4, datalen - 4);
+	len = decode_u16_le(data + 4);
+	if(len == 0 || len > datalen - 6)
+		return PROTO_ABORT;
+
+	opcode = decode_u8(data + 6);
+	for(i = 0; i < (int)ARRAY_SIZE(message_handlers); i += 1){
+		if(message_handlers[i].opcode == opcode)
+			break;
+	}
+	if(i >= (int)ARRAY_SIZE(message_handlers)){
+		DEBUG_LOG("protocol_game: unhandled message %02X", opcode);
+		return PROTO_OK;
 	}
 
-	version = decode_u16_le(data + 7);
-	if(version < 830)
-		return PROTO_CLOSE;
+	msg = kpl_malloc(sizeof(struct game_message) + len - 1);
+	msg->connection = c;
+	msg->opcode = opcode;
+	msg->len = len - 1;
+	memcpy(msg->data, data + 7, len - 1);
+	// the server thread can't wait on the shard so the message
+	// is dropped if its queue is full
+	if(!game_try_add_connection_task_prio(c, message_handlers[i].prio,
+			message_handlers[i].fp, msg)){
+		DEBUG_LOG("protocol_game: dropped message %02X", opcode);
+		kpl_free(msg);
+	}
+	return PROTO_OK;
+}
+// called on the server thread once the RSA block is decoded
+static void on_rsa_decoded(void *arg, bool ok, size_t decoded_len){
+	struct cont *k = arg;
+	struct login_info *login = CONT_DATA(k, struct login_info);
+	uint8 *decoded = login->u.rsa;
+	uint16 A, B, C, S;
 
-	// rsa decode
-	decoded = data + 9;
-	if(!tibia_rsa_decode(decoded, 128, &decoded_len))
-		return PROTO_CLOSE;
-	if(decoded_len != 127)
-		return PROTO_CLOSE;
+	if(!ok || decoded_len != 127){
+		connection_close(login->connection);
+		cont_release(k);
+		return;
+	}
 
-	login = kpl_malloc(sizeof(struct login_info));
 	login->xtea[0] = decode_u32_le(decoded + 0);
 	login->xtea[1] = decode_u32_le(decoded + 4);
 	login->xtea[2] = decode_u32_le(decoded + 8);
 	login->xtea[3] = decode_u32_le(decoded + 12);
 
-	if(version < TIBIA_CLIENT_VERSION_MIN || version > TIBIA_CLIENT_VERSION_MAX){
-		kpl_free(login); // "This server requires client version " TIBIA_CLIENT_VERSION_STR "."
-		return PROTO_CLOSE;
+	if(login->version < TIBIA_CLIENT_VERSION_MIN
+			|| login->version > TIBIA_CLIENT_VERSION_MAX){
+		// "This server requires client version " TIBIA_CLIENT_VERSION_STR "."
+		connection_close(login->connection);
+		cont_release(k);
+		return;
 	}
 
 	// (?)
@@ -134,30 +463,61 @@ static protocol_status_t on_recv_first_message(uint32 c, uint8 *data, uint32 dat
 	S += C = (B > 32) ? 0
 		: decode_tibia_string(decoded + 17 + S,
 			login->password, sizeof(login->password));
-	if(A > 32 || B > 32 || C > 32){
-		kpl_free(login); //"Your account has been banned."
-		return PROTO_CLOSE;
-	}
 
 	// see `on_connect` about this data
 	// decode_u32_le(decoded + 17 + S) == 0x0000FFFF;
 	// decode_u8(decoded + 21 + S) == 0xFF;
 
+	// the key and credentials were copied out
+	memset(login->u.rsa, 0, sizeof(login->u.rsa));
+	if(A > 32 || B > 32 || C > 32){
+		connection_close(login->connection); //"Your account has been banned."
+		memset(login->password, 0, sizeof(login->password));
+		cont_release(k);
+		return;
+	}
+
 	DEBUG_LOG("player login:");
 	DEBUG_LOG("xtea = {%08X, %08X, %08X, %08X}",
 		login->xtea[0], login->xtea[1],
 		login->xtea[2], login->xtea[3]);
-	LOG("accname = '%s', password = '%s'",
-		login->accname, login->password);
-	LOG("charname = '%s'", login->charname);
-
-	//if(!db_add_task(database_resolve_login, login)){
-	//	kpl_free(login); //"Internal error. Try again later."
-	//	return PROTO_CLOSE;
-	//}
-	kpl_free(login);
-	return PROTO_CLOSE;
-	//return PROTO_OK;
+	LOG("accname = '%s', charname = '%s'",
+		login->accname, login->charname);
+
+	// the connection is handed to the player's shard
+	// once the player is loaded (see `route_player`)
+	cont_start(k);
+}
+
+static protocol_status_t on_recv_first_message(uint32 c, uint8 *data, uint32 datalen){
+	// @NOTE: See `protocol_login.on_recv_first_message`
+	// comments if something is unclear. They're almost
+	// the same function so I omitted common comments in here.
+	struct login_info *login;
+	struct cont *k;
+	uint16 version;
+
+	if(datalen != 137){
+		DEBUG_LOG("protocol_game: invalid login message length"
+			" (expected = %d, got = %d)", 137, datalen);
+		return PROTO_CLOSE;
+	}
+
+	version = decode_u16_le(data + 7);
+	if(version < 830)
+		return PROTO_CLOSE;
+
+	// rsa decode
+	k = cont_create(login_flow, sizeof(struct login_info));
+	login = CONT_DATA(k, struct login_info);
+	login->connection = c;
+	login->version = version;
+	memcpy(login->u.rsa, data + 9, 128);
+	if(!tibia_rsa_decode_async(login->u.rsa, 128, on_rsa_decoded, k)){
+		cont_release(k);
+		return PROTO_CLOSE;
+	}
+	return PROTO_STOP_READING;
 }
 
 /* PROTOCOL DECL */
@@ -56,20 +56,34 @@
  *
  */
 
+#include "account_cache.h"
 #include "buffer_util.h"
 #include "config.h"
+#include "cont.h"
 #include "game.h"
+#include "log.h"
 #include "outbuf.h"
+#include "password.h"
 #include "tibia_rsa.h"
 #include "server/server.h"
-#include "crypto/xtea.h"
 #include "db/database.h"
 
-/* LIFETIME OF `login_info`
- *	Any of the functions that take `struct login_info` as a parameter
- *	WILL take ownership of it. The structure lifetime starts at
- *	`on_recv_first_message` and ends at `internal_resolve_login`
- *	regardless. The path may change but this should always be the case.
+/* LOGIN FLOW
+ *	`struct login_info` lives in the frame of the `login_flow`
+ *	continuation. It's created when the first message arrives and
+ *	started on the server thread once the RSA block is decoded on the
+ *	worker pool (see tibia_rsa.h). From there it loads the account
+ *	(unless it's cached) with an async query that completes back on
+ *	the server thread (see database.h), hops to the password threads
+ *	to check the password (see password.h) and back to the server
+ *	thread to queue the response on the outbuf wrap stage (see
+ *	cont.h). It's sent when the stage is flushed at the end of the
+ *	frame.
+ *	If async queries are disabled or full, the account is loaded
+ *	on a database worker instead.
+ *	If the stored password needs to be rehashed (it's in plaintext
+ *	or it has a lower cost), the flow makes one last hop to the
+ *	database to store the new hash after the response is queued.
  */
 
 struct login_info{
@@ -78,52 +92,48 @@ struct login_info{
 	uint32 xtea[4];
 	char accname[32];
 	char password[32];
+	uint16 version;
+	bool check_password;
+	int32 account_id;
+	// account loading (see `database_begin_login`)
+	struct db_batch *batch;
+	uint32 ticket;
+	int8 i_info;
+	int8 i_chars;
+	bool batch_submitted;
+	bool batch_ok;
+	// the RSA block is only needed until it's decoded
+	// and the stored password only after that
+	union{
+		uint8 rsa[128];
+		struct{
+			char stored[DB_MAX_PASSWORD_LEN + 1];
+			char rehash[BCRYPT_HASH_STRLEN];
+		} pw;
+	} u;
 };
 
-static void outbuf_prepare(struct outbuf *buf){
-	// reserve 8 bytes for header
-	buf->ptr = buf->base + 8;
-}
-
-static void outbuf_wrap(struct outbuf *buf, uint32 *xtea){
-	uint8 *data = buf->base + 6;
-	uint32 datalen = (uint32)(buf->ptr - data);
-	uint32 checksum;
-	int padding = (8 - (datalen & 7)) & 7;
-
-	// xtea encode
-	encode_u16_le(data, datalen-2);
-	datalen += padding;
-	while(padding-- > 0)
-		outbuf_write_byte(buf, 0x33);
-	xtea_encode(xtea, data, datalen);
-
-	// add message header
-	checksum = adler32(data, datalen);
-	encode_u16_le(buf->base, datalen+4);
-	encode_u32_le(buf->base+2, checksum);
+// called on the server thread once the output is wrapped
+static void login_send(uint32 connection, struct outbuf *buf){
+	void **udata = connection_userdata(connection);
+	if(udata != NULL){
+		*udata = buf;
+		connection_send(connection, outbuf_data(buf), outbuf_len(buf));
+	}else{
+		// if the connection is no loger valid we
+		// need to release the outbuf HERE
+		outbuf_release(buf);
+	}
 }
 
-static void internal_resolve_login(void *arg){
-	DEBUG_ASSERT(arg != NULL); // PARANOID
-	struct login_info *login = arg;
-	void **udata = connection_userdata(login->connection);
+static void internal_resolve_login(struct login_info *login){
 	if(login->output != NULL){
-		if(udata != NULL){
-			*udata = login->output;
-			connection_send(login->connection,
-				outbuf_data(login->output),
-				outbuf_len(login->output));
-		}else{
-			// if the connection is no loger valid we
-			// need to release the outbuf HERE
-			outbuf_release(login->output);
-		}
+		outbuf_wrap_add(login->output, login->xtea,
+			login->connection, login_send);
+		login->output = NULL;
 	}
 	// clear password to be extra safe
 	memset(login->password, 0, sizeof(login->password));
-	// always release the login data here
-	kpl_free(login);
 }
 
 static void build_disconnect_message(struct login_info *login, const char *message){
@@ -132,7 +142,6 @@ static void build_disconnect_message(struct login_info *login, const char *messa
 	outbuf_prepare(buf);
 	outbuf_write_byte(buf, 0x0A);
 	outbuf_write_str(buf, message);
-	outbuf_wrap(buf, login->xtea);
 }
 
 static void internal_send_disconnect(struct login_info *login, const char *message){
@@ -140,56 +149,20 @@ static void internal_send_disconnect(struct login_info *login, const char *messa
 	internal_resolve_login(login);
 }
 
-static void send_disconnect(struct login_info *login, const char *message){
-	build_disconnect_message(login, message);
-	game_add_server_task(internal_resolve_login, login);
-}
-
-static void database_resolve_login(void *udata){
-	struct login_info *login = udata;
+// builds the response into `login->output` (the password
+// is checked later by `check_password`)
+static void resolve_account(struct login_info *login, const struct cached_account *acc){
 	struct outbuf *buf;
-	db_result_t *res;
-	int32 accid;
-	int64 premend;
-	const char *pwd;
-	int nrows;
-
-	if(login->accname[0] == 0){
-		send_disconnect(login, "Invalid account name.");
-		return;
-	}
 
-	// load account info
-	res = db_load_account_info(login->accname);
-	nrows = db_result_nrows(res);
-	if(res == NULL || nrows == 0){
-		if(nrows == 0)
-			db_result_clear(res);
-		send_disconnect(login, "Account name or password is not correct.");
-		return;
-	}
-	DEBUG_ASSERT(nrows == 1); // PARANOID
-	accid = db_result_get_int32(res, 0, DBRES_ACC_INFO_ID);
-	premend = db_result_get_int64(res, 0, DBRES_ACC_INFO_PREMEND);
-	pwd = db_result_get_value(res, 0, DBRES_ACC_INFO_PASSWORD);
-	if(strcmp(pwd, login->password) != 0){ //@TODO: use bcrypt or some other hashing
-		db_result_clear(res);
-		send_disconnect(login, "Account name or password is not correct.");
-		return;
-	}
-	db_result_clear(res);
+	login->check_password = true;
+	login->account_id = acc->account_id;
+	kpl_strncpy(login->u.pw.stored, sizeof(login->u.pw.stored), acc->password);
+	login->u.pw.rehash[0] = 0;
 
 	// @TODO: CHECK IF ACC BANNED
 	// @TODO: CHECK IF IP BANNED
 
-	// load charlist
-	res = db_load_account_charlist(accid);
-	if(res == NULL){
-		send_disconnect(login, "Internal error. Contact an admin.");
-		return;
-	}
 	// send charlist message
-	nrows = db_result_nrows(res);
 	buf = login->output = outbuf_acquire();
 	outbuf_prepare(buf);
 	// motd
@@ -197,20 +170,174 @@ static void database_resolve_login(void *udata){
 	outbuf_write_str(buf, config_get("motd"));
 	// charlist
 	outbuf_write_byte(buf, 0x64);
-	outbuf_write_byte(buf, nrows);
-	for(int i = 0; i < nrows; i += 1){
-		outbuf_write_str(buf,
-			db_result_get_value(res, i, DBRES_ACC_CHARLIST_NAME));
+	outbuf_write_byte(buf, (uint8)acc->num_chars);
+	for(int i = 0; i < acc->num_chars; i += 1){
+		outbuf_write_str(buf, acc->chars[i]);
 		outbuf_write_str(buf, config_get("sv_name"));
 		outbuf_write_u32(buf, 16777343); // (localhost) @TODO: resolve addr from config sv_addr
 		outbuf_write_u16(buf, (uint16)config_geti("sv_game_port"));
 	}
 	outbuf_write_u16(buf, 1); // @TODO: calc premdays from premend = days_until(premend)
-	outbuf_wrap(buf, login->xtea);
-	db_result_clear(res);
-	game_add_server_task(internal_resolve_login, login);
 }
 
+// returns false on a cache miss
+static bool cache_resolve_login(struct login_info *login){
+	struct cached_account acc;
+	if(login->accname[0] == 0 || !account_cache_lookup(login->accname, &acc))
+		return false;
+	resolve_account(login, &acc);
+	memset(acc.password, 0, sizeof(acc.password));
+	return true;
+}
+
+// returns false if there is nothing to load (the response
+// is already built)
+static bool database_begin_login(struct login_info *login){
+	if(login->accname[0] == 0){
+		build_disconnect_message(login, "Invalid account name.");
+		return false;
+	}
+
+	// load account info and charlist in a single round trip
+	login->ticket = account_cache_load_begin();
+	login->batch = db_batch_create();
+	login->i_info = (int8)db_batch_load_account_info(
+		login->batch, login->accname);
+	login->i_chars = (int8)db_batch_load_account_charlist_by_name(
+		login->batch, login->accname);
+	login->batch_submitted = false;
+	login->batch_ok = false;
+	return true;
+}
+
+// called on the server thread once the async batch is done (or on
+// the database thread with no result if it couldn't be posted)
+static void on_login_batch(void *res, void *arg){
+	struct cont *k = arg;
+	struct login_info *login = CONT_DATA(k, struct login_info);
+	login->batch_submitted = true;
+	login->batch_ok = (res != NULL);
+	cont_complete(k, res == NULL);
+}
+
+static void database_resolve_login(struct login_info *login){
+	struct cached_account acc;
+	struct db_batch *batch = login->batch;
+	struct db_account_info *info;
+	struct db_charlist *chars;
+	int count;
+
+	login->batch = NULL;
+	if(!login->batch_ok){
+		db_batch_destroy(batch);
+		build_disconnect_message(login, "Internal error. Try again later.");
+		return;
+	}
+
+	// account info
+	info = db_batch_result(batch, login->i_info);
+	if(info == NULL || !info->found){
+		db_batch_destroy(batch);
+		build_disconnect_message(login, "Account name or password is not correct.");
+		return;
+	}
+	acc.account_id = info->account_id;
+	acc.premend = info->premend;
+	kpl_strncpy(acc.password, sizeof(acc.password), info->password);
+	memset(info->password, 0, sizeof(info->password));
+
+	// charlist
+	chars = db_batch_result(batch, login->i_chars);
+	if(chars == NULL){
+		db_batch_destroy(batch);
+		build_disconnect_message(login, "Internal error. Contact an admin.");
+		return;
+	}
+	count = chars->count;
+	if(count > ACCOUNT_CACHE_MAX_CHARS){
+		LOG_WARNING("database_resolve_login: account %d has %d"
+			" characters but only %d will be listed",
+			acc.account_id, count, ACCOUNT_CACHE_MAX_CHARS);
+		count = ACCOUNT_CACHE_MAX_CHARS;
+	}
+	acc.num_chars = count;
+	for(int i = 0; i < count; i += 1)
+		kpl_strncpy(acc.chars[i], sizeof(acc.chars[i]), chars->names[i]);
+	db_batch_destroy(batch);
+
+	account_cache_insert(login->ticket, login->accname, &acc);
+	resolve_account(login, &acc);
+	memset(acc.password, 0, sizeof(acc.password));
+}
+
+// replaces the response if the password doesn't match
+static void check_password(struct login_info *login){
+	if(!password_check(login->password, login->u.pw.stored,
+			login->u.pw.rehash, sizeof(login->u.pw.rehash))){
+		outbuf_release(login->output);
+		login->output = NULL;
+		build_disconnect_message(login, "Account name or password is not correct.");
+	}
+}
+
+static void rehash_password(struct login_info *login){
+	if(db_update_account_password(login->account_id,
+			login->u.pw.stored, login->u.pw.rehash)){
+		account_cache_invalidate_id(login->account_id);
+		DEBUG_LOG("rehash_password: account %d", login->account_id);
+	}
+}
+
+static void login_flow(struct cont *k){
+	struct login_info *login = CONT_DATA(k, struct login_info);
+	CONT_BEGIN(k);
+	// repeated logins are resolved from the account cache
+	// without going through the database
+	if(!cache_resolve_login(login) && database_begin_login(login)){
+		CONT_AWAIT_CALL(k, db_async_batch_exec(login->batch,
+			CONT_DOMAIN_NET, on_login_batch, k));
+		if(!login->batch_submitted){
+			// async queries are disabled or full
+			CONT_AWAIT(k, CONT_DOMAIN_DB);
+			login->batch_ok = !CONT_FAILED(k)
+				&& db_batch_exec(login->batch);
+		}
+		database_resolve_login(login);
+	}
+	if(login->check_password){
+		CONT_AWAIT(k, CONT_DOMAIN_PASSWORD);
+		if(CONT_FAILED(k)){
+			// too many password checks waiting
+			outbuf_release(login->output);
+			login->output = NULL;
+			build_disconnect_message(login, "Too many login attempts."
+				" Try again later.");
+		}else{
+			check_password(login);
+		}
+	}
+	CONT_AWAIT(k, CONT_DOMAIN_NET);
+	// if we failed to get back to the server thread there's
+	// no safe place to touch the connection so we just release
+	// the output (the connection will time out)
+	if(CONT_FAILED(k)){
+		outbuf_release(login->output);
+		memset(login->password, 0, sizeof(login->password));
+		memset(&login->u, 0, sizeof(login->u));
+		CONT_EXIT(k);
+	}
+	internal_resolve_login(login);
+	if(login->u.pw.rehash[0] != 0){
+		CONT_AWAIT(k, CONT_DOMAIN_DB);
+		if(!CONT_FAILED(k))
+			rehash_password(login);
+	}
+	// the stored password may be in plaintext
+	memset(&login->u, 0, sizeof(login->u));
+	CONT_END(k);
+}
+
+
 /* PROTOCOL IMPL */
 static bool identify(uint8 *data, uint32 datalen){
 	uint32 checksum;
@@ -251,69 +378,90 @@ static protocol_status_t on_recv_message(uint32 c, uint8 *data, uint32 datalen){
 	return PROTO_ABORT; // should no happen
 }
 
-static protocol_status_t on_recv_first_message(uint32 c, uint8 *data, uint32 datalen){
-	struct login_info *login;
-	uint8 *decoded;
-	size_t decoded_len;
-	uint16 version, A, B;
-
-	if(datalen != 149){
-		DEBUG_LOG("protocol_login: invalid login message length"
-			" (expected = %d, got = %d)", 149, datalen);
-		return PROTO_CLOSE;
-	}
-
-	version = decode_u16_le(data + 7);
-	// version <= 760 didn't have RSA + XTEA encryption
-	// version <  830 didn't have checksum
-	// shouldn't happen unless it's a purposely malformed message
-	if(version < 830)
-		return PROTO_CLOSE;
-
-	// rsa decode
-	decoded = data + 21;
-	if(!tibia_rsa_decode(decoded, 128, &decoded_len))
-		return PROTO_CLOSE;
+// called on the server thread once the RSA block is decoded
+static void on_rsa_decoded(void *arg, bool ok, size_t decoded_len){
+	struct cont *k = arg;
+	struct login_info *login = CONT_DATA(k, struct login_info);
+	uint8 *decoded = login->u.rsa;
+	uint16 A, B;
 
 	// `decoded_len` seems to be constant and the extra bytes are
 	// just padding bytes
-	if(decoded_len != 127)
-		return PROTO_CLOSE;
+	if(!ok || decoded_len != 127){
+		connection_close(login->connection);
+		cont_release(k);
+		return;
+	}
 
-	login = kpl_malloc(sizeof(struct login_info));
-	login->connection = c;
-	login->output = NULL;
 	login->xtea[0] = decode_u32_le(decoded + 0);
 	login->xtea[1] = decode_u32_le(decoded + 4);
 	login->xtea[2] = decode_u32_le(decoded + 8);
 	login->xtea[3] = decode_u32_le(decoded + 12);
 
-	if(version < TIBIA_CLIENT_VERSION_MIN || version > TIBIA_CLIENT_VERSION_MAX){
-		internal_send_disconnect(login, "This server requires client"
-			" version " TIBIA_CLIENT_VERSION_STR ".");
-		return PROTO_CLOSE;
-	}
-
 	// the client doesn't allow for account name or password to be
 	// larger than 30 bytes
 	A = decode_tibia_string(decoded + 16, login->accname, sizeof(login->accname));
 	B = (A > 32) ? 0
 		: decode_tibia_string(decoded + 16 + A,
 			login->password, sizeof(login->password));
+	// the key and credentials were copied out
+	memset(login->u.rsa, 0, sizeof(login->u.rsa));
+
+	if(login->version < TIBIA_CLIENT_VERSION_MIN
+			|| login->version > TIBIA_CLIENT_VERSION_MAX){
+		internal_send_disconnect(login, "This server requires client"
+			" version " TIBIA_CLIENT_VERSION_STR ".");
+		cont_release(k);
+		return;
+	}
+
 	if(A > 32 || B > 32){
 		internal_send_disconnect(login, "Your account has been banned.");
-		return PROTO_CLOSE;
+		cont_release(k);
+		return;
 	}
 
 	DEBUG_LOG("account_login");
 	DEBUG_LOG("xtea = {%08X, %08X, %08X, %08X}",
 		login->xtea[0], login->xtea[1],
 		login->xtea[2], login->xtea[3]);
-	LOG("accname = '%s', password = '%s'",
-		login->accname, login->password);
+	LOG("accname = '%s'", login->accname);
+
+	// the response is queued on the wrap stage (either right away
+	// from the account cache or later from the database) and the
+	// connection is closed once it's written (see `on_write`)
+	cont_start(k);
+}
 
-	if(!db_add_task(database_resolve_login, login)){
-		internal_send_disconnect(login, "Internal error. Try again later.");
+static protocol_status_t on_recv_first_message(uint32 c, uint8 *data, uint32 datalen){
+	struct login_info *login;
+	struct cont *k;
+	uint16 version;
+
+	if(datalen != 149){
+		DEBUG_LOG("protocol_login: invalid login message length"
+			" (expected = %d, got = %d)", 149, datalen);
+		return PROTO_CLOSE;
+	}
+
+	version = decode_u16_le(data + 7);
+	// version <= 760 didn't have RSA + XTEA encryption
+	// version <  830 didn't have checksum
+	// shouldn't happen unless it's a purposely malformed message
+	if(version < 830)
+		return PROTO_CLOSE;
+
+	// rsa decode (the rest of the message is handled
+	// by `on_rsa_decoded`)
+	k = cont_create(login_flow, sizeof(struct login_info));
+	login = CONT_DATA(k, struct login_info);
+	login->connection = c;
+	login->output = NULL;
+	login->version = version;
+	memcpy(login->u.rsa, data + 21, 128);
+	if(!tibia_rsa_decode_async(login->u.rsa, 128, on_rsa_decoded, k)){
+		// too many logins waiting
+		cont_release(k);
 		return PROTO_CLOSE;
 	}
 	return PROTO_STOP_READING;
@@ -33,6 +33,7 @@
 #define CONN_CLOSING			0x02
 #define CONN_FIRST_MSG			0x04
 #define CONN_OUTPUT_IN_PROGRESS		0x08
+#define CONN_READ_STOPPED		0x10
 
 struct conn_ctl{
 	uint32 uid;
@@ -256,7 +257,10 @@ static void internal_on_read_body(void *data, DWORD err, DWORD transferred){
 	// dispatch message to protocol
 	switch(internal_dispatch_on_recv_message(c, buf, c->bodylen)){
 	case PROTO_OK: break;
-	case PROTO_STOP_READING: return;
+	case PROTO_STOP_READING:
+		// until `connection_resume_reading`
+		c->flags |= CONN_READ_STOPPED;
+		return;
 	case PROTO_CLOSE:
 		internal_close(c);
 		return;
@@ -530,6 +534,16 @@ void connection_abort(uint32 uid){
 		internal_abort(c);
 }
 
+bool connection_resume_reading(uint32 uid){
+	struct conn_ctl *c = CONN_CTL(uid);
+	if(c->uid != uid || (c->flags & CONN_CLOSING)
+			|| !(c->flags & CONN_READ_STOPPED))
+		return false;
+	c->flags &= ~CONN_READ_STOPPED;
+	internal_async_read(c, CONN_INPUT_BUF(c), 2, internal_on_read_length);
+	return true;
+}
+
 void **connection_userdata(uint32 uid){
 	struct conn_ctl *c = CONN_CTL(uid);
 	if(c->uid == uid)
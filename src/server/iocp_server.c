@@ -1,5 +1,6 @@
 #include "iocp.h"
 #include "../log.h"
+#include "../trace.h"
 
 #ifdef PLATFORM_WINDOWS
 
@@ -128,11 +129,12 @@ void server_internal_shutdown(void){
 void server_internal_work(void){
 	// timeout
 	static int64 next_timeout_check = 0;
-	int64 now;
+	int64 now, start;
 
 	// events
 	OVERLAPPED_ENTRY evs[MAX_EVENTS];
 	struct async_ov *ov;
+	void (*complete)(void*, DWORD, DWORD);
 	DWORD error, transferred, flags;
 	ULONG ev_count, i;
 	BOOL ret;
@@ -159,7 +161,11 @@ void server_internal_work(void){
 				&transferred, FALSE, &flags);
 			if(ret)	error = NOERROR;
 			else	error = WSAGetLastError();
-			ov->complete(ov->data, error, transferred);
+			// `ov` may be released by `complete`
+			complete = ov->complete;
+			start = trace_begin();
+			complete(ov->data, error, transferred);
+			trace_end(TRACE_CAT_NET, (void*)complete, start);
 		}
 	}
 }
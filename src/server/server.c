@@ -1,5 +1,7 @@
 #include "server.h"
+#include "../cont.h"
 #include "../thread.h"
+#include "../trace.h"
 
 /* these will depend on the OS */
 bool server_internal_init(void);
@@ -19,6 +21,8 @@ void *server_thread(void *unused){
 	void (*fp)(void*);
 	void *arg;
 
+	trace_thread_name("server");
+	cont_set_thread_domain(CONT_DOMAIN_NET);
 	while(1){
 		mutex_lock(&mtx);
 		// check if still running
@@ -13,6 +13,9 @@ bool svcmgr_add_protocol(struct protocol *protocol, int port);
 // connection interface
 void connection_close(uint32 uid);
 void connection_abort(uint32 uid);
+// resumes reading messages after the protocol returned
+// PROTO_STOP_READING (returns false if it wasn't stopped)
+bool connection_resume_reading(uint32 uid);
 // `connection_userdata` will not fail while the connection is alive
 // so it can't fail when used inside the protocol callbacks but might
 // if used elsewhere returning NULL in that case
@@ -0,0 +1,82 @@
+#include "task.h"
+#include "log.h"
+#include "thread.h"
+
+#define MAX_TASK_QUEUES 64
+
+struct task_queue_entry{
+	void *queue;
+	char name[TASK_QUEUE_MAX_NAME];
+	void (*get_stats)(void*, struct task_queue_stats*);
+};
+
+static bool initialized = false;
+static mutex_t queues_mtx;
+static uint32 num_queues;
+static struct task_queue_entry queues[MAX_TASK_QUEUES];
+
+bool task_init(void){
+	mutex_init(&queues_mtx);
+	num_queues = 0;
+	initialized = true;
+	return true;
+}
+
+void task_shutdown(void){
+	initialized = false;
+	mutex_destroy(&queues_mtx);
+}
+
+void task_queue_register(void *queue, const char *name,
+		void (*get_stats)(void*, struct task_queue_stats*)){
+	struct task_queue_entry *entry;
+	// queues created before `task_init` (or without it
+	// like in tests) won't be reported
+	if(!initialized)
+		return;
+	mutex_lock(&queues_mtx);
+	if(num_queues < MAX_TASK_QUEUES){
+		entry = &queues[num_queues];
+		entry->queue = queue;
+		kpl_strncpy(entry->name, sizeof(entry->name), name);
+		entry->get_stats = get_stats;
+		num_queues += 1;
+	}else{
+		LOG_WARNING("task_queue_register: too many queues"
+			" (`%s` won't be reported)", name);
+	}
+	mutex_unlock(&queues_mtx);
+}
+
+void task_queue_unregister(void *queue){
+	if(!initialized)
+		return;
+	mutex_lock(&queues_mtx);
+	for(uint32 i = 0; i < num_queues; i += 1){
+		if(queues[i].queue == queue){
+			num_queues -= 1;
+			queues[i] = queues[num_queues];
+			break;
+		}
+	}
+	mutex_unlock(&queues_mtx);
+}
+
+void task_queue_report(void){
+	struct task_queue_stats stats;
+	struct task_queue_entry *entry;
+	if(!initialized)
+		return;
+	mutex_lock(&queues_mtx);
+	for(uint32 i = 0; i < num_queues; i += 1){
+		entry = &queues[i];
+		entry->get_stats(entry->queue, &stats);
+		LOG("queue `%s`: pending = %u, high water = %u/%u+%u,"
+			" spilled = %llu, rejected = %llu, blocked = %llu"
+			" (%lldus)", entry->name, stats.pending,
+			stats.high_water, stats.capacity, stats.max_overflow,
+			stats.num_spilled, stats.num_rejected,
+			stats.num_blocked, stats.blocked_time / 1000);
+	}
+	mutex_unlock(&queues_mtx);
+}
@@ -0,0 +1,42 @@
+#ifndef KAPLAR_TASK_H_
+#define KAPLAR_TASK_H_ 1
+
+#include "common.h"
+
+struct task{
+	void (*fp)(void*);
+	void *arg;
+};
+
+// task queue stats
+//	NOTES:
+//	- `capacity` is the number of tasks a queue holds before it
+//	starts spilling into its overflow segment and `max_overflow` is
+//	how many extra tasks the overflow segment can grow to hold.
+//	- `high_water` is the maximum number of pending tasks seen.
+//	- `num_blocked` and `blocked_time` (ns) count the time producers
+//	spent blocked because both the queue and its overflow were full.
+//	- `num_rejected` counts failed `try` submissions.
+struct task_queue_stats{
+	uint32 capacity;
+	uint32 max_overflow;
+	uint32 pending;
+	uint32 high_water;
+	uint64 num_spilled;
+	uint64 num_rejected;
+	uint64 num_blocked;
+	int64 blocked_time;
+};
+
+// task queue registry
+//	- Every task queue registers itself on creation so that all of
+//	them can be reported from a single place with `task_queue_report`.
+#define TASK_QUEUE_MAX_NAME 32
+bool task_init(void);
+void task_shutdown(void);
+void task_queue_register(void *queue, const char *name,
+		void (*get_stats)(void*, struct task_queue_stats*));
+void task_queue_unregister(void *queue);
+void task_queue_report(void);
+
+#endif //KAPLAR_TASK_H_
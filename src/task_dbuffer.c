@@ -1,4 +1,5 @@
 #include "task_dbuffer.h"
+#include "trace.h"
 
 struct task_dbuffer{
 	mutex_t write_lock;
@@ -6,57 +7,120 @@ struct task_dbuffer{
 	bool active;
 	int write_idx;
 	uint32 max_tasks;
+	uint32 max_overflow;
 	uint32 count[2];
+	uint32 capacity[2];
 	struct task *buffer[2];
+	struct task_queue_stats stats;
 };
 
-struct task_dbuffer *task_dbuffer_create(uint32 max_tasks){
+static void get_stats(void *db, struct task_queue_stats *out_stats){
+	task_dbuffer_stats(db, out_stats);
+}
+
+struct task_dbuffer *task_dbuffer_create(const char *name,
+		uint32 max_tasks, uint32 max_overflow){
 	struct task_dbuffer *db = kpl_malloc(sizeof(struct task_dbuffer));
 	mutex_init(&db->write_lock);
 	condvar_init(&db->buffer_full);
 	db->active = true;
 	db->write_idx = 0;
 	db->max_tasks = max_tasks;
+	db->max_overflow = max_overflow;
 	db->count[0] = 0;
 	db->count[1] = 0;
-	db->buffer[0] = kpl_malloc(sizeof(struct task) * max_tasks * 2);
-	db->buffer[1] = db->buffer[0] + max_tasks;
+	db->capacity[0] = max_tasks;
+	db->capacity[1] = max_tasks;
+	db->buffer[0] = kpl_malloc(sizeof(struct task) * max_tasks);
+	db->buffer[1] = kpl_malloc(sizeof(struct task) * max_tasks);
+	memset(&db->stats, 0, sizeof(struct task_queue_stats));
+	db->stats.capacity = max_tasks;
+	db->stats.max_overflow = max_overflow;
+	task_queue_register(db, name, get_stats);
 	return db;
 }
 
 void task_dbuffer_destroy(struct task_dbuffer *db){
+	task_queue_unregister(db);
 	mutex_destroy(&db->write_lock);
 	condvar_destroy(&db->buffer_full);
 	kpl_free(db->buffer[0]);
+	kpl_free(db->buffer[1]);
 	kpl_free(db);
 }
 
+// returns false if the write buffer can't hold another task
+// (must be called with the write lock held)
+static bool task_dbuffer_reserve(struct task_dbuffer *db, int idx){
+	uint32 limit, capacity;
+	if(db->count[idx] < db->capacity[idx])
+		return true;
+	// grow into the overflow segment
+	limit = db->max_tasks + db->max_overflow;
+	if(db->capacity[idx] >= limit)
+		return false;
+	capacity = MIN(db->capacity[idx] * 2, limit);
+	db->buffer[idx] = kpl_realloc(db->buffer[idx],
+		sizeof(struct task) * capacity);
+	db->capacity[idx] = capacity;
+	return true;
+}
+
+static void task_dbuffer_push(struct task_dbuffer *db,
+		int idx, void (*fp)(void*), void *arg){
+	struct task *task = &db->buffer[idx][db->count[idx]];
+	task->fp = fp;
+	task->arg = arg;
+	db->count[idx] += 1;
+	if(db->count[idx] > db->max_tasks)
+		db->stats.num_spilled += 1;
+	if(db->count[idx] > db->stats.high_water)
+		db->stats.high_water = db->count[idx];
+}
+
 bool task_dbuffer_add(struct task_dbuffer *db, void (*fp)(void*), void *arg){
-	struct task *task;
-	uint32 count;
+	int64 block_start;
 	int idx;
 
 	mutex_lock(&db->write_lock);
 	idx = db->write_idx;
-	count = db->count[idx];
-	while(count >= db->max_tasks && db->active){
-		condvar_wait(&db->buffer_full, &db->write_lock);
-		count = db->count[idx];
+	if(db->active && !task_dbuffer_reserve(db, idx)){
+		block_start = kpl_clock_monotonic_nsec();
+		do{
+			condvar_wait(&db->buffer_full, &db->write_lock);
+			// buffers may have been swapped while waiting
+			idx = db->write_idx;
+		}while(db->active && !task_dbuffer_reserve(db, idx));
+		db->stats.num_blocked += 1;
+		db->stats.blocked_time += kpl_clock_monotonic_nsec() - block_start;
 	}
 	if(!db->active){
 		mutex_unlock(&db->write_lock);
 		return false;
 	}
-	task = &db->buffer[idx][count];
-	task->fp = fp;
-	task->arg = arg;
-	db->count[idx] += 1;
+	task_dbuffer_push(db, idx, fp, arg);
 	mutex_unlock(&db->write_lock);
 	return true;
 }
 
-void task_dbuffer_swap_and_run(struct task_dbuffer *db){
-	struct task *task;
+bool task_dbuffer_try_add(struct task_dbuffer *db, void (*fp)(void*), void *arg){
+	int idx;
+	mutex_lock(&db->write_lock);
+	idx = db->write_idx;
+	if(!db->active || !task_dbuffer_reserve(db, idx)){
+		if(db->active)
+			db->stats.num_rejected += 1;
+		mutex_unlock(&db->write_lock);
+		return false;
+	}
+	task_dbuffer_push(db, idx, fp, arg);
+	mutex_unlock(&db->write_lock);
+	return true;
+}
+
+// swaps buffers and returns the tasks that were queued until now
+// in `out_tasks` (they're valid until the next swap)
+uint32 task_dbuffer_swap(struct task_dbuffer *db, struct task **out_tasks){
 	uint32 count;
 	int idx;
 
@@ -64,23 +128,40 @@ void task_dbuffer_swap_and_run(struct task_dbuffer *db){
 	// get write buffer info
 	idx = db->write_idx;
 	count = db->count[idx];
-	task = &db->buffer[idx][0];
-	// swap buffers
+	*out_tasks = &db->buffer[idx][0];
+	// swap buffers (the old read buffer is done by now
+	// so if it grew into the overflow, shrink it back)
 	db->write_idx = 1 - db->write_idx;
 	db->count[db->write_idx] = 0;
+	if(db->capacity[db->write_idx] > db->max_tasks){
+		db->buffer[db->write_idx] = kpl_realloc(db->buffer[db->write_idx],
+			sizeof(struct task) * db->max_tasks);
+		db->capacity[db->write_idx] = db->max_tasks;
+	}
 	// signal any thread that may be waiting for
 	// a free buffer slot
-	if(count >= db->max_tasks)
+	if(count >= db->max_tasks + db->max_overflow)
 		condvar_broadcast(&db->buffer_full);
 	mutex_unlock(&db->write_lock);
+	return count;
+}
+
+// returns the number of tasks that were run
+uint32 task_dbuffer_swap_and_run(struct task_dbuffer *db){
+	struct task *task;
+	uint32 count, ret;
 
 	// run queued tasks (this is OK because `swap_and_run`
 	// should only be called from a single thread!)
+	ret = count = task_dbuffer_swap(db, &task);
 	while(count > 0){
+		int64 start = trace_begin();
 		task->fp(task->arg);
+		trace_end(TRACE_CAT_TASK, (void*)task->fp, start);
 		task += 1;
 		count -= 1;
 	}
+	return ret;
 }
 
 void task_dbuffer_set_inactive(struct task_dbuffer *db){
@@ -89,3 +170,10 @@ void task_dbuffer_set_inactive(struct task_dbuffer *db){
 	condvar_broadcast(&db->buffer_full);
 	mutex_unlock(&db->write_lock);
 }
+
+void task_dbuffer_stats(struct task_dbuffer *db, struct task_queue_stats *out_stats){
+	mutex_lock(&db->write_lock);
+	*out_stats = db->stats;
+	out_stats->pending = db->count[db->write_idx];
+	mutex_unlock(&db->write_lock);
+}
@@ -2,18 +2,25 @@
 #define KAPLAR_TASK_DBUFFER_H_ 1
 
 #include "common.h"
+#include "task.h"
 #include "thread.h"
 
-struct task{
-	void (*fp)(void*);
-	void *arg;
-};
-
+// task double buffer
+//	NOTES:
+//	- Each buffer holds `max_tasks` tasks and may grow to hold
+//	`max_overflow` more to absorb bursts. Buffers shrink back to
+//	their original size once they are swapped out.
+//	- `task_dbuffer_add` will only block if both the buffer and its
+//	overflow are full while `task_dbuffer_try_add` will fail instead.
 struct task_dbuffer;
-struct task_dbuffer *task_dbuffer_create(uint32 max_tasks);
+struct task_dbuffer *task_dbuffer_create(const char *name,
+		uint32 max_tasks, uint32 max_overflow);
 void task_dbuffer_destroy(struct task_dbuffer *db);
 bool task_dbuffer_add(struct task_dbuffer *db, void (*fp)(void*), void *arg);
-void task_dbuffer_swap_and_run(struct task_dbuffer *db);
+bool task_dbuffer_try_add(struct task_dbuffer *db, void (*fp)(void*), void *arg);
+uint32 task_dbuffer_swap(struct task_dbuffer *db, struct task **out_tasks);
+uint32 task_dbuffer_swap_and_run(struct task_dbuffer *db);
 void task_dbuffer_set_inactive(struct task_dbuffer *db);
+void task_dbuffer_stats(struct task_dbuffer *db, struct task_queue_stats *out_stats);
 
 #endif //KAPLAR_TASK_DBUFFER_H_
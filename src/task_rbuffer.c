@@ -1,5 +1,8 @@
 #include "task_rbuffer.h"
 #include "thread.h"
+#include "trace.h"
+
+#define MIN_OVERFLOW_CAPACITY 64
 
 struct task_rbuffer{
 	mutex_t lock;
@@ -9,10 +12,24 @@ struct task_rbuffer{
 	uint32 index_mask;
 	uint32 readpos;
 	uint32 writepos;
+
+	// overflow segment (a growable ring of its own)
+	uint32 max_overflow;
+	uint32 overflow_head;
+	uint32 overflow_count;
+	uint32 overflow_capacity;
+	struct task *overflow;
+
+	struct task_queue_stats stats;
 	struct task buffer[];
 };
 
-struct task_rbuffer *task_rbuffer_create(uint32 max_tasks){
+static void get_stats(void *rb, struct task_queue_stats *out_stats){
+	task_rbuffer_stats(rb, out_stats);
+}
+
+struct task_rbuffer *task_rbuffer_create(const char *name,
+		uint32 max_tasks, uint32 max_overflow){
 	ASSERT(IS_POWER_OF_TWO(max_tasks));
 	struct task_rbuffer *rb = kpl_malloc(
 		sizeof(struct task_rbuffer) +
@@ -24,13 +41,25 @@ struct task_rbuffer *task_rbuffer_create(uint32 max_tasks){
 	rb->index_mask = max_tasks - 1;
 	rb->readpos = 0;
 	rb->writepos = 0;
+	rb->max_overflow = max_overflow;
+	rb->overflow_head = 0;
+	rb->overflow_count = 0;
+	rb->overflow_capacity = 0;
+	rb->overflow = NULL;
+	memset(&rb->stats, 0, sizeof(struct task_queue_stats));
+	rb->stats.capacity = max_tasks;
+	rb->stats.max_overflow = max_overflow;
+	task_queue_register(rb, name, get_stats);
 	return rb;
 }
 
 void task_rbuffer_destroy(struct task_rbuffer *rb){
+	task_queue_unregister(rb);
 	mutex_destroy(&rb->lock);
 	condvar_destroy(&rb->rb_full);
 	condvar_destroy(&rb->rb_empty);
+	if(rb->overflow != NULL)
+		kpl_free(rb->overflow);
 	kpl_free(rb);
 }
 
@@ -42,29 +71,92 @@ static INLINE bool task_rbuffer_full(struct task_rbuffer *rb){
 	return (rb->writepos - rb->readpos) > rb->index_mask;
 }
 
-bool task_rbuffer_push(struct task_rbuffer *rb, void (*fp)(void*), void *arg){
+static INLINE uint32 task_rbuffer_pending(struct task_rbuffer *rb){
+	return (rb->writepos - rb->readpos) + rb->overflow_count;
+}
+
+// returns false if there is no room left in the ring or in the
+// overflow (must be called with the lock held)
+static bool task_rbuffer_reserve(struct task_rbuffer *rb){
+	uint32 old_capacity, capacity;
+	// once tasks start spilling, new tasks must go into the
+	// overflow until it drains or they would run out of order
+	if(!task_rbuffer_full(rb) && rb->overflow_count == 0)
+		return true;
+	if(rb->overflow_count < rb->overflow_capacity)
+		return true;
+	if(rb->overflow_capacity >= rb->max_overflow)
+		return false;
+
+	// grow the overflow (it's full at this point) and move
+	// the segment from `overflow_head` to the end of it
+	old_capacity = rb->overflow_capacity;
+	capacity = MAX(old_capacity * 2, MIN_OVERFLOW_CAPACITY);
+	capacity = MIN(capacity, rb->max_overflow);
+	rb->overflow = kpl_realloc(rb->overflow, sizeof(struct task) * capacity);
+	rb->overflow_capacity = capacity;
+	if(rb->overflow_head > 0){
+		memmove(&rb->overflow[capacity - (old_capacity - rb->overflow_head)],
+			&rb->overflow[rb->overflow_head],
+			sizeof(struct task) * (old_capacity - rb->overflow_head));
+		rb->overflow_head = capacity - (old_capacity - rb->overflow_head);
+	}
+	return true;
+}
+
+static void task_rbuffer_insert(struct task_rbuffer *rb,
+		void (*fp)(void*), void *arg){
 	struct task *task;
+	uint32 pending;
+	if(!task_rbuffer_full(rb) && rb->overflow_count == 0){
+		// signal a worker thread that there is a new task (this
+		// must be done on every push because there may be more
+		// than one worker waiting)
+		condvar_signal(&rb->rb_empty);
+		task = &rb->buffer[rb->writepos++ & rb->index_mask];
+	}else{
+		task = &rb->overflow[(rb->overflow_head + rb->overflow_count)
+			% rb->overflow_capacity];
+		rb->overflow_count += 1;
+		rb->stats.num_spilled += 1;
+	}
+	task->fp = fp;
+	task->arg = arg;
+	pending = task_rbuffer_pending(rb);
+	if(pending > rb->stats.high_water)
+		rb->stats.high_water = pending;
+}
+
+bool task_rbuffer_push(struct task_rbuffer *rb, void (*fp)(void*), void *arg){
+	int64 block_start;
 	mutex_lock(&rb->lock);
+	if(rb->active && !task_rbuffer_reserve(rb)){
+		// wait until there is room in the ringbuffer
+		block_start = kpl_clock_monotonic_nsec();
+		do{
+			condvar_wait(&rb->rb_full, &rb->lock);
+		}while(rb->active && !task_rbuffer_reserve(rb));
+		rb->stats.num_blocked += 1;
+		rb->stats.blocked_time += kpl_clock_monotonic_nsec() - block_start;
+	}
 	if(!rb->active){
 		mutex_unlock(&rb->lock);
 		return false;
 	}
-	if(task_rbuffer_full(rb)){
-		// wait until there is room in the ringbuffer
-		do{
-			condvar_wait(&rb->rb_full, &rb->lock);
-		}while(task_rbuffer_full(rb) && rb->active);
-		if(!rb->active){
-			mutex_unlock(&rb->lock);
-			return false;
-		}
-	}else if(task_rbuffer_empty(rb)){
-		// signal the worker thread that there is a new task
-		condvar_signal(&rb->rb_empty);
+	task_rbuffer_insert(rb, fp, arg);
+	mutex_unlock(&rb->lock);
+	return true;
+}
+
+bool task_rbuffer_try_push(struct task_rbuffer *rb, void (*fp)(void*), void *arg){
+	mutex_lock(&rb->lock);
+	if(!rb->active || !task_rbuffer_reserve(rb)){
+		if(rb->active)
+			rb->stats.num_rejected += 1;
+		mutex_unlock(&rb->lock);
+		return false;
 	}
-	task = &rb->buffer[rb->writepos++ & rb->index_mask];
-	task->fp = fp;
-	task->arg = arg;
+	task_rbuffer_insert(rb, fp, arg);
 	mutex_unlock(&rb->lock);
 	return true;
 }
@@ -73,6 +165,8 @@ bool task_rbuffer_run_one(struct task_rbuffer *rb){
 	struct task *task;
 	void (*fp)(void*);
 	void *arg;
+	int64 start;
+	bool was_full;
 	mutex_lock(&rb->lock);
 	if(!rb->active){
 		mutex_unlock(&rb->lock);
@@ -87,16 +181,28 @@ bool task_rbuffer_run_one(struct task_rbuffer *rb){
 			mutex_unlock(&rb->lock);
 			return false;
 		}
-	}else if(task_rbuffer_full(rb)){
-		// signal any thread waiting for there to be room in the ringbuffer
-		condvar_signal(&rb->rb_full);
 	}
+	was_full = task_rbuffer_pending(rb) >=
+		(rb->index_mask + 1 + rb->max_overflow);
 	task = &rb->buffer[rb->readpos++ & rb->index_mask];
 	fp = task->fp;
 	arg = task->arg;
+	if(rb->overflow_count > 0){
+		// move the oldest spilled task into the slot we just freed
+		task = &rb->buffer[rb->writepos++ & rb->index_mask];
+		*task = rb->overflow[rb->overflow_head];
+		rb->overflow_head = (rb->overflow_head + 1) % rb->overflow_capacity;
+		rb->overflow_count -= 1;
+	}
+	if(was_full){
+		// signal any thread waiting for there to be room in the ringbuffer
+		condvar_signal(&rb->rb_full);
+	}
 	mutex_unlock(&rb->lock);
 
+	start = trace_begin();
 	fp(arg);
+	trace_end(TRACE_CAT_TASK, (void*)fp, start);
 	return true;
 }
 
@@ -107,3 +213,10 @@ void task_rbuffer_set_inactive(struct task_rbuffer *rb){
 	condvar_broadcast(&rb->rb_empty);
 	mutex_unlock(&rb->lock);
 }
+
+void task_rbuffer_stats(struct task_rbuffer *rb, struct task_queue_stats *out_stats){
+	mutex_lock(&rb->lock);
+	*out_stats = rb->stats;
+	out_stats->pending = task_rbuffer_pending(rb);
+	mutex_unlock(&rb->lock);
+}
@@ -2,18 +2,24 @@
 #define KAPLAR_TASK_RBUFFER_H_ 1
 
 #include "common.h"
+#include "task.h"
 
-struct task{
-	void (*fp)(void*);
-	void *arg;
-};
-
+// task ring buffer
+//	NOTES:
+//	- When the ring is full, tasks spill into an overflow segment
+//	that grows up to `max_overflow` tasks. Tasks are moved back into
+//	the ring as it drains so the execution order is preserved.
+//	- `task_rbuffer_push` will only block if both the ring and its
+//	overflow are full while `task_rbuffer_try_push` will fail instead.
 struct task_rbuffer;
-struct task_rbuffer *task_rbuffer_create(uint32 max_tasks);
+struct task_rbuffer *task_rbuffer_create(const char *name,
+		uint32 max_tasks, uint32 max_overflow);
 void task_rbuffer_destroy(struct task_rbuffer *rb);
 bool task_rbuffer_push(struct task_rbuffer *rb, void (*fp)(void*), void *arg);
+bool task_rbuffer_try_push(struct task_rbuffer *rb, void (*fp)(void*), void *arg);
 bool task_rbuffer_run_one(struct task_rbuffer *rb);
 void task_rbuffer_set_inactive(struct task_rbuffer *rb);
+void task_rbuffer_stats(struct task_rbuffer *rb, struct task_queue_stats *out_stats);
 
 
 #endif //KAPLAR_TASK_RBUFFER_H_
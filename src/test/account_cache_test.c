@@ -0,0 +1,109 @@
+#include "../common.h"
+#ifdef BUILD_TEST
+
+#include "../account_cache.h"
+#include "../log.h"
+
+#include <stdio.h>
+
+static void make_account(struct cached_account *acc, int32 id){
+	memset(acc, 0, sizeof(struct cached_account));
+	acc->account_id = id;
+	acc->premend = id * 1000;
+	snprintf(acc->password, sizeof(acc->password), "pwd%d", id);
+	acc->num_chars = 1;
+	snprintf(acc->chars[0], sizeof(acc->chars[0]), "char%d", id);
+}
+
+static void insert_account(const char *accname, int32 id){
+	struct cached_account acc;
+	make_account(&acc, id);
+	account_cache_insert(account_cache_load_begin(), accname, &acc);
+}
+
+static bool lookup_id(const char *accname, int32 *out_id){
+	struct cached_account acc;
+	if(!account_cache_lookup(accname, &acc))
+		return false;
+	*out_id = acc.account_id;
+	return true;
+}
+
+static bool lru_test(void){
+	int32 id;
+	bool ret;
+	account_cache_init_params(4, 60000);
+	insert_account("a", 1);
+	insert_account("b", 2);
+	insert_account("c", 3);
+	insert_account("d", 4);
+	// touch `a` so `b` is the least recently used
+	lookup_id("a", &id);
+	insert_account("e", 5);
+	ret = !lookup_id("b", &id)
+		&& lookup_id("a", &id) && id == 1
+		&& lookup_id("e", &id) && id == 5
+		// keys are case insensitive
+		&& lookup_id("C", &id) && id == 3;
+	account_cache_shutdown();
+	return ret;
+}
+
+static bool invalidation_test(void){
+	struct cached_account acc;
+	uint32 ticket;
+	int32 id;
+	bool ret;
+	account_cache_init_params(16, 60000);
+	insert_account("acc1", 1);
+	insert_account("acc2", 2);
+	insert_account("acc3", 3);
+	account_cache_invalidate("ACC1");
+	account_cache_invalidate_id(2);
+	ret = !lookup_id("acc1", &id)
+		&& !lookup_id("acc2", &id)
+		&& lookup_id("acc3", &id);
+
+	// a load that raced with an invalidation must be dropped
+	make_account(&acc, 4);
+	ticket = account_cache_load_begin();
+	account_cache_invalidate_id(4);
+	account_cache_insert(ticket, "acc4", &acc);
+	ret = ret && !lookup_id("acc4", &id);
+
+	account_cache_clear();
+	ret = ret && !lookup_id("acc3", &id);
+	account_cache_shutdown();
+	return ret;
+}
+
+static bool ttl_test(void){
+	int32 id;
+	bool ret;
+	account_cache_init_params(16, 5);
+	insert_account("acc", 1);
+	ret = lookup_id("acc", &id);
+	kpl_sleep_msec(10);
+	ret = ret && !lookup_id("acc", &id);
+	account_cache_shutdown();
+	return ret;
+}
+
+bool account_cache_test(void){
+	bool ret = true;
+	if(!lru_test()){
+		LOG_ERROR("account_cache_test: lru test failed");
+		ret = false;
+	}
+	if(!invalidation_test()){
+		LOG_ERROR("account_cache_test: invalidation test failed");
+		ret = false;
+	}
+	if(!ttl_test()){
+		LOG_ERROR("account_cache_test: ttl test failed");
+		ret = false;
+	}
+	return ret;
+}
+
+#endif //BUILD_TEST
@@ -0,0 +1,119 @@
+#include "../common.h"
+#ifdef BUILD_TEST
+
+#include "../log.h"
+#include "test_util.h"
+
+// larger than NMAX so the reductions are exercised
+#define MAX_LEN 65536
+static uint8 buf[MAX_LEN];
+
+static uint32 rng_state = 0x2545F491;
+
+static bool check_vector(void){
+	static const uint8 msg[] = "Wikipedia";
+	for(int impl = 0; impl < ADLER32_NUM_IMPLS; impl += 1){
+		if(!adler32_impl_supported(impl))
+			continue;
+		if(adler32_impl(impl, 1, msg, 9) != 0x11E60398){
+			LOG_ERROR("adler32_test: %s: invalid checksum",
+				adler32_impl_name(impl));
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool check_impl(int impl, uint32 adler, size_t len){
+	uint32 expected = adler32_impl(ADLER32_IMPL_SCALAR, adler, buf, len);
+	uint32 result = adler32_impl(impl, adler, buf, len);
+	if(result != expected){
+		LOG_ERROR("adler32_test: %s: mismatch (len = %d, got %08X,"
+			" expected %08X)", adler32_impl_name(impl),
+			(int)len, result, expected);
+		return false;
+	}
+	return true;
+}
+
+// every implementation must match the scalar one on random data
+// with random lengths and starting values, and on all 0xFF bytes
+// which is the worst case for the accumulators
+static bool check_impls(void){
+	uint32 adler;
+	size_t len;
+	for(int impl = 1; impl < ADLER32_NUM_IMPLS; impl += 1){
+		if(!adler32_impl_supported(impl)){
+			LOG("adler32_test: %s not supported", adler32_impl_name(impl));
+			continue;
+		}
+		for(size_t i = 0; i < MAX_LEN; i += 1)
+			buf[i] = (uint8)test_rng_next(&rng_state);
+		for(len = 0; len <= 300; len += 1){
+			if(!check_impl(impl, 1, len))
+				return false;
+		}
+		for(int i = 0; i < 1000; i += 1){
+			len = test_rng_next(&rng_state) % (MAX_LEN + 1);
+			adler = (test_rng_next(&rng_state) % 65521) | ((test_rng_next(&rng_state) % 65521) << 16);
+			if(!check_impl(impl, adler, len))
+				return false;
+		}
+		memset(buf, 0xFF, MAX_LEN);
+		if(!check_impl(impl, 0xFFF0FFF0, MAX_LEN))
+			return false;
+	}
+	return true;
+}
+
+// checksums computed in pieces must match the whole buffer
+static bool check_update(void){
+	uint32 expected, adler;
+	size_t off, len;
+	for(size_t i = 0; i < MAX_LEN; i += 1)
+		buf[i] = (uint8)test_rng_next(&rng_state);
+	expected = adler32(buf, MAX_LEN);
+	adler = 1;
+	for(off = 0; off < MAX_LEN; off += len){
+		len = MIN(test_rng_next(&rng_state) % 4096, MAX_LEN - off);
+		adler = adler32_update(adler, buf + off, len);
+	}
+	if(adler != expected){
+		LOG_ERROR("adler32_test: update mismatch");
+		return false;
+	}
+	return true;
+}
+
+static void bench(void){
+	static const size_t sizes[] = {16, 64, 256, 1024, 4096, 16384};
+	int64 start, elapsed;
+	size_t total = 32 << 20;
+	volatile uint32 sink = 0;
+	int iterations;
+
+	for(int i = 0; i < (int)ARRAY_SIZE(sizes); i += 1){
+		iterations = (int)(total / sizes[i]);
+		for(int impl = 0; impl < ADLER32_NUM_IMPLS; impl += 1){
+			if(!adler32_impl_supported(impl))
+				continue;
+			start = kpl_clock_monotonic_nsec();
+			for(int j = 0; j < iterations; j += 1)
+				sink += adler32_impl(impl, 1, buf, sizes[i]);
+			elapsed = kpl_clock_monotonic_nsec() - start;
+			LOG("adler32_bench: %-6s %5d bytes: %7.1f MB/s (%lldns per message)",
+				adler32_impl_name(impl), (int)sizes[i],
+				(double)total / (1 << 20) / (elapsed / 1e9),
+				elapsed / iterations);
+		}
+	}
+}
+
+bool adler32_test(void){
+	if(!check_vector() || !check_impls() || !check_update())
+		return false;
+	bench();
+	return true;
+}
+
+#endif //BUILD_TEST
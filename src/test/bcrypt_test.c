@@ -1,23 +1,149 @@
-// REMAKE
-#if 0
-
-#include "../log.h"
-#include "../crypto/bcrypt.h"
-
-static const char pw[] = "h4rdp455w0rd";
-bool bcrypt_test(void){
-	char hash[255];
-	LOG("password: %s", pw);
-	if(!bcrypt_newhash(pw, 10, hash, 255)){
-		LOG_ERROR("failed to create hash");
-		return false;
-	}
-	LOG("hash: %s", hash);
-	if(bcrypt_checkpass(pw, hash))
-		LOG("password hash check passed");
-	else
-		LOG("password hash check failed");
-	return false;
-}
-
-#endif
+#include "../common.h"
+#ifdef BUILD_TEST
+
+#include "../log.h"
+#include "test_util.h"
+#include "../crypto/base64.h"
+#include "../crypto/bcrypt.h"
+#include "../crypto/blowfish.h"
+
+#include <stdio.h>
+
+// known vectors from the original OpenBSD implementation
+// (also used by crypt_blowfish and most other ports)
+static const struct{
+	const char *password;
+	const char *hash;
+} vectors[] = {
+	{"U*U", "$2a$05$CCCCCCCCCCCCCCCCCCCCC.E5YPO9kmyuRGyh0XouQYb4YMJKvyOeW"},
+	{"U*U*", "$2a$05$CCCCCCCCCCCCCCCCCCCCC.VGOzA784oUp/Z0DY336zx7pLYAy0lwK"},
+	{"U*U*U", "$2a$05$XXXXXXXXXXXXXXXXXXXXXOAcXxm9kjPGEMsLznoKqmqw7tc8WCx4a"},
+	{"", "$2a$05$CCCCCCCCCCCCCCCCCCCCC.7uG0VCzI2bS7j6ymqJi9CdcdxiRTWNy"},
+	{"0123456789abcdefghijklmnopqrstuvwxyz"
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789"
+		"chars after 72 are ignored",
+		"$2a$05$abcdefghijklmnopqrstuu5s2v8.iXieOjg/.AySBTTZIIVFJeBui"},
+};
+
+static bool check_vectors(void){
+	for(int i = 0; i < (int)ARRAY_SIZE(vectors); i += 1){
+		if(!bcrypt_checkpass(vectors[i].password, vectors[i].hash)){
+			LOG_ERROR("bcrypt_test: vector %d failed", i);
+			return false;
+		}
+		if(bcrypt_hash_cost(vectors[i].hash) != 5){
+			LOG_ERROR("bcrypt_test: vector %d has the wrong cost", i);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool check_newhash(void){
+	static const char pw[] = "h4rdp455w0rd";
+	char hash[BCRYPT_HASH_STRLEN];
+	if(!bcrypt_newhash(pw, 6, hash, sizeof(hash))){
+		LOG_ERROR("bcrypt_test: failed to create hash");
+		return false;
+	}
+	if(strlen(hash) != BCRYPT_HASH_STRLEN - 1
+	|| bcrypt_hash_cost(hash) != 6
+	|| !bcrypt_checkpass(pw, hash)
+	|| bcrypt_checkpass("h4rdp455w0rD", hash)){
+		LOG_ERROR("bcrypt_test: new hash check failed (%s)", hash);
+		return false;
+	}
+	// plaintext and malformed hashes
+	if(bcrypt_hash_cost(pw) != -1
+	|| bcrypt_hash_cost("$2a$03$CCCCCCCCCCCCCCCCCCCCC.E5YPO9kmyuRGyh0XouQYb4YMJKvyOeW") != -1
+	|| bcrypt_hash_cost("$2a$05$CCCCCCCCCCCCCCCCCCCCC.E5YPO9kmyuRGyh0XouQYb4YMJKvyOe") != -1){
+		LOG_ERROR("bcrypt_test: invalid hash accepted");
+		return false;
+	}
+	return true;
+}
+
+static uint32 rng_state = 0x6A09E667;
+
+// the straightforward bcrypt on top of the generic blowfish.c
+// (what bcrypt.c used before it had its own key schedule)
+static void reference_hash(const char *pw, const uint8 *csalt,
+		int logr, char *hash){
+	uint8 ctext[24];
+	struct blowfish_ctx b;
+	size_t keylen = MIN(strlen(pw) + 1, 72);
+	blowfish_init(&b);
+	blowfish_expandkey1(&b, (uint8*)pw, keylen, (uint8*)csalt, 16);
+	for(uint32 i = 0; i < (1U << logr); i += 1){
+		blowfish_expandkey(&b, (uint8*)pw, keylen);
+		blowfish_expandkey(&b, (uint8*)csalt, 16);
+	}
+	memcpy(ctext, "OrpheanBeholderScryDoubt", 24);
+	blowfish_ecb_encode_n(&b, 64, ctext, 24);
+	sprintf(hash, "$2b$%02d$", logr);
+	base64_encode(hash + 7, csalt, 16);
+	base64_encode(hash + 29, ctext, 23);
+}
+
+static void random_password(char *pw, int len){
+	for(int i = 0; i < len; i += 1)
+		pw[i] = (char)(test_rng_next(&rng_state) % 255 + 1);
+	pw[len] = 0;
+}
+
+// random passwords (of every length up to past the 72 byte
+// limit) and salts must hash the same as the reference
+static bool check_reference(void){
+	char pw[81], hash[BCRYPT_HASH_STRLEN];
+	uint8 csalt[16];
+	for(int len = 0; len <= 80; len += 1){
+		random_password(pw, len);
+		for(int i = 0; i < 16; i += 1)
+			csalt[i] = (uint8)test_rng_next(&rng_state);
+		reference_hash(pw, csalt, 4, hash);
+		if(!bcrypt_checkpass(pw, hash)){
+			LOG_ERROR("bcrypt_test: reference mismatch (len = %d)", len);
+			return false;
+		}
+	}
+	return true;
+}
+
+// single thread so it's the rate per core
+static void bench_report(const char *name, int cost,
+		int iterations, int64 elapsed){
+	LOG("bcrypt_bench: %-9s cost %2d: %8.1f checks/s per core"
+		" (%lldus per check)", name, cost,
+		iterations / (elapsed / 1e9), elapsed / iterations / 1000);
+}
+
+static void bench(void){
+	static const char pw[] = "h4rdp455w0rd";
+	char hash[BCRYPT_HASH_STRLEN];
+	uint8 csalt[16];
+	int64 start;
+	int iterations;
+	memset(csalt, 0x5A, sizeof(csalt));
+	for(int cost = 4; cost <= 10; cost += 2){
+		iterations = 1 << (12 - cost);
+		start = kpl_clock_monotonic_nsec();
+		for(int i = 0; i < iterations; i += 1)
+			reference_hash(pw, csalt, cost, hash);
+		bench_report("reference", cost, iterations,
+			kpl_clock_monotonic_nsec() - start);
+		start = kpl_clock_monotonic_nsec();
+		for(int i = 0; i < iterations; i += 1)
+			bcrypt_checkpass(pw, hash);
+		bench_report("bcrypt", cost, iterations,
+			kpl_clock_monotonic_nsec() - start);
+	}
+}
+
+bool bcrypt_test(void){
+	if(!check_vectors() || !check_newhash() || !check_reference())
+		return false;
+	bench();
+	return true;
+}
+
+#endif //BUILD_TEST
@@ -0,0 +1,278 @@
+#include "../common.h"
+#ifdef BUILD_TEST
+
+#include "../config.h"
+#include "../game.h"
+#include "../log.h"
+#include "../thread.h"
+
+// shards 1 and 2 run on their own threads while the main shard
+// (which needs the server) is never started
+#define TEST_CONNECTION 0x00010005
+#define TEST_TIMEOUT 5000
+
+// must match the config in `game_test`
+#define TEST_MAX_DEFERRAL 3
+#define TEST_LOW_TASKS 12
+
+// messages sent on each side of the handoff in `handoff_order_test`
+#define TEST_ORDER_MESSAGES 4
+
+enum{
+	EVENT_START = 0,
+	EVENT_ARRIVE,
+	EVENT_BEFORE,
+	EVENT_AFTER,
+};
+
+struct test_event{
+	int event;
+	uint32 shard;
+};
+
+static mutex_t mtx;
+static condvar_t cv;
+static int num_events;
+static struct test_event events[16];
+
+static void record(int event){
+	mutex_lock(&mtx);
+	if(num_events < (int)ARRAY_SIZE(events)){
+		events[num_events].event = event;
+		events[num_events].shard = game_current_shard();
+		num_events += 1;
+	}
+	condvar_signal(&cv);
+	mutex_unlock(&mtx);
+}
+
+static bool wait_events(int count){
+	bool ret;
+	mutex_lock(&mtx);
+	while(num_events < count){
+		if(!condvar_timedwait(&cv, &mtx, TEST_TIMEOUT))
+			break;
+	}
+	ret = num_events >= count;
+	mutex_unlock(&mtx);
+	return ret;
+}
+
+static void record_task(void *arg){
+	record((int)(intptr_t)arg);
+}
+
+static void on_arrive(void *creature){
+	record(EVENT_ARRIVE);
+}
+
+static void start_handoff(void *arg){
+	record(EVENT_START);
+	// this is queued on shard 1 before the handoff so it
+	// will be forwarded to shard 2 while in flight
+	game_try_add_connection_task(TEST_CONNECTION,
+		record_task, (void*)(intptr_t)EVENT_BEFORE);
+	game_shard_handoff(1, 2, TEST_CONNECTION, on_arrive, NULL);
+}
+
+static bool check_event(int i, int event, uint32 shard){
+	if(events[i].event != event || events[i].shard != shard){
+		LOG_ERROR("handoff_test: event %d is (%d, shard %u)"
+			" (expected (%d, shard %u))", i, events[i].event,
+			events[i].shard, event, shard);
+		return false;
+	}
+	return true;
+}
+
+// sends messages to the connection on shard 1 right before
+// and after the handoff (like the server thread would do while
+// the player walks into shard 2)
+static void start_ordered_handoff(void *arg){
+	record(EVENT_START);
+	for(int i = 0; i < TEST_ORDER_MESSAGES; i += 1){
+		game_try_add_connection_task(TEST_CONNECTION,
+			record_task, (void*)(intptr_t)EVENT_BEFORE);
+	}
+	game_shard_handoff(1, 2, TEST_CONNECTION, on_arrive, NULL);
+	// these go straight to shard 2 but must still run after
+	// the ones being forwarded from shard 1
+	for(int i = 0; i < TEST_ORDER_MESSAGES; i += 1){
+		game_try_add_connection_task(TEST_CONNECTION,
+			record_task, (void*)(intptr_t)EVENT_AFTER);
+	}
+}
+
+static bool handoff_order_test(void){
+	int count = 2 + 2 * TEST_ORDER_MESSAGES;
+	bool ret;
+	num_events = 0;
+	game_route_connection(TEST_CONNECTION, 1);
+	if(!game_shard_add_task(1, start_ordered_handoff, NULL)
+			|| !wait_events(count)){
+		LOG_ERROR("handoff_order_test: timed out (%d events)", num_events);
+		game_unroute_connection(TEST_CONNECTION);
+		return false;
+	}
+	ret = check_event(0, EVENT_START, 1)
+		&& check_event(1, EVENT_ARRIVE, 2);
+	for(int i = 0; ret && i < TEST_ORDER_MESSAGES; i += 1){
+		ret = check_event(2 + i, EVENT_BEFORE, 2)
+			&& check_event(2 + TEST_ORDER_MESSAGES + i, EVENT_AFTER, 2);
+	}
+	game_unroute_connection(TEST_CONNECTION);
+	return ret;
+}
+
+static bool handoff_test(void){
+	bool ret = false;
+	num_events = 0;
+	game_route_connection(TEST_CONNECTION, 1);
+	if(!game_shard_add_task(1, start_handoff, NULL)
+			|| !wait_events(3)){
+		LOG_ERROR("handoff_test: timed out (%d events)", num_events);
+		return false;
+	}
+	// tasks added after the handoff go straight to shard 2
+	if(!game_try_add_connection_task(TEST_CONNECTION,
+			record_task, (void*)(intptr_t)EVENT_AFTER)
+			|| !wait_events(4)){
+		LOG_ERROR("handoff_test: timed out (%d events)", num_events);
+		return false;
+	}
+	ret = check_event(0, EVENT_START, 1)
+		&& check_event(1, EVENT_ARRIVE, 2)
+		&& check_event(2, EVENT_BEFORE, 2)
+		&& check_event(3, EVENT_AFTER, 2);
+	if(ret && game_connection_shard(TEST_CONNECTION) != 2){
+		LOG_ERROR("handoff_test: connection wasn't routed to shard 2");
+		ret = false;
+	}
+	game_unroute_connection(TEST_CONNECTION);
+	return ret;
+}
+
+// low priority tasks take 1ms each so only about two of
+// them fit in the 2ms frame budget and the rest is deferred
+// until it's old enough to be promoted
+static volatile bool marker_running;
+static int frame_counter;
+static int start_frame;
+static int num_low;
+static int low_order[TEST_LOW_TASKS];
+static int low_frame[TEST_LOW_TASKS];
+
+static void frame_marker(void *arg){
+	mutex_lock(&mtx);
+	frame_counter += 1;
+	mutex_unlock(&mtx);
+	// high priority tasks added while running are
+	// only picked up on the next frame
+	if(marker_running)
+		game_shard_add_task_prio(1, GAME_TASK_HIGH, frame_marker, NULL);
+}
+
+static void low_task(void *arg){
+	int64 end = kpl_clock_monotonic_nsec() + 1000000;
+	while(kpl_clock_monotonic_nsec() < end)
+		continue;
+	mutex_lock(&mtx);
+	if(num_low < TEST_LOW_TASKS){
+		low_order[num_low] = (int)(intptr_t)arg;
+		low_frame[num_low] = frame_counter - start_frame;
+		num_low += 1;
+	}
+	condvar_signal(&cv);
+	mutex_unlock(&mtx);
+}
+
+static void start_low_tasks(void *arg){
+	mutex_lock(&mtx);
+	start_frame = frame_counter;
+	mutex_unlock(&mtx);
+	for(int i = 0; i < TEST_LOW_TASKS; i += 1)
+		game_shard_add_task_prio(1, GAME_TASK_LOW, low_task, (void*)(intptr_t)i);
+}
+
+static bool budget_test(void){
+	int per_frame[TEST_MAX_DEFERRAL + 1] = {0};
+	bool ret = true;
+	int i;
+
+	frame_counter = 0;
+	num_low = 0;
+	marker_running = true;
+	if(!game_shard_add_task_prio(1, GAME_TASK_HIGH, frame_marker, NULL)
+			|| !game_shard_add_task(1, start_low_tasks, NULL)){
+		LOG_ERROR("budget_test: failed to add tasks");
+		marker_running = false;
+		return false;
+	}
+	mutex_lock(&mtx);
+	while(num_low < TEST_LOW_TASKS){
+		if(!condvar_timedwait(&cv, &mtx, TEST_TIMEOUT))
+			break;
+	}
+	mutex_unlock(&mtx);
+	marker_running = false;
+	if(num_low < TEST_LOW_TASKS){
+		LOG_ERROR("budget_test: timed out (%d tasks)", num_low);
+		return false;
+	}
+
+	for(i = 0; i < TEST_LOW_TASKS; i += 1){
+		if(low_order[i] != i){
+			LOG_ERROR("budget_test: task %d ran out of order"
+				" (at %d)", low_order[i], i);
+			ret = false;
+		}
+		if(low_frame[i] < 0 || low_frame[i] > TEST_MAX_DEFERRAL){
+			LOG_ERROR("budget_test: task %d ran %d frames after"
+				" being added (max deferral is %d)",
+				i, low_frame[i], TEST_MAX_DEFERRAL);
+			ret = false;
+			continue;
+		}
+		per_frame[low_frame[i]] += 1;
+	}
+
+	// the budget must have deferred tasks in every frame
+	// before the remaining ones were promoted
+	for(i = 0; i < TEST_MAX_DEFERRAL; i += 1){
+		if(per_frame[i] > 3){
+			LOG_ERROR("budget_test: %d tasks ran in frame %d"
+				" (the budget fits 2)", per_frame[i], i);
+			ret = false;
+		}
+	}
+	if(per_frame[TEST_MAX_DEFERRAL] <= 3){
+		LOG_ERROR("budget_test: only %d tasks were promoted",
+			per_frame[TEST_MAX_DEFERRAL]);
+		ret = false;
+	}
+	return ret;
+}
+
+bool game_test(void){
+	static char *argv[] = {
+		"game_test",
+		"game_shards=3",
+		"tick_interval=10",
+		"game_frame_budget=2",
+		"game_max_task_deferral=3",
+		"frame_report_interval=0",
+	};
+	bool ret;
+	config_init(ARRAY_SIZE(argv), argv);
+	if(!game_init())
+		return false;
+	mutex_init(&mtx);
+	condvar_init(&cv);
+	ret = handoff_test() && handoff_order_test() && budget_test();
+	game_shutdown();
+	condvar_destroy(&cv);
+	mutex_destroy(&mtx);
+	return ret;
+}
+
+#endif //BUILD_TEST
@@ -0,0 +1,55 @@
+#include "../common.h"
+#ifdef BUILD_TEST
+
+#include "../histogram.h"
+#include "../log.h"
+
+static struct histogram hist;
+
+static bool check_error(const char *what, uint64 value, uint64 expected){
+	// buckets have a relative error of at most 1/32
+	uint64 diff = value > expected ? value - expected : expected - value;
+	if(diff > expected / HISTOGRAM_SUB_COUNT + 1){
+		LOG_ERROR("histogram_test: %s = %llu (expected %llu)",
+			what, value, expected);
+		return false;
+	}
+	return true;
+}
+
+bool histogram_test(void){
+	struct histogram other;
+	histogram_reset(&hist);
+	for(uint64 i = 1; i <= 100000; i += 1)
+		histogram_add(&hist, i * 1000);
+	if(hist.count != 100000 || hist.min != 1000 || hist.max != 100000000){
+		LOG_ERROR("histogram_test: invalid count/min/max");
+		return false;
+	}
+	if(!check_error("mean", histogram_mean(&hist), 50000500)
+	|| !check_error("p50", histogram_percentile(&hist, 50.0), 50000000)
+	|| !check_error("p90", histogram_percentile(&hist, 90.0), 90000000)
+	|| !check_error("p99", histogram_percentile(&hist, 99.0), 99000000)
+	|| histogram_percentile(&hist, 100.0) != hist.max)
+		return false;
+
+	// small values are exact
+	histogram_reset(&other);
+	for(uint64 i = 0; i < HISTOGRAM_SUB_COUNT; i += 1)
+		histogram_add(&other, i);
+	if(histogram_percentile(&other, 50.0) != HISTOGRAM_SUB_COUNT / 2 - 1){
+		LOG_ERROR("histogram_test: small values are not exact");
+		return false;
+	}
+
+	// merging keeps count/min/max
+	histogram_merge(&hist, &other);
+	if(hist.count != 100000 + HISTOGRAM_SUB_COUNT || hist.min != 0
+	|| hist.max != 100000000){
+		LOG_ERROR("histogram_test: invalid merge");
+		return false;
+	}
+	return true;
+}
+
+#endif //BUILD_TEST
@@ -10,12 +10,19 @@
 		else LOG(#name "_test: failed"); }while(0)
 
 int main(int argc, char **argv){
+	RUN_TEST(adler32);
 	//RUN_TEST(base64);
-	//RUN_TEST(bcrypt);
+	RUN_TEST(bcrypt);
 	//RUN_TEST(blowfish);
-	//RUN_TEST(rsa);
-	//RUN_TEST(xtea);
+	RUN_TEST(rsa);
+	RUN_TEST(xtea);
 
+	RUN_TEST(account_cache);
+	RUN_TEST(game);
+	RUN_TEST(histogram);
+	RUN_TEST(player_blob);
+	RUN_TEST(task);
+	RUN_TEST(pgsql);
 	//RUN_TEST(rbtree);
 	RUN_TEST(slab);
 	RUN_TEST(slab_cache);
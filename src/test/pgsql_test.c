@@ -0,0 +1,217 @@
+#include "../common.h"
+#ifdef BUILD_TEST
+
+#define DB_INTERNAL 1
+#include "../db/database.h"
+#include "../config.h"
+#include "../log.h"
+#include "../thread.h"
+
+// pgsql login benchmark
+//	NOTES:
+//	- Needs a database with `schema.pgsql` loaded, reachable with
+//	the pgsql_* config values. It's skipped if it can't connect.
+//	- Logins (account info + charlist) go through `db_load_*` on
+//	the test thread's connection, first with the query text sent
+//	on every call (how it was done before prepared statements)
+//	and then with the prepared statements. The last run sends both
+//	queries in a batch, like `protocol_login.c` does.
+//	- Then compares the throughput of account info queries executed
+//	one at a time against `db_async_load_account_info` with up to
+//	PGSQL_BENCH_ASYNC_WINDOW queries submitted at once over
+//	`db_async_connections` (set in `pgsql_test`).
+
+#define PGSQL_BENCH_LOGINS 5000
+#define PGSQL_BENCH_QUERIES 20000
+#define PGSQL_BENCH_ASYNC_WINDOW 256
+#define PGSQL_BENCH_TIMEOUT 5000
+
+// db/pgsql.c
+void pgsql_test_exec_text(bool enabled);
+
+static bool login(const char *accname){
+	struct db_account_info *info;
+	struct db_charlist *charlist;
+	info = db_load_account_info(accname);
+	if(info == NULL || !info->found){
+		LOG_ERROR("pgsql_test: failed to load account `%s`", accname);
+		if(info != NULL)
+			db_result_free(info);
+		return false;
+	}
+	charlist = db_load_account_charlist(info->account_id);
+	db_result_free(info);
+	if(charlist == NULL)
+		return false;
+	db_result_free(charlist);
+	return true;
+}
+
+static bool login_text(const char *accname){
+	bool ret;
+	pgsql_test_exec_text(true);
+	ret = login(accname);
+	pgsql_test_exec_text(false);
+	return ret;
+}
+
+// same as protocol_login.c
+static bool login_batch(const char *accname){
+	struct db_batch *batch = db_batch_create();
+	struct db_account_info *info;
+	int i_info, i_chars;
+	bool ret;
+	i_info = db_batch_load_account_info(batch, accname);
+	i_chars = db_batch_load_account_charlist_by_name(batch, accname);
+	ret = db_batch_exec(batch);
+	if(ret){
+		info = db_batch_result(batch, i_info);
+		ret = info != NULL && info->found
+			&& db_batch_result(batch, i_chars) != NULL;
+		if(!ret){
+			LOG_ERROR("pgsql_test: failed to load account `%s`"
+				" with a batch", accname);
+		}
+	}
+	db_batch_destroy(batch);
+	return ret;
+}
+
+static bool run_bench_logins(const char *name, bool (*fn)(const char*)){
+	int64 start, end;
+	bool ret = true;
+	start = kpl_clock_monotonic_nsec();
+	for(int i = 0; ret && i < PGSQL_BENCH_LOGINS; i += 1)
+		ret = fn("acctest");
+	end = kpl_clock_monotonic_nsec();
+	if(ret){
+		LOG("pgsql_test: %s: %d logins, %.2fus per login", name,
+			PGSQL_BENCH_LOGINS, (double)(end - start)
+				/ (1000.0 * PGSQL_BENCH_LOGINS));
+	}
+	return ret;
+}
+
+static bool run_bench_sync_queries(void){
+	struct db_account_info *info;
+	int64 start, end;
+	start = kpl_clock_monotonic_nsec();
+	for(int i = 0; i < PGSQL_BENCH_QUERIES; i += 1){
+		info = db_load_account_info("acctest");
+		if(info == NULL)
+			return false;
+		db_result_free(info);
+	}
+	end = kpl_clock_monotonic_nsec();
+	LOG("pgsql_test: sync: %d queries, %.2fus per query",
+		PGSQL_BENCH_QUERIES, (double)(end - start)
+			/ (1000.0 * PGSQL_BENCH_QUERIES));
+	return true;
+}
+
+// async completions run on the async thread (CONT_DOMAIN_NONE)
+static mutex_t async_mtx;
+static condvar_t async_cv;
+static int async_inflight;
+static int async_done;
+static int async_failed;
+
+static void on_async_account_info(void *res, void *arg){
+	mutex_lock(&async_mtx);
+	if(res == NULL)
+		async_failed += 1;
+	async_inflight -= 1;
+	async_done += 1;
+	condvar_signal(&async_cv);
+	mutex_unlock(&async_mtx);
+	if(res != NULL)
+		db_result_free(res);
+}
+
+static bool run_bench_async_queries(void){
+	int64 start, end;
+	int sent = 0;
+	bool ret = true;
+
+	async_inflight = 0;
+	async_done = 0;
+	async_failed = 0;
+	start = kpl_clock_monotonic_nsec();
+	mutex_lock(&async_mtx);
+	while(ret && async_done < PGSQL_BENCH_QUERIES){
+		while(sent < PGSQL_BENCH_QUERIES
+				&& async_inflight < PGSQL_BENCH_ASYNC_WINDOW){
+			async_inflight += 1;
+			sent += 1;
+			mutex_unlock(&async_mtx);
+			ret = db_async_load_account_info("acctest",
+				CONT_DOMAIN_NONE, on_async_account_info, NULL);
+			mutex_lock(&async_mtx);
+			if(!ret){
+				LOG_ERROR("pgsql_test: failed to submit async query");
+				async_inflight -= 1;
+				break;
+			}
+		}
+		if(ret && async_done < PGSQL_BENCH_QUERIES
+				&& !condvar_timedwait(&async_cv, &async_mtx,
+					PGSQL_BENCH_TIMEOUT)){
+			LOG_ERROR("pgsql_test: async queries timed out");
+			ret = false;
+		}
+	}
+	if(ret && async_failed > 0){
+		LOG_ERROR("pgsql_test: %d async queries failed", async_failed);
+		ret = false;
+	}
+	mutex_unlock(&async_mtx);
+	end = kpl_clock_monotonic_nsec();
+	if(ret){
+		LOG("pgsql_test: async (%d connections): %d queries,"
+			" %.2fus per query", config_geti("db_async_connections"),
+			PGSQL_BENCH_QUERIES, (double)(end - start)
+				/ (1000.0 * PGSQL_BENCH_QUERIES));
+	}
+	return ret;
+}
+
+bool pgsql_test(void){
+	static char *argv[] = {
+		"pgsql_test",
+		"db_async_connections=4",
+	};
+	bool ret;
+	config_init(ARRAY_SIZE(argv), argv);
+	if(!db_stats_init() || !db_internal_init())
+		return false;
+	if(!db_internal_connect()){
+		LOG_WARNING("pgsql_test: skipped (unable to connect)");
+		db_internal_shutdown();
+		db_stats_shutdown();
+		return true;
+	}
+	// warm up caches before measuring
+	ret = login("acctest")
+		&& run_bench_logins("sql text", login_text)
+		&& run_bench_logins("prepared", login)
+		&& run_bench_logins("batch", login_batch)
+		&& run_bench_sync_queries();
+	if(ret){
+		mutex_init(&async_mtx);
+		condvar_init(&async_cv);
+		ret = db_internal_async_init();
+		if(ret){
+			ret = run_bench_async_queries();
+			// this will complete anything still in flight
+			db_internal_async_shutdown();
+		}
+		condvar_destroy(&async_cv);
+		mutex_destroy(&async_mtx);
+	}
+	db_internal_connection_close();
+	db_internal_shutdown();
+	db_stats_shutdown();
+	return ret;
+}
+
+#endif //BUILD_TEST
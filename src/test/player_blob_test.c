@@ -0,0 +1,150 @@
+#include "../common.h"
+#ifdef BUILD_TEST
+
+#include "../player_blob.h"
+#include "../log.h"
+
+static bool add_item(struct player_data *pd, uint8 slot,
+		uint16 id, uint8 count, uint16 num_children){
+	struct player_item item = {slot, id, count, num_children};
+	return player_data_add_item(pd, &item);
+}
+
+static bool data_equal(const struct player_data *a, const struct player_data *b){
+	if(a->num_storage != b->num_storage || a->num_items != b->num_items)
+		return false;
+	for(int i = 0; i < PLAYER_NUM_SKILLS; i += 1){
+		if(a->skills[i].level != b->skills[i].level
+		|| a->skills[i].tries != b->skills[i].tries)
+			return false;
+	}
+	for(int i = 0; i < a->num_storage; i += 1){
+		if(a->storage[i].key != b->storage[i].key
+		|| a->storage[i].value != b->storage[i].value)
+			return false;
+	}
+	for(int i = 0; i < a->num_items; i += 1){
+		if(a->items[i].slot != b->items[i].slot
+		|| a->items[i].id != b->items[i].id
+		|| a->items[i].count != b->items[i].count
+		|| a->items[i].num_children != b->items[i].num_children)
+			return false;
+	}
+	return true;
+}
+
+static bool check_roundtrip(void){
+	struct player_data pd, out;
+	uint8 buf[1024];
+	bool upgraded;
+	int len;
+
+	player_data_init(&pd);
+	player_data_init(&out);
+	pd.skills[PLAYER_SKILL_SWORD].level = 85;
+	pd.skills[PLAYER_SKILL_SWORD].tries = 123456;
+	for(uint32 i = 0; i < 50; i += 1)
+		player_data_add_storage(&pd, 1000 + i, -(int32)i);
+	// backpack with a bag (with a stack inside) and a rope
+	add_item(&pd, 3, 1988, 1, 2);
+	add_item(&pd, 0, 1987, 1, 1);
+	add_item(&pd, 0, 2152, 100, 0);
+	add_item(&pd, 0, 2120, 1, 0);
+	add_item(&pd, 6, 2400, 1, 0);
+
+	len = player_blob_encode(&pd, buf, sizeof(buf));
+	if(len != player_blob_size(&pd)
+	|| player_blob_encode(&pd, buf, len - 1) != -1){
+		LOG_ERROR("player_blob_test: invalid encoded size");
+		return false;
+	}
+	if(!player_blob_decode(&out, buf, len, &upgraded)
+	|| upgraded || !data_equal(&pd, &out)){
+		LOG_ERROR("player_blob_test: roundtrip mismatch");
+		return false;
+	}
+
+	// truncated blobs are rejected (without logging)
+	for(int i = 1; i < len; i += 1){
+		if(player_blob_decode(&out, buf, i, &upgraded)){
+			LOG_ERROR("player_blob_test: accepted truncated blob (%d)", i);
+			return false;
+		}
+	}
+	player_data_free(&pd);
+	player_data_free(&out);
+	return true;
+}
+
+static bool check_invalid_tree(void){
+	struct player_data pd, out;
+	uint8 buf[256];
+	bool upgraded, ret;
+	int len;
+
+	// a container with more children than there are items
+	player_data_init(&pd);
+	player_data_init(&out);
+	add_item(&pd, 3, 1988, 1, 3);
+	add_item(&pd, 0, 2120, 1, 0);
+	len = player_blob_encode(&pd, buf, sizeof(buf));
+	ret = !player_blob_decode(&out, buf, len, &upgraded);
+
+	// a nested item with a slot
+	pd.num_items = 0;
+	add_item(&pd, 3, 1988, 1, 1);
+	add_item(&pd, 4, 2120, 1, 0);
+	len = player_blob_encode(&pd, buf, sizeof(buf));
+	ret = ret && !player_blob_decode(&out, buf, len, &upgraded);
+	if(!ret)
+		LOG_ERROR("player_blob_test: accepted invalid item tree");
+	player_data_free(&pd);
+	player_data_free(&out);
+	return ret;
+}
+
+// NOTE: version 1 is the only blob format so far and the only
+// upgrade path is from version zero (no blob). The version 1 blob
+// below must be kept as it is when a new version is added so it
+// becomes the legacy fixture for that upgrade.
+static bool check_upgrade(void){
+	// version 1 blob with fewer skills than the current
+	// version (the rest keep their defaults)
+	static uint8 v1[] = {
+		0x01,
+		0x02, 0x0C, 0x00, 0x10, 0x00, 0x00, 0x00,
+			0x0D, 0x00, 0x20, 0x00, 0x00, 0x00,
+		0x00, 0x00,
+		0x00, 0x00,
+	};
+	struct player_data pd;
+	bool upgraded, ret;
+
+	// players without a blob
+	player_data_init(&pd);
+	ret = player_blob_decode(&pd, NULL, 0, &upgraded) && upgraded
+		&& pd.skills[PLAYER_SKILL_FIST].level == 10;
+
+	ret = ret && player_blob_decode(&pd, v1, sizeof(v1), &upgraded)
+		&& upgraded == (PLAYER_BLOB_VERSION != 1)
+		&& pd.skills[PLAYER_SKILL_FIST].level == 12
+		&& pd.skills[PLAYER_SKILL_CLUB].tries == 32
+		&& pd.skills[PLAYER_SKILL_FISHING].level == 10;
+
+	// unknown versions are rejected
+	v1[0] = PLAYER_BLOB_VERSION + 1;
+	ret = ret && !player_blob_decode(&pd, v1, sizeof(v1), &upgraded);
+	v1[0] = 0x01;
+	if(!ret)
+		LOG_ERROR("player_blob_test: failed to decode older versions");
+	player_data_free(&pd);
+	return ret;
+}
+
+bool player_blob_test(void){
+	return check_roundtrip()
+		&& check_invalid_tree()
+		&& check_upgrade();
+}
+
+#endif //BUILD_TEST
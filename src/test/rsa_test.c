@@ -1,9 +1,9 @@
-// REMAKE
-#if 0
-
 #include "../common.h"
-#include "../log.h"
+#ifdef BUILD_TEST
+
 #include "../crypto/rsa.h"
+#include "../log.h"
+#include "test_util.h"
 
 static const char p[] =
 	"142996239624163995200701773828988955507954033454661532174705160829"
@@ -15,19 +15,148 @@ static const char q[] =
 	"7096809910315212884101";
 static const char e[] = "65537";
 
+static uint32 rng_state = 0x9E3779B9;
+
+// a random block that is smaller than the modulus (like the
+// client's, which always start with a zero byte)
+static void random_block(uint8 *block){
+	block[0] = 0;
+	for(int i = 1; i < 128; i += 1)
+		block[i] = (uint8)test_rng_next(&rng_state);
+}
+
+static bool check_roundtrip(struct rsa_ctx *rsa){
+	uint8 plain[128], block[128];
+	size_t len;
+	for(int i = 0; i < 16; i += 1){
+		random_block(plain);
+		memcpy(block, plain, 128);
+		rsa_encode(rsa, block, 128, &len);
+		if(len < 128){
+			memmove(block + 128 - len, block, len);
+			memset(block, 0, 128 - len);
+		}
+		rsa_decode(rsa, block, 128, &len);
+		if(len != 127 || memcmp(block, plain + 1, 127) != 0){
+			LOG_ERROR("rsa_test: roundtrip mismatch");
+			return false;
+		}
+	}
+	return true;
+}
+
+#ifdef RSA_HAS_FIXED
+static bool check_block(struct rsa_ctx *rsa, struct rsa_fixed *fixed,
+		mp_limb_t *scratch, const uint8 *block){
+	uint8 expected[128], result[128];
+	size_t expected_len, result_len;
+	memcpy(expected, block, 128);
+	rsa_decode(rsa, expected, 128, &expected_len);
+	memcpy(result, block, 128);
+	rsa_fixed_decode(fixed, result, 128, &result_len, scratch);
+	if(result_len != expected_len
+			|| memcmp(result, expected, expected_len) != 0){
+		LOG_ERROR("rsa_test: fixed decode mismatch (len = %d, expected = %d)",
+			(int)result_len, (int)expected_len);
+		return false;
+	}
+	return true;
+}
+
+// the fixed width decode must match `rsa_decode` on random blocks
+// and on the ones that are zero modulo p or q
+static bool check_fixed(struct rsa_ctx *rsa, struct rsa_fixed *fixed,
+		mp_limb_t *scratch){
+	uint8 block[128];
+	size_t len;
+	for(int i = 0; i < 256; i += 1){
+		random_block(block);
+		if(!check_block(rsa, fixed, scratch, block))
+			return false;
+	}
+	memset(block, 0, sizeof(block));
+	if(!check_block(rsa, fixed, scratch, block))
+		return false;
+	mpz_export(block, &len, 1, 1, 0, 0, rsa->p);
+	memmove(block + 128 - len, block, len);
+	memset(block, 0, 128 - len);
+	if(!check_block(rsa, fixed, scratch, block))
+		return false;
+	mpz_export(block, &len, 1, 1, 0, 0, rsa->q);
+	memmove(block + 128 - len, block, len);
+	memset(block, 0, 128 - len);
+	return check_block(rsa, fixed, scratch, block);
+}
+#endif
+
+// single thread so it's the rate per core
+#define BENCH_ITERATIONS 2000
+static void bench_report(const char *name, int64 elapsed){
+	LOG("rsa_bench: %-5s %8.1f decodes/s per core (%lldns per decode)",
+		name, BENCH_ITERATIONS / (elapsed / 1e9),
+		elapsed / BENCH_ITERATIONS);
+}
+
+static void bench(struct rsa_ctx *rsa){
+	uint8 block[128], tmp[128];
+	int64 start;
+	size_t len;
+	random_block(block);
+	start = kpl_clock_monotonic_nsec();
+	for(int i = 0; i < BENCH_ITERATIONS; i += 1){
+		memcpy(tmp, block, 128);
+		rsa_decode(rsa, tmp, 128, &len);
+	}
+	bench_report("mpz", kpl_clock_monotonic_nsec() - start);
+}
+
+#ifdef RSA_HAS_FIXED
+static void bench_fixed(struct rsa_fixed *fixed, mp_limb_t *scratch){
+	uint8 block[128], tmp[128];
+	int64 start;
+	size_t len;
+	random_block(block);
+	start = kpl_clock_monotonic_nsec();
+	for(int i = 0; i < BENCH_ITERATIONS; i += 1){
+		memcpy(tmp, block, 128);
+		rsa_fixed_decode(fixed, tmp, 128, &len, scratch);
+	}
+	bench_report("fixed", kpl_clock_monotonic_nsec() - start);
+}
+#endif
+
 bool rsa_test(void){
 	struct rsa_ctx rsa;
-	size_t len;
-	char msg[255] = "MESSAGE";
+#ifdef RSA_HAS_FIXED
+	struct rsa_fixed fixed;
+	mp_limb_t *scratch;
+	bool ok;
+#endif
 
 	rsa_init(&rsa);
-	rsa_setkey(&rsa, p, q, e);
-	rsa_encode(&rsa, msg, strlen(msg), &len); msg[len] = 0;
-	LOG("encoded message: %llu -> %s", len, msg);
-	rsa_decode(&rsa, msg, len, &len); msg[len] = 0;
-	LOG("decoded message: %llu -> %s", len, msg);
+	if(!rsa_setkey(&rsa, p, q, e) || !check_roundtrip(&rsa)){
+		rsa_cleanup(&rsa);
+		return false;
+	}
+	bench(&rsa);
+
+#ifdef RSA_HAS_FIXED
+	if(!rsa_fixed_init(&fixed, &rsa)){
+		LOG_ERROR("rsa_test: failed to init fixed width key");
+		rsa_cleanup(&rsa);
+		return false;
+	}
+	scratch = kpl_malloc(sizeof(mp_limb_t) * fixed.scratch_limbs);
+	ok = check_fixed(&rsa, &fixed, scratch);
+	if(ok)
+		bench_fixed(&fixed, scratch);
+	kpl_free(scratch);
 	rsa_cleanup(&rsa);
-	return false;
+	return ok;
+#else
+	rsa_cleanup(&rsa);
+	return true;
+#endif
 }
 
-#endif
+#endif //BUILD_TEST
@@ -0,0 +1,71 @@
+#include "../common.h"
+#ifdef BUILD_TEST
+
+#include "../log.h"
+#include "../task_dbuffer.h"
+#include "../task_rbuffer.h"
+
+static int next_seq;
+static int out_of_order;
+
+static void check_seq(void *arg){
+	if((int)(intptr_t)arg != next_seq)
+		out_of_order += 1;
+	next_seq += 1;
+}
+
+static bool rbuffer_overflow_test(void){
+	struct task_rbuffer *rb = task_rbuffer_create("test", 4, 100);
+	int count = 0;
+	next_seq = 0;
+	out_of_order = 0;
+	// push faster than we run so tasks spill into the overflow
+	for(int i = 0; i < 50; i += 1){
+		for(int j = 0; j < 7; j += 1){
+			if(task_rbuffer_try_push(rb, check_seq, (void*)(intptr_t)count))
+				count += 1;
+		}
+		for(int j = 0; j < 3; j += 1)
+			task_rbuffer_run_one(rb);
+	}
+	while(next_seq < count)
+		task_rbuffer_run_one(rb);
+	task_rbuffer_destroy(rb);
+	// the ring and overflow hold 104 tasks so some pushes
+	// must have failed but everything accepted must run in order
+	if(count <= 104 || count >= 350 || out_of_order != 0){
+		LOG_ERROR("rbuffer_overflow_test: count = %d,"
+			" out of order = %d", count, out_of_order);
+		return false;
+	}
+	return true;
+}
+
+static bool dbuffer_overflow_test(void){
+	struct task_dbuffer *db = task_dbuffer_create("test", 4, 10);
+	int count = 0;
+	next_seq = 0;
+	out_of_order = 0;
+	for(int i = 0; i < 5; i += 1){
+		for(int j = 0; j < 20; j += 1){
+			if(task_dbuffer_try_add(db, check_seq, (void*)(intptr_t)count))
+				count += 1;
+		}
+		task_dbuffer_swap_and_run(db);
+	}
+	task_dbuffer_destroy(db);
+	// each swap should run exactly 14 tasks
+	if(count != 70 || next_seq != 70 || out_of_order != 0){
+		LOG_ERROR("dbuffer_overflow_test: count = %d,"
+			" out of order = %d", count, out_of_order);
+		return false;
+	}
+	return true;
+}
+
+bool task_test(void){
+	return rbuffer_overflow_test()
+		&& dbuffer_overflow_test();
+}
+
+#endif //BUILD_TEST
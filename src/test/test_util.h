@@ -0,0 +1,17 @@
+#ifndef KAPLAR_TEST_TEST_UTIL_H_
+#define KAPLAR_TEST_TEST_UTIL_H_ 1
+
+#include "../common.h"
+
+// xorshift32 so test runs are reproducible (each test keeps
+// its own state with a different non zero seed)
+static INLINE uint32 test_rng_next(uint32 *state){
+	uint32 x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+#endif //KAPLAR_TEST_TEST_UTIL_H_
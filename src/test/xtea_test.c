@@ -1,20 +1,162 @@
-// REMAKE
-#if 0
-#include "../../src/log.h"
-#include "../../src/crypto/xtea.h"
-static char plain_msg[] = "MESSAGE";
-static uint32 key[] = { 0x11111111, 0x22222222,
-			0x33333333, 0x44444444 };
-int main(int argc, char **argv){
-	char msg[32]; strcpy(msg, plain_msg);
-	uint32 len = array_size(plain_msg); // this includes the null terminator
-	xtea_encode(key, (uint8*)msg, len);
-	xtea_decode(key, (uint8*)msg, len);
-	if(strcmp(msg, plain_msg) == 0)
-		LOG("XTEA encryption test OK");
-	else
-		LOG("XTEA encryption test FAILED");
-	getchar();
-	return 0;
+#include "../common.h"
+#ifdef BUILD_TEST
+
+#include "../crypto/xtea.h"
+#include "../log.h"
+
+#define MAX_LEN 16384
+static uint32 key[] = { 0x11111111, 0x22222222,
+			0x33333333, 0x44444444 };
+static uint8 plain[MAX_LEN];
+static uint8 expected[MAX_LEN];
+static uint8 buf[MAX_LEN];
+
+// a known block (the client's key schedule with little endian words)
+static bool check_vector(void){
+	static const uint8 msg[8] = "MESSAGE";
+	static const uint8 cipher[8] = {
+		0x6C, 0xB9, 0x14, 0x40, 0x22, 0x4B, 0x47, 0x9F };
+	for(int impl = 0; impl < XTEA_NUM_IMPLS; impl += 1){
+		if(!xtea_impl_supported(impl))
+			continue;
+		memcpy(buf, msg, 8);
+		xtea_encode_impl(impl, key, buf, 8);
+		if(memcmp(buf, cipher, 8) != 0){
+			LOG_ERROR("xtea_test: %s: invalid encoded block",
+				xtea_impl_name(impl));
+			return false;
+		}
+	}
+	return true;
 }
-#endif
+
+// every implementation must match the scalar one for every length
+// (so all tails are covered) and decode back to the plain text
+static bool check_impls(void){
+	size_t len;
+	for(size_t i = 0; i < MAX_LEN; i += 1)
+		plain[i] = (uint8)(i * 31 + (i >> 8));
+	memcpy(expected, plain, MAX_LEN);
+	xtea_encode_impl(XTEA_IMPL_SCALAR, key, expected, MAX_LEN);
+
+	for(int impl = 1; impl < XTEA_NUM_IMPLS; impl += 1){
+		if(!xtea_impl_supported(impl)){
+			LOG("xtea_test: %s not supported", xtea_impl_name(impl));
+			continue;
+		}
+		for(len = 0; len <= 40 * 8; len += 8){
+			memcpy(buf, plain, len);
+			xtea_encode_impl(impl, key, buf, len);
+			if(memcmp(buf, expected, len) != 0){
+				LOG_ERROR("xtea_test: %s: encode mismatch (len = %d)",
+					xtea_impl_name(impl), (int)len);
+				return false;
+			}
+			xtea_decode_impl(impl, key, buf, len);
+			if(memcmp(buf, plain, len) != 0){
+				LOG_ERROR("xtea_test: %s: decode mismatch (len = %d)",
+					xtea_impl_name(impl), (int)len);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// buffers with different keys and lengths (including empty ones and
+// one larger than the others) must match encoding each one on its own
+#define MANY_BUFS 37
+static bool check_many(void){
+	static uint32 keys[MANY_BUFS][4];
+	struct xtea_buffer bufs[MANY_BUFS];
+	size_t len, off;
+	for(int i = 0; i < MANY_BUFS; i += 1){
+		for(int j = 0; j < 4; j += 1)
+			keys[i][j] = (uint32)(i * 0x9E3779B9UL + j * 0x7F4A7C15UL);
+	}
+	for(int impl = 0; impl < XTEA_NUM_IMPLS; impl += 1){
+		if(!xtea_impl_supported(impl))
+			continue;
+		off = 0;
+		for(int i = 0; i < MANY_BUFS; i += 1){
+			len = (i == 5) ? 2048 : (size_t)((i * 7) % 23) * 8;
+			bufs[i].key = keys[i];
+			bufs[i].data = buf + off;
+			bufs[i].len = len;
+			memcpy(expected + off, plain + off, len);
+			xtea_encode_impl(XTEA_IMPL_SCALAR, keys[i], expected + off, len);
+			off += len;
+		}
+		memcpy(buf, plain, off);
+		xtea_encode_many_impl(impl, bufs, MANY_BUFS);
+		if(memcmp(buf, expected, off) != 0){
+			LOG_ERROR("xtea_test: %s: multi buffer mismatch",
+				xtea_impl_name(impl));
+			return false;
+		}
+	}
+	return true;
+}
+
+// a frame worth of small messages, each with its own key
+static void bench_many(void){
+	static uint32 keys[256][4];
+	struct xtea_buffer bufs[256];
+	size_t total = 8 << 20;
+	int64 start, elapsed;
+	int iterations;
+	for(int i = 0; i < 256; i += 1){
+		for(int j = 0; j < 4; j += 1)
+			keys[i][j] = (uint32)(i * 4 + j);
+		bufs[i].key = keys[i];
+		bufs[i].data = buf + i * 64;
+		bufs[i].len = 64;
+	}
+	iterations = (int)(total / (256 * 64));
+	for(int impl = 0; impl < XTEA_NUM_IMPLS; impl += 1){
+		if(!xtea_impl_supported(impl))
+			continue;
+		start = kpl_clock_monotonic_nsec();
+		for(int j = 0; j < iterations; j += 1)
+			xtea_encode_many_impl(impl, bufs, 256);
+		elapsed = kpl_clock_monotonic_nsec() - start;
+		LOG("xtea_bench: %-6s 256 x 64 bytes (multi buffer): %7.1f MB/s",
+			xtea_impl_name(impl),
+			(double)total / (1 << 20) / (elapsed / 1e9));
+	}
+}
+
+// message sizes go from a single creature move to a full
+// map description
+static void bench(void){
+	static const size_t sizes[] = {16, 64, 256, 1024, 4096, 16384};
+	int64 start, elapsed;
+	size_t total = 8 << 20;
+	int iterations;
+
+	for(int i = 0; i < (int)ARRAY_SIZE(sizes); i += 1){
+		iterations = (int)(total / sizes[i]);
+		for(int impl = 0; impl < XTEA_NUM_IMPLS; impl += 1){
+			if(!xtea_impl_supported(impl))
+				continue;
+			start = kpl_clock_monotonic_nsec();
+			for(int j = 0; j < iterations; j += 1)
+				xtea_encode_impl(impl, key, buf, sizes[i]);
+			elapsed = kpl_clock_monotonic_nsec() - start;
+			LOG("xtea_bench: %-6s %5d bytes: %7.1f MB/s (%lldns per message)",
+				xtea_impl_name(impl), (int)sizes[i],
+				(double)total / (1 << 20) / (elapsed / 1e9),
+				elapsed / iterations);
+		}
+	}
+	bench_many();
+}
+
+bool xtea_test(void){
+	if(!check_vector() || !check_impls() || !check_many())
+		return false;
+	bench();
+	return true;
+}
+
+#endif //BUILD_TEST
@@ -1,4 +1,5 @@
 #include "thread.h"
+#include <errno.h>
 
 #ifdef PLATFORM_WINDOWS
 
@@ -55,8 +56,11 @@ void condvar_destroy(condvar_t *cv){
 void condvar_wait(condvar_t *cv, mutex_t *mtx){
 	ASSERT(SleepConditionVariableCS(cv, mtx, INFINITE) == TRUE);
 }
-void condvar_timedwait(condvar_t *cv, mutex_t *mtx, long msec){
-	ASSERT(SleepConditionVariableCS(cv, mtx, (DWORD)msec) == TRUE);
+bool condvar_timedwait(condvar_t *cv, mutex_t *mtx, long msec){
+	if(SleepConditionVariableCS(cv, mtx, (DWORD)msec) == TRUE)
+		return true;
+	ASSERT(GetLastError() == ERROR_TIMEOUT);
+	return false;
 }
 void condvar_signal(condvar_t *cv){
 	WakeConditionVariable(cv);
@@ -105,12 +109,19 @@ void condvar_destroy(condvar_t *cv){
 void condvar_wait(condvar_t *cv, mutex_t *mtx){
 	ASSERT(pthread_cond_wait(cv, mtx) == 0);
 }
-void condvar_timedwait(condvar_t *cv, mutex_t *mtx, long msec){
+bool condvar_timedwait(condvar_t *cv, mutex_t *mtx, long msec){
 	struct timespec ts;
+	int ret;
 	clock_gettime(CLOCK_REALTIME, &ts);
 	ts.tv_sec += (msec / 1000);
 	ts.tv_nsec += (msec % 1000) * 1000000;
-	ASSERT(pthread_cond_timedwait(c, m, &ts) == 0);
+	if(ts.tv_nsec >= 1000000000){
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000;
+	}
+	ret = pthread_cond_timedwait(cv, mtx, &ts);
+	ASSERT(ret == 0 || ret == ETIMEDOUT);
+	return ret == 0;
 }
 void condvar_signal(condvar_t *cv){
 	ASSERT(pthread_cond_signal(cv) == 0);
@@ -34,8 +34,35 @@ void mutex_unlock(mutex_t *mtx);
 void condvar_init(condvar_t *cv);
 void condvar_destroy(condvar_t *cv);
 void condvar_wait(condvar_t *cv, mutex_t *mtx);
-void condvar_timedwait(condvar_t *cv, mutex_t *mtx, long msec);
+// returns false on timeout
+bool condvar_timedwait(condvar_t *cv, mutex_t *mtx, long msec);
 void condvar_signal(condvar_t *cv);
 void condvar_broadcast(condvar_t *cv);
 
+// atomics
+//	NOTES:
+//	- These are only what's needed for single producer single
+//	consumer structures (acquire loads and release stores).
+//	- On windows we only target x86/x64 where plain loads and
+//	stores already have acquire/release semantics so we only need
+//	to stop the compiler from reordering them.
+#ifdef PLATFORM_WINDOWS
+static INLINE uint32 atomic_load_acquire_u32(volatile uint32 *ptr){
+	uint32 value = *ptr;
+	_ReadWriteBarrier();
+	return value;
+}
+static INLINE void atomic_store_release_u32(volatile uint32 *ptr, uint32 value){
+	_ReadWriteBarrier();
+	*ptr = value;
+}
+#else
+static INLINE uint32 atomic_load_acquire_u32(volatile uint32 *ptr){
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+static INLINE void atomic_store_release_u32(volatile uint32 *ptr, uint32 value){
+	__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+#endif
+
 #endif //KAPLAR_THREAD_H_
@@ -1,6 +1,10 @@
 #include "crypto/rsa.h"
+#include "config.h"
+#include "game.h"
 #include "log.h"
+#include "thread.h"
 #include "tibia_rsa.h"
+#include "worker_pool.h"
 
 static const char p[] =
 	"142996239624163995200701773828988955507954033454661532174705160829"
@@ -12,11 +16,48 @@ static const char q[] =
 	"7096809910315212884101";
 static const char e[] = "65537";
 
-// We will use only RSA decoding and it'll be done only
-// on the server thread when receiving the first message
-// of the login or game protocols. This implies that
-// locks are not required.
+// `ctx` is only used by the synchronous functions which should
+// only be called from a single thread (the server thread). The
+// async decoding uses one clone of `ctx` per worker so it doesn't
+// need locks. With `rsa_constant_time` it uses the fixed width key
+// (read only) with scratch space per worker instead, which doesn't
+// leak the private key through timing but is slower (`mpn_sec_powm`
+// against the variable time windows of `mpz_powm`).
 static struct rsa_ctx ctx;
+static int num_workers;
+#ifdef RSA_HAS_FIXED
+static bool use_fixed;
+static struct rsa_fixed fixed;
+static mp_limb_t *worker_scratch;
+#endif
+static struct rsa_ctx *worker_ctx;
+
+/* async decoding state (server thread only) */
+struct rsa_job{
+	struct rsa_job *next;
+	uint8 *data;
+	size_t len;
+	size_t outlen;
+	bool ok;
+	void (*on_done)(void*, bool, size_t);
+	void *arg;
+};
+
+static int max_inflight;
+static int max_queued;
+static int inflight;
+static int queued;
+static struct rsa_job *queue_head;
+static struct rsa_job *queue_tail;
+
+// jobs handed to the worker pool that haven't finished decoding
+// (`inflight` only drops when the server thread gets the result
+// which never happens once it's down). The worker pool shuts down
+// after this module so `tibia_rsa_shutdown` must wait for these
+// before releasing the per worker state.
+static mutex_t running_mtx;
+static condvar_t running_cv;
+static int running;
 
 bool tibia_rsa_init(void){
 	rsa_init(&ctx);
@@ -25,10 +66,77 @@ bool tibia_rsa_init(void){
 		rsa_cleanup(&ctx);
 		return false;
 	}
+
+	max_inflight = config_geti("rsa_max_inflight");
+	max_queued = config_geti("rsa_max_queued");
+	if(max_inflight <= 0 || max_queued < 0){
+		LOG_ERROR("tibia_rsa_init: invalid limits (rsa_max_inflight = %d,"
+			" rsa_max_queued = %d)", max_inflight, max_queued);
+		rsa_cleanup(&ctx);
+		return false;
+	}
+	inflight = 0;
+	queued = 0;
+	queue_head = queue_tail = NULL;
+	running = 0;
+	mutex_init(&running_mtx);
+	condvar_init(&running_cv);
+
+	num_workers = worker_pool_size();
+	if(config_getb("rsa_constant_time")){
+#ifdef RSA_HAS_FIXED
+		use_fixed = rsa_fixed_init(&fixed, &ctx);
+		if(use_fixed){
+			worker_scratch = kpl_malloc(sizeof(mp_limb_t)
+				* fixed.scratch_limbs * num_workers);
+			return true;
+		}
+		LOG_WARNING("tibia_rsa_init: key doesn't fit the fixed width"
+			" decoding, falling back to mpz");
+#else
+		LOG_WARNING("tibia_rsa_init: constant time decoding is"
+			" not available, falling back to mpz");
+#endif
+	}
+	worker_ctx = kpl_malloc(sizeof(struct rsa_ctx) * num_workers);
+	for(int i = 0; i < num_workers; i += 1)
+		rsa_init_clone(&worker_ctx[i], &ctx);
 	return true;
 }
 
 void tibia_rsa_shutdown(void){
+	struct rsa_job *job;
+	// the server is already down so jobs that are still
+	// waiting won't be completed
+	while(queue_head != NULL){
+		job = queue_head;
+		queue_head = job->next;
+		kpl_free(job);
+	}
+	queue_tail = NULL;
+	queued = 0;
+
+	mutex_lock(&running_mtx);
+	while(running > 0)
+		condvar_wait(&running_cv, &running_mtx);
+	mutex_unlock(&running_mtx);
+	condvar_destroy(&running_cv);
+	mutex_destroy(&running_mtx);
+
+#ifdef RSA_HAS_FIXED
+	if(use_fixed){
+		kpl_free(worker_scratch);
+		worker_scratch = NULL;
+		use_fixed = false;
+	}
+#endif
+	if(worker_ctx != NULL){
+		for(int i = 0; i < num_workers; i += 1)
+			rsa_cleanup(&worker_ctx[i]);
+		kpl_free(worker_ctx);
+		worker_ctx = NULL;
+	}
+	num_workers = 0;
 	rsa_cleanup(&ctx);
 }
 
@@ -45,3 +153,104 @@ bool tibia_rsa_decode(uint8 *data, size_t len, size_t *outlen){
 	rsa_decode(&ctx, data, len, outlen);
 	return true;
 }
+
+/* ASYNC DECODING */
+static void job_done(void *arg);
+
+// worker thread
+static void job_decode(void *arg){
+	struct rsa_job *job = arg;
+	int index = worker_pool_thread_index();
+	DEBUG_ASSERT(index >= 0 && index < num_workers);
+	job->ok = ctx.encoding_limit >= job->len;
+	if(job->ok){
+#ifdef RSA_HAS_FIXED
+		if(use_fixed){
+			rsa_fixed_decode(&fixed, job->data, job->len, &job->outlen,
+				worker_scratch + fixed.scratch_limbs * index);
+		}else
+#endif
+		rsa_decode(&worker_ctx[index], job->data, job->len, &job->outlen);
+	}
+	if(!game_try_add_server_task(job_done, job)){
+		// the server queue is full (or it's shutting down) and
+		// its thread is the only place the result can be delivered
+		// so the login is dropped (the connection will time out)
+		LOG_WARNING("tibia_rsa: failed to deliver decoding result");
+		kpl_free(job);
+	}
+
+	// the per worker state may be released after this
+	mutex_lock(&running_mtx);
+	running -= 1;
+	if(running == 0)
+		condvar_signal(&running_cv);
+	mutex_unlock(&running_mtx);
+}
+
+static bool job_dispatch(struct rsa_job *job){
+	mutex_lock(&running_mtx);
+	running += 1;
+	mutex_unlock(&running_mtx);
+	if(!worker_pool_add_task(job_decode, job)){
+		mutex_lock(&running_mtx);
+		running -= 1;
+		mutex_unlock(&running_mtx);
+		return false;
+	}
+	inflight += 1;
+	return true;
+}
+
+// server thread
+static void queue_pump(void){
+	struct rsa_job *job;
+	while(queue_head != NULL && inflight < max_inflight){
+		job = queue_head;
+		if(!job_dispatch(job))
+			break;
+		queue_head = job->next;
+		if(queue_head == NULL)
+			queue_tail = NULL;
+		queued -= 1;
+	}
+}
+
+static void job_done(void *arg){
+	struct rsa_job *job = arg;
+	inflight -= 1;
+	job->on_done(job->arg, job->ok, job->outlen);
+	kpl_free(job);
+	// hand waiting jobs to the workers as slots free up
+	queue_pump();
+}
+
+bool tibia_rsa_decode_async(uint8 *data, size_t len,
+		void (*on_done)(void*, bool, size_t), void *arg){
+	struct rsa_job *job = kpl_malloc(sizeof(struct rsa_job));
+	job->next = NULL;
+	job->data = data;
+	job->len = len;
+	job->outlen = 0;
+	job->ok = false;
+	job->on_done = on_done;
+	job->arg = arg;
+
+	queue_pump();
+	if(queue_head == NULL && inflight < max_inflight && job_dispatch(job))
+		return true;
+
+	// with nothing in flight there's nothing that would
+	// pick it up from the queue later
+	if(queued >= max_queued || inflight == 0){
+		kpl_free(job);
+		return false;
+	}
+	if(queue_tail != NULL)
+		queue_tail->next = job;
+	else
+		queue_head = job;
+	queue_tail = job;
+	queued += 1;
+	return true;
+}
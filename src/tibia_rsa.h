@@ -7,4 +7,19 @@ void tibia_rsa_shutdown(void);
 bool tibia_rsa_encode(uint8 *data, size_t len, size_t *outlen);
 bool tibia_rsa_decode(uint8 *data, size_t len, size_t *outlen);
 
+// async decoding
+//	NOTES:
+//	- `tibia_rsa_decode_async` decodes `data` in place on the worker
+//	pool (with a per worker copy of the key, or the constant time
+//	decoding if `rsa_constant_time` is set) and then calls
+//	`on_done(arg, ok, outlen)` on the server thread. `data` must stay
+//	valid until then.
+//	- At most `rsa_max_inflight` jobs are on the worker pool at once.
+//	The others wait in arrival order so a login flood can't fill the
+//	pool ahead of other work. It returns false (and `on_done` is never
+//	called) if `rsa_max_queued` jobs are already waiting.
+//	- Must be called from the server thread.
+bool tibia_rsa_decode_async(uint8 *data, size_t len,
+	void (*on_done)(void*, bool, size_t), void *arg);
+
 #endif //KAPLAR_TIBIA_RSA_H_
@@ -0,0 +1,444 @@
+// `dladdr` and `Dl_info` are extensions that glibc only
+// declares with _GNU_SOURCE (must come before any header)
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "trace.h"
+#include "config.h"
+#include "log.h"
+#include "thread.h"
+
+#include <stdio.h>
+
+#ifdef PLATFORM_WINDOWS
+#include <dbghelp.h>
+#else
+#include <dlfcn.h>
+#include <signal.h>
+#endif
+
+#define TRACE_MAX_THREADS	64
+#define TRACE_SYMBOL_CACHE	1024	// must be a power of two
+#define TRACE_SYMBOL_MAXLEN	64
+// how often the flusher checks for SIGUSR1 (ms)
+#define TRACE_SIGNAL_POLL	100
+
+struct trace_event{
+	int64 start;
+	int64 duration;
+	void *fp;
+	const char *cat;
+};
+
+struct trace_ring{
+	// producer side
+	volatile uint32 writepos;
+	uint32 dropped;
+	uint8 pad0[ARCH_CACHE_LINE_SIZE - 8];
+	// consumer side
+	volatile uint32 readpos;
+	uint32 reported_dropped;
+	uint8 pad1[ARCH_CACHE_LINE_SIZE - 8];
+
+	uint32 tid;
+	uint32 index_mask;
+	bool name_changed;
+	char name[32];
+	struct trace_event events[];
+};
+
+struct trace_symbol{
+	void *fp;
+	char name[TRACE_SYMBOL_MAXLEN];
+};
+
+bool trace_enabled = false;
+
+static THREAD_LOCAL struct trace_ring *local_ring = NULL;
+
+// ring registry
+static mutex_t rings_mtx;
+static uint32 num_rings;
+static struct trace_ring *rings[TRACE_MAX_THREADS];
+static uint32 ring_size;
+
+// flusher thread
+static thread_t flush_thr;
+static mutex_t flush_mtx;
+static condvar_t flush_cv;
+static bool flush_running;
+static bool flush_requested;
+static long flush_interval;
+#ifndef PLATFORM_WINDOWS
+static volatile sig_atomic_t flush_signaled;
+#endif
+
+// output (only touched by the flusher thread after init)
+static FILE *output;
+static bool output_empty;
+static int64 trace_epoch;
+static struct trace_symbol symbols[TRACE_SYMBOL_CACHE];
+
+/* RINGS */
+static struct trace_ring *trace_local_ring(void){
+	struct trace_ring *ring = local_ring;
+	if(ring != NULL)
+		return ring;
+
+	mutex_lock(&rings_mtx);
+	if(num_rings < TRACE_MAX_THREADS){
+		ring = kpl_malloc(sizeof(struct trace_ring) +
+			sizeof(struct trace_event) * ring_size);
+		memset(ring, 0, sizeof(struct trace_ring));
+		ring->tid = num_rings + 1;
+		ring->index_mask = ring_size - 1;
+		rings[num_rings] = ring;
+		num_rings += 1;
+	}
+	mutex_unlock(&rings_mtx);
+	if(ring == NULL){
+		LOG_WARNING("trace: too many threads (max = %d)",
+			TRACE_MAX_THREADS);
+		return NULL;
+	}
+	local_ring = ring;
+	return ring;
+}
+
+void trace_thread_name(const char *name){
+	struct trace_ring *ring;
+	if(!trace_enabled)
+		return;
+	ring = trace_local_ring();
+	if(ring == NULL)
+		return;
+	mutex_lock(&rings_mtx);
+	kpl_strncpy(ring->name, sizeof(ring->name), name);
+	ring->name_changed = true;
+	mutex_unlock(&rings_mtx);
+}
+
+void trace_end(const char *cat, void *fp, int64 start){
+	struct trace_ring *ring;
+	struct trace_event *ev;
+	uint32 writepos;
+	if(!trace_enabled || start == 0)
+		return;
+	ring = trace_local_ring();
+	if(ring == NULL)
+		return;
+	writepos = ring->writepos;
+	if((writepos - atomic_load_acquire_u32(&ring->readpos)) > ring->index_mask){
+		ring->dropped += 1;
+		return;
+	}
+	ev = &ring->events[writepos & ring->index_mask];
+	ev->start = start;
+	ev->duration = kpl_clock_monotonic_nsec() - start;
+	ev->fp = fp;
+	ev->cat = cat;
+	atomic_store_release_u32(&ring->writepos, writepos + 1);
+}
+
+/* SYMBOLS */
+static void resolve_symbol(void *fp, char *buf, size_t buflen){
+#ifdef PLATFORM_WINDOWS
+	union{
+		SYMBOL_INFO info;
+		uint8 data[sizeof(SYMBOL_INFO) + TRACE_SYMBOL_MAXLEN];
+	} sym;
+	memset(&sym.info, 0, sizeof(SYMBOL_INFO));
+	sym.info.SizeOfStruct = sizeof(SYMBOL_INFO);
+	sym.info.MaxNameLen = TRACE_SYMBOL_MAXLEN;
+	if(SymFromAddr(GetCurrentProcess(), (DWORD64)fp, NULL, &sym.info)){
+		snprintf(buf, buflen, "%s", sym.info.Name);
+		return;
+	}
+#else
+	Dl_info info;
+	const char *module;
+	if(dladdr(fp, &info) != 0){
+		if(info.dli_sname != NULL){
+			snprintf(buf, buflen, "%s", info.dli_sname);
+			return;
+		}
+		// static functions are not in the dynamic symbol
+		// table so use the module offset instead
+		if(info.dli_fname != NULL){
+			module = strrchr(info.dli_fname, '/');
+			module = (module != NULL) ? module + 1 : info.dli_fname;
+			snprintf(buf, buflen, "%s+0x%llx", module,
+				(unsigned long long)((uint8*)fp - (uint8*)info.dli_fbase));
+			return;
+		}
+	}
+#endif
+	snprintf(buf, buflen, "%p", fp);
+}
+
+static const char *symbol_name(void *fp){
+	uint32 idx = (uint32)(((uintptr_t)fp >> 4) * 2654435761U);
+	struct trace_symbol *sym;
+	for(uint32 i = 0; i < TRACE_SYMBOL_CACHE; i += 1){
+		sym = &symbols[(idx + i) & (TRACE_SYMBOL_CACHE - 1)];
+		if(sym->fp == fp)
+			return sym->name;
+		if(sym->fp == NULL){
+			sym->fp = fp;
+			resolve_symbol(fp, sym->name, sizeof(sym->name));
+			return sym->name;
+		}
+	}
+	// cache is full so just use a scratch slot
+	sym = &symbols[idx & (TRACE_SYMBOL_CACHE - 1)];
+	sym->fp = fp;
+	resolve_symbol(fp, sym->name, sizeof(sym->name));
+	return sym->name;
+}
+
+/* OUTPUT */
+// symbol and thread names may have anything in them
+static void output_str(const char *str){
+	for(const uint8 *p = (const uint8*)str; *p != 0; p += 1){
+		if(*p == '"' || *p == '\\')
+			fprintf(output, "\\%c", *p);
+		else if(*p < 0x20)
+			fprintf(output, "\\u%04x", *p);
+		else
+			fputc(*p, output);
+	}
+}
+
+static void output_separator(void){
+	if(output_empty){
+		output_empty = false;
+		fputs("\n", output);
+	}else{
+		fputs(",\n", output);
+	}
+}
+
+static void output_thread_name(uint32 tid, const char *name){
+	output_separator();
+	fprintf(output, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"tid\":%u,\"args\":{\"name\":\"", tid);
+	output_str(name);
+	fputs("\"}}", output);
+}
+
+static void output_event(uint32 tid, struct trace_event *ev){
+	output_separator();
+	fputs("{\"name\":\"", output);
+	output_str(symbol_name(ev->fp));
+	fprintf(output, "\",\"cat\":\"%s\",\"ph\":\"X\","
+		"\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+		ev->cat, tid,
+		(double)(ev->start - trace_epoch) / 1000.0,
+		(double)ev->duration / 1000.0);
+}
+
+static void trace_flush(void){
+	struct trace_ring *ring;
+	uint32 count, readpos, writepos, dropped;
+	char name[32];
+	bool name_changed;
+
+	mutex_lock(&rings_mtx);
+	count = num_rings;
+	mutex_unlock(&rings_mtx);
+
+	for(uint32 i = 0; i < count; i += 1){
+		ring = rings[i];
+
+		mutex_lock(&rings_mtx);
+		name_changed = ring->name_changed;
+		if(name_changed){
+			memcpy(name, ring->name, sizeof(name));
+			ring->name_changed = false;
+		}
+		mutex_unlock(&rings_mtx);
+		if(name_changed)
+			output_thread_name(ring->tid, name);
+
+		readpos = ring->readpos;
+		writepos = atomic_load_acquire_u32(&ring->writepos);
+		while(readpos != writepos){
+			output_event(ring->tid, &ring->events[readpos & ring->index_mask]);
+			readpos += 1;
+		}
+		atomic_store_release_u32(&ring->readpos, readpos);
+
+		// `dropped` is only written by the producer and
+		// it's fine if we read a stale value here
+		dropped = ring->dropped;
+		if(dropped != ring->reported_dropped){
+			LOG_WARNING("trace: thread %u dropped %u events"
+				" (increase `trace_buffer_size`)", ring->tid,
+				dropped - ring->reported_dropped);
+			ring->reported_dropped = dropped;
+		}
+	}
+	fflush(output);
+}
+
+static void *flush_thread(void *unused){
+	int64 now, next_flush;
+	long wait;
+	bool running = true;
+	bool flush;
+	trace_thread_name("trace");
+	next_flush = kpl_clock_monotonic_msec() + flush_interval;
+	while(running){
+		wait = (long)(next_flush - kpl_clock_monotonic_msec());
+#ifndef PLATFORM_WINDOWS
+		// the signal handler can't wake us up
+		wait = MIN(wait, TRACE_SIGNAL_POLL);
+#endif
+		mutex_lock(&flush_mtx);
+		if(flush_running && !flush_requested && wait > 0)
+			condvar_timedwait(&flush_cv, &flush_mtx, wait);
+		flush = flush_requested;
+		flush_requested = false;
+		running = flush_running;
+		mutex_unlock(&flush_mtx);
+#ifndef PLATFORM_WINDOWS
+		if(flush_signaled){
+			flush_signaled = 0;
+			flush = true;
+		}
+#endif
+		now = kpl_clock_monotonic_msec();
+		if(flush || !running || now >= next_flush){
+			trace_flush();
+			next_flush = now + flush_interval;
+		}
+	}
+	return NULL;
+}
+
+void trace_request_flush(void){
+	if(!trace_enabled)
+		return;
+	mutex_lock(&flush_mtx);
+	flush_requested = true;
+	condvar_signal(&flush_cv);
+	mutex_unlock(&flush_mtx);
+}
+
+// on demand flushes from outside the server: Ctrl+Break on the
+// console (windows) or SIGUSR1 (unix)
+#ifdef PLATFORM_WINDOWS
+// console handlers run on their own thread so it's
+// fine to take the lock
+static BOOL WINAPI console_handler(DWORD type){
+	if(type != CTRL_BREAK_EVENT)
+		return FALSE;
+	trace_request_flush();
+	return TRUE;
+}
+
+static void install_flush_trigger(void){
+	if(!SetConsoleCtrlHandler(console_handler, TRUE))
+		LOG_WARNING("trace_init: failed to install console handler");
+}
+
+static void remove_flush_trigger(void){
+	SetConsoleCtrlHandler(console_handler, FALSE);
+}
+#else
+// the flusher picks this up (see `flush_thread`)
+static void signal_handler(int sig){
+	flush_signaled = 1;
+}
+
+static void install_flush_trigger(void){
+	flush_signaled = 0;
+	signal(SIGUSR1, signal_handler);
+}
+
+static void remove_flush_trigger(void){
+	signal(SIGUSR1, SIG_DFL);
+}
+#endif
+
+bool trace_init(void){
+	const char *path;
+	int buffer_size;
+	if(!config_getb("trace_enabled"))
+		return true;
+
+	buffer_size = config_geti("trace_buffer_size");
+	if(!IS_POWER_OF_TWO(buffer_size)){
+		LOG_ERROR("trace_init: buffer size must be a power"
+			" of two (%d)", buffer_size);
+		return false;
+	}
+	path = config_get("trace_output");
+	output = fopen(path, "w");
+	if(output == NULL){
+		LOG_ERROR("trace_init: failed to open `%s`", path);
+		return false;
+	}
+#ifdef PLATFORM_WINDOWS
+	SymSetOptions(SYMOPT_UNDNAME | SYMOPT_DEFERRED_LOADS);
+	if(!SymInitialize(GetCurrentProcess(), NULL, TRUE))
+		LOG_WARNING("trace_init: failed to load symbols"
+			" (tasks will be labelled by address)");
+#endif
+	fputs("[", output);
+	output_empty = true;
+	trace_epoch = kpl_clock_monotonic_nsec();
+	memset(symbols, 0, sizeof(symbols));
+
+	mutex_init(&rings_mtx);
+	num_rings = 0;
+	ring_size = (uint32)buffer_size;
+
+	mutex_init(&flush_mtx);
+	condvar_init(&flush_cv);
+	flush_running = true;
+	flush_requested = false;
+	flush_interval = config_geti("trace_flush_interval");
+
+	// enable tracing before starting the flusher
+	// so it may register its own ring
+	trace_enabled = true;
+	if(thread_init(&flush_thr, flush_thread, NULL) != 0){
+		LOG_ERROR("trace_init: failed to start flusher thread");
+		trace_enabled = false;
+		condvar_destroy(&flush_cv);
+		mutex_destroy(&flush_mtx);
+		mutex_destroy(&rings_mtx);
+		fclose(output);
+		return false;
+	}
+	install_flush_trigger();
+	LOG("trace: writing task timeline to `%s`", path);
+	return true;
+}
+
+void trace_shutdown(void){
+	if(!trace_enabled)
+		return;
+	remove_flush_trigger();
+	// the flusher will drain the rings one last time
+	mutex_lock(&flush_mtx);
+	flush_running = false;
+	condvar_signal(&flush_cv);
+	mutex_unlock(&flush_mtx);
+	thread_join(&flush_thr, NULL);
+
+	trace_enabled = false;
+	fputs("\n]\n", output);
+	fclose(output);
+	for(uint32 i = 0; i < num_rings; i += 1)
+		kpl_free(rings[i]);
+	num_rings = 0;
+	condvar_destroy(&flush_cv);
+	mutex_destroy(&flush_mtx);
+	mutex_destroy(&rings_mtx);
+#ifdef PLATFORM_WINDOWS
+	SymCleanup(GetCurrentProcess());
+#endif
+}
@@ -0,0 +1,43 @@
+#ifndef KAPLAR_TRACE_H_
+#define KAPLAR_TRACE_H_ 1
+
+#include "common.h"
+
+// trace
+//	NOTES:
+//	- Records a complete event (begin timestamp + duration) for
+//	each instrumented task into a per thread lock free ring buffer
+//	(single producer/single consumer). If a ring is full, the event
+//	is dropped and counted.
+//	- A flusher thread drains all rings every `trace_flush_interval`
+//	milliseconds into `trace_output` using the chrome trace event
+//	format (JSON array) which can be opened in chrome://tracing or
+//	ui.perfetto.dev.
+//	- Rings can also be flushed on demand with `trace_request_flush`,
+//	Ctrl+Break on the server console (windows) or SIGUSR1 (unix).
+//	- Tasks are labelled by resolving their function pointer when
+//	the events are flushed (dladdr on unix and dbghelp on windows)
+//	so there is no cost to it on the instrumented threads.
+//	- When `trace_enabled` is false (default) the only cost is
+//	checking a global flag in `trace_begin`.
+
+#define TRACE_CAT_TASK	"task"
+#define TRACE_CAT_NET	"net"
+
+extern bool trace_enabled;
+
+bool trace_init(void);
+void trace_shutdown(void);
+void trace_request_flush(void);
+void trace_thread_name(const char *name);
+void trace_end(const char *cat, void *fp, int64 start);
+
+// returns 0 when tracing is disabled so `trace_end` can be
+// called unconditionally after it
+static INLINE int64 trace_begin(void){
+	if(!trace_enabled)
+		return 0;
+	return kpl_clock_monotonic_nsec();
+}
+
+#endif //KAPLAR_TRACE_H_
@@ -0,0 +1,173 @@
+#include "worker_pool.h"
+#include "config.h"
+#include "log.h"
+#include "task_rbuffer.h"
+#include "thread.h"
+#include "trace.h"
+
+#include <stdio.h>
+
+#define MAX_WORKER_TASKS 1024
+#define MAX_WORKER_TASKS_OVERFLOW 4096
+
+static struct task_rbuffer *tasks;
+static int num_workers;
+static thread_t workers[WORKER_POOL_MAX_THREADS];
+static THREAD_LOCAL int worker_index = -1;
+
+static void *worker_thread(void *arg){
+	char name[32];
+	worker_index = (int)(intptr_t)arg;
+	snprintf(name, sizeof(name), "worker %d", worker_index);
+	trace_thread_name(name);
+	while(task_rbuffer_run_one(tasks))
+		continue;
+	return NULL;
+}
+
+static void stop_workers(int count){
+	// this will make `task_rbuffer_run_one()` return false
+	task_rbuffer_set_inactive(tasks);
+	for(int i = 0; i < count; i += 1)
+		thread_join(&workers[i], NULL);
+}
+
+bool worker_pool_init(void){
+	int count = config_geti("worker_threads");
+	if(count == 0)
+		count = MAX(kpl_cpu_count() - 1, 1);
+	if(count < 1 || count > WORKER_POOL_MAX_THREADS){
+		LOG_ERROR("worker_pool_init: invalid number of threads (%d)"
+			" (should be within [1, %d])", count, WORKER_POOL_MAX_THREADS);
+		return false;
+	}
+	tasks = task_rbuffer_create("workers",
+		MAX_WORKER_TASKS, MAX_WORKER_TASKS_OVERFLOW);
+	for(num_workers = 0; num_workers < count; num_workers += 1){
+		if(thread_init(&workers[num_workers], worker_thread,
+				(void*)(intptr_t)num_workers) != 0){
+			LOG_ERROR("worker_pool_init: failed to start worker %d",
+				num_workers);
+			stop_workers(num_workers);
+			task_rbuffer_destroy(tasks);
+			num_workers = 0;
+			return false;
+		}
+	}
+	return true;
+}
+
+void worker_pool_shutdown(void){
+	stop_workers(num_workers);
+	task_rbuffer_destroy(tasks);
+	num_workers = 0;
+}
+
+int worker_pool_size(void){
+	return num_workers;
+}
+
+int worker_pool_thread_index(void){
+	return worker_index;
+}
+
+bool worker_pool_add_task(void (*fp)(void*), void *arg){
+	return task_rbuffer_try_push(tasks, fp, arg);
+}
+
+/* PARALLEL */
+//	- Indexes are handed out one at a time under the job mutex so
+//	callers should split the work into a few large pieces (about one
+//	per thread) rather than one per item.
+//	- Helpers may only start after the work is done (if the queue
+//	is busy) so the caller doesn't wait for them. The job is shared
+//	and released by whoever drops the last reference.
+struct parallel_job{
+	void (*fp)(void*, int);
+	void *arg;
+	int count;
+	int next;
+	int done;
+	int refs;
+	mutex_t mtx;
+	condvar_t cv;
+};
+
+static void parallel_release(struct parallel_job *job){
+	bool last;
+	mutex_lock(&job->mtx);
+	job->refs -= 1;
+	last = (job->refs == 0);
+	mutex_unlock(&job->mtx);
+	if(last){
+		condvar_destroy(&job->cv);
+		mutex_destroy(&job->mtx);
+		kpl_free(job);
+	}
+}
+
+// runs indexes until there are none left
+static void parallel_run(struct parallel_job *job){
+	int i;
+	while(1){
+		mutex_lock(&job->mtx);
+		i = job->next;
+		if(i < job->count)
+			job->next += 1;
+		mutex_unlock(&job->mtx);
+		if(i >= job->count)
+			break;
+		job->fp(job->arg, i);
+		mutex_lock(&job->mtx);
+		job->done += 1;
+		if(job->done == job->count)
+			condvar_signal(&job->cv);
+		mutex_unlock(&job->mtx);
+	}
+}
+
+static void parallel_helper(void *arg){
+	struct parallel_job *job = arg;
+	parallel_run(job);
+	parallel_release(job);
+}
+
+void worker_pool_parallel(void (*fp)(void*, int), void *arg, int count){
+	struct parallel_job *job;
+	int helpers;
+	if(count <= 0)
+		return;
+	if(count == 1 || num_workers == 0){
+		for(int i = 0; i < count; i += 1)
+			fp(arg, i);
+		return;
+	}
+
+	job = kpl_malloc(sizeof(struct parallel_job));
+	job->fp = fp;
+	job->arg = arg;
+	job->count = count;
+	job->next = 0;
+	job->done = 0;
+	mutex_init(&job->mtx);
+	condvar_init(&job->cv);
+
+	// one reference for the caller and one for each helper
+	helpers = MIN(count - 1, num_workers);
+	job->refs = 1 + helpers;
+	for(int i = 0; i < helpers; i += 1){
+		if(!task_rbuffer_try_push(tasks, parallel_helper, job)){
+			mutex_lock(&job->mtx);
+			job->refs -= helpers - i;
+			mutex_unlock(&job->mtx);
+			break;
+		}
+	}
+	parallel_run(job);
+
+	mutex_lock(&job->mtx);
+	while(job->done < job->count)
+		condvar_wait(&job->cv, &job->mtx);
+	mutex_unlock(&job->mtx);
+	parallel_release(job);
+}
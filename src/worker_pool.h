@@ -0,0 +1,32 @@
+#ifndef KAPLAR_WORKER_POOL_H_
+#define KAPLAR_WORKER_POOL_H_ 1
+
+#include "common.h"
+
+// worker pool
+//	NOTES:
+//	- A fixed set of threads (`worker_threads`, zero means one less
+//	than the number of cpus) for cpu bound work that shouldn't run on
+//	the game or server threads (crypto, compression, ...). Anything
+//	that blocks on io should go to the database workers instead.
+//	- `worker_pool_add_task` runs a task asynchronously. Results must
+//	be handed back with a task on the thread that needs them (eg:
+//	`game_add_server_task`).
+//	- `worker_pool_parallel` runs `fp(arg, i)` for every `i` in
+//	[0, count) and returns when they're all done. The calling thread
+//	takes part in it so it still makes progress if the queue is full
+//	or the pool is busy.
+//	- `worker_pool_thread_index` is in [0, worker_pool_size()) on the
+//	worker threads and -1 anywhere else. It can be used to index per
+//	worker state that is set up once (eg: after `worker_pool_init`).
+
+#define WORKER_POOL_MAX_THREADS 64
+
+bool worker_pool_init(void);
+void worker_pool_shutdown(void);
+int worker_pool_size(void);
+int worker_pool_thread_index(void);
+bool worker_pool_add_task(void (*fp)(void*), void *arg);
+void worker_pool_parallel(void (*fp)(void*, int), void *arg, int count);
+
+#endif //KAPLAR_WORKER_POOL_H_